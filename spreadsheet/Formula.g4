@@ -9,8 +9,16 @@ expr
         | (ADD | SUB) expr  # UnaryOp
         | expr (MUL | DIV) expr  # BinaryOp
         | expr (ADD | SUB) expr  # BinaryOp
+        | NAME '(' argument (',' argument)* ')'  # Function
         | CELL  # Cell
         | NUMBER  # Literal
+        | REF  # RefError
+        ;
+
+// ranges are only meaningful as arguments of the aggregate functions
+argument
+        : CELL ':' CELL  # RangeArgument
+        | expr  # ScalarArgument
         ;
 
 // number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
@@ -27,4 +35,7 @@ SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
 CELL: [A-Z]+[0-9]+ ;
+NAME: [A-Z]+ ;
+// a reference whose cells were deleted
+REF: '#REF!' ;
 WS: [ \t\n\r]+ -> skip ;
\ No newline at end of file
@@ -4,14 +4,23 @@
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
 #include <cmath>
+#include <cstring>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <string_view>
 
 namespace ASTImpl {
 
+// how a reference to deleted cells is written in a formula
+constexpr std::string_view REF_ERROR = "#REF!";
+
 enum ExprPrecedence {
     EP_ADD,
     EP_SUB,
@@ -67,17 +76,34 @@ constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
     /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
+// Positions of a formula are stored relative to its anchor
+Position ToOffset(Position pos, Position anchor) {
+    return {pos.row - anchor.row, pos.col - anchor.col};
+}
+
+Position FromOffset(Position offset, Position anchor) {
+    return {anchor.row + offset.row, anchor.col + offset.col};
+}
+
+Range FromOffset(const Range& offset, Position anchor) {
+    return {FromOffset(offset.top_left, anchor), FromOffset(offset.bottom_right, anchor)};
+}
+
+// Nodes live in the arena of their formula and are never destroyed, so they
+// must not own anything.
 class Expr {
 public:
-    virtual ~Expr() = default;
-    virtual void Print(std::ostream& out) const = 0;
-    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(std::function<double(Position)> func) const = 0;
+    virtual void Print(std::ostream& out, Position anchor) const = 0;
+    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence,
+                                Position anchor) const = 0;
+    // ranges of the aggregate functions go to a separate table which the
+    // Call instructions refer to by index
+    virtual void Compile(std::vector<Instruction>& program, std::vector<Range>& ranges) const = 0;
 
     // higher is tighter
     virtual ExprPrecedence GetPrecedence() const = 0;
 
-    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
+    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence, Position anchor,
                       bool right_child = false) const {
         auto precedence = GetPrecedence();
         auto mask = right_child ? PR_RIGHT : PR_LEFT;
@@ -86,12 +112,15 @@ public:
             out << '(';
         }
 
-        DoPrintFormula(out, precedence);
+        DoPrintFormula(out, precedence, anchor);
 
         if (parens_needed) {
             out << ')';
         }
     }
+
+protected:
+    ~Expr() = default;
 };
 
 namespace {
@@ -105,24 +134,25 @@ public:
     };
 
 public:
-    explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+    explicit BinaryOpExpr(Type type, const Expr* lhs, const Expr* rhs)
         : type_(type)
-        , lhs_(std::move(lhs))
-        , rhs_(std::move(rhs)) {
+        , lhs_(lhs)
+        , rhs_(rhs) {
     }
 
-    void Print(std::ostream& out) const override {
+    void Print(std::ostream& out, Position anchor) const override {
         out << '(' << static_cast<char>(type_) << ' ';
-        lhs_->Print(out);
+        lhs_->Print(out, anchor);
         out << ' ';
-        rhs_->Print(out);
+        rhs_->Print(out, anchor);
         out << ')';
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        lhs_->PrintFormula(out, precedence);
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence,
+                        Position anchor) const override {
+        lhs_->PrintFormula(out, precedence, anchor);
         out << static_cast<char>(type_);
-        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+        rhs_->PrintFormula(out, precedence, anchor, /* right_child = */ true);
     }
 
     ExprPrecedence GetPrecedence() const override {
@@ -142,39 +172,31 @@ public:
         }
     }
 
-    double Evaluate([[maybe_unused]] std::function<double(Position)> func) const override {
-        double rhs_value = rhs_->Evaluate(func);
-        double lhs_value = lhs_->Evaluate(func);
+    void Compile(std::vector<Instruction>& program, std::vector<Range>& ranges) const override {
+        rhs_->Compile(program, ranges);
+        lhs_->Compile(program, ranges);
+        Instruction instruction;
         switch (type_) {
-        case Type::Add:
-            if(!std::isfinite(lhs_value +rhs_value)){
-                throw FormulaError(FormulaError::Category::Div0);
-            }
-            return lhs_value + rhs_value;
-        case Type::Subtract:
-            if(!std::isfinite(lhs_value - rhs_value)){
-                throw FormulaError(FormulaError::Category::Div0);
-            }
-            return lhs_value - rhs_value;
-        case Type::Multiply:
-            if(!std::isfinite(lhs_value * rhs_value)){
-                throw FormulaError(FormulaError::Category::Div0);
-            }
-            return lhs_value * rhs_value;
-        case Type::Divide:
-            if(!std::isfinite(lhs_value / rhs_value)){
-                throw FormulaError(FormulaError::Category::Div0);
-            }
-            return lhs_value / rhs_value;
+            case Add:
+                instruction.op = Instruction::OpCode::Add;
+                break;
+            case Subtract:
+                instruction.op = Instruction::OpCode::Subtract;
+                break;
+            case Multiply:
+                instruction.op = Instruction::OpCode::Multiply;
+                break;
+            case Divide:
+                instruction.op = Instruction::OpCode::Divide;
+                break;
         }
-        throw FormulaError(FormulaError::Category::Value);
-        return 0.0;
+        program.push_back(instruction);
     }
 
 private:
     Type type_;
-    std::unique_ptr<Expr> lhs_;
-    std::unique_ptr<Expr> rhs_;
+    const Expr* lhs_;
+    const Expr* rhs_;
 };
 
 class UnaryOpExpr final : public Expr {
@@ -185,63 +207,75 @@ public:
     };
 
 public:
-    explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
+    explicit UnaryOpExpr(Type type, const Expr* operand)
         : type_(type)
-        , operand_(std::move(operand)) {
+        , operand_(operand) {
     }
 
-    void Print(std::ostream& out) const override {
+    void Print(std::ostream& out, Position anchor) const override {
         out << '(' << static_cast<char>(type_) << ' ';
-        operand_->Print(out);
+        operand_->Print(out, anchor);
         out << ')';
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence,
+                        Position anchor) const override {
         out << static_cast<char>(type_);
-        operand_->PrintFormula(out, precedence);
+        operand_->PrintFormula(out, precedence, anchor);
     }
 
     ExprPrecedence GetPrecedence() const override {
         return EP_UNARY;
     }
 
-    double Evaluate([[maybe_unused]] std::function<double(Position)> func) const override {
-        return type_ == Type::UnaryPlus ? operand_->Evaluate(func) : -operand_->Evaluate(func);
+    void Compile(std::vector<Instruction>& program, std::vector<Range>& ranges) const override {
+        operand_->Compile(program, ranges);
+        if (type_ == Type::UnaryMinus) {
+            Instruction instruction;
+            instruction.op = Instruction::OpCode::Negate;
+            program.push_back(instruction);
+        }
     }
 
 private:
     Type type_;
-    std::unique_ptr<Expr> operand_;
+    const Expr* operand_;
 };
 
 class CellExpr final : public Expr {
 public:
-    explicit CellExpr(const Position* cell)
-        : cell_(cell) {
+    // offset of the cell from the anchor
+    explicit CellExpr(Position offset)
+        : offset_(offset) {
     }
 
-    void Print(std::ostream& out) const override {
-        if (!cell_->IsValid()) {
+    void Print(std::ostream& out, Position anchor) const override {
+        Position cell = FromOffset(offset_, anchor);
+        if (!cell.IsValid()) {
             out << FormulaError::Category::Ref;
         } else {
-            out << cell_->ToString();
+            out << cell.ToString();
         }
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        Print(out);
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */,
+                        Position anchor) const override {
+        Print(out, anchor);
     }
 
     ExprPrecedence GetPrecedence() const override {
         return EP_ATOM;
     }
 
-    double Evaluate([[maybe_unused]] std::function<double(Position)> func) const override {
-        return func(*cell_);
+    void Compile(std::vector<Instruction>& program, std::vector<Range>& /* ranges */) const override {
+        Instruction instruction;
+        instruction.op = Instruction::OpCode::LoadCell;
+        instruction.cell = {offset_.row, offset_.col};
+        program.push_back(instruction);
     }
 
 private:
-    const Position* cell_;
+    Position offset_;
 };
 
 class NumberExpr final : public Expr {
@@ -250,11 +284,12 @@ public:
         : value_(value) {
     }
 
-    void Print(std::ostream& out) const override {
+    void Print(std::ostream& out, Position /* anchor */) const override {
         out << value_;
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */,
+                        Position /* anchor */) const override {
         out << value_;
     }
 
@@ -262,25 +297,167 @@ public:
         return EP_ATOM;
     }
 
-    double Evaluate([[maybe_unused]] std::function<double(Position)> pos) const override {
-        return value_;
+    void Compile(std::vector<Instruction>& program, std::vector<Range>& /* ranges */) const override {
+        Instruction instruction;
+        instruction.op = Instruction::OpCode::PushNumber;
+        instruction.number = value_;
+        program.push_back(instruction);
     }
 
 private:
     double value_;
 };
 
+// A reference whose cells were deleted along with their rows or columns
+class RefErrorExpr final : public Expr {
+public:
+    void Print(std::ostream& out, Position /* anchor */) const override {
+        out << REF_ERROR;
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */,
+                        Position anchor) const override {
+        Print(out, anchor);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    void Compile(std::vector<Instruction>& program, std::vector<Range>& /* ranges */) const override {
+        Instruction instruction;
+        instruction.op = Instruction::OpCode::RefError;
+        program.push_back(instruction);
+    }
+};
+
+struct FunctionName {
+    Function function;
+    std::string_view name;
+};
+
+constexpr FunctionName FUNCTION_NAMES[] = {
+    {Function::Sum, "SUM"},
+    {Function::Average, "AVERAGE"},
+    {Function::Min, "MIN"},
+    {Function::Max, "MAX"},
+};
+
+std::string_view GetFunctionName(Function function) {
+    for (const auto& entry : FUNCTION_NAMES) {
+        if (entry.function == function) {
+            return entry.name;
+        }
+    }
+    assert(false);
+    return {};
+}
+
+std::optional<Function> FindFunction(std::string_view name) {
+    for (const auto& entry : FUNCTION_NAMES) {
+        if (entry.name == name) {
+            return entry.function;
+        }
+    }
+    return std::nullopt;
+}
+
+class FunctionExpr final : public Expr {
+public:
+    // either an expression or, when expr is null, a range relative to the anchor
+    struct Argument {
+        const Expr* expr;
+        Range range;
+    };
+
+public:
+    // args are allocated in the same arena as the node
+    explicit FunctionExpr(Function function, Span<const Argument> args)
+        : function_(function)
+        , args_(args) {
+    }
+
+    void Print(std::ostream& out, Position anchor) const override {
+        out << '(' << GetFunctionName(function_);
+        for (const auto& arg : args_) {
+            out << ' ';
+            if (arg.expr) {
+                arg.expr->Print(out, anchor);
+            } else {
+                out << FromOffset(arg.range, anchor).ToString();
+            }
+        }
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */,
+                        Position anchor) const override {
+        out << GetFunctionName(function_) << '(';
+        bool is_first = true;
+        for (const auto& arg : args_) {
+            if (!is_first) {
+                out << ',';
+            }
+            is_first = false;
+            if (arg.expr) {
+                arg.expr->PrintFormula(out, EP_ATOM, anchor);
+            } else {
+                out << FromOffset(arg.range, anchor).ToString();
+            }
+        }
+        out << ')';
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    void Compile(std::vector<Instruction>& program, std::vector<Range>& ranges) const override {
+        Instruction instruction;
+        instruction.op = Instruction::OpCode::Call;
+        instruction.call = {function_, 0, static_cast<uint16_t>(ranges.size()), 0};
+        for (const auto& arg : args_) {
+            if (arg.expr) {
+                arg.expr->Compile(program, ranges);
+                ++instruction.call.scalars;
+            } else {
+                ranges.push_back(arg.range);
+                ++instruction.call.ranges;
+            }
+        }
+        if (ranges.size() > std::numeric_limits<uint16_t>::max()) {
+            throw ParsingError("Too many ranges in a formula");
+        }
+        program.push_back(instruction);
+    }
+
+private:
+    Function function_;
+    Span<const Argument> args_;
+};
+
+// B5:A1 means the same cells as A1:B5, the result is relative to the anchor
+Range MakeRange(Position first, Position second, Position anchor) {
+    return {ToOffset({std::min(first.row, second.row), std::min(first.col, second.col)}, anchor),
+            ToOffset({std::max(first.row, second.row), std::max(first.col, second.col)}, anchor)};
+}
+
 class ParseASTListener final : public FormulaBaseListener {
 public:
-    std::unique_ptr<Expr> MoveRoot() {
+    ParseASTListener(Arena& arena, Position anchor)
+        : arena_(arena)
+        , anchor_(anchor) {
+    }
+
+    const Expr* MoveRoot() {
         assert(args_.size() == 1);
-        auto root = std::move(args_.front());
+        auto root = args_.front();
         args_.clear();
 
         return root;
     }
 
-    std::forward_list<Position> MoveCells() {
+    std::vector<Position> MoveCells() {
         return std::move(cells_);
     }
 
@@ -288,7 +465,7 @@ public:
     void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
         assert(args_.size() >= 1);
 
-        auto operand = std::move(args_.back());
+        auto operand = args_.back();
 
         UnaryOpExpr::Type type;
         if (ctx->SUB()) {
@@ -298,8 +475,7 @@ public:
             type = UnaryOpExpr::UnaryPlus;
         }
 
-        auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-        args_.back() = std::move(node);
+        args_.back() = arena_.Make<UnaryOpExpr>(type, operand);
     }
 
     void exitLiteral(FormulaParser::LiteralContext* ctx) override {
@@ -311,8 +487,11 @@ public:
             throw ParsingError("Invalid number: " + valueStr);
         }
 
-        auto node = std::make_unique<NumberExpr>(value);
-        args_.push_back(std::move(node));
+        args_.push_back(arena_.Make<NumberExpr>(value));
+    }
+
+    void exitRefError(FormulaParser::RefErrorContext* /* ctx */) override {
+        args_.push_back(arena_.Make<RefErrorExpr>());
     }
 
     void exitCell(FormulaParser::CellContext* ctx) override {
@@ -322,18 +501,62 @@ public:
             throw FormulaException("Invalid position: " + value_str);
         }
 
-        cells_.push_front(value);
-        auto node = std::make_unique<CellExpr>(&cells_.front());
-        args_.push_back(std::move(node));
+        cells_.push_back(ToOffset(value, anchor_));
+        args_.push_back(arena_.Make<CellExpr>(ToOffset(value, anchor_)));
+    }
+
+    void exitRangeArgument(FormulaParser::RangeArgumentContext* ctx) override {
+        auto first_str = ctx->CELL(0)->getSymbol()->getText();
+        auto second_str = ctx->CELL(1)->getSymbol()->getText();
+        auto first = Position::FromString(first_str);
+        auto second = Position::FromString(second_str);
+        if (!first.IsValid() || !second.IsValid()) {
+            throw FormulaException("Invalid range: " + first_str + ':' + second_str);
+        }
+
+        args_.push_back(nullptr);
+        ranges_.push_back(MakeRange(first, second, anchor_));
+    }
+
+    void exitFunction(FormulaParser::FunctionContext* ctx) override {
+        auto name = ctx->NAME()->getSymbol()->getText();
+        auto function = FindFunction(name);
+        if (!function) {
+            throw ParsingError("Unknown function: " + name);
+        }
+
+        size_t count = ctx->argument().size();
+        if (count > std::numeric_limits<uint16_t>::max()) {
+            throw ParsingError("Too many arguments of " + name);
+        }
+        assert(args_.size() >= count);
+
+        // ranges were pushed in the same order as their null placeholders
+        size_t range_count = std::count(args_.end() - count, args_.end(), nullptr);
+        auto range_it = ranges_.end() - range_count;
+        auto args = arena_.MakeArray<FunctionExpr::Argument>(count);
+        auto arg = args.begin();
+        for (auto it = args_.end() - count; it != args_.end(); ++it, ++arg) {
+            if (*it) {
+                *arg = {*it, Range{}};
+            } else {
+                *arg = {nullptr, *range_it++};
+            }
+        }
+        args_.resize(args_.size() - count);
+        ranges_.resize(ranges_.size() - range_count);
+
+        args_.push_back(arena_.Make<FunctionExpr>(
+            *function, Span<const FunctionExpr::Argument>(args.data(), args.size())));
     }
 
     void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
         assert(args_.size() >= 2);
 
-        auto rhs = std::move(args_.back());
+        auto rhs = args_.back();
         args_.pop_back();
 
-        auto lhs = std::move(args_.back());
+        auto lhs = args_.back();
 
         BinaryOpExpr::Type type;
         if (ctx->ADD()) {
@@ -347,8 +570,7 @@ public:
             type = BinaryOpExpr::Divide;
         }
 
-        auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-        args_.back() = std::move(node);
+        args_.back() = arena_.Make<BinaryOpExpr>(type, lhs, rhs);
     }
 
     void visitErrorNode(antlr4::tree::ErrorNode* node) override {
@@ -356,8 +578,12 @@ public:
     }
 
 private:
-    std::vector<std::unique_ptr<Expr>> args_;
-    std::forward_list<Position> cells_;
+    Arena& arena_;
+    Position anchor_;
+    // a null expression stands for the next range of ranges_
+    std::vector<const Expr*> args_;
+    std::vector<Range> ranges_;
+    std::vector<Position> cells_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -370,10 +596,366 @@ public:
     }
 };
 
+// Splits a formula into the tokens of Formula.g4 the way the ANTLR lexer
+// does: the longest match wins, so "1e" is a number followed by a stray
+// letter, and whitespace is skipped.
+class Lexer {
+public:
+    enum class Token : uint8_t {
+        Number,
+        Cell,
+        Name,
+        Add,
+        Sub,
+        Mul,
+        Div,
+        LeftParen,
+        RightParen,
+        Comma,
+        Colon,
+        RefError,
+        End,
+        Invalid,
+    };
+
+    explicit Lexer(std::string_view text)
+        : text_(text) {
+    }
+
+    Token GetToken() const {
+        return token_;
+    }
+
+    std::string_view GetTokenText() const {
+        return token_text_;
+    }
+
+    void Next() {
+        SkipSpaces();
+        size_t start = pos_;
+        if (pos_ == text_.size()) {
+            token_ = Token::End;
+        } else if (IsDigit(text_[pos_]) || text_[pos_] == '.') {
+            LexNumber();
+        } else if (IsLetter(text_[pos_])) {
+            while (pos_ < text_.size() && IsLetter(text_[pos_])) {
+                ++pos_;
+            }
+            token_ = SkipDigits() > 0 ? Token::Cell : Token::Name;
+        } else {
+            switch (text_[pos_++]) {
+                case '+':
+                    token_ = Token::Add;
+                    break;
+                case '-':
+                    token_ = Token::Sub;
+                    break;
+                case '*':
+                    token_ = Token::Mul;
+                    break;
+                case '/':
+                    token_ = Token::Div;
+                    break;
+                case '(':
+                    token_ = Token::LeftParen;
+                    break;
+                case ')':
+                    token_ = Token::RightParen;
+                    break;
+                case ',':
+                    token_ = Token::Comma;
+                    break;
+                case ':':
+                    token_ = Token::Colon;
+                    break;
+                case '#':
+                    token_ = Token::Invalid;
+                    if (text_.substr(start).substr(0, REF_ERROR.size()) == REF_ERROR) {
+                        pos_ = start + REF_ERROR.size();
+                        token_ = Token::RefError;
+                    }
+                    break;
+                default:
+                    token_ = Token::Invalid;
+            }
+        }
+        token_text_ = text_.substr(start, pos_ - start);
+    }
+
+    // the next character after the current token, spaces skipped
+    char PeekChar() {
+        SkipSpaces();
+        return pos_ < text_.size() ? text_[pos_] : '\0';
+    }
+
+private:
+    static bool IsSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+    static bool IsDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    static bool IsLetter(char c) {
+        return c >= 'A' && c <= 'Z';
+    }
+
+    void SkipSpaces() {
+        while (pos_ < text_.size() && IsSpace(text_[pos_])) {
+            ++pos_;
+        }
+    }
+
+    size_t SkipDigits() {
+        size_t start = pos_;
+        while (pos_ < text_.size() && IsDigit(text_[pos_])) {
+            ++pos_;
+        }
+        return pos_ - start;
+    }
+
+    // UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+    void LexNumber() {
+        size_t integer_digits = SkipDigits();
+        if (pos_ + 1 < text_.size() && text_[pos_] == '.' && IsDigit(text_[pos_ + 1])) {
+            ++pos_;
+            SkipDigits();
+        } else if (integer_digits == 0) {
+            ++pos_;
+            token_ = Token::Invalid;
+            return;
+        }
+        if (pos_ < text_.size() && (text_[pos_] == 'e' || text_[pos_] == 'E')) {
+            size_t exponent = pos_ + 1;
+            if (exponent < text_.size() && (text_[exponent] == '+' || text_[exponent] == '-')) {
+                ++exponent;
+            }
+            if (exponent < text_.size() && IsDigit(text_[exponent])) {
+                pos_ = exponent;
+                SkipDigits();
+            }
+        }
+        token_ = Token::Number;
+    }
+
+    std::string_view text_;
+    size_t pos_ = 0;
+    Token token_ = Token::End;
+    std::string_view token_text_;
+};
+
+// Recursive-descent parser for the language of Formula.g4 which builds the
+// tree straight in the arena, without a token stream or a parse tree. It
+// only takes what it is sure about: on a syntax error, an unknown function,
+// an invalid cell or a number out of range it gives up and leaves the text
+// to ANTLR, which reports the error the usual way.
+class FastParser {
+public:
+    using Cells = SmallVector<Position, 8>;
+
+    FastParser(std::string_view text, Arena& arena, Position anchor)
+        : lexer_(text)
+        , arena_(arena)
+        , anchor_(anchor) {
+    }
+
+    // null if the parser gave up
+    const Expr* Parse() {
+        lexer_.Next();
+        const Expr* root = ParseSum();
+        return Is(Token::End) ? root : nullptr;
+    }
+
+    // relative to the anchor
+    const Cells& GetCells() const {
+        return cells_;
+    }
+
+private:
+    using Token = Lexer::Token;
+
+    // nesting of parentheses, functions and unary operators the parser
+    // recurses into before it gives up
+    static constexpr int MAX_DEPTH = 200;
+
+    bool Is(Token token) const {
+        return lexer_.GetToken() == token;
+    }
+
+    const Expr* ParseSum() {
+        const Expr* lhs = ParseProduct();
+        while (lhs && (Is(Token::Add) || Is(Token::Sub))) {
+            auto type = Is(Token::Add) ? BinaryOpExpr::Add : BinaryOpExpr::Subtract;
+            lexer_.Next();
+            const Expr* rhs = ParseProduct();
+            lhs = rhs ? arena_.Make<BinaryOpExpr>(type, lhs, rhs) : nullptr;
+        }
+        return lhs;
+    }
+
+    const Expr* ParseProduct() {
+        const Expr* lhs = ParseUnary();
+        while (lhs && (Is(Token::Mul) || Is(Token::Div))) {
+            auto type = Is(Token::Mul) ? BinaryOpExpr::Multiply : BinaryOpExpr::Divide;
+            lexer_.Next();
+            const Expr* rhs = ParseUnary();
+            lhs = rhs ? arena_.Make<BinaryOpExpr>(type, lhs, rhs) : nullptr;
+        }
+        return lhs;
+    }
+
+    // unary operators bind tighter than binary ones: -A1*B1 is (-A1)*B1
+    const Expr* ParseUnary() {
+        if (!Is(Token::Add) && !Is(Token::Sub)) {
+            return ParsePrimary();
+        }
+        auto type = Is(Token::Add) ? UnaryOpExpr::UnaryPlus : UnaryOpExpr::UnaryMinus;
+        lexer_.Next();
+        if (++depth_ > MAX_DEPTH) {
+            return nullptr;
+        }
+        const Expr* operand = ParseUnary();
+        --depth_;
+        return operand ? arena_.Make<UnaryOpExpr>(type, operand) : nullptr;
+    }
+
+    const Expr* ParsePrimary() {
+        std::string_view text = lexer_.GetTokenText();
+        switch (lexer_.GetToken()) {
+            case Token::Number: {
+                double value = 0;
+                auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+                if (error != std::errc{} || end != text.data() + text.size()) {
+                    return nullptr;
+                }
+                lexer_.Next();
+                return arena_.Make<NumberExpr>(value);
+            }
+            case Token::Cell: {
+                Position pos = Position::FromString(text);
+                if (!pos.IsValid()) {
+                    return nullptr;
+                }
+                cells_.push_back(ToOffset(pos, anchor_));
+                lexer_.Next();
+                return arena_.Make<CellExpr>(ToOffset(pos, anchor_));
+            }
+            case Token::RefError:
+                lexer_.Next();
+                return arena_.Make<RefErrorExpr>();
+            case Token::Name:
+                return ParseFunction();
+            case Token::LeftParen: {
+                lexer_.Next();
+                if (++depth_ > MAX_DEPTH) {
+                    return nullptr;
+                }
+                const Expr* expr = ParseSum();
+                --depth_;
+                if (!expr || !Is(Token::RightParen)) {
+                    return nullptr;
+                }
+                lexer_.Next();
+                return expr;
+            }
+            default:
+                return nullptr;
+        }
+    }
+
+    const Expr* ParseFunction() {
+        auto function = FindFunction(lexer_.GetTokenText());
+        lexer_.Next();
+        if (!function || !Is(Token::LeftParen) || ++depth_ > MAX_DEPTH) {
+            return nullptr;
+        }
+        lexer_.Next();
+
+        SmallVector<FunctionExpr::Argument, 4> args;
+        while (true) {
+            FunctionExpr::Argument arg{nullptr, Range{}};
+            if (!ParseArgument(arg)) {
+                return nullptr;
+            }
+            args.push_back(arg);
+            if (Is(Token::RightParen)) {
+                break;
+            }
+            if (!Is(Token::Comma)) {
+                return nullptr;
+            }
+            lexer_.Next();
+        }
+        lexer_.Next();
+        --depth_;
+        if (args.size() > std::numeric_limits<uint16_t>::max()) {
+            return nullptr;
+        }
+
+        auto array = arena_.MakeArray<FunctionExpr::Argument>(args.size());
+        std::copy(args.begin(), args.end(), array.begin());
+        return arena_.Make<FunctionExpr>(
+            *function, Span<const FunctionExpr::Argument>(array.data(), array.size()));
+    }
+
+    // CELL ':' CELL or an expression
+    bool ParseArgument(FunctionExpr::Argument& arg) {
+        if (!Is(Token::Cell) || lexer_.PeekChar() != ':') {
+            arg.expr = ParseSum();
+            return arg.expr != nullptr;
+        }
+        Position first = Position::FromString(lexer_.GetTokenText());
+        lexer_.Next();
+        lexer_.Next();
+        if (!Is(Token::Cell)) {
+            return false;
+        }
+        Position second = Position::FromString(lexer_.GetTokenText());
+        if (!first.IsValid() || !second.IsValid()) {
+            return false;
+        }
+        lexer_.Next();
+        arg.range = MakeRange(first, second, anchor_);
+        return true;
+    }
+
+    Lexer lexer_;
+    int depth_ = 0;
+    Arena& arena_;
+    Position anchor_;
+    Cells cells_;
+};
+
+#ifdef SPREADSHEET_PARSER_DIFFERENTIAL
+// The fast parser must build the very tree ANTLR builds
+void CheckSameAST(const FormulaAST& fast, const FormulaAST& reference, const std::string& text,
+                  Position anchor) {
+    std::ostringstream fast_tree;
+    std::ostringstream reference_tree;
+    fast.Print(fast_tree, anchor);
+    reference.Print(reference_tree, anchor);
+    if (fast_tree.str() != reference_tree.str()
+        || !std::equal(fast.GetCells().begin(), fast.GetCells().end(),
+                       reference.GetCells().begin(), reference.GetCells().end())
+        || fast.GetRanges() != reference.GetRanges()) {
+        throw std::logic_error("Formula parsers disagree on " + text + ": " + fast_tree.str()
+                               + " vs " + reference_tree.str());
+    }
+}
+#endif
+
+void AppendNumber(std::string& out, int value) {
+    char buffer[16];
+    auto [end, error] = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    assert(error == std::errc{});
+    out.append(buffer, end);
+}
+
 }  // namespace
 }  // namespace ASTImpl
 
-FormulaAST ParseFormulaAST(std::istream& in) {
+FormulaAST ParseFormulaASTWithAntlr(std::istream& in, Position anchor) {
     using namespace antlr4;
 
     ANTLRInputStream input(in);
@@ -391,39 +973,358 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     parser.removeErrorListeners();
 
     tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
+    Arena arena;
+    ASTImpl::ParseASTListener listener(arena, anchor);
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    auto root = listener.MoveRoot();
+    return FormulaAST(std::move(arena), root, listener.MoveCells());
 }
 
-FormulaAST ParseFormulaAST(const std::string& in_str) {
+FormulaAST ParseFormulaASTWithAntlr(const std::string& in_str, Position anchor) {
     std::istringstream in(in_str);
-    return ParseFormulaAST(in);
+    return ParseFormulaASTWithAntlr(in, anchor);
+}
+
+std::optional<FormulaAST> TryParseFormulaAST(std::string_view text, Position anchor) {
+    Arena arena;
+    ASTImpl::FastParser parser(text, arena, anchor);
+    auto root = parser.Parse();
+    if (!root) {
+        return std::nullopt;
+    }
+    return FormulaAST(std::move(arena), root, parser.GetCells());
+}
+
+FormulaAST ParseFormulaAST(std::istream& in, Position anchor) {
+    return ParseFormulaAST(std::string(std::istreambuf_iterator<char>(in), {}), anchor);
+}
+
+FormulaAST ParseFormulaAST(const std::string& in_str, Position anchor) {
+    if (auto ast = TryParseFormulaAST(in_str, anchor)) {
+#ifdef SPREADSHEET_PARSER_DIFFERENTIAL
+        ASTImpl::CheckSameAST(*ast, ParseFormulaASTWithAntlr(in_str, anchor), in_str, anchor);
+#endif
+        return std::move(*ast);
+    }
+    return ParseFormulaASTWithAntlr(in_str, anchor);
 }
 
-void FormulaAST::PrintCells(std::ostream& out) const {
+std::optional<std::string> NormalizeFormula(std::string_view text, Position anchor) {
+    using Token = ASTImpl::Lexer::Token;
+
+    std::string key;
+    key.reserve(text.size() + 16);
+    ASTImpl::Lexer lexer(text);
+    for (lexer.Next(); lexer.GetToken() != Token::End; lexer.Next()) {
+        if (lexer.GetToken() == Token::Invalid) {
+            return std::nullopt;
+        }
+        // tokens are separated by one space whatever whitespace there was
+        if (!key.empty()) {
+            key += ' ';
+        }
+        if (lexer.GetToken() != Token::Cell) {
+            key += lexer.GetTokenText();
+            continue;
+        }
+        Position cell = Position::FromString(lexer.GetTokenText());
+        if (!cell.IsValid()) {
+            return std::nullopt;
+        }
+        Position offset = ASTImpl::ToOffset(cell, anchor);
+        key += "R[";
+        ASTImpl::AppendNumber(key, offset.row);
+        key += "]C[";
+        ASTImpl::AppendNumber(key, offset.col);
+        key += ']';
+    }
+    return key;
+}
+
+void FormulaAST::PrintCells(std::ostream& out, Position anchor) const {
     for (auto cell : cells_) {
-        out << cell.ToString() << ' ';
+        out << ASTImpl::FromOffset(cell, anchor).ToString() << ' ';
     }
 }
 
-void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
+void FormulaAST::Print(std::ostream& out, Position anchor) const {
+    root_expr_->Print(out, anchor);
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+void FormulaAST::PrintFormula(std::ostream& out, Position anchor) const {
+    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM, anchor);
 }
 
-double FormulaAST::Execute(std::function<double(Position)> func) const {
-    return root_expr_->Evaluate(func);
+namespace {
+// Operations overflowing to infinity or NaN are reported as a division by zero
+bool StoreFinite(double& slot, double value) {
+    slot = value;
+    return std::isfinite(value);
+}
+
+CellInterface::NumericValue CheckFinite(double value) {
+    if (!std::isfinite(value)) {
+        return FormulaError(FormulaError::Category::Div0);
+    }
+    return value;
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
-    cells_.sort();  // to avoid sorting in GetReferencedCells
+// The reductions keep LANES independent accumulators instead of one serial
+// dependency chain, which lets the compiler keep them in vector registers.
+constexpr size_t LANES = 4;
+
+double SumKernel(const double* values, size_t size) {
+    double lanes[LANES] = {};
+    size_t i = 0;
+    for (; i + LANES <= size; i += LANES) {
+        for (size_t lane = 0; lane < LANES; ++lane) {
+            lanes[lane] += values[i + lane];
+        }
+    }
+    double sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < size; ++i) {
+        sum += values[i];
+    }
+    return sum;
+}
+
+// size must not be zero
+template <typename Less>
+double SelectKernel(const double* values, size_t size, Less less) {
+    double lanes[LANES];
+    for (size_t lane = 0; lane < LANES; ++lane) {
+        lanes[lane] = values[0];
+    }
+    size_t i = 0;
+    for (; i + LANES <= size; i += LANES) {
+        for (size_t lane = 0; lane < LANES; ++lane) {
+            lanes[lane] = less(values[i + lane], lanes[lane]) ? values[i + lane] : lanes[lane];
+        }
+    }
+    for (; i < size; ++i) {
+        lanes[0] = less(values[i], lanes[0]) ? values[i] : lanes[0];
+    }
+    double result = lanes[0];
+    for (size_t lane = 1; lane < LANES; ++lane) {
+        result = less(lanes[lane], result) ? lanes[lane] : result;
+    }
+    return result;
+}
+
+// MIN and MAX of nothing are zero, AVERAGE of nothing is a division by zero
+CellInterface::NumericValue Aggregate(ASTImpl::Function function, const std::vector<double>& values) {
+    using ASTImpl::Function;
+
+    switch (function) {
+        case Function::Sum:
+            return CheckFinite(SumKernel(values.data(), values.size()));
+        case Function::Average:
+            if (values.empty()) {
+                return FormulaError(FormulaError::Category::Div0);
+            }
+            return CheckFinite(SumKernel(values.data(), values.size()) / values.size());
+        case Function::Min:
+            return values.empty() ? 0.0 : SelectKernel(values.data(), values.size(), std::less<double>{});
+        case Function::Max:
+            return values.empty() ? 0.0 : SelectKernel(values.data(), values.size(), std::greater<double>{});
+    }
+    assert(false);
+    return 0.0;
+}
+}  // namespace
+
+namespace {
+constexpr uint64_t QUIET_NAN = 0x7ff8'0000'0000'0000;
+}  // namespace
+
+double FormulaAST::BoxError(FormulaError error) {
+    const uint64_t bits = QUIET_NAN | (static_cast<uint64_t>(error.GetCategory()) + 1);
+    double value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+FormulaError FormulaAST::UnboxError(double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    switch (bits & ~QUIET_NAN) {
+        case static_cast<uint64_t>(FormulaError::Category::Ref) + 1:
+            return FormulaError::Category::Ref;
+        case static_cast<uint64_t>(FormulaError::Category::Div0) + 1:
+            return FormulaError::Category::Div0;
+        default:
+            // a NaN that was never boxed cannot be read as a number either
+            return FormulaError::Category::Value;
+    }
+}
+
+CellInterface::NumericValue FormulaAST::Execute(const CellReader& read_cell, const RangeReader& read_range,
+                                                Position anchor) const {
+    constexpr size_t INLINE_STACK_SIZE = 32;
+    if (stack_depth_ <= INLINE_STACK_SIZE) {
+        double stack[INLINE_STACK_SIZE];
+        return Run(stack, read_cell, read_range, anchor);
+    }
+    std::vector<double> stack(stack_depth_);
+    return Run(stack.data(), read_cell, read_range, anchor);
+}
+
+CellInterface::NumericValue FormulaAST::Run(double* stack, const CellReader& read_cell,
+                                            const RangeReader& read_range, Position anchor) const {
+    using ASTImpl::Instruction;
+    static const FormulaError DIV0(FormulaError::Category::Div0);
+
+    // arguments of an aggregate function, gathered into one contiguous block
+    std::vector<double> values;
+    double* top = stack;
+    for (const Instruction& instruction : program_) {
+        switch (instruction.op) {
+            case Instruction::OpCode::PushNumber:
+                *top++ = instruction.number;
+                break;
+            case Instruction::OpCode::LoadCell: {
+                const double value = read_cell(
+                    Position{anchor.row + instruction.cell.row, anchor.col + instruction.cell.col});
+                if (std::isnan(value)) {
+                    return UnboxError(value);
+                }
+                *top++ = value;
+                break;
+            }
+            case Instruction::OpCode::Add:
+                --top;
+                if (!StoreFinite(top[-1], top[0] + top[-1])) {
+                    return DIV0;
+                }
+                break;
+            case Instruction::OpCode::Subtract:
+                --top;
+                if (!StoreFinite(top[-1], top[0] - top[-1])) {
+                    return DIV0;
+                }
+                break;
+            case Instruction::OpCode::Multiply:
+                --top;
+                if (!StoreFinite(top[-1], top[0] * top[-1])) {
+                    return DIV0;
+                }
+                break;
+            case Instruction::OpCode::Divide:
+                --top;
+                if (!StoreFinite(top[-1], top[0] / top[-1])) {
+                    return DIV0;
+                }
+                break;
+            case Instruction::OpCode::Negate:
+                top[-1] = -top[-1];
+                break;
+            case Instruction::OpCode::RefError:
+                return FormulaError(FormulaError::Category::Ref);
+            case Instruction::OpCode::Call: {
+                const Instruction::Call& call = instruction.call;
+                top -= call.scalars;
+                values.assign(top, top + call.scalars);
+                for (size_t i = call.first_range; i < size_t{call.first_range} + call.ranges; ++i) {
+                    if (auto error = read_range(ASTImpl::FromOffset(range_args_[i], anchor), values)) {
+                        return *error;
+                    }
+                }
+                const CellInterface::NumericValue result = Aggregate(call.function, values);
+                if (std::holds_alternative<FormulaError>(result)) {
+                    return result;
+                }
+                *top++ = std::get<double>(result);
+                break;
+            }
+        }
+    }
+    return top[-1];
+}
+
+FormulaAST::FormulaAST(Arena arena, const ASTImpl::Expr* root_expr, Span<const Position> cells)
+    : arena_(std::move(arena))
+    , root_expr_(root_expr)
+    , cells_(cells.begin(), cells.end()) {
+    // sorted once here, so that the formula can hand out its references as is
+    std::sort(cells_.begin(), cells_.end());
+    auto last = std::unique(cells_.begin(), cells_.end());
+    while (cells_.end() != last) {
+        cells_.pop_back();
+    }
+
+    // compiled into buffers reused across formulas, so that the program and
+    // the range table are allocated once at their final size
+    thread_local std::vector<ASTImpl::Instruction> program;
+    thread_local std::vector<Range> range_args;
+    program.clear();
+    range_args.clear();
+    root_expr_->Compile(program, range_args);
+    program_.assign(program.begin(), program.end());
+    range_args_.assign(range_args.begin(), range_args.end());
+    ranges_ = range_args_;
+    std::sort(ranges_.begin(), ranges_.end());
+    ranges_.erase(std::unique(ranges_.begin(), ranges_.end()), ranges_.end());
+
+    size_t depth = 0;
+    for (const auto& instruction : program_) {
+        switch (instruction.op) {
+            case ASTImpl::Instruction::OpCode::PushNumber:
+            case ASTImpl::Instruction::OpCode::LoadCell:
+            case ASTImpl::Instruction::OpCode::RefError:
+                stack_depth_ = std::max(stack_depth_, ++depth);
+                break;
+            case ASTImpl::Instruction::OpCode::Negate:
+                break;
+            case ASTImpl::Instruction::OpCode::Call:
+                depth -= instruction.call.scalars;
+                stack_depth_ = std::max(stack_depth_, ++depth);
+                break;
+            default:
+                --depth;
+        }
+    }
 }
 
 FormulaAST::~FormulaAST() = default;
+
+std::optional<std::string> RelocateFormula(
+    std::string_view text, const std::function<std::optional<Position>(Position)>& locate_cell,
+    const std::function<std::optional<Range>(const Range&)>& locate_range) {
+    using Token = ASTImpl::Lexer::Token;
+
+    const std::string_view ref_error = ASTImpl::REF_ERROR;
+    std::string relocated;
+    relocated.reserve(text.size() + 8);
+    ASTImpl::Lexer lexer(text);
+    for (lexer.Next(); lexer.GetToken() != Token::End; lexer.Next()) {
+        if (lexer.GetToken() == Token::Invalid) {
+            return std::nullopt;
+        }
+        if (lexer.GetToken() != Token::Cell) {
+            relocated += lexer.GetTokenText();
+            continue;
+        }
+        const Position first = Position::FromString(lexer.GetTokenText());
+        if (!first.IsValid()) {
+            return std::nullopt;
+        }
+        // CELL ':' CELL is a range, as in FastParser::ParseArgument
+        if (lexer.PeekChar() != ':') {
+            const std::optional<Position> cell = locate_cell(first);
+            relocated += cell ? cell->ToString() : ref_error;
+            continue;
+        }
+        lexer.Next();
+        lexer.Next();
+        const Position second = Position::FromString(lexer.GetTokenText());
+        if (lexer.GetToken() != Token::Cell || !second.IsValid()) {
+            return std::nullopt;
+        }
+        const Range range{{std::min(first.row, second.row), std::min(first.col, second.col)},
+                          {std::max(first.row, second.row), std::max(first.col, second.col)}};
+        const std::optional<Range> moved = locate_range(range);
+        relocated += moved ? moved->ToString() : ref_error;
+    }
+    return relocated;
+}
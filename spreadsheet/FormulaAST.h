@@ -1,15 +1,67 @@
 #pragma once
 
 #include "FormulaLexer.h"
+#include "arena.h"
 #include "common.h"
+#include "small_vector.h"
 
-#include <forward_list>
+#include <cstdint>
 #include <functional>
+#include <optional>
 #include <stdexcept>
+#include <string_view>
+#include <vector>
 
 namespace ASTImpl {
 class Expr;
-}
+
+enum class Function : uint8_t {
+    Sum,
+    Average,
+    Min,
+    Max,
+};
+
+// One step of a formula compiled into postfix form. Operands of a binary
+// operation are emitted right-to-left, so cells are read in the same order
+// as the tree walk used to read them.
+struct Instruction {
+    enum class OpCode : uint8_t {
+        PushNumber,
+        LoadCell,
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        Negate,
+        Call,
+        // a reference to deleted cells, the formula's value is #REF!
+        RefError,
+    };
+
+    struct CellRef {
+        int row;
+        int col;
+    };
+
+    // Pops the scalar arguments of an aggregate function and pushes its
+    // result over them and the ranges [first_range, first_range + ranges)
+    // of the formula's range table.
+    struct Call {
+        Function function;
+        uint16_t scalars;
+        uint16_t first_range;
+        uint16_t ranges;
+    };
+
+    OpCode op;
+    union {
+        double number;
+        CellRef cell;
+        Call call;
+    };
+};
+}  // namespace ASTImpl
 
 class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
@@ -17,33 +69,96 @@ class ParsingError : public std::runtime_error {
 
 class FormulaAST {
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
+    using Cells = SmallVector<Position, 4>;
+
+    // The value of a cell the way formulas read it, an error boxed with BoxError
+    using CellReader = std::function<double(Position)>;
+    // Appends the numeric values of the non-empty cells of a range, stops at
+    // the first cell with an error and returns it
+    using RangeReader = std::function<std::optional<FormulaError>(const Range&, std::vector<double>&)>;
+
+    // root_expr and everything below it are allocated in arena
+    explicit FormulaAST(Arena arena, const ASTImpl::Expr* root_expr,
+                        Span<const Position> cells);
     FormulaAST(FormulaAST&&) = default;
     FormulaAST& operator=(FormulaAST&&) = default;
     ~FormulaAST();
 
-    double Execute(std::function<double(Position)> func) const;
-    void PrintCells(std::ostream& out) const;
-    void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
+    // Positions are stored relative to the anchor the formula was parsed at,
+    // so that one FormulaAST serves every cell the formula was filled into.
+    // These methods work with the absolute positions for the given anchor.
+    // Errors are values rather than exceptions: the first error the program
+    // runs into, read from a cell or produced by an operation, is the result.
+    CellInterface::NumericValue Execute(const CellReader& read_cell, const RangeReader& read_range,
+                                        Position anchor = {}) const;
+    void PrintCells(std::ostream& out, Position anchor = {}) const;
+    void Print(std::ostream& out, Position anchor = {}) const;
+    void PrintFormula(std::ostream& out, Position anchor = {}) const;
 
-    std::forward_list<Position>& GetCells() {
+    // Errors read from cells travel NaN-boxed, the category in the payload,
+    // so that the common case returns a plain double. The values of cells
+    // are always finite, a NaN can only be an error.
+    static double BoxError(FormulaError error);
+    static FormulaError UnboxError(double value);
+
+    // offsets from the anchor, sorted and without duplicates
+    const Cells& GetCells() const {
         return cells_;
     }
 
-    const std::forward_list<Position>& GetCells() const {
-        return cells_;
+    // ranges read by the aggregate functions relative to the anchor, sorted
+    // and without duplicates
+    const std::vector<Range>& GetRanges() const {
+        return ranges_;
     }
 
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
+    CellInterface::NumericValue Run(double* stack, const CellReader& read_cell,
+                                    const RangeReader& read_range, Position anchor) const;
+
+    Arena arena_;
+    // the tree is only kept to print the formula, Execute runs program_
+    const ASTImpl::Expr* root_expr_;
 
     // physically stores cells so that they can be
     // efficiently traversed without going through
     // the whole AST
-    std::forward_list<Position> cells_;
+    Cells cells_;
+
+    std::vector<Range> ranges_;
+
+    std::vector<ASTImpl::Instruction> program_;
+    // ranges in the order the Call instructions refer to them
+    std::vector<Range> range_args_;
+    size_t stack_depth_ = 0;
 };
 
-FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
+// Parses with the hand-written parser and falls back to ANTLR for whatever
+// it doesn't take, errors included. Built with SPREADSHEET_PARSER_DIFFERENTIAL
+// it also parses every formula with ANTLR and throws std::logic_error when
+// the trees differ.
+// The anchor is the cell the formula is written in, A1 keeps the positions
+// absolute.
+FormulaAST ParseFormulaAST(std::istream& in, Position anchor = {});
+FormulaAST ParseFormulaAST(const std::string& in_str, Position anchor = {});
+
+// Only the hand-written parser, nothing if it gave up on the text
+std::optional<FormulaAST> TryParseFormulaAST(std::string_view text, Position anchor = {});
+
+// Only ANTLR, the reference for the hand-written parser
+FormulaAST ParseFormulaASTWithAntlr(std::istream& in, Position anchor = {});
+FormulaAST ParseFormulaASTWithAntlr(const std::string& in_str, Position anchor = {});
+
+// The tokens of a formula with its cells written relative to the anchor,
+// R[1]C[-2] style: =B2*C2 in A2 and =B3*C3 in A3 give the same key and
+// parse to the same FormulaAST at their anchors. Nothing if the text has
+// a character or a cell the lexer rejects, the formula is invalid then.
+std::optional<std::string> NormalizeFormula(std::string_view text, Position anchor);
+
+// The text of a formula with its references moved: every cell goes through
+// locate_cell and every range through locate_range, the ones they give
+// nothing for are written as #REF!. The rest of the text is kept as it is,
+// spaces dropped. Nothing if the text doesn't lex.
+std::optional<std::string> RelocateFormula(
+    std::string_view text, const std::function<std::optional<Position>(Position)>& locate_cell,
+    const std::function<std::optional<Range>(const Range&)>& locate_range);
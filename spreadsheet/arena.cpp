@@ -0,0 +1,54 @@
+#include "arena.h"
+
+#include <algorithm>
+#include <cstdint>
+
+Arena::Arena(Arena&& other) noexcept
+    : block_(std::exchange(other.block_, nullptr))
+    , next_(std::exchange(other.next_, nullptr))
+    , end_(std::exchange(other.end_, nullptr))
+{}
+
+Arena& Arena::operator=(Arena&& other) noexcept{
+    if(this != &other){
+        Free();
+        block_ = std::exchange(other.block_, nullptr);
+        next_ = std::exchange(other.next_, nullptr);
+        end_ = std::exchange(other.end_, nullptr);
+    }
+    return *this;
+}
+
+Arena::~Arena(){
+    Free();
+}
+
+void* Arena::Allocate(size_t size, size_t alignment){
+    auto address = reinterpret_cast<uintptr_t>(next_);
+    auto aligned = (address + alignment - 1) & ~(uintptr_t{alignment} - 1);
+    if(!next_ || aligned + size > reinterpret_cast<uintptr_t>(end_)){
+        // blocks double, so a formula of any length takes a few of them
+        size_t block_size = block_ ? block_->size * 2 : FIRST_BLOCK_SIZE;
+        block_size = std::max(block_size, sizeof(Block) + size + alignment);
+        auto* block = static_cast<Block*>(::operator new(block_size));
+        block->previous = block_;
+        block->size = block_size;
+        block_ = block;
+        next_ = reinterpret_cast<char*>(block + 1);
+        end_ = reinterpret_cast<char*>(block) + block_size;
+        address = reinterpret_cast<uintptr_t>(next_);
+        aligned = (address + alignment - 1) & ~(uintptr_t{alignment} - 1);
+    }
+    next_ = reinterpret_cast<char*>(aligned + size);
+    return reinterpret_cast<void*>(aligned);
+}
+
+void Arena::Free(){
+    while(block_){
+        Block* previous = block_->previous;
+        ::operator delete(block_);
+        block_ = previous;
+    }
+    next_ = nullptr;
+    end_ = nullptr;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "span.h"
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Bump allocator for the nodes of one structure which are all released
+// together. Nothing allocated in it is ever destroyed, so only trivially
+// destructible types are allowed.
+class Arena {
+public:
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    Arena(Arena&& other) noexcept;
+    Arena& operator=(Arena&& other) noexcept;
+    ~Arena();
+
+    template <typename T, typename... Args>
+    T* Make(Args&&... args) {
+        static_assert(std::is_trivially_destructible_v<T>, "Arena never destroys its objects");
+        return new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    template <typename T>
+    Span<T> MakeArray(size_t size) {
+        static_assert(std::is_trivially_destructible_v<T>, "Arena never destroys its objects");
+        T* data = static_cast<T*>(Allocate(sizeof(T) * size, alignof(T)));
+        std::uninitialized_value_construct_n(data, size);
+        return {data, size};
+    }
+
+private:
+    // header of every block, the objects follow it
+    struct Block {
+        Block* previous;
+        size_t size;
+    };
+
+    void* Allocate(size_t size, size_t alignment);
+    void Free();
+
+    static constexpr size_t FIRST_BLOCK_SIZE = 512;
+
+    Block* block_ = nullptr;
+    char* next_ = nullptr;
+    char* end_ = nullptr;
+};
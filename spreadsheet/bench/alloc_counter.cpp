@@ -0,0 +1,95 @@
+#include "bench.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi")
+#else
+#include <sys/resource.h>
+#endif
+
+namespace {
+std::atomic<size_t> allocations{0};
+std::atomic<size_t> live_bytes{0};
+std::atomic<size_t> peak_bytes{0};
+
+// every block is prefixed with its size so that delete can account for it
+constexpr size_t HEADER_SIZE = alignof(std::max_align_t);
+}  // namespace
+
+void* operator new(std::size_t size) {
+    void* raw = std::malloc(size + HEADER_SIZE);
+    if(!raw){
+        throw std::bad_alloc();
+    }
+    *static_cast<size_t*>(raw) = size;
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    const size_t live = live_bytes.fetch_add(size, std::memory_order_relaxed) + size;
+    size_t peak = peak_bytes.load(std::memory_order_relaxed);
+    while(live > peak && !peak_bytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)){
+    }
+    return static_cast<char*>(raw) + HEADER_SIZE;
+}
+
+void* operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    if(!ptr){
+        return;
+    }
+    void* raw = static_cast<char*>(ptr) - HEADER_SIZE;
+    live_bytes.fetch_sub(*static_cast<size_t*>(raw), std::memory_order_relaxed);
+    std::free(raw);
+}
+
+void operator delete[](void* ptr) noexcept {
+    operator delete(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    operator delete(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+    operator delete(ptr);
+}
+
+namespace bench {
+
+AllocStats GetAllocStats() {
+    return {allocations.load(std::memory_order_relaxed), live_bytes.load(std::memory_order_relaxed),
+            peak_bytes.load(std::memory_order_relaxed)};
+}
+
+void ResetAllocPeak() {
+    peak_bytes.store(live_bytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+size_t GetPeakRss() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if(!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))){
+        return 0;
+    }
+    return counters.PeakWorkingSetSize;
+#else
+    rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0){
+        return 0;
+    }
+#ifdef __APPLE__
+    return static_cast<size_t>(usage.ru_maxrss);
+#else
+    // kilobytes everywhere else
+    return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+}  // namespace bench
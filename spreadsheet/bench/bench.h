@@ -0,0 +1,132 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+namespace bench {
+
+// Heap usage of the process as seen by the replaced global operator new/delete
+struct AllocStats {
+    size_t allocations = 0;
+    size_t live_bytes = 0;
+    // the most live bytes since the last ResetAllocPeak
+    size_t peak_bytes = 0;
+};
+
+AllocStats GetAllocStats();
+void ResetAllocPeak();
+// Peak resident set size of the process in bytes, 0 where it is not known
+size_t GetPeakRss();
+
+// Set from the command line, see bench_main.cpp
+struct Options {
+    // the reports are collected into a JSON document printed at the end
+    bool json = false;
+    // multiplies the sizes of the synthetic workloads
+    double scale = 1.0;
+};
+
+const Options& GetOptions();
+
+class Timer {
+public:
+    Timer()
+        : start_(std::chrono::steady_clock::now())
+    {}
+
+    std::chrono::nanoseconds Elapsed() const {
+        return std::chrono::steady_clock::now() - start_;
+    }
+
+private:
+    std::chrono::steady_clock::time_point start_;
+};
+
+// Counts the characters and throws them away, so that only the printing
+// itself is measured and allocates
+class NullBuffer : public std::streambuf {
+public:
+    size_t GetSize() const {
+        return size_;
+    }
+
+protected:
+    int_type overflow(int_type c) override {
+        ++size_;
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(const char*, std::streamsize count) override {
+        size_ += count;
+        return count;
+    }
+
+private:
+    size_t size_ = 0;
+};
+
+// Durations of single operations. Each one is timed on its own, so the
+// operations should take well over the cost of reading the clock.
+class LatencySamples {
+public:
+    template <typename Func>
+    void Measure(Func&& func) {
+        Timer timer;
+        func();
+        Add(timer.Elapsed());
+    }
+
+    void Add(std::chrono::nanoseconds sample) {
+        samples_.push_back(sample);
+    }
+
+    size_t Size() const {
+        return samples_.size();
+    }
+
+    // sorts the samples
+    std::chrono::nanoseconds Percentile(double fraction);
+    std::chrono::nanoseconds Total() const;
+
+private:
+    std::vector<std::chrono::nanoseconds> samples_;
+    bool sorted_ = false;
+};
+
+// Prints the average time of one operation
+void ReportLatency(const std::string& name, size_t ops, std::chrono::nanoseconds elapsed);
+// Prints the average and the 50th, 90th and 99th percentiles and the maximum
+void ReportPercentiles(const std::string& name, LatencySamples& samples);
+// Prints the heap footprint of a structure holding the given number of items
+void ReportMemory(const std::string& name, size_t items, size_t bytes);
+// Prints an arbitrary measurement
+void ReportValue(const std::string& name, double value, const std::string& unit);
+// Prints the average number of heap allocations made by one operation
+void ReportAllocations(const std::string& name, size_t ops, size_t allocations);
+
+void RunStorageBenchmarks();
+void RunFormulaBenchmarks();
+void RunInvalidationBenchmarks();
+void RunCycleCheckBenchmarks();
+void RunTopologicalOrderBenchmarks();
+void RunRecalculationBenchmarks();
+void RunRangeBenchmarks();
+void RunNumericTextBenchmarks();
+void RunParseBenchmarks();
+void RunSharedFormulaBenchmarks();
+void RunBatchBenchmarks();
+void RunSnapshotBenchmarks();
+void RunDelimitedBenchmarks();
+void RunPrintBenchmarks();
+void RunWorkloadBenchmarks();
+void RunErrorBenchmarks();
+void RunDependencyBenchmarks();
+void RunConcurrentReadBenchmarks();
+void RunSheetViewBenchmarks();
+void RunDurabilityBenchmarks();
+void RunStructureBenchmarks();
+
+}  // namespace bench
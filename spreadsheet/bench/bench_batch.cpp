@@ -0,0 +1,98 @@
+#include "bench.h"
+
+#include "sheet.h"
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using namespace std::literals;
+
+namespace bench {
+namespace {
+
+constexpr int ROWS = 16'000;
+
+// Column B holds the inputs, column A a running total over them and C1 the
+// sum of the whole column, so every input is read by a long chain.
+std::vector<Sheet::CellEdit> ModelEdits() {
+    std::vector<Sheet::CellEdit> edits;
+    edits.reserve(ROWS * 2 + 1);
+    for(int row = 0; row < ROWS; ++row){
+        const std::string r = std::to_string(row + 1);
+        edits.push_back({Position{row, 1}, std::to_string(row % 100)});
+        edits.push_back({Position{row, 0}, row == 0 ? "=B1"s : "=A"s + std::to_string(row) + "+B" + r});
+    }
+    edits.push_back({Position{0, 2}, "=SUM(A1:A"s + std::to_string(ROWS) + ")"});
+    return edits;
+}
+
+std::vector<Sheet::CellEdit> InputEdits(int count) {
+    std::vector<Sheet::CellEdit> edits;
+    for(int i = 0; i < count; ++i){
+        edits.push_back({Position{(i * 7919) % ROWS, 1}, std::to_string(i)});
+    }
+    return edits;
+}
+
+void ReadResult(const Sheet& sheet) {
+    // the chain is too deep for the lazy evaluation
+    sheet.Recalculate(1);
+    if(sheet.GetCell(Position{0, 2})->GetValue() == CellInterface::Value("?"s)){
+        std::abort();
+    }
+}
+
+void RunLoad() {
+    const auto edits = ModelEdits();
+    {
+        Sheet sheet;
+        Timer timer;
+        for(const auto& edit : edits){
+            sheet.SetCell(edit.pos, edit.text);
+        }
+        ReportLatency("batch/load/SetCell", edits.size(), timer.Elapsed());
+    }
+    {
+        Sheet sheet;
+        auto batch = edits;
+        Timer timer;
+        sheet.ApplyBatch(std::move(batch));
+        ReportLatency("batch/load/ApplyBatch", edits.size(), timer.Elapsed());
+    }
+}
+
+// Inputs changed under a computed model, the cells reading them hold values
+void RunInputEdits(int count) {
+    const auto edits = InputEdits(count);
+    const std::string suffix = "/" + std::to_string(count);
+    {
+        Sheet sheet;
+        sheet.ApplyBatch(ModelEdits());
+        ReadResult(sheet);
+        Timer timer;
+        for(const auto& edit : edits){
+            sheet.SetCell(edit.pos, edit.text);
+        }
+        ReportLatency("batch/inputs/SetCell" + suffix, edits.size(), timer.Elapsed());
+    }
+    {
+        Sheet sheet;
+        sheet.ApplyBatch(ModelEdits());
+        ReadResult(sheet);
+        auto batch = edits;
+        Timer timer;
+        sheet.ApplyBatch(std::move(batch));
+        ReportLatency("batch/inputs/ApplyBatch" + suffix, edits.size(), timer.Elapsed());
+    }
+}
+
+}  // namespace
+
+void RunBatchBenchmarks() {
+    RunLoad();
+    RunInputEdits(10);
+    RunInputEdits(1000);
+}
+
+}  // namespace bench
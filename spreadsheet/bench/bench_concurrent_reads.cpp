@@ -0,0 +1,124 @@
+#include "bench.h"
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std::literals;
+
+namespace bench {
+namespace {
+
+constexpr int ROWS = 400;
+constexpr int COLS = 100;
+constexpr int WARM_PASSES = 5;
+
+// Every cell of a row reads its three neighbours in the row above, an edit
+// of the first row invalidates the whole sheet
+void BuildModel(Sheet& sheet) {
+    for(int row = ROWS - 1; row > 0; --row){
+        for(int col = 0; col < COLS; ++col){
+            std::string text = "="s + Position{row - 1, col}.ToString();
+            text += "*0.5+" + Position{row - 1, std::max(col - 1, 0)}.ToString();
+            text += "*0.25+" + Position{row - 1, std::min(col + 1, COLS - 1)}.ToString() + "*0.25";
+            sheet.SetCell(Position{row, col}, text);
+        }
+    }
+}
+
+void ChangeInputs(Sheet& sheet, int edit) {
+    for(int col = 0; col < COLS; ++col){
+        sheet.SetCell(Position{0, col}, std::to_string((col + edit) % 10));
+    }
+}
+
+// Reads every cell once, the threads start at different rows
+void ReadAll(const Sheet& sheet, size_t thread, size_t threads) {
+    const int first = static_cast<int>(thread * ROWS / threads);
+    for(int i = 0; i < ROWS; ++i){
+        const int row = (first + i) % ROWS;
+        for(int col = 0; col < COLS; ++col){
+            sheet.GetCell(Position{row, col})->GetValue();
+        }
+    }
+}
+
+std::chrono::nanoseconds RunThreads(size_t threads, const std::function<void(size_t)>& func) {
+    std::vector<std::thread> workers;
+    Timer timer;
+    for(size_t t = 0; t < threads; ++t){
+        workers.emplace_back(func, t);
+    }
+    for(std::thread& worker : workers){
+        worker.join();
+    }
+    return timer.Elapsed();
+}
+
+void Run(Sheet& sheet, size_t threads, int edit) {
+    const size_t cells = size_t{ROWS} * COLS;
+    const std::string name = "concurrent_reads/"s;
+    const std::string suffix = "/" + std::to_string(threads);
+
+    // every reader goes through the whole sheet right after an edit, each
+    // formula has to be computed by one of them and waited for by the rest
+    ChangeInputs(sheet, edit);
+    Sheet::ResetStats();
+    const auto cold = RunThreads(threads, [&](size_t t){
+        ReadAll(sheet, t, threads);
+    });
+    ReportLatency(name + "cold" + suffix, cells * threads, cold);
+    const EngineStats stats = Sheet::GetStats();
+    if(stats.enabled){
+        ReportValue(name + "cold/evaluations_per_formula" + suffix,
+                    static_cast<double>(stats.Get(StatCounter::Evaluations)) / (cells - COLS), "x");
+    }
+
+    const auto warm = RunThreads(threads, [&](size_t t){
+        for(int pass = 0; pass < WARM_PASSES; ++pass){
+            ReadAll(sheet, t, threads);
+        }
+    });
+    ReportLatency(name + "warm" + suffix, cells * threads * WARM_PASSES, warm);
+
+    // what the callers had to do before: one lock around every read
+    std::mutex mutex;
+    const auto locked = RunThreads(threads, [&](size_t t){
+        const int first = static_cast<int>(t * ROWS / threads);
+        for(int pass = 0; pass < WARM_PASSES; ++pass){
+            for(int i = 0; i < ROWS; ++i){
+                const int row = (first + i) % ROWS;
+                for(int col = 0; col < COLS; ++col){
+                    std::lock_guard lock(mutex);
+                    sheet.GetCell(Position{row, col})->GetValue();
+                }
+            }
+        }
+    });
+    ReportLatency(name + "warm_global_mutex" + suffix, cells * threads * WARM_PASSES, locked);
+}
+
+}  // namespace
+
+// The latencies are wall time per read of all the threads together, so they
+// drop as the reads scale
+void RunConcurrentReadBenchmarks() {
+    Sheet sheet;
+    BuildModel(sheet);
+    std::vector<size_t> thread_counts = {1, 2, 4, 8};
+    const size_t hardware = std::thread::hardware_concurrency();
+    if(hardware > thread_counts.back()){
+        thread_counts.push_back(hardware);
+    }
+    int edit = 0;
+    for(size_t threads : thread_counts){
+        Run(sheet, threads, edit++);
+    }
+}
+
+}  // namespace bench
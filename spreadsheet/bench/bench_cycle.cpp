@@ -0,0 +1,63 @@
+#include "bench.h"
+
+#include "sheet.h"
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using namespace std::literals;
+
+namespace bench {
+namespace {
+
+constexpr int LATTICE_COLS = 100;
+constexpr int LATTICE_ROWS = 1000;
+
+// Every cell reads the cell above it and the one above and to the right, so
+// the cone above any cell of the last row is the whole 100k-cell lattice.
+void BuildLattice(Sheet& sheet) {
+    for(int row = LATTICE_ROWS - 1; row > 0; --row){
+        for(int col = 0; col < LATTICE_COLS; ++col){
+            sheet.SetCell(Position{row, col}, "="s + Position{row - 1, col}.ToString() + "+"
+                          + Position{row - 1, (col + 1) % LATTICE_COLS}.ToString());
+        }
+    }
+    for(int col = 0; col < LATTICE_COLS; ++col){
+        sheet.SetCell(Position{0, col}, "1");
+    }
+}
+
+}  // namespace
+
+void RunCycleCheckBenchmarks() {
+    Sheet sheet;
+    BuildLattice(sheet);
+
+    const Position top{LATTICE_ROWS, 0};
+    const std::vector<Position> references{Position{LATTICE_ROWS - 1, 0}, Position{LATTICE_ROWS - 1, 1}};
+    const std::string formula = "="s + references[0].ToString() + "+" + references[1].ToString();
+    constexpr int ITERATIONS = 20;
+
+    {
+        const AllocStats before = GetAllocStats();
+        Timer timer;
+        for(int i = 0; i < ITERATIONS; ++i){
+            if(!sheet.CycleCheck(top, references)){
+                std::abort();
+            }
+        }
+        ReportLatency("cycle_check/lattice_100k/CycleCheck", ITERATIONS, timer.Elapsed());
+        ReportAllocations("cycle_check/lattice_100k/CycleCheck", ITERATIONS,
+                          GetAllocStats().allocations - before.allocations);
+    }
+    {
+        Timer timer;
+        for(int i = 0; i < ITERATIONS; ++i){
+            sheet.SetCell(top, formula);
+        }
+        ReportLatency("cycle_check/lattice_100k/SetCell", ITERATIONS, timer.Elapsed());
+    }
+}
+
+}  // namespace bench
@@ -0,0 +1,136 @@
+#include "bench.h"
+
+#include "delimited.h"
+#include "sheet.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+using namespace std::literals;
+
+namespace bench {
+namespace {
+
+constexpr int ROWS = 16'000;
+constexpr int COLS = 16;
+// the reader alone goes through a file this many times larger
+constexpr int REPEAT = 16;
+
+std::string MakeRow(int row) {
+    std::string line;
+    for(int col = 0; col < COLS; ++col){
+        if(col > 0){
+            line += '\t';
+        }
+        if(col % 4 == 3){
+            line += "label "s + std::to_string((row + col) % 97);
+        }
+        else{
+            line += std::to_string((row * 31 + col * 7) % 10007) + "." + std::to_string(col);
+        }
+    }
+    return line + '\n';
+}
+
+void ReportThroughput(const std::string& name, size_t bytes, std::chrono::nanoseconds elapsed) {
+    ReportValue(name, bytes / 1e6 / (elapsed.count() / 1e9), "MB/s");
+}
+
+void RunReader(const std::filesystem::path& path) {
+    const size_t bytes = std::filesystem::file_size(path);
+    {
+        std::ifstream input(path, std::ios::binary);
+        DelimitedReader reader(input, DelimitedFormat::Tsv);
+        std::vector<std::string_view> fields;
+        size_t count = 0;
+        Timer timer;
+        while(reader.ReadRecord(fields)){
+            count += fields.size();
+        }
+        ReportThroughput("delimited/read/DelimitedReader", bytes, timer.Elapsed());
+        if(count == 0){
+            std::abort();
+        }
+    }
+    {
+        // the usual way: a line at a time, fields copied out
+        std::ifstream input(path, std::ios::binary);
+        std::string line;
+        std::vector<std::string> fields;
+        size_t count = 0;
+        Timer timer;
+        while(std::getline(input, line)){
+            fields.clear();
+            size_t begin = 0;
+            for(size_t tab = line.find('\t'); tab != std::string::npos; tab = line.find('\t', begin)){
+                fields.push_back(line.substr(begin, tab - begin));
+                begin = tab + 1;
+            }
+            fields.push_back(line.substr(begin));
+            count += fields.size();
+        }
+        ReportThroughput("delimited/read/getline", bytes, timer.Elapsed());
+        if(count == 0){
+            std::abort();
+        }
+    }
+}
+
+void RunExport(const Sheet& sheet, const std::filesystem::path& path) {
+    {
+        std::ofstream output(path, std::ios::binary);
+        Timer timer;
+        ExportDelimited(sheet, output, DelimitedFormat::Tsv);
+        output.flush();
+        const auto elapsed = timer.Elapsed();
+        ReportThroughput("delimited/export/ExportDelimited", std::filesystem::file_size(path), elapsed);
+    }
+    {
+        std::ofstream output(path, std::ios::binary);
+        Timer timer;
+        sheet.PrintValues(output);
+        output.flush();
+        const auto elapsed = timer.Elapsed();
+        ReportThroughput("delimited/export/PrintValues", std::filesystem::file_size(path), elapsed);
+    }
+}
+
+}  // namespace
+
+void RunDelimitedBenchmarks() {
+    const auto path = std::filesystem::temp_directory_path() / "spreadsheet_bench.tsv";
+    {
+        std::ofstream output(path, std::ios::binary);
+        for(int repeat = 0; repeat < REPEAT; ++repeat){
+            for(int row = 0; row < ROWS; ++row){
+                output << MakeRow(row);
+            }
+        }
+    }
+    RunReader(path);
+
+    {
+        std::ofstream output(path, std::ios::binary);
+        for(int row = 0; row < ROWS; ++row){
+            output << MakeRow(row);
+        }
+    }
+    Sheet sheet;
+    {
+        std::ifstream input(path, std::ios::binary);
+        Timer timer;
+        const ImportResult result = ImportDelimited(sheet, input, DelimitedFormat::Tsv);
+        ReportLatency("delimited/import/cell", result.cells, timer.Elapsed());
+        if(result.failed != 0){
+            std::abort();
+        }
+    }
+    RunExport(sheet, path);
+    std::filesystem::remove(path);
+}
+
+}  // namespace bench
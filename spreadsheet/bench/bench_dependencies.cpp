@@ -0,0 +1,148 @@
+#include "bench.h"
+
+#include "dependency_graph.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std::literals;
+
+namespace bench {
+namespace {
+
+using Edges = std::vector<std::pair<Position, Position>>;
+
+// every cell of a column reads the first one
+Edges FanOut(int rows) {
+    Edges edges;
+    for(int row = 1; row < rows; ++row){
+        edges.push_back({Position{0, 0}, Position{row, 0}});
+    }
+    return edges;
+}
+
+// every cell reads the one above it
+Edges Chain(int rows) {
+    Edges edges;
+    for(int row = 1; row < rows; ++row){
+        edges.push_back({Position{row - 1, 0}, Position{row, 0}});
+    }
+    return edges;
+}
+
+// every cell of a square reads its neighbours above and to the left
+Edges Grid(int side) {
+    Edges edges;
+    for(int row = 0; row < side; ++row){
+        for(int col = 0; col < side; ++col){
+            if(row > 0){
+                edges.push_back({Position{row - 1, col}, Position{row, col}});
+            }
+            if(col > 0){
+                edges.push_back({Position{row, col - 1}, Position{row, col}});
+            }
+        }
+    }
+    return edges;
+}
+
+// The graph against the map of sets it replaced, both built from the same edges
+void RunShape(const std::string& name, const Edges& edges) {
+    {
+        DependencyGraph graph;
+        Timer timer;
+        for(const auto& [cell, dependent] : edges){
+            graph.AddEdge(cell, dependent);
+        }
+        ReportLatency(name + "/graph/AddEdge", edges.size(), timer.Elapsed());
+        ReportMemory(name + "/graph/memory", edges.size(), graph.GetMemoryUsage());
+
+        std::vector<Position> cells;
+        for(const auto& [cell, dependent] : edges){
+            cells.push_back(cell);
+        }
+        std::sort(cells.begin(), cells.end());
+        cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+        size_t visited = 0;
+        Timer walk_timer;
+        for(Position cell : cells){
+            graph.ForEachDependent(cell, [&visited](Position){
+                ++visited;
+            });
+        }
+        // per dependent visited
+        ReportLatency(name + "/graph/ForEachDependent", edges.size(), walk_timer.Elapsed());
+        if(visited != edges.size()){
+            std::abort();
+        }
+    }
+    {
+        const AllocStats before = GetAllocStats();
+        std::map<Position, std::set<Position>> map_set;
+        Timer timer;
+        for(const auto& [cell, dependent] : edges){
+            map_set[cell].insert(dependent);
+        }
+        ReportLatency(name + "/map_set/AddEdge", edges.size(), timer.Elapsed());
+        ReportMemory(name + "/map_set/memory", edges.size(), GetAllocStats().live_bytes - before.live_bytes);
+    }
+}
+
+// Formulas are rewritten over and over to read cells further down the sheet,
+// so every round leaves the cells read before without dependents. Once the
+// references went through the whole sheet a few times and the tables reached
+// their working sizes, the heap has to stay the same.
+void RunChurn(int formulas, int sweeps) {
+    constexpr int WARMUP_SWEEPS = 4;
+    const int span = Position::MAX_ROWS - 1;
+    const int rounds_per_sweep = (span + formulas - 1) / formulas;
+    const AllocStats before = GetAllocStats();
+    Sheet sheet;
+    size_t warm = 0;
+    std::chrono::nanoseconds set_time{0};
+    const int rounds = rounds_per_sweep * (WARMUP_SWEEPS + sweeps);
+    for(int round = 0; round < rounds; ++round){
+        Timer timer;
+        for(int i = 0; i < formulas; ++i){
+            const int row = (round * formulas + i) % span + 1;
+            const std::string r = std::to_string(row);
+            sheet.SetCell(Position{i, 0}, "=B"s + r + "+C" + r);
+        }
+        set_time += timer.Elapsed();
+        if(round + 1 == rounds_per_sweep * WARMUP_SWEEPS){
+            warm = GetAllocStats().live_bytes - before.live_bytes;
+        }
+    }
+    const size_t last = GetAllocStats().live_bytes - before.live_bytes;
+    ReportLatency("dependencies/churn/SetCell", static_cast<size_t>(formulas) * rounds, set_time);
+    ReportMemory("dependencies/churn/warm", formulas, warm);
+    ReportMemory("dependencies/churn/last", formulas, last);
+    ReportValue("dependencies/churn/growth", static_cast<double>(last) / warm, "x");
+
+    for(int i = 0; i < formulas; ++i){
+        sheet.ClearCell(Position{i, 0});
+    }
+    ReportMemory("dependencies/churn/cleared", formulas, GetAllocStats().live_bytes - before.live_bytes);
+}
+
+int Scaled(int size, int limit) {
+    return std::clamp(static_cast<int>(size * GetOptions().scale), 1, limit);
+}
+
+}  // namespace
+
+void RunDependencyBenchmarks() {
+    const int rows = Scaled(Position::MAX_ROWS, Position::MAX_ROWS);
+    RunShape("dependencies/fan_out", FanOut(rows));
+    RunShape("dependencies/chain", Chain(rows));
+    RunShape("dependencies/grid", Grid(Scaled(128, Position::MAX_COLS)));
+    RunChurn(1000, Scaled(16, 1000));
+}
+
+}  // namespace bench
@@ -0,0 +1,147 @@
+#include "bench.h"
+
+#include "durable_sheet.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std::literals;
+
+namespace bench {
+namespace {
+
+constexpr int COLS = 8;
+
+std::filesystem::path BenchDirectory() {
+    return std::filesystem::temp_directory_path() / "spreadsheet_bench_durability";
+}
+
+Position EditedCell(int edit) {
+    return Position{(edit / COLS) % Position::MAX_ROWS, edit % COLS};
+}
+
+void ReportSyncs(const std::string& name, int edits) {
+#ifdef SPREADSHEET_STATS
+    const uint64_t syncs = Sheet::GetStats().Get(StatCounter::JournalSyncs);
+    ReportValue(name + "/edits_per_sync", static_cast<double>(edits) / std::max<uint64_t>(syncs, 1), "edits");
+#endif
+}
+
+// Every thread waits for each of its edits: a lone writer pays a sync per
+// edit, concurrent ones share them
+void RunDurableWriters(int threads, int edits_per_thread) {
+    std::filesystem::remove_all(BenchDirectory());
+    const std::string name = "durability/SetCell/"s + std::to_string(threads) + "_threads";
+    {
+        DurableSheet sheet(BenchDirectory().string());
+        Sheet::ResetStats();
+        Timer timer;
+        std::vector<std::thread> writers;
+        for(int t = 0; t < threads; ++t){
+            writers.emplace_back([&sheet, t, threads, edits_per_thread]{
+                for(int i = 0; i < edits_per_thread; ++i){
+                    const int edit = i * threads + t;
+                    sheet.SetCell(EditedCell(edit), std::to_string(edit));
+                }
+            });
+        }
+        for(std::thread& writer : writers){
+            writer.join();
+        }
+        const auto elapsed = timer.Elapsed();
+        const int edits = threads * edits_per_thread;
+        ReportLatency(name, edits, elapsed);
+        ReportValue(name + "/throughput", edits / std::chrono::duration<double>(elapsed).count(), "edits/s");
+        ReportSyncs(name, edits);
+    }
+    std::filesystem::remove_all(BenchDirectory());
+}
+
+// A writer that doesn't wait for each edit, only for all of them at the end
+void RunAsyncWriter(int edits) {
+    std::filesystem::remove_all(BenchDirectory());
+    const std::string name = "durability/SetCellAsync"s;
+    {
+        DurableSheet sheet(BenchDirectory().string());
+        Sheet::ResetStats();
+        Timer timer;
+        for(int edit = 0; edit < edits; ++edit){
+            sheet.SetCellAsync(EditedCell(edit), std::to_string(edit));
+        }
+        sheet.Sync();
+        const auto elapsed = timer.Elapsed();
+        ReportLatency(name, edits, elapsed);
+        ReportValue(name + "/throughput", edits / std::chrono::duration<double>(elapsed).count(), "edits/s");
+        ReportSyncs(name, edits);
+    }
+    std::filesystem::remove_all(BenchDirectory());
+}
+
+// Opening a sheet replays the journal after the checkpoint; folding the
+// journal into a checkpoint costs a snapshot of the sheet
+void RunRecovery(int cells, int journaled) {
+    std::filesystem::remove_all(BenchDirectory());
+    {
+        DurableSheet sheet(BenchDirectory().string());
+        for(int edit = 0; edit < cells; ++edit){
+            sheet.SetCellAsync(EditedCell(edit), std::to_string(edit));
+        }
+        Timer timer;
+        sheet.Checkpoint();
+        ReportLatency("durability/Checkpoint", cells, timer.Elapsed());
+        for(int edit = 0; edit < journaled; ++edit){
+            sheet.SetCellAsync(EditedCell(edit * 7 % cells), "="s + std::to_string(edit) + "+1");
+        }
+        sheet.Sync();
+    }
+    Timer timer;
+    DurableSheet sheet(BenchDirectory().string());
+    ReportLatency("durability/open/replayed_edit", journaled, timer.Elapsed());
+    std::filesystem::remove_all(BenchDirectory());
+}
+
+// Edits that don't wait for the disk while checkpoints of a large sheet are
+// written in the background: the slowest ones are those that start the
+// journal over, they wait for the records appended meanwhile to be copied
+void RunCheckpointStalls(int cells, int edits) {
+    std::filesystem::remove_all(BenchDirectory());
+    {
+        DurableSheetOptions options;
+        options.checkpoint_bytes = uint64_t{1} << 20;
+        DurableSheet sheet(BenchDirectory().string(), options);
+        for(int edit = 0; edit < cells; ++edit){
+            sheet.SetCellAsync(EditedCell(edit), std::to_string(edit));
+        }
+        sheet.Checkpoint();
+        LatencySamples samples;
+        for(int edit = 0; edit < edits; ++edit){
+            samples.Measure([&]{
+                sheet.SetCellAsync(EditedCell(edit * 7 % cells), "="s + std::to_string(edit) + "+1");
+            });
+        }
+        sheet.Sync();
+        ReportPercentiles("durability/SetCellAsync/during_checkpoints", samples);
+    }
+    std::filesystem::remove_all(BenchDirectory());
+}
+
+int Scaled(int size) {
+    return std::max(static_cast<int>(size * GetOptions().scale), 1);
+}
+
+}  // namespace
+
+void RunDurabilityBenchmarks() {
+    RunDurableWriters(1, Scaled(2000));
+    RunDurableWriters(8, Scaled(2000));
+    RunDurableWriters(64, Scaled(500));
+    RunAsyncWriter(Scaled(200000));
+    RunRecovery(Scaled(50000), Scaled(100000));
+    RunCheckpointStalls(Scaled(200000), Scaled(200000));
+}
+
+}  // namespace bench
@@ -0,0 +1,68 @@
+#include "bench.h"
+
+#include "sheet.h"
+
+#include <cstdlib>
+#include <string>
+#include <variant>
+
+using namespace std::literals;
+
+namespace bench {
+namespace {
+
+constexpr int ROWS = 16'000;
+constexpr int EDITS = 5;
+
+// Every row reads the input in A1 through a few layers of formulas and a
+// range, so a bad input turns every formula of the sheet into an error
+void BuildModel(Sheet& sheet) {
+    for(int row = 0; row < ROWS; ++row){
+        const std::string r = std::to_string(row + 1);
+        sheet.SetCell(Position{row, 1}, "=A1+"s + std::to_string(row));
+        sheet.SetCell(Position{row, 2}, "=B"s + r + "*2");
+        sheet.SetCell(Position{row, 3}, "=C"s + r + "-B" + r);
+        sheet.SetCell(Position{row, 4}, "=SUM(B"s + r + ":D" + r + ")");
+    }
+}
+
+void ReadAll(const Sheet& sheet, bool errors) {
+    for(int row = 0; row < ROWS; ++row){
+        for(int col = 1; col <= 4; ++col){
+            if(std::holds_alternative<FormulaError>(sheet.GetCell(Position{row, col})->GetValueView()) != errors){
+                std::abort();
+            }
+        }
+    }
+}
+
+void Run(const std::string& name, Sheet& sheet, const std::string& input, bool errors) {
+    const size_t cells = size_t{ROWS} * 4;
+    std::chrono::nanoseconds recalculate_time{0};
+    std::chrono::nanoseconds lazy_time{0};
+    for(int i = 0; i < EDITS; ++i){
+        sheet.SetCell(Position{0, 0}, input);
+        Timer recalculate_timer;
+        sheet.Recalculate(1);
+        recalculate_time += recalculate_timer.Elapsed();
+
+        sheet.SetCell(Position{0, 0}, input);
+        Timer lazy_timer;
+        ReadAll(sheet, errors);
+        lazy_time += lazy_timer.Elapsed();
+    }
+    ReportLatency(name + "/recalculate", cells * EDITS, recalculate_time);
+    ReportLatency(name + "/lazy", cells * EDITS, lazy_time);
+}
+
+}  // namespace
+
+void RunErrorBenchmarks() {
+    Sheet sheet;
+    BuildModel(sheet);
+    Run("errors/error_free", sheet, "1", false);
+    Run("errors/text_input", sheet, "not a number", true);
+    Run("errors/div0_input", sheet, "=1/0", true);
+}
+
+}  // namespace bench
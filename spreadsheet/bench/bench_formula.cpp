@@ -0,0 +1,215 @@
+#include "bench.h"
+
+#include "common.h"
+#include "formula.h"
+
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+using namespace std::literals;
+
+namespace bench {
+namespace {
+
+// A1+A2+...+An: a long left-leaning chain of additions
+std::string WideFormula(int cells) {
+    std::string formula = "A1";
+    for(int row = 2; row <= cells; ++row){
+        formula += "+A" + std::to_string(row);
+    }
+    return formula;
+}
+
+// (A1*(A2-(A3/(A4+...)))): right-nested, the tree is as deep as it is long
+std::string DeepFormula(int depth) {
+    static const char ops[] = {'*', '-', '/', '+'};
+    std::string formula;
+    for(int i = 1; i < depth; ++i){
+        formula += "(A" + std::to_string(i) + ops[i % 4];
+    }
+    formula += "A" + std::to_string(depth) + std::string(depth - 1, ')');
+    return formula;
+}
+
+// The tree walk the bytecode replaced, kept to compare against: a virtual
+// call per node, the cell reader copied at every level and errors thrown
+class TreeNode {
+public:
+    virtual ~TreeNode() = default;
+    virtual double Evaluate(std::function<double(Position)> read_cell) const = 0;
+};
+
+class NumberNode final : public TreeNode {
+public:
+    explicit NumberNode(double value)
+        : value_(value)
+    {}
+
+    double Evaluate(std::function<double(Position)>) const override {
+        return value_;
+    }
+
+private:
+    double value_;
+};
+
+class CellNode final : public TreeNode {
+public:
+    explicit CellNode(Position pos)
+        : pos_(pos)
+    {}
+
+    double Evaluate(std::function<double(Position)> read_cell) const override {
+        return read_cell(pos_);
+    }
+
+private:
+    Position pos_;
+};
+
+class BinaryNode final : public TreeNode {
+public:
+    BinaryNode(char op, std::unique_ptr<TreeNode> lhs, std::unique_ptr<TreeNode> rhs)
+        : op_(op)
+        , lhs_(std::move(lhs))
+        , rhs_(std::move(rhs))
+    {}
+
+    double Evaluate(std::function<double(Position)> read_cell) const override {
+        const double rhs = rhs_->Evaluate(read_cell);
+        const double lhs = lhs_->Evaluate(read_cell);
+        double result;
+        switch(op_){
+        case '+':
+            result = lhs + rhs;
+            break;
+        case '-':
+            result = lhs - rhs;
+            break;
+        case '*':
+            result = lhs * rhs;
+            break;
+        default:
+            result = lhs / rhs;
+            break;
+        }
+        if(!std::isfinite(result)){
+            throw FormulaError(FormulaError::Category::Div0);
+        }
+        return result;
+    }
+
+private:
+    char op_;
+    std::unique_ptr<TreeNode> lhs_;
+    std::unique_ptr<TreeNode> rhs_;
+};
+
+// Builds the tree of the expressions above: numbers, cells, the four
+// operators and parentheses
+class TreeParser {
+public:
+    explicit TreeParser(std::string_view text)
+        : text_(text)
+    {}
+
+    std::unique_ptr<TreeNode> ParseSum() {
+        std::unique_ptr<TreeNode> node = ParseProduct();
+        while(pos_ < text_.size() && (text_[pos_] == '+' || text_[pos_] == '-')){
+            const char op = text_[pos_++];
+            node = std::make_unique<BinaryNode>(op, std::move(node), ParseProduct());
+        }
+        return node;
+    }
+
+private:
+    std::unique_ptr<TreeNode> ParseProduct() {
+        std::unique_ptr<TreeNode> node = ParseAtom();
+        while(pos_ < text_.size() && (text_[pos_] == '*' || text_[pos_] == '/')){
+            const char op = text_[pos_++];
+            node = std::make_unique<BinaryNode>(op, std::move(node), ParseAtom());
+        }
+        return node;
+    }
+
+    std::unique_ptr<TreeNode> ParseAtom() {
+        if(text_[pos_] == '('){
+            ++pos_;
+            std::unique_ptr<TreeNode> node = ParseSum();
+            ++pos_;
+            return node;
+        }
+        const size_t begin = pos_;
+        while(pos_ < text_.size() && std::isalnum(static_cast<unsigned char>(text_[pos_]))){
+            ++pos_;
+        }
+        const std::string_view token = text_.substr(begin, pos_ - begin);
+        if(std::isdigit(static_cast<unsigned char>(token.front()))){
+            return std::make_unique<NumberNode>(std::stod(std::string(token)));
+        }
+        return std::make_unique<CellNode>(Position::FromString(token));
+    }
+
+    std::string_view text_;
+    size_t pos_ = 0;
+};
+
+void RunEvaluate(const std::string& name, const SheetInterface& sheet, const std::string& expression,
+                 size_t iterations) {
+    auto formula = ParseFormula(expression);
+    double sum = 0;
+    Timer timer;
+    for(size_t i = 0; i < iterations; ++i){
+        auto value = formula->Evaluate(sheet);
+        if(std::holds_alternative<double>(value)){
+            sum += std::get<double>(value);
+        }
+    }
+    const std::chrono::nanoseconds bytecode = timer.Elapsed();
+    ReportLatency("formula/evaluate/"s + name, iterations, bytecode);
+
+    // the same expression walked as a tree, reading the cells the same way
+    const std::unique_ptr<TreeNode> tree = TreeParser(expression).ParseSum();
+    const std::function<double(Position)> read_cell = [&sheet](Position pos){
+        const CellInterface::NumericValue value = sheet.GetNumericValue(pos);
+        if(std::holds_alternative<FormulaError>(value)){
+            throw std::get<FormulaError>(value);
+        }
+        return std::get<double>(value);
+    };
+    double tree_sum = 0;
+    timer = Timer();
+    for(size_t i = 0; i < iterations; ++i){
+        tree_sum += tree->Evaluate(read_cell);
+    }
+    const std::chrono::nanoseconds tree_walk = timer.Elapsed();
+    ReportLatency("formula/tree_walk/"s + name, iterations, tree_walk);
+    ReportValue("formula/speedup/"s + name,
+                static_cast<double>(tree_walk.count()) / static_cast<double>(bytecode.count()), "x");
+
+    // both must have computed the same thing, which also keeps the loops
+    if(sum != tree_sum){
+        std::abort();
+    }
+}
+
+}  // namespace
+
+void RunFormulaBenchmarks() {
+    // numbers are set as formulas, so reading them doesn't involve text conversion
+    auto sheet = CreateSheet();
+    for(int row = 0; row < 1000; ++row){
+        sheet->SetCell(Position{row, 0}, "="s + std::to_string(row % 7 + 1));
+    }
+
+    RunEvaluate("constant", *sheet, "1+2*3-4/5", 1'000'000);
+    RunEvaluate("wide_1000", *sheet, WideFormula(1000), 2'000);
+    RunEvaluate("deep_200", *sheet, DeepFormula(200), 10'000);
+}
+
+}  // namespace bench
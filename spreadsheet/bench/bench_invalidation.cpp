@@ -0,0 +1,77 @@
+#include "bench.h"
+
+#include "common.h"
+
+#include <cstdlib>
+#include <string>
+
+using namespace std::literals;
+
+namespace bench {
+namespace {
+
+std::string Cell(int row) {
+    return Position{row, 0}.ToString();
+}
+
+// Formulas are set from the last row up, so every SetCell only sees empty
+// references and the build cost doesn't depend on the cycle check.
+void BuildChain(SheetInterface& sheet, int length) {
+    for(int row = length - 1; row > 0; --row){
+        sheet.SetCell(Position{row, 0}, "="s + Cell(row - 1) + "+1");
+    }
+    sheet.SetCell(Position{0, 0}, "1");
+}
+
+// Every row refers to the two rows above it, so the number of paths from
+// the first row grows exponentially with the depth.
+void BuildLattice(SheetInterface& sheet, int depth) {
+    for(int row = depth - 1; row > 1; --row){
+        sheet.SetCell(Position{row, 0}, "="s + Cell(row - 1) + "+" + Cell(row - 2));
+    }
+    sheet.SetCell(Position{1, 0}, "1");
+    sheet.SetCell(Position{0, 0}, "1");
+}
+
+// Rows are read top-down, so lazy evaluation never recurses more than one level deep
+void Recalculate(const SheetInterface& sheet, int rows) {
+    for(int row = 0; row < rows; ++row){
+        if(std::holds_alternative<FormulaError>(sheet.GetCell(Position{row, 0})->GetValue())){
+            std::abort();
+        }
+    }
+}
+
+void RunEdits(const std::string& name, SheetInterface& sheet, int rows, int edits) {
+    Recalculate(sheet, rows);
+    std::chrono::nanoseconds set_time{0};
+    std::chrono::nanoseconds get_time{0};
+    for(int i = 0; i < edits; ++i){
+        Timer set_timer;
+        sheet.SetCell(Position{0, 0}, std::to_string(i % 3 + 1));
+        set_time += set_timer.Elapsed();
+
+        Timer get_timer;
+        Recalculate(sheet, rows);
+        get_time += get_timer.Elapsed();
+    }
+    ReportLatency(name + "/SetCell", edits, set_time);
+    ReportLatency(name + "/recalculate", edits, get_time);
+}
+
+}  // namespace
+
+void RunInvalidationBenchmarks() {
+    {
+        auto sheet = CreateSheet();
+        BuildChain(*sheet, Position::MAX_ROWS);
+        RunEdits("invalidation/chain_16384", *sheet, Position::MAX_ROWS, 20);
+    }
+    {
+        auto sheet = CreateSheet();
+        BuildLattice(*sheet, 30);
+        RunEdits("invalidation/lattice_30", *sheet, 30, 20);
+    }
+}
+
+}  // namespace bench
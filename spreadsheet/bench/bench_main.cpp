@@ -0,0 +1,258 @@
+#include "bench.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace bench {
+namespace {
+
+Options options;
+
+// A report kept for the JSON document
+struct Result {
+    std::string name;
+    double value;
+    std::string unit;
+    // further numbers of the same measurement
+    std::vector<std::pair<std::string, double>> details;
+};
+
+std::vector<Result> results;
+
+void PrintName(const std::string& name) {
+    std::cout << std::left << std::setw(60) << name << std::right << std::setw(14) << std::fixed;
+}
+
+void PrintJsonString(std::string_view text) {
+    std::cout << '"';
+    for(char c : text){
+        if(c == '"' || c == '\\'){
+            std::cout << '\\';
+        }
+        std::cout << c;
+    }
+    std::cout << '"';
+}
+
+void PrintJsonNumber(double value) {
+    // JSON has no infinities or NaNs
+    if(std::isfinite(value)){
+        std::cout << std::setprecision(12) << std::defaultfloat << value;
+    }
+    else{
+        std::cout << "null";
+    }
+}
+
+void PrintJson() {
+    std::cout << "{\n  \"context\": {\"hardware_threads\": " << std::thread::hardware_concurrency()
+              << ", \"scale\": ";
+    PrintJsonNumber(options.scale);
+    std::cout << ", \"peak_rss_bytes\": " << GetPeakRss() << "},\n  \"results\": [";
+    for(size_t i = 0; i < results.size(); ++i){
+        const Result& result = results[i];
+        std::cout << (i > 0 ? ",\n    {" : "\n    {") << "\"name\": ";
+        PrintJsonString(result.name);
+        std::cout << ", \"value\": ";
+        PrintJsonNumber(result.value);
+        std::cout << ", \"unit\": ";
+        PrintJsonString(result.unit);
+        for(const auto& [key, value] : result.details){
+            std::cout << ", ";
+            PrintJsonString(key);
+            std::cout << ": ";
+            PrintJsonNumber(value);
+        }
+        std::cout << '}';
+    }
+    std::cout << "\n  ]\n}" << std::endl;
+}
+
+struct Group {
+    const char* name;
+    void (*run)();
+};
+
+// the names are the prefixes of the reports of each group
+constexpr Group GROUPS[] = {
+    {"storage", RunStorageBenchmarks},
+    {"formula", RunFormulaBenchmarks},
+    {"invalidation", RunInvalidationBenchmarks},
+    {"cycle_check", RunCycleCheckBenchmarks},
+    {"topological_order", RunTopologicalOrderBenchmarks},
+    {"recalculate", RunRecalculationBenchmarks},
+    {"ranges", RunRangeBenchmarks},
+    {"numeric_text", RunNumericTextBenchmarks},
+    {"parse", RunParseBenchmarks},
+    {"shared_formulas", RunSharedFormulaBenchmarks},
+    {"batch", RunBatchBenchmarks},
+    {"snapshot", RunSnapshotBenchmarks},
+    {"delimited", RunDelimitedBenchmarks},
+    {"print", RunPrintBenchmarks},
+    {"workloads", RunWorkloadBenchmarks},
+    {"errors", RunErrorBenchmarks},
+    {"dependencies", RunDependencyBenchmarks},
+    {"concurrent_reads", RunConcurrentReadBenchmarks},
+    {"sheet_views", RunSheetViewBenchmarks},
+    {"durability", RunDurabilityBenchmarks},
+    {"structure", RunStructureBenchmarks},
+};
+
+void PrintUsage() {
+    std::cerr << "Usage: spreadsheet_bench [--json] [--scale=FACTOR] [--list] [GROUP...]\n"
+                 "Runs the given groups of benchmarks, all of them by default.\n";
+}
+
+}  // namespace
+
+const Options& GetOptions() {
+    return options;
+}
+
+std::chrono::nanoseconds LatencySamples::Percentile(double fraction) {
+    if(samples_.empty()){
+        return std::chrono::nanoseconds{0};
+    }
+    if(!sorted_){
+        std::sort(samples_.begin(), samples_.end());
+        sorted_ = true;
+    }
+    // nearest rank
+    const size_t rank = static_cast<size_t>(std::ceil(fraction * samples_.size()));
+    return samples_[std::min(std::max<size_t>(rank, 1), samples_.size()) - 1];
+}
+
+std::chrono::nanoseconds LatencySamples::Total() const {
+    std::chrono::nanoseconds total{0};
+    for(std::chrono::nanoseconds sample : samples_){
+        total += sample;
+    }
+    return total;
+}
+
+void ReportLatency(const std::string& name, size_t ops, std::chrono::nanoseconds elapsed) {
+    const double average = static_cast<double>(elapsed.count()) / ops;
+    if(options.json){
+        results.push_back({name, average, "ns/op", {}});
+        return;
+    }
+    PrintName(name);
+    std::cout << std::setprecision(1) << average << " ns/op" << std::endl;
+}
+
+void ReportPercentiles(const std::string& name, LatencySamples& samples) {
+    if(samples.Size() == 0){
+        return;
+    }
+    const double average = static_cast<double>(samples.Total().count()) / samples.Size();
+    const std::pair<const char*, double> percentiles[] = {
+        {"p50", static_cast<double>(samples.Percentile(0.5).count())},
+        {"p90", static_cast<double>(samples.Percentile(0.9).count())},
+        {"p99", static_cast<double>(samples.Percentile(0.99).count())},
+        {"max", static_cast<double>(samples.Percentile(1.0).count())},
+    };
+    if(options.json){
+        Result result{name, average, "ns/op", {{"samples", static_cast<double>(samples.Size())}}};
+        for(const auto& [key, value] : percentiles){
+            result.details.emplace_back(key, value);
+        }
+        results.push_back(std::move(result));
+        return;
+    }
+    PrintName(name);
+    std::cout << std::setprecision(1) << average << " ns/op (";
+    for(const auto& [key, value] : percentiles){
+        std::cout << (key == percentiles[0].first ? "" : ", ") << key << ' ' << value;
+    }
+    std::cout << ')' << std::endl;
+}
+
+void ReportMemory(const std::string& name, size_t items, size_t bytes) {
+    const double per_item = static_cast<double>(bytes) / items;
+    if(options.json){
+        results.push_back({name, static_cast<double>(bytes), "bytes", {{"per_item", per_item}}});
+        return;
+    }
+    PrintName(name);
+    std::cout << bytes << " bytes (" << std::setprecision(1) << per_item << " per item)" << std::endl;
+}
+
+void ReportValue(const std::string& name, double value, const std::string& unit) {
+    if(options.json){
+        results.push_back({name, value, unit, {}});
+        return;
+    }
+    PrintName(name);
+    std::cout << std::setprecision(2) << value << ' ' << unit << std::endl;
+}
+
+void ReportAllocations(const std::string& name, size_t ops, size_t allocations) {
+    const double average = static_cast<double>(allocations) / ops;
+    if(options.json){
+        results.push_back({name, average, "allocs/op", {}});
+        return;
+    }
+    PrintName(name);
+    std::cout << std::setprecision(2) << average << " allocs/op" << std::endl;
+}
+
+}  // namespace bench
+
+int main(int argc, char* argv[]) {
+    std::vector<const bench::Group*> groups;
+    for(int i = 1; i < argc; ++i){
+        const std::string_view arg = argv[i];
+        if(arg == "--json"){
+            bench::options.json = true;
+        }
+        else if(arg.substr(0, 8) == "--scale="){
+            bench::options.scale = std::atof(argv[i] + 8);
+            if(!(bench::options.scale > 0)){
+                bench::PrintUsage();
+                return 1;
+            }
+        }
+        else if(arg == "--list"){
+            for(const bench::Group& group : bench::GROUPS){
+                std::cout << group.name << '\n';
+            }
+            return 0;
+        }
+        else{
+            auto it = std::find_if(std::begin(bench::GROUPS), std::end(bench::GROUPS),
+                                   [arg](const bench::Group& group){
+                return arg == group.name;
+            });
+            if(it == std::end(bench::GROUPS)){
+                std::cerr << "Unknown group " << arg << '\n';
+                bench::PrintUsage();
+                return 1;
+            }
+            groups.push_back(&*it);
+        }
+    }
+    if(groups.empty()){
+        for(const bench::Group& group : bench::GROUPS){
+            groups.push_back(&group);
+        }
+    }
+
+    for(const bench::Group* group : groups){
+        group->run();
+    }
+    if(bench::options.json){
+        bench::PrintJson();
+    }
+    else{
+        bench::ReportValue("process/peak_rss", static_cast<double>(bench::GetPeakRss()) / (1 << 20), "MiB");
+    }
+    return 0;
+}
@@ -0,0 +1,117 @@
+#include "bench.h"
+
+#include "common.h"
+#include "numeric_text.h"
+
+#include <cstdlib>
+#include <optional>
+#include <random>
+#include <regex>
+#include <string>
+#include <vector>
+
+using namespace std::literals;
+
+namespace bench {
+namespace {
+
+constexpr int ROWS = 10000;
+
+// the way formulas used to read text cells, kept to compare against
+std::optional<double> ParseWithRegex(const std::string& text) {
+    static const std::regex number(
+        R"([ \t\n]*(-?)(0|([1-9][0-9]*))(.[0-9]+)?([eE]-?[1-9][0-9]*)?[ \t\n]*)");
+    if(!std::regex_match(text, number)){
+        return std::nullopt;
+    }
+    try{
+        return std::stod(text);
+    }
+    catch(const std::exception&){
+        return std::nullopt;
+    }
+}
+
+// what a column of imported data looks like: mostly numbers, some words
+std::vector<std::string> MakeTexts(size_t count) {
+    std::mt19937 random(3);
+    std::uniform_int_distribution<int> kind(0, 4);
+    std::uniform_int_distribution<int> integer(-100000, 100000);
+    std::uniform_real_distribution<double> real(-1e6, 1e6);
+    std::vector<std::string> texts;
+    texts.reserve(count);
+    for(size_t i = 0; i < count; ++i){
+        switch(kind(random)){
+        case 0:
+            texts.push_back(std::to_string(integer(random)));
+            break;
+        case 1:
+        case 2:
+            texts.push_back(std::to_string(real(random)));
+            break;
+        case 3:
+            texts.push_back(std::to_string(integer(random)) + "e-" + std::to_string(i % 9 + 1));
+            break;
+        default:
+            texts.push_back("item " + std::to_string(i));
+        }
+    }
+    return texts;
+}
+
+template <typename Parser>
+void RunParser(const std::string& name, const std::vector<std::string>& texts, Parser parse) {
+    constexpr int ROUNDS = 5;
+    double sum = 0;
+    Timer timer;
+    for(int round = 0; round < ROUNDS; ++round){
+        for(const auto& text : texts){
+            if(auto number = parse(text)){
+                sum += *number;
+            }
+        }
+    }
+    ReportLatency(name, texts.size() * ROUNDS, timer.Elapsed());
+    if(sum == 42.4242){
+        std::abort();
+    }
+}
+
+// A total over a column of numbers typed in as text, recomputed after each
+// edit of a cell it reads besides the range.
+void RunTextColumnTotal(int edits) {
+    auto sheet = CreateSheet();
+    std::vector<std::string> texts = MakeTexts(ROWS);
+    for(int row = 0; row < ROWS; ++row){
+        sheet->SetCell(Position{row, 0}, row % 5 == 4 ? std::to_string(row) : texts[row]);
+    }
+    sheet->SetCell(Position{0, 1}, "=SUM(A1:A"s + std::to_string(ROWS) + ")+C1");
+
+    double sum = 0;
+    Timer timer;
+    for(int i = 0; i < edits; ++i){
+        sheet->SetCell(Position{0, 2}, std::to_string(i));
+        auto value = sheet->GetCell(Position{0, 1})->GetValue();
+        if(std::holds_alternative<double>(value)){
+            sum += std::get<double>(value);
+        }
+    }
+    ReportLatency("numeric_text/text_column_total/recalculate_per_cell", edits * size_t{ROWS},
+                  timer.Elapsed());
+    if(sum == 42.4242){
+        std::abort();
+    }
+}
+
+}  // namespace
+
+void RunNumericTextBenchmarks() {
+    std::vector<std::string> texts = MakeTexts(100000);
+    RunParser("numeric_text/regex_and_stod", texts, ParseWithRegex);
+    RunParser("numeric_text/scanner", texts, [](const std::string& text){
+        return ParseNumericText(text);
+    });
+    RunTextColumnTotal(100);
+}
+
+}  // namespace bench
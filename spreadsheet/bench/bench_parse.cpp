@@ -0,0 +1,61 @@
+#include "bench.h"
+
+#include "FormulaAST.h"
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using namespace std::literals;
+
+namespace bench {
+namespace {
+
+std::string WideFormula(int cells) {
+    std::string formula = "A1";
+    for(int row = 2; row <= cells; ++row){
+        formula += "+A" + std::to_string(row);
+    }
+    return formula;
+}
+
+template <typename Parse>
+void RunParse(const std::string& name, const std::string& formula, size_t iterations, Parse parse) {
+    size_t cells = 0;
+    const size_t allocations_before = GetAllocStats().allocations;
+    Timer timer;
+    for(size_t i = 0; i < iterations; ++i){
+        cells += parse(formula).GetCells().size();
+    }
+    ReportLatency(name, iterations, timer.Elapsed());
+    ReportAllocations(name, iterations, GetAllocStats().allocations - allocations_before);
+    if(cells == 42){
+        std::abort();
+    }
+}
+
+}  // namespace
+
+void RunParseBenchmarks() {
+    struct Case {
+        std::string name;
+        std::string formula;
+        size_t iterations;
+    };
+    const std::vector<Case> cases = {
+        {"small", "A1+1", 200'000},
+        {"arithmetic", "(A1*B2-C3)/2.5e1+-D4", 100'000},
+        {"functions", "SUM(A1:A100)+MAX(B1:B10,3)*AVERAGE(C1,C2)", 100'000},
+        {"wide_100", WideFormula(100), 5'000},
+    };
+    for(const auto& c : cases){
+        RunParse("parse/antlr/"s + c.name, c.formula, c.iterations / 10, [](const std::string& text){
+            return ParseFormulaASTWithAntlr(text);
+        });
+        RunParse("parse/hand_written/"s + c.name, c.formula, c.iterations, [](const std::string& text){
+            return ParseFormulaAST(text);
+        });
+    }
+}
+
+}  // namespace bench
@@ -0,0 +1,92 @@
+#include "bench.h"
+
+#include "sheet.h"
+
+#include <functional>
+#include <ostream>
+#include <string>
+#include <variant>
+
+using namespace std::literals;
+
+namespace bench {
+namespace {
+
+constexpr int ROWS = 16'000;
+
+// Numbers, labels and formulas in the first columns, a few cells far to the
+// right make most of the printable area empty
+void BuildSheet(Sheet& sheet) {
+    for(int row = 0; row < ROWS; ++row){
+        const std::string r = std::to_string(row + 1);
+        sheet.SetCell(Position{row, 0}, std::to_string(row % 1000));
+        // longer than the small string buffer, copies of them allocate
+        sheet.SetCell(Position{row, 1}, "label of the group "s + std::to_string(row % 97));
+        sheet.SetCell(Position{row, 2}, "=A"s + r + "*2+A" + r + "/3+100");
+        sheet.SetCell(Position{row, 3}, "=A"s + r + "/B" + r + "+C" + r);
+        if(row % 100 == 0){
+            sheet.SetCell(Position{row, 40}, "'far");
+        }
+    }
+    sheet.Recalculate(1);
+}
+
+void Measure(const std::string& name, size_t cells, const std::function<void(std::ostream&)>& print) {
+    NullBuffer buffer;
+    std::ostream output(&buffer);
+    // the first pass fills the caches
+    print(output);
+    const size_t allocations_before = GetAllocStats().allocations;
+    Timer timer;
+    print(output);
+    ReportLatency(name, cells, timer.Elapsed());
+    ReportAllocations(name, cells, GetAllocStats().allocations - allocations_before);
+}
+
+// What printing did before: every position of the area is looked up, texts
+// and values are copied out
+void PrintDense(const Sheet& sheet, std::ostream& output, bool values) {
+    const Size size = sheet.GetPrintableSize();
+    for(int row = 0; row < size.rows; ++row){
+        for(int col = 0; col < size.cols; ++col){
+            if(col > 0){
+                output << '\t';
+            }
+            if(const CellInterface* cell = sheet.GetCell(Position{row, col})){
+                if(cell->GetText().empty()){
+                    continue;
+                }
+                if(!values){
+                    output << cell->GetText();
+                }
+                else{
+                    std::visit([&output](const auto& value){ output << value; }, cell->GetValue());
+                }
+            }
+        }
+        output << '\n';
+    }
+}
+
+}  // namespace
+
+void RunPrintBenchmarks() {
+    Sheet sheet;
+    BuildSheet(sheet);
+    const size_t cells = ROWS * 4 + ROWS / 100;
+
+    Measure("print/values/dense_copies", cells, [&sheet](std::ostream& output){
+        PrintDense(sheet, output, true);
+    });
+    Measure("print/values/PrintValues", cells, [&sheet](std::ostream& output){
+        sheet.PrintValues(output);
+    });
+    Measure("print/texts/dense_copies", cells, [&sheet](std::ostream& output){
+        PrintDense(sheet, output, false);
+    });
+    Measure("print/texts/PrintTexts", cells, [&sheet](std::ostream& output){
+        sheet.PrintTexts(output);
+    });
+}
+
+}  // namespace bench
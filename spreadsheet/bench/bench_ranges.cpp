@@ -0,0 +1,121 @@
+#include "bench.h"
+
+#include "common.h"
+
+#include <cstdlib>
+#include <random>
+#include <string>
+
+using namespace std::literals;
+
+namespace bench {
+namespace {
+
+constexpr int ROWS = 10000;
+constexpr int WINDOW = 10;
+
+std::string Cell(int row, int col) {
+    return Position{row, col}.ToString();
+}
+
+std::string RangeTotal(int first_row, int last_row) {
+    return "=SUM("s + Cell(first_row, 0) + ":" + Cell(last_row, 0) + ")";
+}
+
+// the same total written out as A1+A2+...+An
+std::string ExpandedTotal(int first_row, int last_row) {
+    std::string text = "="s + Cell(first_row, 0);
+    for(int row = first_row + 1; row <= last_row; ++row){
+        text += "+" + Cell(row, 0);
+    }
+    return text;
+}
+
+// numbers are set as formulas, so reading them doesn't involve text conversion
+void FillColumn(SheetInterface& sheet) {
+    for(int row = 0; row < ROWS; ++row){
+        sheet.SetCell(Position{row, 0}, "="s + std::to_string(row % 7 + 1));
+    }
+}
+
+double Read(const SheetInterface& sheet, Position pos) {
+    auto value = sheet.GetCell(pos)->GetValue();
+    if(!std::holds_alternative<double>(value)){
+        std::abort();
+    }
+    return std::get<double>(value);
+}
+
+// One total over the whole column: setting it, then editing a cell inside
+// the range and reading the total again.
+void RunColumnTotal(const std::string& name, const std::string& total, int edits) {
+    auto sheet = CreateSheet();
+    FillColumn(*sheet);
+
+    const size_t bytes_before = GetAllocStats().live_bytes;
+    Timer set_timer;
+    sheet->SetCell(Position{0, 1}, total);
+    ReportLatency(name + "/SetCell", 1, set_timer.Elapsed());
+    ReportMemory(name + "/memory", ROWS, GetAllocStats().live_bytes - bytes_before);
+
+    Timer first_timer;
+    Read(*sheet, Position{0, 1});
+    ReportLatency(name + "/first_evaluation", 1, first_timer.Elapsed());
+
+    std::mt19937 random(1);
+    std::uniform_int_distribution<int> row(0, ROWS - 1);
+    double sum = 0;
+    Timer edit_timer;
+    for(int i = 0; i < edits; ++i){
+        sheet->SetCell(Position{row(random), 0}, "="s + std::to_string(i % 5));
+        sum += Read(*sheet, Position{0, 1});
+    }
+    ReportLatency(name + "/edit_and_recalculate", edits, edit_timer.Elapsed());
+    if(sum == 42.4242){
+        std::abort();
+    }
+}
+
+// A sliding window total next to every row: a write into the column has
+// WINDOW dependents among ROWS range formulas.
+void RunWindowTotals(const std::string& name, bool ranges, int edits) {
+    auto sheet = CreateSheet();
+    FillColumn(*sheet);
+
+    const size_t bytes_before = GetAllocStats().live_bytes;
+    Timer build_timer;
+    for(int row = 0; row + WINDOW <= ROWS; ++row){
+        sheet->SetCell(Position{row, 1}, ranges ? RangeTotal(row, row + WINDOW - 1)
+                                                : ExpandedTotal(row, row + WINDOW - 1));
+    }
+    ReportLatency(name + "/SetCell", ROWS - WINDOW + 1, build_timer.Elapsed());
+    ReportMemory(name + "/memory", ROWS - WINDOW + 1, GetAllocStats().live_bytes - bytes_before);
+    for(int row = 0; row + WINDOW <= ROWS; ++row){
+        Read(*sheet, Position{row, 1});
+    }
+
+    std::mt19937 random(2);
+    std::uniform_int_distribution<int> pick(WINDOW, ROWS - WINDOW);
+    double sum = 0;
+    Timer edit_timer;
+    for(int i = 0; i < edits; ++i){
+        int row = pick(random);
+        sheet->SetCell(Position{row, 0}, "="s + std::to_string(i % 5));
+        sum += Read(*sheet, Position{row, 1});
+    }
+    ReportLatency(name + "/edit_and_recalculate", edits, edit_timer.Elapsed());
+    if(sum == 42.4242){
+        std::abort();
+    }
+}
+
+}  // namespace
+
+void RunRangeBenchmarks() {
+    RunColumnTotal("ranges/column_total_10000/SUM", RangeTotal(0, ROWS - 1), 200);
+    RunColumnTotal("ranges/column_total_10000/expanded", ExpandedTotal(0, ROWS - 1), 200);
+    RunWindowTotals("ranges/window_totals_10/SUM", true, 10000);
+    RunWindowTotals("ranges/window_totals_10/expanded", false, 10000);
+}
+
+}  // namespace bench
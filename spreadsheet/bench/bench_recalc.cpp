@@ -0,0 +1,87 @@
+#include "bench.h"
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std::literals;
+
+namespace bench {
+namespace {
+
+constexpr int ROWS = 400;
+constexpr int COLS = 250;
+
+// Every cell of a row reads its three neighbours in the row above, so a row
+// is a layer of COLS independent formulas which can run in parallel.
+void BuildModel(Sheet& sheet) {
+    for(int row = ROWS - 1; row > 0; --row){
+        for(int col = 0; col < COLS; ++col){
+            std::string text = "="s + Position{row - 1, col}.ToString();
+            text += "*0.5+" + Position{row - 1, std::max(col - 1, 0)}.ToString();
+            text += "*0.25+" + Position{row - 1, std::min(col + 1, COLS - 1)}.ToString() + "*0.25";
+            sheet.SetCell(Position{row, col}, text);
+        }
+    }
+}
+
+void ChangeInputs(Sheet& sheet, int edit) {
+    for(int col = 0; col < COLS; ++col){
+        sheet.SetCell(Position{0, col}, std::to_string((col + edit) % 10));
+    }
+}
+
+void ReadAll(const Sheet& sheet) {
+    for(int row = 0; row < ROWS; ++row){
+        for(int col = 0; col < COLS; ++col){
+            sheet.GetCell(Position{row, col})->GetValue();
+        }
+    }
+}
+
+}  // namespace
+
+void RunRecalculationBenchmarks() {
+    constexpr int EDITS = 5;
+    const size_t cells = size_t{ROWS} * COLS;
+    Sheet sheet;
+    BuildModel(sheet);
+    ChangeInputs(sheet, 0);
+
+    std::chrono::nanoseconds lazy_time{0};
+    for(int i = 0; i < EDITS; ++i){
+        ChangeInputs(sheet, i + 1);
+        Timer timer;
+        ReadAll(sheet);
+        lazy_time += timer.Elapsed();
+    }
+    ReportLatency("recalculate/lazy/cell", cells * EDITS, lazy_time);
+
+    std::vector<size_t> thread_counts = {1, 2, 4, 8};
+    size_t hardware = std::thread::hardware_concurrency();
+    if(hardware > thread_counts.back()){
+        thread_counts.push_back(hardware);
+    }
+    std::chrono::nanoseconds single_thread_time{0};
+    for(size_t threads : thread_counts){
+        std::chrono::nanoseconds elapsed{0};
+        for(int i = 0; i < EDITS; ++i){
+            ChangeInputs(sheet, i + 1);
+            Timer timer;
+            sheet.Recalculate(threads);
+            elapsed += timer.Elapsed();
+        }
+        if(threads == 1){
+            single_thread_time = elapsed;
+        }
+        std::string name = "recalculate/threads_" + std::to_string(threads);
+        ReportLatency(name + "/cell", cells * EDITS, elapsed);
+        ReportValue(name + "/speedup", static_cast<double>(single_thread_time.count()) / elapsed.count(), "x");
+    }
+    ReportValue("recalculate/hardware_threads", static_cast<double>(hardware), "");
+}
+
+}  // namespace bench
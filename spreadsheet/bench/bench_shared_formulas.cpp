@@ -0,0 +1,62 @@
+#include "bench.h"
+
+#include "common.h"
+
+#include <cstdlib>
+#include <functional>
+#include <string>
+
+using namespace std::literals;
+
+namespace bench {
+namespace {
+
+constexpr int ROWS = 16'000;
+
+// Column A gets one formula per row over columns B and C, which are filled
+// beforehand so that only the formulas are measured.
+void RunFormulaColumn(const std::string& name, const std::function<std::string(int)>& formula) {
+    auto sheet = CreateSheet();
+    for(int row = 0; row < ROWS; ++row){
+        sheet->SetCell(Position{row, 1}, std::to_string(row % 100));
+        sheet->SetCell(Position{row, 2}, "3");
+    }
+
+    const size_t bytes_before = GetAllocStats().live_bytes;
+    Timer set_timer;
+    for(int row = 0; row < ROWS; ++row){
+        sheet->SetCell(Position{row, 0}, formula(row));
+    }
+    ReportLatency(name + "/SetCell", ROWS, set_timer.Elapsed());
+    ReportMemory(name + "/memory", ROWS, GetAllocStats().live_bytes - bytes_before);
+
+    double sum = 0;
+    Timer evaluate_timer;
+    for(int row = 0; row < ROWS; ++row){
+        auto value = sheet->GetCell(Position{row, 0})->GetValue();
+        if(std::holds_alternative<double>(value)){
+            sum += std::get<double>(value);
+        }
+    }
+    ReportLatency(name + "/evaluate", ROWS, evaluate_timer.Elapsed());
+    if(sum == 42.4242){
+        std::abort();
+    }
+}
+
+}  // namespace
+
+void RunSharedFormulaBenchmarks() {
+    // =B1*C1, =B2*C2, ...: one shared formula
+    RunFormulaColumn("shared_formulas/fill_down", [](int row){
+        const std::string r = std::to_string(row + 1);
+        return "=B"s + r + "*C" + r;
+    });
+    // =B1*C1+0, =B2*C2+1, ...: every formula is parsed and kept on its own
+    RunFormulaColumn("shared_formulas/distinct", [](int row){
+        const std::string r = std::to_string(row + 1);
+        return "=B"s + r + "*C" + r + "+" + std::to_string(row);
+    });
+}
+
+}  // namespace bench
@@ -0,0 +1,139 @@
+#include "bench.h"
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+
+using namespace std::literals;
+
+namespace bench {
+namespace {
+
+constexpr int COLS = 6;
+
+// Five numbers and their sum per row
+void BuildModel(Sheet& sheet, int rows) {
+    for(int row = 0; row < rows; ++row){
+        for(int col = 0; col + 1 < COLS; ++col){
+            sheet.SetCell(Position{row, col}, std::to_string(row + col));
+        }
+        const std::string r = std::to_string(row + 1);
+        sheet.SetCell(Position{row, COLS - 1}, "=SUM(A"s + r + ":E" + r + ")");
+    }
+}
+
+// a number somewhere in the sheet, the edits are spread over its tiles
+Position EditedCell(int edit, int rows) {
+    return Position{static_cast<int>((edit * 7919LL) % rows), edit % (COLS - 1)};
+}
+
+// Taking a view costs the same for any size of the sheet, the first write
+// after it copies the path to the tile it changes
+void RunTake(int rows) {
+    Sheet sheet;
+    BuildModel(sheet, rows);
+    const std::string name = "sheet_views/"s + std::to_string(rows * COLS) + "_cells/";
+    constexpr int OPS = 2000;
+    LatencySamples take;
+    LatencySamples first_write;
+    LatencySamples write;
+    for(int i = 0; i < OPS; ++i){
+        std::shared_ptr<const SheetView> view;
+        take.Measure([&]{
+            view = sheet.Snapshot();
+        });
+        first_write.Measure([&]{
+            sheet.SetCell(EditedCell(2 * i, rows), std::to_string(i));
+        });
+        view.reset();
+        write.Measure([&]{
+            sheet.SetCell(EditedCell(2 * i + 1, rows), std::to_string(i));
+        });
+    }
+    ReportPercentiles(name + "Snapshot", take);
+    ReportPercentiles(name + "SetCell/first_after_snapshot", first_write);
+    ReportPercentiles(name + "SetCell/no_view", write);
+}
+
+// Heap the sheet copies for an open view, per edit of another tile
+void RunCopiedMemory(int rows, int edits) {
+    Sheet sheet;
+    BuildModel(sheet, rows);
+    const AllocStats before = GetAllocStats();
+    std::shared_ptr<const SheetView> view = sheet.Snapshot();
+    for(int i = 0; i < edits; ++i){
+        sheet.SetCell(EditedCell(i, rows), std::to_string(i));
+    }
+    ReportMemory("sheet_views/copied_for_view", edits, GetAllocStats().live_bytes - before.live_bytes);
+    view.reset();
+    sheet.SetCell(EditedCell(0, rows), "0");
+    ReportMemory("sheet_views/left_after_release", edits, GetAllocStats().live_bytes - before.live_bytes);
+}
+
+// A report generator prints the whole sheet over and over while the edits
+// keep coming in. With a view the writer goes on during the report; without
+// one the report has to hold a lock the writer waits for.
+void RunReports(int rows, int reports, bool use_views) {
+    Sheet sheet;
+    BuildModel(sheet, rows);
+    std::mutex mutex;
+    std::atomic<bool> done{false};
+    LatencySamples report_latency;
+    std::thread reporter([&]{
+        for(int i = 0; i < reports; ++i){
+            NullBuffer buffer;
+            std::ostream output(&buffer);
+            report_latency.Measure([&]{
+                if(use_views){
+                    std::shared_ptr<const SheetView> view;
+                    {
+                        std::lock_guard lock(mutex);
+                        view = sheet.Snapshot();
+                    }
+                    view->PrintValues(output);
+                }
+                else{
+                    std::lock_guard lock(mutex);
+                    sheet.PrintValues(output);
+                }
+            });
+        }
+        done.store(true);
+    });
+
+    LatencySamples edit_latency;
+    int edit = 0;
+    for(; !done.load(); ++edit){
+        edit_latency.Measure([&]{
+            std::lock_guard lock(mutex);
+            sheet.SetCell(EditedCell(edit, rows), std::to_string(edit));
+        });
+    }
+    reporter.join();
+    const std::string name = "sheet_views/reports_while_editing/"s + (use_views ? "view/" : "locked/");
+    ReportPercentiles(name + "report", report_latency);
+    ReportPercentiles(name + "SetCell", edit_latency);
+    ReportValue(name + "edits_per_report", static_cast<double>(edit) / reports, "edits");
+}
+
+int Scaled(int size) {
+    return std::clamp(static_cast<int>(size * GetOptions().scale), 1, Position::MAX_ROWS);
+}
+
+}  // namespace
+
+void RunSheetViewBenchmarks() {
+    RunTake(Scaled(200));
+    RunTake(Scaled(10000));
+    RunCopiedMemory(Scaled(10000), Scaled(1000));
+    RunReports(Scaled(10000), Scaled(10), true);
+    RunReports(Scaled(10000), Scaled(10), false);
+}
+
+}  // namespace bench
@@ -0,0 +1,92 @@
+#include "bench.h"
+
+#include "sheet.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std::literals;
+
+namespace bench {
+namespace {
+
+constexpr int ROWS = 16'000;
+
+// Inputs and labels, a formula per row over them and a total, all computed
+void BuildModel(Sheet& sheet) {
+    for(int row = 0; row < ROWS; ++row){
+        const std::string r = std::to_string(row + 1);
+        sheet.SetCell(Position{row, 1}, std::to_string(row % 100));
+        sheet.SetCell(Position{row, 2}, "item "s + std::to_string(row % 50));
+        sheet.SetCell(Position{row, 0}, "=B"s + r + "*2+B" + r + "/4");
+    }
+    sheet.SetCell(Position{0, 3}, "=SUM(A1:A"s + std::to_string(ROWS) + ")");
+    sheet.Recalculate(1);
+}
+
+void CheckTotal(const Sheet& sheet) {
+    if(!std::holds_alternative<double>(sheet.GetCell(Position{0, 3})->GetValue())){
+        std::abort();
+    }
+}
+
+}  // namespace
+
+void RunSnapshotBenchmarks() {
+    Sheet sheet;
+    BuildModel(sheet);
+    const size_t cells = ROWS * 3 + 1;
+
+    std::string data;
+    {
+        Timer timer;
+        std::ostringstream output;
+        sheet.SaveSnapshot(output);
+        data = output.str();
+        ReportLatency("snapshot/save", cells, timer.Elapsed());
+    }
+    ReportValue("snapshot/size", static_cast<double>(data.size()) / cells, "bytes/cell");
+
+    const auto path = std::filesystem::temp_directory_path() / "spreadsheet_bench_snapshot.bin";
+    {
+        std::ofstream file(path, std::ios::binary);
+        file << data;
+    }
+    {
+        Timer timer;
+        auto loaded = Sheet::LoadSnapshotFile(path.string());
+        ReportLatency("snapshot/load_file", cells, timer.Elapsed());
+        Timer read_timer;
+        CheckTotal(*loaded);
+        ReportLatency("snapshot/first_read", 1, read_timer.Elapsed());
+    }
+    std::filesystem::remove(path);
+
+    // the old way back: the texts set again and every formula recomputed
+    std::vector<std::pair<Position, std::string>> texts;
+    for(int row = 0; row < ROWS; ++row){
+        for(int col = 0; col < 4; ++col){
+            if(const CellInterface* cell = sheet.GetCell(Position{row, col})){
+                texts.emplace_back(Position{row, col}, cell->GetText());
+            }
+        }
+    }
+    {
+        Timer timer;
+        Sheet reloaded;
+        for(const auto& [pos, text] : texts){
+            reloaded.SetCell(pos, text);
+        }
+        reloaded.Recalculate(1);
+        CheckTotal(reloaded);
+        ReportLatency("snapshot/reload_texts", cells, timer.Elapsed());
+    }
+}
+
+}  // namespace bench
@@ -0,0 +1,80 @@
+#include "bench.h"
+
+#include "common.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace bench {
+namespace {
+
+std::vector<Position> DenseBlock(int rows, int cols) {
+    std::vector<Position> positions;
+    positions.reserve(static_cast<size_t>(rows) * cols);
+    for(int row = 0; row < rows; ++row){
+        for(int col = 0; col < cols; ++col){
+            positions.push_back({row, col});
+        }
+    }
+    return positions;
+}
+
+std::vector<Position> ScatteredCells(size_t count) {
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<int> rows(0, Position::MAX_ROWS - 1);
+    std::uniform_int_distribution<int> cols(0, Position::MAX_COLS - 1);
+    std::vector<Position> positions;
+    positions.reserve(count);
+    for(size_t i = 0; i < count; ++i){
+        positions.push_back({rows(gen), cols(gen)});
+    }
+    return positions;
+}
+
+void RunWorkload(const std::string& name, const std::vector<Position>& positions,
+                 const std::string& text = "1") {
+    const AllocStats before = GetAllocStats();
+    auto sheet = CreateSheet();
+    {
+        Timer timer;
+        for(Position pos : positions){
+            sheet->SetCell(pos, text);
+        }
+        ReportLatency(name + "/SetCell", positions.size(), timer.Elapsed());
+    }
+    ReportMemory(name + "/memory", positions.size(), GetAllocStats().live_bytes - before.live_bytes);
+
+    std::vector<Position> shuffled = positions;
+    std::shuffle(shuffled.begin(), shuffled.end(), std::mt19937(7));
+    {
+        size_t found = 0;
+        Timer timer;
+        for(Position pos : shuffled){
+            found += sheet->GetCell(pos) != nullptr;
+        }
+        ReportLatency(name + "/GetCell", shuffled.size(), timer.Elapsed());
+        if(found != shuffled.size()){
+            std::abort();
+        }
+    }
+}
+
+}  // namespace
+
+void RunStorageBenchmarks() {
+    RunWorkload("storage/dense_512x512", DenseBlock(512, 512));
+    RunWorkload("storage/scattered_100k", ScatteredCells(100'000));
+    RunWorkload("storage/dense_formulas_512x512", DenseBlock(512, 512), "=1+2");
+
+    const AllocStats before = GetAllocStats();
+    auto sheet = CreateSheet();
+    Timer timer;
+    sheet->SetCell(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, "far away");
+    ReportLatency("storage/single_far_cell/SetCell", 1, timer.Elapsed());
+    ReportMemory("storage/single_far_cell/memory", 1, GetAllocStats().live_bytes - before.live_bytes);
+}
+
+}  // namespace bench
@@ -0,0 +1,127 @@
+#include "bench.h"
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <ostream>
+#include <string>
+
+using namespace std::literals;
+
+namespace bench {
+namespace {
+
+constexpr int COLS = 6;
+
+// Five numbers and their sum per row, and the total of the sums above them
+void BuildModel(Sheet& sheet, int rows) {
+    for(int row = 0; row < rows; ++row){
+        for(int col = 0; col + 1 < COLS; ++col){
+            sheet.SetCell(Position{row, col}, std::to_string(row + col));
+        }
+        const std::string r = std::to_string(row + 1);
+        sheet.SetCell(Position{row, COLS - 1}, "=SUM(A"s + r + ":E" + r + ")");
+    }
+    sheet.SetCell(Position{0, COLS}, "=SUM(F1:F"s + std::to_string(rows) + ")");
+}
+
+// A row inserted and deleted in the middle of the sheet: no formula refers
+// to its cells, so the cost doesn't grow with the sheet
+void RunRowEdits(int rows) {
+    Sheet sheet;
+    BuildModel(sheet, rows);
+    const std::string name = "structure/"s + std::to_string(rows) + "_rows/";
+    constexpr int OPS = 2000;
+    LatencySamples insert;
+    LatencySamples remove;
+    for(int i = 0; i < OPS; ++i){
+        const int row = 1 + static_cast<int>((i * 7919LL) % (rows - 1));
+        insert.Measure([&]{
+            sheet.InsertRows(row, 1);
+        });
+        sheet.SetCell(Position{row, 0}, std::to_string(i));
+        remove.Measure([&]{
+            sheet.DeleteRows(row, 1);
+        });
+    }
+    ReportPercentiles(name + "InsertRows", insert);
+    ReportPercentiles(name + "DeleteRows", remove);
+}
+
+// Inserting a column touches no cell, deleting one removes its cells
+void RunColumnEdits(int rows) {
+    Sheet sheet;
+    BuildModel(sheet, rows);
+    const std::string name = "structure/"s + std::to_string(rows) + "_rows/";
+    constexpr int OPS = 100;
+    LatencySamples insert;
+    LatencySamples remove;
+    for(int i = 0; i < OPS; ++i){
+        insert.Measure([&]{
+            sheet.InsertColumns(1, 1);
+        });
+        remove.Measure([&]{
+            sheet.DeleteColumns(1, 1);
+        });
+    }
+    ReportPercentiles(name + "InsertColumns", insert);
+    ReportPercentiles(name + "DeleteColumns/empty", remove);
+
+    // three of the numbers of every row, the sums lose them
+    LatencySamples remove_cells;
+    for(int i = 0; i < 3; ++i){
+        remove_cells.Measure([&]{
+            sheet.DeleteColumns(1, 1);
+        });
+    }
+    ReportPercentiles(name + "DeleteColumns/" + std::to_string(rows) + "_cells", remove_cells);
+}
+
+// The cells are read through the layout, which splits into more runs with
+// every edit in a new place
+void RunReadsAfterEdits(int rows, int edits) {
+    Sheet sheet;
+    BuildModel(sheet, rows);
+    for(int i = 0; i < edits; ++i){
+        sheet.InsertRows(1 + static_cast<int>((i * 7919LL) % (rows - 1)), 1);
+        sheet.DeleteRows(1 + static_cast<int>((i * 104729LL) % (rows - 1)), 1);
+    }
+    const std::string name = "structure/"s + std::to_string(rows) + "_rows/after_"s + std::to_string(edits) + "_edits/";
+    Timer timer;
+    sheet.Recalculate(1);
+    ReportLatency(name + "Recalculate/cell", static_cast<size_t>(rows) * COLS, timer.Elapsed());
+
+    NullBuffer buffer;
+    std::ostream output(&buffer);
+    timer = Timer();
+    sheet.PrintTexts(output);
+    ReportLatency(name + "PrintTexts/cell", static_cast<size_t>(rows) * COLS, timer.Elapsed());
+
+    constexpr int READS = 100000;
+    double sum = 0.0;
+    timer = Timer();
+    for(int i = 0; i < READS; ++i){
+        const CellInterface::NumericValue value =
+            sheet.GetNumericValue(Position{static_cast<int>((i * 7919LL) % rows), i % COLS});
+        sum += std::holds_alternative<double>(value) ? std::get<double>(value) : 0.0;
+    }
+    ReportLatency(name + "GetNumericValue", READS, timer.Elapsed());
+    ReportValue(name + "checksum", sum, "sum");
+}
+
+int Scaled(int size) {
+    return std::clamp(static_cast<int>(size * GetOptions().scale), 2, Position::MAX_ROWS / 2);
+}
+
+}  // namespace
+
+void RunStructureBenchmarks() {
+    RunRowEdits(Scaled(1000));
+    RunRowEdits(Scaled(8000));
+    RunColumnEdits(Scaled(1000));
+    RunColumnEdits(Scaled(8000));
+    RunReadsAfterEdits(Scaled(8000), 0);
+    RunReadsAfterEdits(Scaled(8000), 1000);
+}
+
+}  // namespace bench
@@ -0,0 +1,93 @@
+#include "bench.h"
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std::literals;
+
+namespace bench {
+namespace {
+
+constexpr int COLS = 100;
+constexpr int ROWS = 500;
+constexpr int CELLS = COLS * ROWS;
+constexpr int WINDOW = 2000;
+
+Position ToPosition(int index) {
+    return Position{index / COLS, index % COLS};
+}
+
+struct Edit {
+    Position pos;
+    std::vector<Position> references;
+    std::string text;
+};
+
+Edit MakeEdit(int index, int first_ref, int last_ref, std::mt19937& gen) {
+    std::uniform_int_distribution<int> refs(first_ref, last_ref);
+    Edit edit{ToPosition(index), {ToPosition(refs(gen)), ToPosition(refs(gen))}, {}};
+    edit.text = "="s + edit.references[0].ToString() + "+" + edit.references[1].ToString();
+    std::sort(edit.references.begin(), edit.references.end());
+    edit.references.erase(std::unique(edit.references.begin(), edit.references.end()),
+                          edit.references.end());
+    return edit;
+}
+
+// Every formula reads two random cells among the WINDOW cells before it
+void BuildRandomDag(Sheet& sheet, std::mt19937& gen) {
+    for(int index = 0; index < COLS; ++index){
+        sheet.SetCell(ToPosition(index), "1");
+    }
+    for(int index = COLS; index < CELLS; ++index){
+        sheet.SetCell(ToPosition(index), MakeEdit(index, std::max(0, index - WINDOW), index - 1, gen).text);
+    }
+}
+
+void RunEdits(const std::string& name, Sheet& sheet, const std::vector<Edit>& edits) {
+    std::chrono::nanoseconds check_time{0};
+    {
+        Timer timer;
+        for(const Edit& edit : edits){
+            sheet.CycleCheck(edit.pos, edit.references);
+        }
+        check_time = timer.Elapsed();
+    }
+    size_t rejected = 0;
+    Timer timer;
+    for(const Edit& edit : edits){
+        try{
+            sheet.SetCell(edit.pos, edit.text);
+        }
+        catch(const CircularDependencyException&){
+            ++rejected;
+        }
+    }
+    ReportLatency(name + "/CycleCheck", edits.size(), check_time);
+    ReportLatency(name + "/SetCell", edits.size(), timer.Elapsed());
+    ReportValue(name + "/rejected", 100.0 * rejected / edits.size(), "%");
+}
+
+}  // namespace
+
+void RunTopologicalOrderBenchmarks() {
+    std::mt19937 gen(17);
+    Sheet sheet;
+    BuildRandomDag(sheet, gen);
+
+    std::uniform_int_distribution<int> cells(COLS, CELLS - 1);
+    std::vector<Edit> local_edits;
+    std::vector<Edit> random_edits;
+    for(int i = 0; i < 200; ++i){
+        int index = cells(gen);
+        local_edits.push_back(MakeEdit(index, std::max(0, index - WINDOW), index - 1, gen));
+        random_edits.push_back(MakeEdit(cells(gen), 0, CELLS - 1, gen));
+    }
+    RunEdits("topological_order/random_dag_50k/local_edits", sheet, local_edits);
+    RunEdits("topological_order/random_dag_50k/random_edits", sheet, random_edits);
+}
+
+}  // namespace bench
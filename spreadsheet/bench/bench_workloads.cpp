@@ -0,0 +1,213 @@
+#include "bench.h"
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <ostream>
+#include <random>
+#include <string>
+#include <utility>
+#include <variant>
+#include <vector>
+
+using namespace std::literals;
+
+namespace bench {
+namespace {
+
+constexpr int EDITS = 200;
+
+// A synthetic sheet: the cells in the order they are set and the inputs
+// whose edits are timed
+struct Workload {
+    std::vector<std::pair<Position, std::string>> cells;
+    std::vector<Position> inputs;
+};
+
+int Scaled(int size, int limit) {
+    return std::clamp(static_cast<int>(size * GetOptions().scale), 1, limit);
+}
+
+std::string Cell(int row, int col) {
+    return Position{row, col}.ToString();
+}
+
+// Numbers in the first column and formulas copied down the next ones, each
+// row reading its own inputs
+Workload FillDown() {
+    const int rows = Scaled(10'000, Position::MAX_ROWS);
+    Workload workload;
+    for(int row = 0; row < rows; ++row){
+        const std::string a = Cell(row, 0);
+        const std::string b = Cell(row, 1);
+        workload.cells.emplace_back(Position{row, 0}, std::to_string(row % 100));
+        workload.cells.emplace_back(Position{row, 1}, "="s + a + "*1.1");
+        workload.cells.emplace_back(Position{row, 2}, "="s + b + "+" + a);
+        workload.cells.emplace_back(Position{row, 3}, "=SUM("s + a + ":" + Cell(row, 2) + ")");
+        workload.inputs.push_back({row, 0});
+    }
+    return workload;
+}
+
+// Formulas reading three random cells among the two thousand set before them,
+// 100 cells per row
+Workload RandomDag() {
+    constexpr int COLS = 100;
+    constexpr int NUMBERS = 200;
+    const int count = Scaled(20'000, Position::MAX_ROWS * COLS);
+    std::mt19937 gen(42);
+    Workload workload;
+    for(int i = 0; i < count; ++i){
+        const Position pos{i / COLS, i % COLS};
+        if(i < NUMBERS){
+            workload.cells.emplace_back(pos, std::to_string(i + 1));
+            workload.inputs.push_back(pos);
+            continue;
+        }
+        std::uniform_int_distribution<int> earlier(std::max(0, i - 2000), i - 1);
+        std::string text = "=";
+        for(int j = 0; j < 3; ++j){
+            const int ref = earlier(gen);
+            text += (j > 0 ? "+" : "") + Cell(ref / COLS, ref % COLS);
+        }
+        workload.cells.emplace_back(pos, std::move(text) + "/3");
+    }
+    return workload;
+}
+
+// Every row reads the one above it, an edit of the first row recomputes all
+Workload LongChain() {
+    const int rows = Scaled(5'000, Position::MAX_ROWS);
+    Workload workload;
+    workload.cells.emplace_back(Position{0, 0}, "1");
+    for(int row = 1; row < rows; ++row){
+        workload.cells.emplace_back(Position{row, 0}, "="s + Cell(row - 1, 0) + "+1");
+    }
+    workload.inputs.push_back({0, 0});
+    return workload;
+}
+
+// Every cell reads the two cells above it, so an edit of the first row
+// recomputes a widening cone below it
+Workload DiamondLattice() {
+    constexpr int WIDTH = 64;
+    const int depth = Scaled(128, Position::MAX_ROWS);
+    Workload workload;
+    for(int col = 0; col < WIDTH; ++col){
+        workload.cells.emplace_back(Position{0, col}, "1");
+        workload.inputs.push_back({0, col});
+    }
+    for(int row = 1; row < depth; ++row){
+        for(int col = 0; col < WIDTH; ++col){
+            workload.cells.emplace_back(Position{row, col}, "="s + Cell(row - 1, col) + "+"
+                                        + Cell(row - 1, (col + 1) % WIDTH));
+        }
+    }
+    return workload;
+}
+
+// A few rows across thousands of columns
+Workload WideSheet() {
+    const int cols = Scaled(8'000, Position::MAX_COLS);
+    Workload workload;
+    for(int col = 0; col < cols; ++col){
+        const std::string number = Cell(0, col);
+        workload.cells.emplace_back(Position{0, col}, std::to_string(col % 10));
+        workload.cells.emplace_back(Position{1, col}, "="s + number + "*2");
+        workload.cells.emplace_back(Position{2, col}, "="s + number + "+" + Cell(1, col));
+        workload.cells.emplace_back(Position{3, col}, "column " + std::to_string(col));
+        workload.inputs.push_back({0, col});
+    }
+    return workload;
+}
+
+// Labels of every length next to numbers kept as text and the formulas reading them
+Workload TextHeavy() {
+    const int rows = Scaled(10'000, Position::MAX_ROWS);
+    std::mt19937 gen(7);
+    std::uniform_int_distribution<int> length(4, 80);
+    Workload workload;
+    for(int row = 0; row < rows; ++row){
+        for(int col = 0; col < 4; ++col){
+            workload.cells.emplace_back(Position{row, col}, std::string(length(gen), 'a' + col));
+        }
+        workload.cells.emplace_back(Position{row, 4}, std::to_string(row) + ".5");
+        workload.cells.emplace_back(Position{row, 5}, "="s + Cell(row, 4) + "*2");
+        workload.inputs.push_back({row, 4});
+    }
+    return workload;
+}
+
+void RunWorkload(const std::string& name, const Workload& workload) {
+    const size_t cells = workload.cells.size();
+    const AllocStats before = GetAllocStats();
+    ResetAllocPeak();
+    Sheet sheet;
+    {
+        Timer timer;
+        for(const auto& [pos, text] : workload.cells){
+            sheet.SetCell(pos, text);
+        }
+        ReportLatency(name + "/SetCell", cells, timer.Elapsed());
+        ReportAllocations(name + "/SetCell", cells, GetAllocStats().allocations - before.allocations);
+    }
+    {
+        Timer timer;
+        sheet.Recalculate(1);
+        ReportLatency(name + "/recalculate_all", cells, timer.Elapsed());
+    }
+    const AllocStats built = GetAllocStats();
+    ReportMemory(name + "/memory", cells, built.live_bytes - before.live_bytes);
+    ReportMemory(name + "/peak_heap", cells, built.peak_bytes - before.live_bytes);
+    {
+        size_t errors = 0;
+        Timer timer;
+        for(const auto& [pos, text] : workload.cells){
+            errors += std::holds_alternative<FormulaError>(sheet.GetCell(pos)->GetValueView());
+        }
+        ReportLatency(name + "/GetValue", cells, timer.Elapsed());
+        if(errors != 0){
+            std::abort();
+        }
+    }
+
+    // An edit invalidates the cells reading the input, the recalculation
+    // computes them again
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<size_t> input(0, workload.inputs.size() - 1);
+    LatencySamples edits;
+    LatencySamples recalculations;
+    for(int i = 0; i < EDITS; ++i){
+        const Position pos = workload.inputs[input(gen)];
+        const std::string text = std::to_string(i % 7 + 1);
+        edits.Measure([&]{
+            sheet.SetCell(pos, text);
+        });
+        recalculations.Measure([&]{
+            sheet.Recalculate(1);
+        });
+    }
+    ReportPercentiles(name + "/edit/SetCell", edits);
+    ReportPercentiles(name + "/edit/recalculate", recalculations);
+
+    NullBuffer buffer;
+    std::ostream output(&buffer);
+    Timer timer;
+    sheet.PrintValues(output);
+    const double seconds = std::chrono::duration<double>(timer.Elapsed()).count();
+    ReportValue(name + "/PrintValues", buffer.GetSize() / seconds / (1 << 20), "MB/s");
+}
+
+}  // namespace
+
+void RunWorkloadBenchmarks() {
+    RunWorkload("workloads/fill_down", FillDown());
+    RunWorkload("workloads/random_dag", RandomDag());
+    RunWorkload("workloads/long_chain", LongChain());
+    RunWorkload("workloads/diamond_lattice", DiamondLattice());
+    RunWorkload("workloads/wide_sheet", WideSheet());
+    RunWorkload("workloads/text_heavy", TextHeavy());
+}
+
+}  // namespace bench
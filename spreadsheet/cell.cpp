@@ -1,99 +1,728 @@
-#include "sheet.h"
 #include "cell.h"
+#include "FormulaAST.h"
+#include "numeric_text.h"
+#include "stats.h"
 
+#include <algorithm>
 #include <cassert>
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <string>
 #include <optional>
+#include <stdexcept>
+#include <thread>
 
+using namespace std::literals;
 
-// Реализуйте следующие методы
-Cell::Cell(Sheet& sheet)
-    : sheet_(sheet)
-    , impl_(std::make_unique<EmptyImpl>())
+
+CellSlot::CellSlot(const CellSlot& other)
+    : number_(other.number_)
+    , index_(other.index_)
+    , kind_(other.kind_)
+    , flags_(other.flags_)
+    , value_(other.value_.load(std::memory_order_relaxed))
+    , error_(other.error_)
 {}
 
-void Cell::Set(std::string text) {
-    if(!text.empty()){
-        if(text.front() == FORMULA_SIGN && text.size() > 1){
-            impl_ = std::make_unique<FormulaImpl>(text.substr(1), sheet_);
+CellSlot& CellSlot::operator=(const CellSlot& other){
+    number_ = other.number_;
+    index_ = other.index_;
+    kind_ = other.kind_;
+    flags_ = other.flags_;
+    value_.store(other.value_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    error_ = other.error_;
+    return *this;
+}
+
+CellKind CellSlot::GetKind() const{
+    return kind_;
+}
+
+bool CellSlot::IsEmpty() const{
+    return kind_ == CellKind::Empty;
+}
+
+bool CellSlot::IsReferenced() const{
+    return flags_ & REFERENCED;
+}
+
+bool CellSlot::IsPrintable() const{
+    return flags_ & PRINTABLE;
+}
+
+void CellSlot::SetPrintable(){
+    flags_ |= PRINTABLE;
+}
+
+bool CellSlot::HasCache() const{
+    return kind_ == CellKind::Formula && value_.load(std::memory_order_acquire) >= ValueKind::NewNumber;
+}
+
+void CellSlot::ClearCache(){
+    // the values of texts are known from the start and never go away
+    if(kind_ == CellKind::Formula){
+        value_.store(ValueKind::None, std::memory_order_relaxed);
+    }
+}
+
+// A formula reads the cells at the positions it was parsed with, they are
+// looked up at their physical ones
+class CellTable::FormulaInput final : public SheetInterface {
+public:
+    FormulaInput(const CellTable& table, const FormulaEntry& entry)
+        : table_(table)
+        , entry_(entry)
+    {}
+
+    CellInterface::NumericValue GetNumericValue(Position pos) const override{
+        const CellSlot* slot = table_.Find(ToPhysical(entry_, pos));
+        return slot ? table_.GetNumericValue(*slot) : 0.0;
+    }
+
+    void ForEachCellInRange(const Range& range,
+                            const std::function<void(const CellInterface&)>& func) const override{
+        table_.ForEachInRange(ToPhysical(entry_, range.top_left), ToPhysical(entry_, range.bottom_right),
+                              [&](Position, const CellSlot& cell){
+            if(!cell.IsEmpty()){
+                func(Cell(table_, cell));
+            }
+        });
+    }
+
+    // formulas only read the values of cells
+    void SetCell(Position, std::string) override{
+        Unreachable();
+    }
+    const CellInterface* GetCell(Position) const override{
+        Unreachable();
+    }
+    CellInterface* GetCell(Position) override{
+        Unreachable();
+    }
+    void ClearCell(Position) override{
+        Unreachable();
+    }
+    ::Size GetPrintableSize() const override{
+        Unreachable();
+    }
+    void PrintValues(std::ostream&) const override{
+        Unreachable();
+    }
+    void PrintTexts(std::ostream&) const override{
+        Unreachable();
+    }
+
+private:
+    [[noreturn]] static void Unreachable(){
+        throw std::logic_error("Formulas only read the values of cells"s);
+    }
+
+    const CellTable& table_;
+    const FormulaEntry& entry_;
+};
+
+CellTable::CellTable()
+    : storage_(std::make_shared<Storage>())
+    , layout_(std::make_shared<SheetLayout>())
+    , moved_texts_(std::make_unique<MovedTexts>())
+{}
+
+CellTable::CellTable(const CellTable& table, ViewTag)
+    : storage_(table.storage_)
+    , grid_(table.grid_)
+    , layout_(table.layout_)
+    , moved_texts_(std::make_unique<MovedTexts>())
+    , view_values_(std::make_unique<ViewValues>())
+{
+    std::lock_guard lock(storage_->pins_mutex);
+    pinned_version_ = storage_->version.fetch_add(1, std::memory_order_relaxed) + 1;
+    storage_->pins.insert(pinned_version_);
+    storage_->open_views.fetch_add(1, std::memory_order_relaxed);
+}
+
+CellTable::~CellTable(){
+    if(view_values_){
+        std::lock_guard lock(storage_->pins_mutex);
+        storage_->pins.erase(storage_->pins.find(pinned_version_));
+        // pairs with the acquire in Release, the reads of the view are over
+        // before its entries are freed
+        storage_->open_views.fetch_sub(1, std::memory_order_release);
+    }
+}
+
+const CellSlot* CellTable::Find(Position pos) const{
+    return grid_.Find(pos);
+}
+
+void CellTable::Insert(Position pos, CellSlot slot){
+    if(grid_.Find(pos)){
+        CellSlot* old_slot = grid_.FindMutable(pos);
+        Release(*old_slot);
+        *old_slot = slot;
+    }
+    else{
+        grid_.Insert(pos, slot);
+    }
+}
+
+void CellTable::Erase(Position pos){
+    if(const CellSlot* slot = grid_.Find(pos)){
+        CellSlot old_slot = *slot;
+        Release(old_slot);
+        grid_.Erase(pos);
+    }
+}
+
+bool CellTable::ClearCache(Position pos){
+    // the tile is only copied away from the views if there is a value to drop
+    const CellSlot* slot = grid_.Find(pos);
+    if(!slot || !slot->HasCache()){
+        return false;
+    }
+    grid_.FindMutable(pos)->ClearCache();
+    return true;
+}
+
+size_t CellTable::Size() const{
+    return grid_.Size();
+}
+
+const SheetLayout& CellTable::GetLayout() const{
+    return *layout_;
+}
+
+void CellTable::SetLayout(SheetLayout layout){
+    layout_ = std::make_shared<const SheetLayout>(std::move(layout));
+    std::lock_guard lock(moved_texts_->mutex);
+    moved_texts_->texts.clear();
+}
+
+namespace {
+// Writes a run of tabs a block at a time
+void PrintTabs(std::ostream& output, int count){
+    static constexpr int BLOCK = 256;
+    static const std::string tabs(BLOCK, '\t');
+    for(; count > 0; count -= BLOCK){
+        output.write(tabs.data(), std::min(count, BLOCK));
+    }
+}
+}  // namespace
+
+// Visits the printable cells in row order, the gaps between them are filled
+// with runs of separators instead of looking at every position.
+template <typename Func>
+void CellTable::PrintCells(std::ostream& output, ::Size size, Func&& print_cell) const{
+    int row = 0;
+    int col = 0;
+    auto move_to = [&](int next_row, int next_col){
+        for(; row < next_row; ++row){
+            PrintTabs(output, size.cols - 1 - col);
+            output.put('\n');
+            col = 0;
+        }
+        PrintTabs(output, next_col - col);
+        col = next_col;
+    };
+    ForEachPrintable(size, [&](Position pos, const CellSlot& cell){
+        move_to(pos.row, pos.col);
+        print_cell(cell);
+    });
+    move_to(size.rows, 0);
+}
+
+void CellTable::PrintValues(std::ostream& output, ::Size size) const{
+    PrintCells(output, size, [&](const CellSlot& cell){
+        if(!cell.IsEmpty()){
+            std::visit([&output](const auto& value){
+                output << value;
+            }, GetValue(cell));
+        }
+    });
+}
+
+void CellTable::PrintTexts(std::ostream& output, ::Size size) const{
+    PrintCells(output, size, [&](const CellSlot& cell){
+        output << GetText(cell);
+    });
+}
+
+CellSlot CellTable::MakeText(std::string text){
+    CellSlot slot;
+    slot.kind_ = CellKind::Text;
+    if(!text.empty() && text.front() == ESCAPE_SIGN){
+        slot.flags_ |= CellSlot::ESCAPED;
+    }
+    // parsed once, formulas read text cells over and over
+    if(auto number = ParseNumericText(std::string_view(text).substr(slot.flags_ & CellSlot::ESCAPED ? 1 : 0))){
+        slot.number_ = *number;
+    }
+    else{
+        slot.value_.store(CellSlot::ValueKind::Error, std::memory_order_relaxed);
+        slot.error_ = static_cast<uint8_t>(FormulaError::Category::Value);
+    }
+    if(!free_texts_.empty()){
+        slot.index_ = free_texts_.back();
+        free_texts_.pop_back();
+        storage_->texts[slot.index_] = std::move(text);
+    }
+    else{
+        slot.index_ = static_cast<uint32_t>(storage_->texts.size());
+        storage_->texts.emplace_back() = std::move(text);
+    }
+    return slot;
+}
+
+CellSlot CellTable::MakeFormula(std::shared_ptr<const FormulaAST> ast, Position anchor,
+                                std::optional<CellInterface::NumericValue> value){
+    const FormulaAST::Cells& cells = ast->GetCells();
+    CellSlot slot = NewFormula(ShiftedSpan<Position>({cells.data(), cells.size()}, anchor),
+                               ShiftedSpan<Range>(ast->GetRanges(), anchor), value);
+    FormulaEntry& entry = storage_->formulas[slot.index_];
+    entry.ast = std::move(ast);
+    entry.anchor = anchor;
+    return slot;
+}
+
+CellSlot CellTable::MakeFormula(std::unique_ptr<LazyFormula> formula,
+                                std::optional<CellInterface::NumericValue> value){
+    CellSlot slot = NewFormula(formula->GetReferences(), formula->GetRanges(), value);
+    FormulaEntry& entry = storage_->formulas[slot.index_];
+    entry.anchor = formula->GetAnchor();
+    entry.lazy = std::move(formula);
+    return slot;
+}
+
+CellSlot CellTable::NewFormula(ShiftedSpan<Position> references, ShiftedSpan<Range> ranges,
+                               std::optional<CellInterface::NumericValue> value){
+    CellSlot slot;
+    slot.kind_ = CellKind::Formula;
+    if(!references.empty() || !ranges.empty()){
+        slot.flags_ |= CellSlot::REFERENCED;
+    }
+    CellSlot::ValueKind kind = CellSlot::ValueKind::None;
+    if(value && std::holds_alternative<double>(*value)){
+        kind = CellSlot::ValueKind::Number;
+        slot.number_ = std::get<double>(*value);
+    }
+    else if(value){
+        kind = CellSlot::ValueKind::Error;
+        slot.error_ = static_cast<uint8_t>(std::get<FormulaError>(*value).GetCategory());
+    }
+    slot.value_.store(kind, std::memory_order_relaxed);
+    // the references were parsed at logical positions
+    std::unique_ptr<Relocation> relocation;
+    if(!layout_->IsIdentity() && slot.IsReferenced()){
+        relocation = std::make_unique<Relocation>();
+        relocation->layout = layout_;
+        bool moved = false;
+        for(const Position ref : references){
+            relocation->references.push_back(layout_->ToPhysical(ref));
+            moved = moved || !(relocation->references.back() == ref);
+        }
+        for(const Range range : ranges){
+            relocation->ranges.push_back(layout_->ToPhysical(range));
+            moved = moved || !(relocation->ranges.back() == range);
+        }
+        if(!moved){
+            relocation.reset();
+        }
+    }
+    if(!free_formulas_.empty()){
+        slot.index_ = free_formulas_.back();
+        free_formulas_.pop_back();
+    }
+    else{
+        slot.index_ = static_cast<uint32_t>(storage_->formulas.size());
+        storage_->formulas.emplace_back();
+    }
+    storage_->formulas[slot.index_].relocation = std::move(relocation);
+    return slot;
+}
+
+void CellTable::Release(CellSlot& slot){
+    const size_t open_views = storage_->open_views.load(std::memory_order_acquire);
+    if(slot.kind_ != CellKind::Empty){
+        if(open_views > 0){
+            stats::Add(StatCounter::RetiredEntries);
+            retired_.push_back({storage_->version.load(std::memory_order_relaxed), slot.index_, slot.kind_});
         }
         else{
-            impl_ = std::make_unique<TextImpl>(std::move(text));\
+            Free(slot.kind_, slot.index_);
         }
     }
+    // the first change after the views are gone frees what they held
+    if(retired_.size() >= reclaim_at_ || (!retired_.empty() && open_views == 0)){
+        Reclaim();
+    }
+    slot = CellSlot();
 }
 
-void Cell::Clear() {
-    impl_ = std::make_unique<EmptyImpl>();
+void CellTable::Free(CellKind kind, uint32_t index){
+    if(kind == CellKind::Text){
+        // swapped out to give the memory of long texts back
+        std::string().swap(storage_->texts[index]);
+        free_texts_.push_back(index);
+    }
+    else{
+        FormulaEntry& entry = storage_->formulas[index];
+        entry.ast.reset();
+        entry.lazy.reset();
+        entry.relocation.reset();
+        {
+            std::lock_guard lock(moved_texts_->mutex);
+            moved_texts_->texts.erase(index);
+        }
+        entry.text.reset();
+        entry.has_text.store(false, std::memory_order_relaxed);
+        free_formulas_.push_back(index);
+    }
 }
 
-Cell::Value Cell::GetValue() const {
-    if(!cache_value_.has_value()){
-        cache_value_ = impl_->GetValue();
+// Frees the retired entries no open view can read: those released before
+// the oldest view was taken
+void CellTable::Reclaim(){
+    uint64_t oldest = std::numeric_limits<uint64_t>::max();
+    {
+        std::lock_guard lock(storage_->pins_mutex);
+        if(!storage_->pins.empty()){
+            oldest = *storage_->pins.begin();
+        }
     }
-    return *cache_value_;
+    size_t kept = 0;
+    for(const RetiredEntry& entry : retired_){
+        if(entry.version < oldest){
+            stats::Add(StatCounter::ReclaimedEntries);
+            Free(entry.kind, entry.index);
+        }
+        else{
+            retired_[kept++] = entry;
+        }
+    }
+    retired_.resize(kept);
+    // the entries a long-lived view holds are not scanned on every release
+    reclaim_at_ = std::max<size_t>(64, kept * 2);
 }
 
-std::string Cell::GetText() const {
-    return impl_->GetText();
+std::string_view CellTable::GetText(const CellSlot& slot) const{
+    switch(slot.kind_){
+    case CellKind::Text:
+        return storage_->texts[slot.index_];
+    case CellKind::Formula: {
+        FormulaEntry& entry = GetEntry(slot);
+        if(entry.relocation || (slot.IsReferenced() && !layout_->IsIdentity())){
+            return GetMovedText(slot);
+        }
+        if(!entry.has_text.load(std::memory_order_acquire)){
+            std::lock_guard lock(storage_->text_mutex);
+            if(!entry.has_text.load(std::memory_order_relaxed)){
+                entry.text = std::make_unique<std::string>(FORMULA_SIGN + GetExpression(entry));
+                entry.has_text.store(true, std::memory_order_release);
+            }
+        }
+        return *entry.text;
+    }
+    default:
+        return {};
+    }
 }
 
-std::vector<Position> Cell::GetReferencedCells() const{
-    return impl_->GetReferencedCells();
+// Kept per table, the views print the texts for their own layouts
+std::string_view CellTable::GetMovedText(const CellSlot& slot) const{
+    std::lock_guard lock(moved_texts_->mutex);
+    auto it = moved_texts_->texts.find(slot.index_);
+    if(it == moved_texts_->texts.end()){
+        auto locate = [this](Position pos){
+            return layout_->ToLogical(pos);
+        };
+        std::string text = RelocateText(slot, locate, [&locate](const Range& range){
+            return Range{locate(range.top_left), locate(range.bottom_right)};
+        });
+        // the map's nodes stay in place, the view outlives the lock
+        it = moved_texts_->texts.emplace(slot.index_, std::move(text)).first;
+    }
+    return it->second;
 }
 
-void Cell::ClearCache() const{
-    cache_value_.reset();
+std::string CellTable::RelocateText(const CellSlot& slot,
+                                    const std::function<std::optional<Position>(Position)>& locate_cell,
+                                    const std::function<std::optional<Range>(const Range&)>& locate_range) const{
+    const FormulaEntry& entry = GetEntry(slot);
+    const std::string expression = GetExpression(entry);
+    std::optional<std::string> text = RelocateFormula(
+        expression,
+        [&](Position pos){
+            return locate_cell(ToPhysical(entry, pos));
+        },
+        [&](const Range& range){
+            return locate_range(Range{ToPhysical(entry, range.top_left), ToPhysical(entry, range.bottom_right)});
+        });
+    // a printed expression always lexes
+    return FORMULA_SIGN + text.value_or(expression);
 }
 
-bool Cell::IsReferenced() const{
-    return !GetReferencedCells().empty();
+CellInterface::ValueView CellTable::GetValue(const CellSlot& slot) const{
+    // only formulas are evaluated and cached, texts are read in place
+    if(slot.kind_ == CellKind::Text){
+        return std::string_view(storage_->texts[slot.index_]).substr(slot.flags_ & CellSlot::ESCAPED ? 1 : 0);
+    }
+    const CellSlot& value = LoadValue(slot);
+    const CellSlot::ValueKind kind = value.value_.load(std::memory_order_relaxed);
+    if(kind == CellSlot::ValueKind::Number || kind == CellSlot::ValueKind::NewNumber){
+        return value.number_;
+    }
+    return FormulaError(static_cast<FormulaError::Category>(value.error_));
 }
 
-Cell::Value Cell::EmptyImpl::GetValue() const{
-    using namespace std::literals;
-    return 0.0;
+CellInterface::NumericValue CellTable::GetNumericValue(const CellSlot& slot) const{
+    const CellSlot& value = LoadValue(slot);
+    const CellSlot::ValueKind kind = value.value_.load(std::memory_order_relaxed);
+    if(kind == CellSlot::ValueKind::Number || kind == CellSlot::ValueKind::NewNumber){
+        return value.number_;
+    }
+    return FormulaError(FormulaError::Category::Value);
 }
 
-std::string Cell::EmptyImpl::GetText() const{
-    using namespace std::literals;
-    return ""s;
+const CellSlot& CellTable::LoadValue(const CellSlot& slot) const{
+    // the acquire pairs with the release in Evaluate, the number and the
+    // error written before it are visible once the kind is
+    const CellSlot::ValueKind value = slot.value_.load(std::memory_order_acquire);
+    if(value < CellSlot::ValueKind::Number){
+        return LoadNewValue(slot, value);
+    }
+    if(slot.kind_ == CellKind::Formula){
+        stats::Add(StatCounter::CacheHits);
+    }
+    return slot;
 }
 
-std::vector<Position> Cell::EmptyImpl::GetReferencedCells() const{
-    return {};
+const CellSlot& CellTable::LoadNewValue(const CellSlot& slot, CellSlot::ValueKind value) const{
+    if(view_values_){
+        return EvaluateInView(slot);
+    }
+    if(value >= CellSlot::ValueKind::NewNumber){
+        stats::Add(StatCounter::CacheHits);
+        if(storage_->open_views.load(std::memory_order_relaxed) == 0){
+            // the views that could not take it are gone, later ones may
+            const CellSlot::ValueKind old_value = value == CellSlot::ValueKind::NewNumber
+                ? CellSlot::ValueKind::Number : CellSlot::ValueKind::Error;
+            slot.value_.compare_exchange_strong(value, old_value, std::memory_order_relaxed);
+        }
+        return slot;
+    }
+    stats::Add(StatCounter::CacheMisses);
+    Evaluate(slot);
+    return slot;
 }
 
-Cell::TextImpl::TextImpl(std::string text)
-    : text_(std::move(text))
-{}
+void CellTable::Evaluate(const CellSlot& slot) const{
+    CellSlot::ValueKind value = CellSlot::ValueKind::None;
+    while(!slot.value_.compare_exchange_weak(value, CellSlot::ValueKind::Computing,
+                                             std::memory_order_acquire)){
+        if(value >= CellSlot::ValueKind::NewNumber){
+            return;
+        }
+        if(value == CellSlot::ValueKind::Computing){
+            // Another reader computes the cell. The formulas it reads form
+            // no cycle, so that reader never waits for this one.
+            std::this_thread::yield();
+            value = CellSlot::ValueKind::None;
+        }
+    }
+
+    stats::SampledTimer timer(StatHistogram::EvaluationLatency);
+    stats::Add(StatCounter::Evaluations);
+    FormulaInterface::Value result;
+    try{
+        const FormulaEntry& entry = GetEntry(slot);
+        result = EvaluateFormula(GetAST(entry), entry.anchor, FormulaInput(*this, entry));
+    }
+    catch(...){
+        // a lazily parsed formula may fail, the next reader tries again
+        slot.value_.store(CellSlot::ValueKind::None, std::memory_order_release);
+        throw;
+    }
+    // the slot may be in a tile a view shares, which must not take a value
+    // computed from cells changed after it was taken
+    const bool views_open = storage_->open_views.load(std::memory_order_relaxed) > 0;
+    if(std::holds_alternative<double>(result)){
+        slot.number_ = std::get<double>(result);
+        value = views_open ? CellSlot::ValueKind::NewNumber : CellSlot::ValueKind::Number;
+    }
+    else{
+        slot.error_ = static_cast<uint8_t>(std::get<FormulaError>(result).GetCategory());
+        value = views_open ? CellSlot::ValueKind::NewError : CellSlot::ValueKind::Error;
+    }
+    slot.value_.store(value, std::memory_order_release);
+}
 
-Cell::Value Cell::TextImpl::GetValue() const{
-    if(text_.front() == ESCAPE_SIGN){
-        return text_.substr(1);
+// A view never writes to the slots it shares with the sheet. Two readers of
+// the view may both compute a cell, they get the same value.
+const CellSlot& CellTable::EvaluateInView(const CellSlot& slot) const{
+    ViewValues::Shard& shard = view_values_->shards[std::hash<const CellSlot*>()(&slot) % view_values_->shards.size()];
+    {
+        std::lock_guard lock(shard.mutex);
+        auto it = shard.values.find(&slot);
+        if(it != shard.values.end()){
+            stats::Add(StatCounter::CacheHits);
+            return it->second;
+        }
+    }
+    stats::Add(StatCounter::CacheMisses);
+    stats::SampledTimer timer(StatHistogram::EvaluationLatency);
+    stats::Add(StatCounter::Evaluations);
+    const FormulaEntry& entry = GetEntry(slot);
+    const FormulaInterface::Value result = EvaluateFormula(GetAST(entry), entry.anchor,
+                                                           FormulaInput(*this, entry));
+    CellSlot value;
+    if(std::holds_alternative<double>(result)){
+        value.number_ = std::get<double>(result);
     }
     else{
-        return text_;
+        value.error_ = static_cast<uint8_t>(std::get<FormulaError>(result).GetCategory());
+        value.value_.store(CellSlot::ValueKind::Error, std::memory_order_relaxed);
+    }
+    std::lock_guard lock(shard.mutex);
+    // the map's nodes stay in place, the reference outlives the lock
+    return shard.values.emplace(&slot, value).first->second;
+}
+
+std::vector<Position> CellTable::GetLogicalReferences(const CellSlot& slot) const{
+    if(slot.kind_ != CellKind::Formula){
+        return {};
+    }
+    std::vector<Position> cells;
+    for(const Position ref : GetReferences(slot)){
+        cells.push_back(layout_->ToLogical(ref));
+    }
+    std::sort(cells.begin(), cells.end());
+    return cells;
+}
+
+std::vector<Range> CellTable::GetLogicalRanges(const CellSlot& slot) const{
+    if(slot.kind_ != CellKind::Formula){
+        return {};
+    }
+    std::vector<Range> ranges;
+    for(const Range range : GetRanges(slot)){
+        ranges.push_back(layout_->ToLogical(range));
+    }
+    std::sort(ranges.begin(), ranges.end());
+    return ranges;
+}
+
+ShiftedSpan<Position> CellTable::GetReferences(const CellSlot& slot) const{
+    if(!slot.IsReferenced()){
+        return {};
+    }
+    const FormulaEntry& entry = GetEntry(slot);
+    if(entry.relocation){
+        return entry.relocation->references;
+    }
+    return GetParsedReferences(entry);
+}
+
+ShiftedSpan<Range> CellTable::GetRanges(const CellSlot& slot) const{
+    if(!slot.IsReferenced()){
+        return {};
+    }
+    const FormulaEntry& entry = GetEntry(slot);
+    if(entry.relocation){
+        return entry.relocation->ranges;
+    }
+    return GetParsedRanges(entry);
+}
+
+uint8_t CellTable::GetMark(const CellSlot& slot, uint32_t epoch) const{
+    if(slot.kind_ != CellKind::Formula){
+        return 0;
+    }
+    const FormulaEntry& entry = GetEntry(slot);
+    return entry.mark_epoch == epoch ? entry.mark : 0;
+}
+
+uint32_t CellTable::GetMarkIndex(const CellSlot& slot) const{
+    return GetEntry(slot).mark_index;
+}
+
+void CellTable::SetMark(const CellSlot& slot, uint32_t epoch, uint8_t mark, uint32_t index) const{
+    FormulaEntry& entry = GetEntry(slot);
+    entry.mark_epoch = epoch;
+    entry.mark = mark;
+    entry.mark_index = index;
+}
+
+void CellTable::ResetMarks() const{
+    for(size_t i = 0; i < storage_->formulas.size(); ++i){
+        FormulaEntry& entry = storage_->formulas[i];
+        entry.mark_epoch = 0;
+        entry.mark = 0;
+    }
+}
+
+int64_t CellTable::GetOrder(const CellSlot& slot) const{
+    return GetEntry(slot).order;
+}
+
+void CellTable::SetOrder(const CellSlot& slot, int64_t order) const{
+    GetEntry(slot).order = order;
+}
+
+CellTable::FormulaEntry& CellTable::GetEntry(const CellSlot& slot) const{
+    assert(slot.kind_ == CellKind::Formula);
+    return storage_->formulas[slot.index_];
+}
+
+ShiftedSpan<Position> CellTable::GetParsedReferences(const FormulaEntry& entry){
+    // a lazy formula keeps the ones it was stored with until it is computed
+    if(entry.lazy){
+        return entry.lazy->GetReferences();
+    }
+    const FormulaAST::Cells& cells = entry.ast->GetCells();
+    return ShiftedSpan<Position>({cells.data(), cells.size()}, entry.anchor);
+}
+
+ShiftedSpan<Range> CellTable::GetParsedRanges(const FormulaEntry& entry){
+    if(entry.lazy){
+        return entry.lazy->GetRanges();
     }
+    return ShiftedSpan<Range>(entry.ast->GetRanges(), entry.anchor);
 }
 
-std::string Cell::TextImpl::GetText() const{
-    return text_;
+const FormulaAST& CellTable::GetAST(const FormulaEntry& entry){
+    return entry.lazy ? entry.lazy->GetAST() : *entry.ast;
 }
 
-std::vector<Position> Cell::TextImpl::GetReferencedCells() const{
-    return {};
+std::string CellTable::GetExpression(const FormulaEntry& entry){
+    return entry.lazy ? entry.lazy->GetExpression() : PrintExpression(*entry.ast, entry.anchor);
 }
 
-Cell::FormulaImpl::FormulaImpl(std::string expr, const Sheet& sheet)
-    : formula_(ParseFormula(expr))
-    , sheet_(sheet)
+Position CellTable::ToPhysical(const FormulaEntry& entry, Position pos){
+    return entry.relocation ? entry.relocation->layout->ToPhysical(pos) : pos;
+}
+
+// Реализуйте следующие методы
+Cell::Cell(const CellTable& table, const CellSlot& slot)
+    : table_(&table)
+    , slot_(&slot)
 {}
 
-Cell::Value Cell::FormulaImpl::GetValue() const{
-    auto value = formula_->Evaluate(sheet_);
-    if(std::holds_alternative<double>(value)){
+Cell::Cell(const CellTable& table, Position pos)
+    : table_(&table)
+    , pos_(pos)
+{}
+
+const CellSlot& Cell::GetSlot() const{
+    // a handle lives no longer than its cell
+    return slot_ ? *slot_ : *table_->Find(pos_);
+}
+
+Cell::Value Cell::GetValue() const {
+    const ValueView value = GetValueView();
+    if(std::holds_alternative<std::string_view>(value)){
+        return std::string(std::get<std::string_view>(value));
+    }
+    else if(std::holds_alternative<double>(value)){
         return std::get<double>(value);
     }
     else{
@@ -101,11 +730,69 @@ Cell::Value Cell::FormulaImpl::GetValue() const{
     }
 }
 
-std::string Cell::FormulaImpl::GetText() const{
-    using namespace std::literals;
-    return "="s + formula_->GetExpression();
+Cell::ValueView Cell::GetValueView() const{
+    return table_->GetValue(GetSlot());
 }
 
-std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const{
-    return formula_->GetReferencedCells();
+std::string Cell::GetText() const {
+    return std::string(table_->GetText(GetSlot()));
+}
+
+std::string_view Cell::GetTextView() const{
+    return table_->GetText(GetSlot());
+}
+
+Cell::NumericValue Cell::GetNumericValue() const{
+    return table_->GetNumericValue(GetSlot());
+}
+
+std::vector<Position> Cell::GetReferencedCells() const{
+    const CellSlot& slot = GetSlot();
+    return ListReferencedCells(table_->GetLogicalReferences(slot), table_->GetLogicalRanges(slot));
+}
+
+std::vector<Position> Cell::GetReferences() const{
+    return table_->GetLogicalReferences(GetSlot());
+}
+
+std::vector<Range> Cell::GetRanges() const{
+    return table_->GetLogicalRanges(GetSlot());
+}
+
+bool Cell::IsEmpty() const{
+    return GetSlot().IsEmpty();
+}
+
+bool Cell::HasCache() const{
+    return GetSlot().HasCache();
+}
+
+Cell* CellHandles::Get(const CellTable& table, Position pos){
+    std::lock_guard lock(mutex_);
+    // a handle is released along with its cell
+    if(Cell* const* handle = handles_.Find(pos)){
+        return *handle;
+    }
+    if(!table.Find(pos)){
+        return nullptr;
+    }
+    Cell* handle;
+    if(!free_.empty()){
+        handle = free_.back();
+        free_.pop_back();
+        *handle = Cell(table, pos);
+    }
+    else{
+        handle = &pool_.emplace_back(table, pos);
+    }
+    handles_.Insert(pos, handle);
+    return handle;
+}
+
+void CellHandles::Release(Position pos){
+    std::lock_guard lock(mutex_);
+    if(Cell* const* handle = handles_.Find(pos)){
+        free_.push_back(*handle);
+        handles_.Erase(pos);
+    }
 }
@@ -1,70 +1,385 @@
 #pragma once
 
+#include "chunked_vector.h"
 #include "common.h"
 #include "formula.h"
+#include "sheet_layout.h"
+#include "sparse_grid.h"
 
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <deque>
 #include <functional>
-#include <unordered_set>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
-class Sheet;
+enum class CellKind : uint8_t {
+    // empty cells are only kept for the formulas reading them
+    Empty,
+    Text,
+    Formula,
+};
 
-class Cell : public CellInterface {
+// The part of a cell stored in the sheet's grid, 16 bytes per occupied
+// position. Texts and formulas are kept in the side tables of CellTable under
+// the slot's index; the slot itself holds the value formulas read, which is
+// the number of a text or the cached value of a formula. Slots are plain
+// values, the table owns what they point to.
+//
+// The cached value of a formula is published through the atomic value kind:
+// the thread that moves it from None to Computing evaluates the formula,
+// writes the number or the error and then stores the kind with release
+// semantics, other readers of the cell wait for it instead of computing the
+// value again. Slots are copied and changed by the writer only. A value
+// computed while views of the table are open is published as a new one:
+// it may come from cells changed after a view was taken, so the views
+// compute such cells on their own.
+class CellSlot {
 public:
-        Cell(Sheet& sheet);
-        ~Cell() = default;
-
-        void Set(std::string text);
-        void Clear();
+    CellSlot() = default;
+    CellSlot(const CellSlot& other);
+    CellSlot& operator=(const CellSlot& other);
 
-        Value GetValue() const override;
-        std::string GetText() const override;
-        std::vector<Position> GetReferencedCells() const override;
+    CellKind GetKind() const;
+    bool IsEmpty() const;
+    // a formula with references, only such cells are ranked and walked
+    bool IsReferenced() const;
+    // set through the sheet, as opposed to an empty cell kept only for the
+    // formulas reading it; such cells are printed and make the printable area
+    bool IsPrintable() const;
+    void SetPrintable();
+    bool HasCache() const;
+    void ClearCache();
 
-        bool IsReferenced() const;
-        void ClearCache() const;
 private:
+    friend class CellTable;
 
-        class Impl{
-        public:
-            virtual Value GetValue() const = 0;
-            virtual std::string GetText() const = 0;
-            virtual std::vector<Position> GetReferencedCells() const = 0;
-        };
+    // the kinds without a value come first, then the ones views don't take
+    enum class ValueKind : uint8_t {
+        // a formula that has not been computed since its inputs changed
+        None,
+        // a reader is computing the formula
+        Computing,
+        NewNumber,
+        NewError,
+        Number,
+        Error,
+    };
+    enum Flags : uint8_t {
+        ESCAPED = 1,
+        REFERENCED = 2,
+        PRINTABLE = 4,
+    };
 
-        class EmptyImpl : public Impl{
-        public:
-            Value GetValue() const override;
-            std::string GetText() const override;
-            std::vector<Position> GetReferencedCells() const override;
-        };
+    mutable double number_ = 0.0;
+    uint32_t index_ = 0;
+    CellKind kind_ = CellKind::Empty;
+    uint8_t flags_ = 0;
+    mutable std::atomic<ValueKind> value_{ValueKind::Number};
+    // the FormulaError::Category of an error value
+    mutable uint8_t error_ = 0;
+};
+
+static_assert(sizeof(CellSlot) == 16, "cell slots are packed into the grid tiles");
+
+// The cells of a sheet: the grid of slots and the side tables of their texts
+// and formulas. Released entries of the side tables are reused, and entries
+// never move, so the views handed out stay valid until their cell changes.
+//
+// A table may be copied into a read-only view of itself for a SheetView. The
+// view shares the tiles of the grid until the sheet writes to them and the
+// side tables for good; entries released while views are open are kept until
+// the views that may read them are gone, the next change of the sheet after
+// that reuses them.
+//
+// Slots are stored at physical positions, the layout of the table gives the
+// logical ones (sheet_layout.h). The references and ranges of formulas are
+// physical too: a formula set while rows or columns were moved keeps them
+// along with the layout it was parsed in, and its text is printed with the
+// positions its cells have now.
+class CellTable {
+public:
+    struct ViewTag {};
+    static constexpr ViewTag VIEW{};
+
+    CellTable();
+    // A view of the table as it is now, taken in O(1) while nothing changes
+    // the table
+    CellTable(const CellTable& table, ViewTag);
+    ~CellTable();
+
+    CellTable(const CellTable&) = delete;
+    CellTable& operator=(const CellTable&) = delete;
 
-        class TextImpl : public Impl{
-        public:
-            explicit TextImpl(std::string text);
-            Value GetValue() const override;
-            std::string GetText() const override;
-            std::vector<Position> GetReferencedCells() const override;
-        private:
-            std::string text_;
+    const CellSlot* Find(Position pos) const;
+    // Stores slot at pos and releases the content of the one it replaces
+    void Insert(Position pos, CellSlot slot);
+    void Erase(Position pos);
+    // Drops the cached value of a formula, true if it had one
+    bool ClearCache(Position pos);
+    size_t Size() const;
+
+    const SheetLayout& GetLayout() const;
+    // Moving rows or columns changes the texts of the formulas, not the slots
+    void SetLayout(SheetLayout layout);
+
+    // Calls func(Position, const CellSlot&) for the occupied slots of the
+    // range between the physical corners, row by row in the logical order
+    template <typename Func>
+    void ForEachInRange(Position top_left, Position bottom_right, Func&& func) const {
+        if(layout_->IsIdentity()){
+            grid_.ForEachInRange(top_left, bottom_right, std::forward<Func>(func));
+            return;
+        }
+        layout_->ForEachBlock(layout_->ToLogical(top_left), layout_->ToLogical(bottom_right),
+                              [&](Position block_top_left, Position block_bottom_right, Position){
+            grid_.ForEachInRange(block_top_left, block_bottom_right, func);
+        });
+    }
+    // Every occupied slot in no particular order
+    template <typename Func>
+    void ForEach(Func&& func) const {
+        grid_.ForEach(std::forward<Func>(func));
+    }
+    // Calls func(Position, const CellSlot&) for the printable slots of a
+    // sheet of the given printable size in row order, at their logical positions
+    template <typename Func>
+    void ForEachPrintable(::Size size, Func&& func) const {
+        auto print = [&func](Position pos, const CellSlot& cell){
+            if(cell.IsPrintable()){
+                func(pos, cell);
+            }
         };
+        if(layout_->IsIdentity()){
+            grid_.ForEach(print);
+            return;
+        }
+        if(size.rows == 0 || size.cols == 0){
+            return;
+        }
+        layout_->ForEachBlock({0, 0}, {size.rows - 1, size.cols - 1},
+                              [&](Position top_left, Position bottom_right, Position logical){
+            grid_.ForEachInRange(top_left, bottom_right, [&](Position pos, const CellSlot& cell){
+                print({logical.row + pos.row - top_left.row, logical.col + pos.col - top_left.col}, cell);
+            });
+        });
+    }
+
+    // The printable cells of a sheet of the given printable size
+    void PrintValues(std::ostream& output, ::Size size) const;
+    void PrintTexts(std::ostream& output, ::Size size) const;
+
+    // Slots of new content. The side table entry is taken right away and
+    // belongs to the slot until it is inserted or released.
+    CellSlot MakeText(std::string text);
+    // A formula compiled by the sheet's FormulaTable for the cell at the
+    // logical position anchor, with its value if it is known. The compiled
+    // formula is shared, the entry keeps it and the anchor only.
+    CellSlot MakeFormula(std::shared_ptr<const FormulaAST> ast, Position anchor,
+                         std::optional<CellInterface::NumericValue> value = std::nullopt);
+    CellSlot MakeFormula(std::unique_ptr<LazyFormula> formula,
+                         std::optional<CellInterface::NumericValue> value = std::nullopt);
+    void Release(CellSlot& slot);
+
+    // The text as it was set, a formula's text is printed once it is asked for
+    std::string_view GetText(const CellSlot& slot) const;
+    // The text of a formula with its references moved: the locators get
+    // their physical positions, see RelocateFormula
+    std::string RelocateText(const CellSlot& slot,
+                             const std::function<std::optional<Position>(Position)>& locate_cell,
+                             const std::function<std::optional<Range>(const Range&)>& locate_range) const;
+    // The value of the cell, a formula is computed if it has no cached value
+    CellInterface::ValueView GetValue(const CellSlot& slot) const;
+    // The value the way formulas read it, see CellInterface::GetNumericValue
+    CellInterface::NumericValue GetNumericValue(const CellSlot& slot) const;
+    // The single cells and the ranges a formula reads at their logical
+    // positions, sorted, empty for other cells. A range stays one item.
+    std::vector<Position> GetLogicalReferences(const CellSlot& slot) const;
+    std::vector<Range> GetLogicalRanges(const CellSlot& slot) const;
+    // The single cells and the ranges a formula reads, empty for other
+    // cells; physical, in no particular order once rows or columns moved.
+    // The offsets of the compiled formula are moved to its cell as they are
+    // read, nothing is copied per cell.
+    ShiftedSpan<Position> GetReferences(const CellSlot& slot) const;
+    ShiftedSpan<Range> GetRanges(const CellSlot& slot) const;
+
+    // Scratch mark for graph walks over the sheet, only formulas carry one.
+    // A mark and the index stored along with it are only meaningful while
+    // they were set with the epoch of the current walk.
+    uint8_t GetMark(const CellSlot& slot, uint32_t epoch) const;
+    uint32_t GetMarkIndex(const CellSlot& slot) const;
+    void SetMark(const CellSlot& slot, uint32_t epoch, uint8_t mark, uint32_t index = 0) const;
+    void ResetMarks() const;
+
+    // Rank of a formula in the topological order the sheet keeps for
+    // formulas with references: a cell ranks above every cell it reads.
+    int64_t GetOrder(const CellSlot& slot) const;
+    void SetOrder(const CellSlot& slot, int64_t order) const;
+
+private:
+    // Where the cells of a formula parsed while rows or columns were moved
+    // are: the layout it was parsed in and its references at their
+    // physical positions
+    struct Relocation {
+        std::shared_ptr<const SheetLayout> layout;
+        std::vector<Position> references;
+        std::vector<Range> ranges;
+    };
+
+    struct FormulaEntry {
+        // shared by the cells the formula was filled into, its positions are
+        // offsets from the anchor; none for a lazy formula
+        std::shared_ptr<const FormulaAST> ast;
+        // the logical position the formula was parsed at
+        Position anchor;
+        // a formula loaded from a snapshot, it keeps its text and references
+        std::unique_ptr<LazyFormula> lazy;
+        // none when the formula was parsed at the physical positions
+        std::unique_ptr<Relocation> relocation;
+        // the expression is printed from the AST once it is asked for, under
+        // text_mutex
+        std::unique_ptr<std::string> text;
+        int64_t order = 0;
+        uint32_t mark_epoch = 0;
+        uint32_t mark_index = 0;
+        uint8_t mark = 0;
+        std::atomic<bool> has_text{false};
+    };
+
+    // What a table shares with its views. The side tables are appended to
+    // and released by the sheet only; a view pins the version it was taken
+    // at from its own thread.
+    struct Storage {
+        ChunkedVector<std::string> texts;
+        ChunkedVector<FormulaEntry> formulas;
+        std::mutex text_mutex;
+        std::atomic<uint64_t> version{0};
+        std::atomic<size_t> open_views{0};
+        std::mutex pins_mutex;
+        std::multiset<uint64_t> pins;
+    };
 
-        class FormulaImpl : public Impl{
-        public:
-            explicit FormulaImpl(std::string expr, const Sheet& sheet);
-            Value GetValue() const override;
-            std::string GetText() const override;
-            std::vector<Position> GetReferencedCells() const override;
-        private:
-            std::unique_ptr<FormulaInterface> formula_;
-            const Sheet& sheet_;
+    // an entry released at the given version, views pinned at it or before
+    // may still read it
+    struct RetiredEntry {
+        uint64_t version;
+        uint32_t index;
+        CellKind kind;
+    };
+
+    // Values a view computed itself, keyed by the slot; spread over shards
+    // so that the readers of a view seldom wait for each other
+    struct ViewValues {
+        struct Shard {
+            std::mutex mutex;
+            std::unordered_map<const CellSlot*, CellSlot> values;
         };
+        std::array<Shard, 16> shards;
+    };
+
+    // The texts of the formulas whose printed references differ from the
+    // ones they were parsed with, printed for the layout of this table
+    struct MovedTexts {
+        std::mutex mutex;
+        std::unordered_map<uint32_t, std::string> texts;
+    };
+
+    // the cells formulas read, see cell.cpp
+    class FormulaInput;
+
+    FormulaEntry& GetEntry(const CellSlot& slot) const;
+    // A formula slot with a new entry for a formula with the given logical
+    // references, the caller sets what the entry computes
+    CellSlot NewFormula(ShiftedSpan<Position> references, ShiftedSpan<Range> ranges,
+                        std::optional<CellInterface::NumericValue> value);
+    // the references and ranges the formula was parsed with, logical
+    static ShiftedSpan<Position> GetParsedReferences(const FormulaEntry& entry);
+    static ShiftedSpan<Range> GetParsedRanges(const FormulaEntry& entry);
+    static const FormulaAST& GetAST(const FormulaEntry& entry);
+    static std::string GetExpression(const FormulaEntry& entry);
+    static Position ToPhysical(const FormulaEntry& entry, Position pos);
+    std::string_view GetMovedText(const CellSlot& slot) const;
+    // The slot holding the value of the given one: itself, or for a view
+    // the copy with the value the view computed
+    const CellSlot& LoadValue(const CellSlot& slot) const;
+    const CellSlot& LoadNewValue(const CellSlot& slot, CellSlot::ValueKind value) const;
+    void Evaluate(const CellSlot& slot) const;
+    const CellSlot& EvaluateInView(const CellSlot& slot) const;
+    template <typename Func>
+    void PrintCells(std::ostream& output, ::Size size, Func&& print_cell) const;
+    void Free(CellKind kind, uint32_t index);
+    void Reclaim();
+
+    std::shared_ptr<Storage> storage_;
+    SparseGrid<CellSlot> grid_;
+    // replaced as a whole, the formulas and views keep the ones they had
+    std::shared_ptr<const SheetLayout> layout_;
+    std::unique_ptr<MovedTexts> moved_texts_;
+    // the sheet's side of the storage
+    std::vector<uint32_t> free_texts_;
+    std::vector<uint32_t> free_formulas_;
+    std::vector<RetiredEntry> retired_;
+    size_t reclaim_at_ = 64;
+    // set for a view only
+    uint64_t pinned_version_ = 0;
+    std::unique_ptr<ViewValues> view_values_;
+};
+
+// A cell as CellInterface sees it. The handle only names the cell, the
+// sheet hands one out per position when it is asked for the cell.
+class Cell : public CellInterface {
+public:
+        // a cell read while the grid doesn't change
+        Cell(const CellTable& table, const CellSlot& slot);
+        // a cell handed out by a sheet, the slot is found on every call
+        // since the grid copies it when it is changed after a snapshot
+        Cell(const CellTable& table, Position pos);
+
+        Value GetValue() const override;
+        ValueView GetValueView() const override;
+        std::string GetText() const override;
+        NumericValue GetNumericValue() const override;
+        std::vector<Position> GetReferencedCells() const override;
+
+        // The cells the formula reads one by one and its ranges, which
+        // GetReferencedCells lists cell by cell
+        std::vector<Position> GetReferences() const;
+        std::vector<Range> GetRanges() const;
 
+        // The text without copying it out: the view stays valid until the
+        // cell is changed, the formula text is kept once it was asked for.
+        std::string_view GetTextView() const;
 
+        bool IsEmpty() const;
+        bool HasCache() const;
 
 private:
-        Sheet& sheet_;
-        std::unique_ptr<Impl> impl_;
-        mutable std::optional<Value> cache_value_;
+        const CellSlot& GetSlot() const;
+
+        const CellTable* table_;
+        const CellSlot* slot_ = nullptr;
+        Position pos_;
 };
 
+// The handles of the cells a sheet was asked for, one per position, made on
+// demand and reused once their cell is removed. Any thread may get a handle.
+class CellHandles {
+public:
+    // The handle of the cell of the table at pos, nullptr if there is none
+    Cell* Get(const CellTable& table, Position pos);
+    void Release(Position pos);
+
+private:
+    SparseGrid<Cell*> handles_;
+    std::deque<Cell> pool_;
+    std::vector<Cell*> free_;
+    std::mutex mutex_;
+};
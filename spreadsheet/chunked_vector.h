@@ -0,0 +1,53 @@
+#pragma once
+
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <memory>
+
+// Vector whose elements never move. Elements live in chunks of a fixed size
+// reached through a two-level table of chunks, so an element is found in
+// O(1) and appending leaves the elements and the tables in place: other
+// threads may read the elements they know of while the owner appends.
+template <typename T>
+class ChunkedVector {
+public:
+    T& operator[](size_t index) {
+        return (*pages_[index >> (CHUNK_SHIFT + PAGE_SHIFT)])[(index >> CHUNK_SHIFT) & (PAGE_SIZE - 1)]
+            [index & (CHUNK_SIZE - 1)];
+    }
+
+    const T& operator[](size_t index) const {
+        return const_cast<ChunkedVector*>(this)->operator[](index);
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    // The new element is default-constructed along with the rest of its chunk
+    T& emplace_back() {
+        if ((size_ & (CHUNK_SIZE - 1)) == 0) {
+            assert(size_ < CHUNK_SIZE * PAGE_SIZE * PAGE_COUNT);
+            std::unique_ptr<Page>& page = pages_[size_ >> (CHUNK_SHIFT + PAGE_SHIFT)];
+            if (!page) {
+                page = std::make_unique<Page>();
+            }
+            (*page)[(size_ >> CHUNK_SHIFT) & (PAGE_SIZE - 1)] = std::make_unique<T[]>(CHUNK_SIZE);
+        }
+        return (*this)[size_++];
+    }
+
+private:
+    static constexpr int CHUNK_SHIFT = 8;
+    static constexpr size_t CHUNK_SIZE = size_t{1} << CHUNK_SHIFT;
+    static constexpr int PAGE_SHIFT = 10;
+    static constexpr size_t PAGE_SIZE = size_t{1} << PAGE_SHIFT;
+    // as many elements as a sheet has cells
+    static constexpr size_t PAGE_COUNT = (size_t{1} << 28) / CHUNK_SIZE / PAGE_SIZE;
+
+    using Page = std::array<std::unique_ptr<T[]>, PAGE_SIZE>;
+
+    std::array<std::unique_ptr<Page>, PAGE_COUNT> pages_;
+    size_t size_ = 0;
+};
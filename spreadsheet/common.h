@@ -1,5 +1,6 @@
 #pragma once
 
+#include <functional>
 #include <iosfwd>
 #include <memory>
 #include <stdexcept>
@@ -26,6 +27,19 @@ struct Position {
     static const Position NONE;
 };
 
+// Прямоугольный диапазон ячеек, например A1:C100. Обе границы включаются
+// в диапазон, top_left не ниже и не правее bottom_right.
+struct Range {
+    Position top_left;
+    Position bottom_right;
+
+    bool operator==(const Range& rhs) const;
+    bool operator<(const Range& rhs) const;
+
+    bool Contains(Position pos) const;
+    std::string ToString() const;
+};
+
 struct Size {
     int rows = 0;
     int cols = 0;
@@ -81,6 +95,10 @@ public:
     // Либо текст ячейки, либо значение формулы, либо сообщение об ошибке из
     // формулы
     using Value = std::variant<std::string, double, FormulaError>;
+    // То же значение, но текст не копируется
+    using ValueView = std::variant<std::string_view, double, FormulaError>;
+    // Значение ячейки, каким его видят формулы
+    using NumericValue = std::variant<double, FormulaError>;
 
     virtual ~CellInterface() = default;
 
@@ -88,11 +106,19 @@ public:
     // В случае текстовой ячейки это её текст (без экранирующих символов). В
     // случае формулы - числовое значение формулы или сообщение об ошибке.
     virtual Value GetValue() const = 0;
+    // Возвращает то же значение без копирования текста. Представление
+    // действительно, пока ячейка не изменена.
+    virtual ValueView GetValueView() const = 0;
     // Возвращает внутренний текст ячейки, как если бы мы начали её
     // редактирование. В случае текстовой ячейки это её текст (возможно,
     // содержащий экранирующие символы). В случае формулы - её выражение.
     virtual std::string GetText() const = 0;
 
+    // Возвращает значение ячейки так, как его читают формулы. Пустая ячейка -
+    // это ноль, текст - число, если он его представляет. Текст, который не
+    // является числом, и ошибка формулы дают ошибку #VALUE!.
+    virtual NumericValue GetNumericValue() const = 0;
+
     // Возвращает список ячеек, которые непосредственно задействованы в данной
     // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек. В случае текстовой ячейки список пуст.
@@ -132,11 +158,21 @@ public:
     // объект с пустым текстом.
     virtual void ClearCell(Position pos) = 0;
 
+    // Вызывает func для каждой непустой ячейки диапазона, строка за строкой
+    // слева направо. Пустые ячейки пропускаются.
+    virtual void ForEachCellInRange(
+        const Range& range,
+        const std::function<void(const CellInterface&)>& func) const = 0;
+
     // Вычисляет размер области, которая участвует в печати.
     // Определяется как ограничивающий прямоугольник всех ячеек с непустым
     // текстом.
     virtual Size GetPrintableSize() const = 0;
 
+    // Возвращает значение ячейки так, как его читают формулы (см.
+    // CellInterface::GetNumericValue). Отсутствующая ячейка - это ноль.
+    virtual CellInterface::NumericValue GetNumericValue(Position pos) const = 0;
+
     // Выводит всю таблицу в переданный поток. Столбцы разделяются знаком
     // табуляции. После каждой строки выводится символ перевода строки. Для
     // преобразования ячеек в строку используются методы GetValue() или GetText()
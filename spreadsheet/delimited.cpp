@@ -0,0 +1,340 @@
+#include "delimited.h"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstring>
+#include <limits>
+
+using namespace std::literals;
+
+namespace {
+
+constexpr char QUOTE = '"';
+
+char GetDelimiter(DelimitedFormat format){
+    return format == DelimitedFormat::Csv ? ',' : '\t';
+}
+
+}  // namespace
+
+DelimitedReader::DelimitedReader(std::istream& input, DelimitedFormat format, size_t chunk_size)
+    : input_(input)
+    , delimiter_(GetDelimiter(format))
+    , buffer_(new char[std::max<size_t>(chunk_size, 1)])
+    , capacity_(std::max<size_t>(chunk_size, 1))
+{}
+
+bool DelimitedReader::ReadRecord(std::vector<std::string_view>& fields){
+    fields.clear();
+    if(begin_ == end_){
+        if(eof_){
+            return false;
+        }
+        Refill();
+        if(begin_ == end_){
+            return false;
+        }
+    }
+    // an incomplete record is split again once more data is read, nothing
+    // is changed in the buffer before the whole record is there
+    size_t record_end;
+    while(!SplitRecord(record_end)){
+        Refill();
+    }
+    for(const Field& field : fields_){
+        if(field.quoted){
+            fields.push_back(Unquote(field));
+        }
+        else{
+            fields.emplace_back(buffer_.get() + field.begin, field.end - field.begin);
+        }
+    }
+    begin_ = record_end;
+    return true;
+}
+
+bool DelimitedReader::SplitRecord(size_t& record_end){
+    const char* data = buffer_.get();
+    fields_.clear();
+    size_t i = begin_;
+    // the next line break of unquoted data, quoted fields may hold others
+    size_t line_end = 0;
+    bool line_end_known = false;
+    while(true){
+        if(i < end_ && data[i] == QUOTE){
+            // the closing quote is the one not followed by another
+            size_t close = i + 1;
+            while(true){
+                const void* found = std::memchr(data + close, QUOTE, end_ - close);
+                if(!found){
+                    if(!eof_){
+                        return false;
+                    }
+                    // unterminated at the end of the stream, the rest is the field
+                    close = end_;
+                    break;
+                }
+                close = static_cast<const char*>(found) - data;
+                if(close + 1 == end_ && !eof_){
+                    return false;
+                }
+                if(close + 1 < end_ && data[close + 1] == QUOTE){
+                    close += 2;
+                    continue;
+                }
+                break;
+            }
+            fields_.push_back({i + 1, close, true});
+            i = std::min(close + 1, end_);
+            // anything between the closing quote and the separator is dropped
+            while(i < end_ && data[i] != delimiter_ && data[i] != '\n'){
+                ++i;
+            }
+        }
+        else{
+            // a line is searched once, the fields then only look for the delimiter
+            if(!line_end_known || line_end < i){
+                line_end_known = true;
+                const void* newline = std::memchr(data + i, '\n', end_ - i);
+                line_end = newline ? static_cast<const char*>(newline) - data : end_;
+            }
+            const size_t begin = i;
+            while(i < line_end && data[i] != delimiter_){
+                ++i;
+            }
+            fields_.push_back({begin, i, false});
+        }
+
+        if(i == end_){
+            if(!eof_){
+                return false;
+            }
+            record_end = end_;
+            return true;
+        }
+        if(data[i] == delimiter_){
+            ++i;
+            continue;
+        }
+        Field& last = fields_.back();
+        if(!last.quoted && last.end > last.begin && data[last.end - 1] == '\r'){
+            --last.end;
+        }
+        record_end = i + 1;
+        return true;
+    }
+}
+
+void DelimitedReader::Refill(){
+    if(begin_ > 0){
+        std::memmove(buffer_.get(), buffer_.get() + begin_, end_ - begin_);
+        end_ -= begin_;
+        begin_ = 0;
+    }
+    else if(end_ == capacity_){
+        // a record longer than the chunk
+        std::unique_ptr<char[]> buffer(new char[capacity_ * 2]);
+        std::memcpy(buffer.get(), buffer_.get(), end_);
+        buffer_ = std::move(buffer);
+        capacity_ *= 2;
+    }
+    input_.read(buffer_.get() + end_, static_cast<std::streamsize>(capacity_ - end_));
+    end_ += static_cast<size_t>(input_.gcount());
+    if(!input_){
+        eof_ = true;
+    }
+}
+
+std::string_view DelimitedReader::Unquote(const Field& field){
+    // doubled quotes become single ones, the field only gets shorter
+    char* data = buffer_.get();
+    size_t out = field.begin;
+    for(size_t i = field.begin; i < field.end; ++i){
+        data[out++] = data[i];
+        if(data[i] == QUOTE){
+            ++i;
+        }
+    }
+    return {data + field.begin, out - field.begin};
+}
+
+ImportResult ImportDelimited(Sheet& sheet, std::istream& input, DelimitedFormat format){
+    // bounds the memory taken by the texts waiting to be set
+    constexpr size_t BATCH_CELLS = 1 << 16;
+
+    ImportResult result;
+    auto fail = [&result](Position pos, Sheet::EditResult error){
+        ++result.failed;
+        if(result.errors.size() < ImportResult::MAX_REPORTED_ERRORS){
+            result.errors.push_back({pos, error});
+        }
+    };
+    std::vector<Sheet::CellEdit> edits;
+    std::vector<Position> positions;
+    auto flush = [&]{
+        if(edits.empty()){
+            return;
+        }
+        const auto results = sheet.ApplyBatch(std::move(edits), Sheet::BatchMode::ValidSubset);
+        for(size_t i = 0; i < results.size(); ++i){
+            if(results[i] == Sheet::EditResult::Applied){
+                ++result.cells;
+            }
+            else{
+                fail(positions[i], results[i]);
+            }
+        }
+        edits.clear();
+        positions.clear();
+    };
+
+    DelimitedReader reader(input, format);
+    std::vector<std::string_view> fields;
+    while(reader.ReadRecord(fields)){
+        const int row = static_cast<int>(std::min<size_t>(result.rows, Position::MAX_ROWS));
+        for(size_t col = 0; col < fields.size(); ++col){
+            if(fields[col].empty()){
+                continue;
+            }
+            const Position pos{row, static_cast<int>(std::min<size_t>(col, Position::MAX_COLS))};
+            if(!pos.IsValid()){
+                fail(pos, Sheet::EditResult::InvalidPosition);
+                continue;
+            }
+            edits.push_back({pos, std::string(fields[col])});
+            positions.push_back(pos);
+        }
+        ++result.rows;
+        if(edits.size() >= BATCH_CELLS){
+            flush();
+        }
+    }
+    flush();
+    return result;
+}
+
+namespace {
+
+// Collects the output in a large buffer and writes it out in one call
+class BufferedOutput {
+public:
+    static constexpr size_t CAPACITY = 1 << 20;
+    // longer than any double printed by to_chars
+    static constexpr size_t MAX_NUMBER_LENGTH = 32;
+
+    explicit BufferedOutput(std::ostream& output)
+        : output_(output)
+        , buffer_(new char[CAPACITY])
+    {}
+
+    void Append(char c){
+        if(size_ == CAPACITY){
+            Flush();
+        }
+        buffer_[size_++] = c;
+    }
+
+    void Append(std::string_view text){
+        if(text.size() > CAPACITY - size_){
+            Flush();
+            if(text.size() > CAPACITY){
+                output_.write(text.data(), static_cast<std::streamsize>(text.size()));
+                return;
+            }
+        }
+        std::memcpy(buffer_.get() + size_, text.data(), text.size());
+        size_ += text.size();
+    }
+
+    void Append(double value){
+        if(CAPACITY - size_ < MAX_NUMBER_LENGTH){
+            Flush();
+        }
+        auto [end, error] = std::to_chars(buffer_.get() + size_, buffer_.get() + CAPACITY, value);
+        size_ = end - buffer_.get();
+    }
+
+    void Flush(){
+        output_.write(buffer_.get(), static_cast<std::streamsize>(size_));
+        size_ = 0;
+    }
+
+private:
+    std::ostream& output_;
+    std::unique_ptr<char[]> buffer_;
+    size_t size_ = 0;
+};
+
+// the characters that make a field quoted
+using SpecialChars = std::array<bool, 256>;
+
+void AppendField(BufferedOutput& output, std::string_view field, const SpecialChars& special){
+    const bool plain = std::none_of(field.begin(), field.end(), [&special](char c){
+        return special[static_cast<unsigned char>(c)];
+    });
+    if(plain){
+        output.Append(field);
+        return;
+    }
+    output.Append(QUOTE);
+    for(size_t quote = field.find(QUOTE); quote != std::string_view::npos; quote = field.find(QUOTE)){
+        output.Append(field.substr(0, quote + 1));
+        output.Append(QUOTE);
+        field.remove_prefix(quote + 1);
+    }
+    output.Append(field);
+    output.Append(QUOTE);
+}
+
+}  // namespace
+
+void ExportDelimited(const Sheet& sheet, std::ostream& output,
+                     DelimitedFormat format, ExportContent content){
+    const char delimiter = GetDelimiter(format);
+    SpecialChars special{};
+    for(char c : {delimiter, QUOTE, '\n', '\r'}){
+        special[static_cast<unsigned char>(c)] = true;
+    }
+
+    BufferedOutput buffer(output);
+    const Size size = sheet.GetPrintableSize();
+    // the position the output has reached, gaps are filled with separators
+    int row = 0;
+    int col = 0;
+    auto move_to = [&](int next_row, int next_col){
+        for(; row < next_row; ++row){
+            for(; col < size.cols - 1; ++col){
+                buffer.Append(delimiter);
+            }
+            buffer.Append('\n');
+            col = 0;
+        }
+        for(; col < next_col; ++col){
+            buffer.Append(delimiter);
+        }
+    };
+    sheet.ForEachPrintableCell([&](Position pos, const Cell& cell){
+        move_to(pos.row, pos.col);
+        if(content == ExportContent::Texts){
+            AppendField(buffer, cell.GetTextView(), special);
+            return;
+        }
+        const CellInterface::ValueView value = cell.GetValueView();
+        if(std::holds_alternative<double>(value)){
+            // empty cells have zero values but are printed as nothing
+            const double number = std::get<double>(value);
+            if(number != 0.0 || !cell.IsEmpty()){
+                buffer.Append(number);
+            }
+        }
+        else if(std::holds_alternative<std::string_view>(value)){
+            AppendField(buffer, std::get<std::string_view>(value), special);
+        }
+        else{
+            buffer.Append(std::get<FormulaError>(value).ToString());
+        }
+    });
+    move_to(size.rows, 0);
+    buffer.Flush();
+}
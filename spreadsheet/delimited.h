@@ -0,0 +1,86 @@
+#pragma once
+
+#include "common.h"
+#include "sheet.h"
+
+#include <cstddef>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <string_view>
+#include <vector>
+
+// Comma or tab separated values. Both follow RFC 4180: a field starting
+// with a quote runs to the closing quote and may hold separators, line
+// breaks and doubled quotes. Lines end with "\n" or "\r\n".
+enum class DelimitedFormat : uint8_t {
+    Tsv,
+    Csv,
+};
+
+// Splits the records of a stream read in chunks of a fixed size. The
+// fields point into the chunk, quoted ones are unescaped in place, so
+// nothing is copied. Only a record longer than the chunk makes it grow.
+class DelimitedReader {
+public:
+    static constexpr size_t DEFAULT_CHUNK_SIZE = 1 << 20;
+
+    DelimitedReader(std::istream& input, DelimitedFormat format,
+                    size_t chunk_size = DEFAULT_CHUNK_SIZE);
+
+    // Fields of the next record, valid until the next call. False at the end
+    // of the stream.
+    bool ReadRecord(std::vector<std::string_view>& fields);
+
+private:
+    struct Field {
+        size_t begin;
+        size_t end;
+        bool quoted;
+    };
+
+    // Finds the fields of the record starting at begin_, false if it does
+    // not end within the data read so far
+    bool SplitRecord(size_t& record_end);
+    void Refill();
+    std::string_view Unquote(const Field& field);
+
+    std::istream& input_;
+    char delimiter_;
+    std::unique_ptr<char[]> buffer_;
+    size_t capacity_;
+    size_t begin_ = 0;
+    size_t end_ = 0;
+    bool eof_ = false;
+    std::vector<Field> fields_;
+};
+
+struct ImportResult {
+    // an edit the sheet rejected, see Sheet::ApplyBatch
+    struct Error {
+        Position pos;
+        Sheet::EditResult result;
+    };
+    static constexpr size_t MAX_REPORTED_ERRORS = 1000;
+
+    size_t rows = 0;
+    size_t cells = 0;
+    size_t failed = 0;
+    // the first MAX_REPORTED_ERRORS of the failed cells
+    std::vector<Error> errors;
+};
+
+// Sets the non-empty fields as the texts of the cells from A1 on, a record
+// per row. Cells are applied in bounded batches, the ones that fail are
+// reported and skipped.
+ImportResult ImportDelimited(Sheet& sheet, std::istream& input, DelimitedFormat format);
+
+enum class ExportContent : uint8_t {
+    Values,
+    Texts,
+};
+
+// Writes the printable area like PrintValues or PrintTexts, but numbers are
+// printed in full precision and fields are quoted where the format needs it.
+void ExportDelimited(const Sheet& sheet, std::ostream& output,
+                     DelimitedFormat format, ExportContent content = ExportContent::Values);
@@ -0,0 +1,190 @@
+#include "dependency_graph.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace {
+constexpr int COL_BITS = 14;
+static_assert(Position::MAX_COLS <= (1 << COL_BITS) && Position::MAX_ROWS <= (1 << 17),
+              "A position must pack into 31 bits");
+}  // namespace
+
+void DependencyGraph::AddEdge(Position cell, Position dependent){
+    if(Insert(FindOrInsert(Pack(cell)), Pack(dependent))){
+        ++edges_;
+    }
+}
+
+void DependencyGraph::RemoveEdge(Position cell, Position dependent){
+    Slot* slot = Find(Pack(cell));
+    if(!slot){
+        return;
+    }
+    const uint32_t key = Pack(dependent);
+    uint32_t* it = LowerBound(*slot, key);
+    if(it == slot->dependents.end() || *it != key){
+        return;
+    }
+    *it |= REMOVED;
+    ++slot->removed;
+    --edges_;
+    if(slot->removed == slot->dependents.size()){
+        Erase(*slot);
+    }
+    else if(slot->removed * 2 > slot->dependents.size()){
+        SmallVector<uint32_t, 4>& dependents = slot->dependents;
+        dependents.erase(std::remove_if(dependents.begin(), dependents.end(),
+                                        [](uint32_t value){ return value & REMOVED; }),
+                         dependents.end());
+        dependents.shrink_to_fit();
+        slot->removed = 0;
+    }
+}
+
+bool DependencyGraph::HasDependents(Position cell) const{
+    // the entries without live dependents are erased
+    return Find(Pack(cell)) != nullptr;
+}
+
+size_t DependencyGraph::GetCellCount() const{
+    return size_;
+}
+
+size_t DependencyGraph::GetEdgeCount() const{
+    return edges_;
+}
+
+size_t DependencyGraph::GetMemoryUsage() const{
+    size_t bytes = slots_.capacity() * sizeof(Slot);
+    for(const Slot& slot : slots_){
+        if(slot.dependents.capacity() > 4){
+            bytes += slot.dependents.capacity() * sizeof(uint32_t);
+        }
+    }
+    return bytes;
+}
+
+uint32_t DependencyGraph::Pack(Position pos){
+    return static_cast<uint32_t>(pos.row) << COL_BITS | static_cast<uint32_t>(pos.col);
+}
+
+Position DependencyGraph::Unpack(uint32_t key){
+    return Position{static_cast<int>(key >> COL_BITS), static_cast<int>(key & ((1u << COL_BITS) - 1))};
+}
+
+uint32_t* DependencyGraph::LowerBound(Slot& slot, uint32_t key){
+    return std::lower_bound(slot.dependents.begin(), slot.dependents.end(), key,
+                            [](uint32_t lhs, uint32_t rhs){ return (lhs & ~REMOVED) < rhs; });
+}
+
+// Adds the key to the sorted list, false if it is there already
+bool DependencyGraph::Insert(Slot& slot, uint32_t key){
+    SmallVector<uint32_t, 4>& dependents = slot.dependents;
+    // formulas are mostly filled down, the new dependent goes last
+    if(dependents.empty() || (dependents.back() & ~REMOVED) < key){
+        dependents.push_back(key);
+        return true;
+    }
+    uint32_t* it = LowerBound(slot, key);
+    if(it != dependents.end() && (*it & ~REMOVED) == key){
+        if(!(*it & REMOVED)){
+            return false;
+        }
+        *it = key;
+        --slot.removed;
+        return true;
+    }
+    // a removed neighbour takes the key without moving the rest of the list
+    if(it != dependents.end() && (*it & REMOVED)){
+        *it = key;
+        --slot.removed;
+    }
+    else if(it != dependents.begin() && (it[-1] & REMOVED)){
+        it[-1] = key;
+        --slot.removed;
+    }
+    else{
+        dependents.insert(it, key);
+    }
+    return true;
+}
+
+size_t DependencyGraph::HomeOf(uint32_t key) const{
+    // Fibonacci hashing spreads the rows and columns packed in the key
+    return static_cast<size_t>((key * 2654435769u) >> shift_);
+}
+
+const DependencyGraph::Slot* DependencyGraph::Find(uint32_t key) const{
+    return const_cast<DependencyGraph*>(this)->Find(key);
+}
+
+DependencyGraph::Slot* DependencyGraph::Find(uint32_t key){
+    if(size_ == 0){
+        return nullptr;
+    }
+    const size_t mask = slots_.size() - 1;
+    for(size_t index = HomeOf(key); slots_[index].key != EMPTY; index = (index + 1) & mask){
+        if(slots_[index].key == key){
+            return &slots_[index];
+        }
+    }
+    return nullptr;
+}
+
+DependencyGraph::Slot& DependencyGraph::FindOrInsert(uint32_t key){
+    // at most three quarters of the slots are used
+    if((size_ + 1) * 4 > slots_.size() * 3){
+        Rehash(std::max(MIN_CAPACITY, slots_.size() * 2));
+    }
+    const size_t mask = slots_.size() - 1;
+    size_t index = HomeOf(key);
+    for(; slots_[index].key != EMPTY; index = (index + 1) & mask){
+        if(slots_[index].key == key){
+            return slots_[index];
+        }
+    }
+    slots_[index].key = key;
+    ++size_;
+    return slots_[index];
+}
+
+void DependencyGraph::Erase(Slot& slot){
+    // Backward-shift deletion: the following entries of the probe run move
+    // into the hole unless that would put them before their home slot
+    const size_t mask = slots_.size() - 1;
+    size_t hole = &slot - slots_.data();
+    for(size_t next = (hole + 1) & mask; slots_[next].key != EMPTY; next = (next + 1) & mask){
+        const size_t home = HomeOf(slots_[next].key);
+        if(((next - home) & mask) >= ((next - hole) & mask)){
+            slots_[hole] = std::move(slots_[next]);
+            hole = next;
+        }
+    }
+    slots_[hole] = Slot();
+    --size_;
+    // give the memory back after a mass deletion, staying well below the
+    // load that makes the table grow
+    if(slots_.size() > MIN_CAPACITY && size_ * 8 < slots_.size()){
+        Rehash(slots_.size() / 2);
+    }
+}
+
+void DependencyGraph::Rehash(size_t capacity){
+    std::vector<Slot> old_slots(capacity);
+    std::swap(slots_, old_slots);
+    shift_ = 32;
+    for(size_t size = capacity; size > 1; size /= 2){
+        --shift_;
+    }
+    const size_t mask = capacity - 1;
+    for(Slot& slot : old_slots){
+        if(slot.key == EMPTY){
+            continue;
+        }
+        size_t index = HomeOf(slot.key);
+        while(slots_[index].key != EMPTY){
+            index = (index + 1) & mask;
+        }
+        slots_[index] = std::move(slot);
+    }
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "common.h"
+#include "small_vector.h"
+
+#include <cstdint>
+#include <vector>
+
+// The cells reading each cell, the reverse edges of the formula references
+// (the forward ones are the reference lists of the formulas themselves).
+// An open-addressing hash table with linear probing maps a cell packed into
+// 32 bits to the sorted list of its dependents, up to four of them inline.
+// An entry goes away with its last edge and deletions shift the following
+// entries back instead of leaving tombstones, so the table stays as large as
+// the live edges however often the formulas are rewritten.
+class DependencyGraph {
+public:
+    void AddEdge(Position cell, Position dependent);
+    void RemoveEdge(Position cell, Position dependent);
+
+    bool HasDependents(Position cell) const;
+
+    // Calls func(dependent) for the dependents of the cell in row order
+    template <typename Func>
+    void ForEachDependent(Position cell, Func&& func) const{
+        const Slot* slot = Find(Pack(cell));
+        if(!slot){
+            return;
+        }
+        for(uint32_t key : slot->dependents){
+            if(!(key & REMOVED)){
+                func(Unpack(key));
+            }
+        }
+    }
+
+    // number of cells with dependents
+    size_t GetCellCount() const;
+    size_t GetEdgeCount() const;
+    // bytes taken by the table and by the lists which outgrew their slots
+    size_t GetMemoryUsage() const;
+
+private:
+    static constexpr uint32_t EMPTY = UINT32_MAX;
+    // Marks a dependent removed from a list, it is kept in place so that the
+    // removal from a long list costs a binary search. The list is compacted
+    // once half of it is removed.
+    static constexpr uint32_t REMOVED = uint32_t{1} << 31;
+    static constexpr size_t MIN_CAPACITY = 16;
+
+    struct Slot{
+        uint32_t key = EMPTY;
+        uint32_t removed = 0;
+        SmallVector<uint32_t, 4> dependents;
+    };
+
+    static uint32_t Pack(Position pos);
+    static Position Unpack(uint32_t key);
+    static uint32_t* LowerBound(Slot& slot, uint32_t key);
+    static bool Insert(Slot& slot, uint32_t key);
+
+    size_t HomeOf(uint32_t key) const;
+    const Slot* Find(uint32_t key) const;
+    Slot* Find(uint32_t key);
+    Slot& FindOrInsert(uint32_t key);
+    void Erase(Slot& slot);
+    void Rehash(size_t capacity);
+
+    std::vector<Slot> slots_;
+    // the home of a key is the top bits of its hash
+    int shift_ = 32;
+    size_t size_ = 0;
+    size_t edges_ = 0;
+};
@@ -0,0 +1,246 @@
+#include "durable_sheet.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <optional>
+#include <sstream>
+#include <vector>
+
+using namespace std::literals;
+
+namespace {
+
+const std::string CHECKPOINT_PREFIX = "checkpoint."s;
+
+// the sequence of a checkpoint file, none for the other files
+std::optional<uint64_t> ParseCheckpointName(const std::string& name){
+    if(name.size() <= CHECKPOINT_PREFIX.size() || name.compare(0, CHECKPOINT_PREFIX.size(), CHECKPOINT_PREFIX) != 0){
+        return std::nullopt;
+    }
+    uint64_t sequence = 0;
+    for(size_t i = CHECKPOINT_PREFIX.size(); i < name.size(); ++i){
+        if(name[i] < '0' || name[i] > '9'){
+            return std::nullopt;
+        }
+        sequence = sequence * 10 + static_cast<uint64_t>(name[i] - '0');
+    }
+    return sequence;
+}
+
+JournalRecordKind ToJournal(StructuralEdit::Kind kind){
+    switch(kind){
+    case StructuralEdit::Kind::InsertRows:
+        return JournalRecordKind::InsertRows;
+    case StructuralEdit::Kind::DeleteRows:
+        return JournalRecordKind::DeleteRows;
+    case StructuralEdit::Kind::InsertColumns:
+        return JournalRecordKind::InsertColumns;
+    default:
+        return JournalRecordKind::DeleteColumns;
+    }
+}
+
+StructuralEdit::Kind FromJournal(JournalRecordKind kind){
+    switch(kind){
+    case JournalRecordKind::InsertRows:
+        return StructuralEdit::Kind::InsertRows;
+    case JournalRecordKind::DeleteRows:
+        return StructuralEdit::Kind::DeleteRows;
+    case JournalRecordKind::InsertColumns:
+        return StructuralEdit::Kind::InsertColumns;
+    default:
+        return StructuralEdit::Kind::DeleteColumns;
+    }
+}
+
+}  // namespace
+
+DurableSheet::DurableSheet(std::string directory, DurableSheetOptions options)
+    : directory_(std::move(directory))
+    , options_(options)
+{
+    std::error_code code;
+    std::filesystem::create_directories(directory_, code);
+    if(code){
+        throw JournalException("Cannot create "s + directory_ + ": " + code.message());
+    }
+
+    // a crash may leave the checkpoint before the latest one behind
+    std::vector<uint64_t> checkpoints;
+    for(const auto& entry : std::filesystem::directory_iterator(directory_)){
+        if(const auto sequence = ParseCheckpointName(entry.path().filename().string())){
+            checkpoints.push_back(*sequence);
+        }
+    }
+    if(checkpoints.empty()){
+        sheet_ = std::make_unique<Sheet>();
+    }
+    else{
+        checkpoint_sequence_ = *std::max_element(checkpoints.begin(), checkpoints.end());
+        sheet_ = Sheet::LoadSnapshotFile(GetCheckpointPath(checkpoint_sequence_));
+    }
+
+    journal_ = std::make_unique<Journal>(
+        (std::filesystem::path(directory_) / "journal").string(), checkpoint_sequence_,
+        [this](const JournalEntry& entry){
+            if(entry.kind == JournalRecordKind::Set){
+                sheet_->SetCell(entry.pos, std::string(entry.text));
+            }
+            else if(entry.kind == JournalRecordKind::Clear){
+                sheet_->ClearCell(entry.pos);
+            }
+            else{
+                sheet_->EditStructure({FromJournal(entry.kind), entry.pos.row, entry.pos.col});
+            }
+        });
+    for(uint64_t sequence : checkpoints){
+        if(sequence != checkpoint_sequence_){
+            std::filesystem::remove(GetCheckpointPath(sequence), code);
+        }
+    }
+    checkpoint_at_ = options_.checkpoint_bytes;
+}
+
+DurableSheet::~DurableSheet(){
+    if(checkpointer_.joinable()){
+        checkpointer_.join();
+    }
+}
+
+void DurableSheet::SetCell(Position pos, std::string text){
+    WaitDurable(SetCellAsync(pos, std::move(text)));
+}
+
+void DurableSheet::ClearCell(Position pos){
+    WaitDurable(ClearCellAsync(pos));
+}
+
+void DurableSheet::EditStructure(const StructuralEdit& edit){
+    WaitDurable(EditStructureAsync(edit));
+}
+
+uint64_t DurableSheet::SetCellAsync(Position pos, std::string text){
+    std::lock_guard lock(mutex_);
+    // a failed journal would lose the edit, the sheet must not show it; a
+    // failure after the check is reported by WaitDurable, Append can't throw
+    journal_->CheckHealthy();
+    sheet_->SetCell(pos, text);
+    const uint64_t sequence = journal_->Append(JournalRecordKind::Set, pos, text);
+    CheckpointIfNeeded();
+    return sequence;
+}
+
+uint64_t DurableSheet::ClearCellAsync(Position pos){
+    std::lock_guard lock(mutex_);
+    journal_->CheckHealthy();
+    sheet_->ClearCell(pos);
+    const uint64_t sequence = journal_->Append(JournalRecordKind::Clear, pos);
+    CheckpointIfNeeded();
+    return sequence;
+}
+
+uint64_t DurableSheet::EditStructureAsync(const StructuralEdit& edit){
+    std::lock_guard lock(mutex_);
+    journal_->CheckHealthy();
+    sheet_->EditStructure(edit);
+    const uint64_t sequence = journal_->Append(ToJournal(edit.kind), Position{edit.first, edit.count});
+    CheckpointIfNeeded();
+    return sequence;
+}
+
+void DurableSheet::WaitDurable(uint64_t sequence){
+    journal_->WaitDurable(sequence);
+}
+
+void DurableSheet::Sync(){
+    journal_->Sync();
+}
+
+void DurableSheet::Checkpoint(){
+    std::unique_lock lock(mutex_);
+    checkpoint_done_.wait(lock, [this]{
+        return !checkpointing_;
+    });
+    const PendingCheckpoint checkpoint = StartCheckpoint();
+    lock.unlock();
+    try{
+        WriteCheckpoint(checkpoint);
+    }
+    catch(...){
+        FinishCheckpoint();
+        throw;
+    }
+    FinishCheckpoint();
+}
+
+std::shared_ptr<const SheetView> DurableSheet::Snapshot() const{
+    std::lock_guard lock(mutex_);
+    return sheet_->Snapshot();
+}
+
+uint64_t DurableSheet::GetLastSequence() const{
+    return journal_->GetLastSequence();
+}
+
+uint64_t DurableSheet::GetJournalSize() const{
+    return journal_->GetSize();
+}
+
+void DurableSheet::CheckpointIfNeeded(){
+    if(checkpointing_ || journal_->GetSize() < checkpoint_at_){
+        return;
+    }
+    // the thread of the last checkpoint is done with it
+    if(checkpointer_.joinable()){
+        checkpointer_.join();
+    }
+    checkpointer_ = std::thread([this, checkpoint = StartCheckpoint()]{
+        try{
+            WriteCheckpoint(checkpoint);
+        }
+        catch(const std::exception&){
+            // the journal keeps the edits, a later checkpoint takes them
+            std::lock_guard lock(mutex_);
+            checkpoint_at_ = journal_->GetSize() + options_.checkpoint_bytes;
+        }
+        FinishCheckpoint();
+    });
+}
+
+DurableSheet::PendingCheckpoint DurableSheet::StartCheckpoint(){
+    checkpointing_ = true;
+    return {sheet_->Snapshot(), journal_->GetLastSequence(), journal_->GetSize()};
+}
+
+void DurableSheet::WriteCheckpoint(const PendingCheckpoint& checkpoint){
+    // The journal is started over only once the checkpoint is in place: a
+    // crash in between leaves a journal whose records the checkpoint holds
+    // already, they are skipped when it is opened
+    std::ostringstream output;
+    checkpoint.view->SaveSnapshot(output);
+    WriteFileDurably(GetCheckpointPath(checkpoint.sequence), output.str());
+    uint64_t previous;
+    {
+        std::lock_guard lock(mutex_);
+        previous = checkpoint_sequence_;
+        checkpoint_sequence_ = checkpoint.sequence;
+        checkpoint_at_ = options_.checkpoint_bytes;
+    }
+    if(previous != checkpoint.sequence){
+        std::error_code code;
+        std::filesystem::remove(GetCheckpointPath(previous), code);
+    }
+    journal_->Restart(checkpoint.sequence, checkpoint.journal_size);
+}
+
+void DurableSheet::FinishCheckpoint(){
+    {
+        std::lock_guard lock(mutex_);
+        checkpointing_ = false;
+    }
+    checkpoint_done_.notify_all();
+}
+
+std::string DurableSheet::GetCheckpointPath(uint64_t sequence) const{
+    return (std::filesystem::path(directory_) / (CHECKPOINT_PREFIX + std::to_string(sequence))).string();
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "common.h"
+#include "journal.h"
+#include "sheet.h"
+#include "sheet_view.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+struct DurableSheetOptions {
+    // the journal is folded into a new checkpoint once it grows past this
+    uint64_t checkpoint_bytes = uint64_t{64} << 20;
+};
+
+// A sheet whose edits survive a crash of the process. It is kept in a
+// directory as the latest checkpoint, a snapshot of the sheet (snapshot.h),
+// and the journal of the edits made after it (journal.h):
+//
+//   checkpoint.<sequence>   the sheet after the edit with that sequence
+//   journal                 the edits that followed
+//
+// An edit is applied to the sheet first and only logged if it succeeded, so
+// a rejected edit throws the way Sheet's does and leaves no trace. SetCell
+// and ClearCell return once their record is on disk; edits of concurrent
+// threads are synced together. Opening the directory loads the checkpoint
+// and replays the journal, which brings back every edit that returned and
+// possibly a few that were under way. Once a write of the journal failed,
+// the edits throw JournalException without applying anything. An edit that
+// was under way when it failed is applied, but waiting for it throws: like
+// one a crash interrupted, it is not brought back.
+//
+// Any thread may edit the sheet and take views of it, edits wait for each
+// other. Once the journal grows past checkpoint_bytes, the edit that found it
+// so takes a view of the sheet (sheet_view.h) and a background thread writes
+// it to a checkpoint while the edits go on. Only starting the journal over
+// holds up the edits: the records appended while the checkpoint was written
+// are copied to the fresh journal meanwhile. A checkpoint that failed in the
+// background is tried again once the journal grew by checkpoint_bytes more,
+// the journal keeps the edits until then.
+class DurableSheet {
+public:
+    // Opens the sheet stored in the directory, creating both if needed.
+    // Throws JournalException or SnapshotException if the files are damaged.
+    explicit DurableSheet(std::string directory, DurableSheetOptions options = {});
+    // waits for a checkpoint under way
+    ~DurableSheet();
+
+    DurableSheet(const DurableSheet&) = delete;
+    DurableSheet& operator=(const DurableSheet&) = delete;
+
+    void SetCell(Position pos, std::string text);
+    void ClearCell(Position pos);
+    // see Sheet::InsertRows and the others
+    void EditStructure(const StructuralEdit& edit);
+
+    // The same edits without waiting for the disk: the sequence they return
+    // is durable once WaitDurable for it returns
+    uint64_t SetCellAsync(Position pos, std::string text);
+    uint64_t ClearCellAsync(Position pos);
+    uint64_t EditStructureAsync(const StructuralEdit& edit);
+    void WaitDurable(uint64_t sequence);
+    // waits for every edit made so far
+    void Sync();
+
+    // Writes the sheet to a new checkpoint and starts the journal over,
+    // after the checkpoint under way if there is one
+    void Checkpoint();
+
+    // A read-only view of the sheet as it is now, see Sheet::Snapshot
+    std::shared_ptr<const SheetView> Snapshot() const;
+    // the sequence of the last edit, the edits are numbered from 1 on
+    uint64_t GetLastSequence() const;
+    uint64_t GetJournalSize() const;
+
+private:
+    // the sheet as of an edit and where its record ends in the journal
+    struct PendingCheckpoint {
+        std::shared_ptr<const SheetView> view;
+        uint64_t sequence;
+        uint64_t journal_size;
+    };
+
+    void CheckpointIfNeeded();
+    // under mutex_, with no checkpoint under way
+    PendingCheckpoint StartCheckpoint();
+    // outside mutex_
+    void WriteCheckpoint(const PendingCheckpoint& checkpoint);
+    void FinishCheckpoint();
+    std::string GetCheckpointPath(uint64_t sequence) const;
+
+    std::string directory_;
+    DurableSheetOptions options_;
+    // serializes the edits, their order in the journal is the order they
+    // were applied in
+    mutable std::mutex mutex_;
+    std::unique_ptr<Sheet> sheet_;
+    uint64_t checkpoint_sequence_ = 0;
+    std::unique_ptr<Journal> journal_;
+    // the journal size the next checkpoint is written at
+    uint64_t checkpoint_at_ = 0;
+    bool checkpointing_ = false;
+    std::condition_variable checkpoint_done_;
+    std::thread checkpointer_;
+};
@@ -2,6 +2,8 @@
 
 #include "FormulaAST.h"
 #include "sheet.h"
+#include "snapshot.h"
+#include "stats.h"
 
 #include <algorithm>
 #include <cassert>
@@ -9,7 +11,6 @@
 #include <sstream>
 #include <functional>
 #include <optional>
-#include <regex>
 
 using namespace std::literals;
 
@@ -41,100 +42,233 @@ std::string_view FormulaError::ToString() const{
     }
 }
 
+std::vector<Position> ListReferencedCells(Span<const Position> references, Span<const Range> ranges){
+    std::vector<Position> cells(references.begin(), references.end());
+    if(ranges.empty()){
+        return cells;
+    }
+    for(const Range& range : ranges){
+        for(int row = range.top_left.row; row <= range.bottom_right.row; ++row){
+            for(int col = range.top_left.col; col <= range.bottom_right.col; ++col){
+                cells.push_back(Position{row, col});
+            }
+        }
+    }
+    std::sort(cells.begin(), cells.end());
+    cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+    return cells;
+}
+
 namespace {
+
+std::shared_ptr<const FormulaAST> ParseAST(const std::string& expression, Position anchor){
+    stats::ScopedTimer timer(StatHistogram::ParseLatency);
+    stats::Add(StatCounter::Parses);
+    try{
+        return std::make_shared<const FormulaAST>(ParseFormulaAST(expression, anchor));
+    }
+    catch(const std::exception& ex){
+        throw FormulaException(ex.what());
+    }
+}
+
+// The cells or ranges of a compiled formula moved from its anchor
+template <typename T, typename Offsets>
+std::vector<T> ShiftAll(const Offsets& offsets, Position anchor){
+    std::vector<T> items;
+    items.reserve(offsets.size());
+    // shifting keeps the order, the lists stay sorted
+    for(const T& offset : offsets){
+        items.push_back(ShiftedSpan<T>::Shift(offset, anchor));
+    }
+    return items;
+}
+
+// A formula parsed on its own, see ParseFormula
 class Formula : public FormulaInterface {
 public:
-    explicit Formula(std::string expression);
+    explicit Formula(const std::string& expression);
     Value Evaluate(const SheetInterface& sheet) const override;
     std::string GetExpression() const override;
     std::vector<Position> GetReferencedCells() const override;
+    Span<const Position> GetReferences() const override;
+    Span<const Range> GetRanges() const override;
 
 private:
-    static void DeleteDuplicate(std::vector<Position>& cells);
-    static std::optional<double> GetDouble(const std::string& text);
-
-    FormulaAST ast_;
+    std::shared_ptr<const FormulaAST> ast_;
+    std::vector<Position> references_;
+    std::vector<Range> ranges_;
 };
 
-Formula::Formula(std::string expression)
-    try : ast_(ParseFormulaAST(expression))
-{
+Formula::Formula(const std::string& expression)
+    : ast_(ParseAST(expression, Position{0, 0}))
+    , references_(ast_->GetCells().begin(), ast_->GetCells().end())
+    , ranges_(ast_->GetRanges())
+{}
 
+FormulaInterface::Value Formula::Evaluate(const SheetInterface& sheet) const{
+    return EvaluateFormula(*ast_, Position{0, 0}, sheet);
 }
-catch(const std::exception& ex){
-    throw FormulaException(ex.what());
+
+std::string Formula::GetExpression() const{
+    return PrintExpression(*ast_, Position{0, 0});
 }
 
-FormulaInterface::Value Formula::Evaluate(const SheetInterface& sheet) const{
-    try{
+std::vector<Position> Formula::GetReferencedCells() const{
+    return ListReferencedCells(references_, ranges_);
+}
 
-        std::function<double(Position)> func = [&sheet](Position pos){
-            if(!pos.IsValid()){
-                throw FormulaError(FormulaError::Category::Ref);
+Span<const Position> Formula::GetReferences() const{
+    return references_;
+}
+
+Span<const Range> Formula::GetRanges() const{
+    return ranges_;
+}
+
+}  // namespace
+
+FormulaInterface::Value EvaluateFormula(const FormulaAST& ast, Position anchor, const SheetInterface& sheet){
+    // an error read from a cell ends the evaluation, it is passed up as a
+    // value and never thrown: a bad input may spread to a whole sheet
+    FormulaAST::CellReader read_cell = [&sheet](Position pos){
+        if(!pos.IsValid()){
+            return FormulaAST::BoxError(FormulaError::Category::Ref);
+        }
+        const CellInterface::NumericValue value = sheet.GetNumericValue(pos);
+        if(std::holds_alternative<double>(value)){
+            return std::get<double>(value);
+        }
+        return FormulaAST::BoxError(std::get<FormulaError>(value));
+    };
+    FormulaAST::RangeReader read_range = [&sheet](const Range& range, std::vector<double>& values){
+        std::optional<FormulaError> error;
+        sheet.ForEachCellInRange(range, [&values, &error](const CellInterface& cell){
+            // the cells after an error are not computed
+            if(error){
+                return;
             }
-            if(const CellInterface* ptr_to_cell = sheet.GetCell(pos)){
-                auto value = ptr_to_cell->GetValue();
-                if(std::holds_alternative<std::string>(value)){
-                    std::string str = std::get<std::string>(value);
-                    if(auto num = GetDouble(str)){
-                        return *num;
-                    }
-                    else{
-                        throw FormulaError(FormulaError::Category::Value);
-                    }
-                }
-                else if(std::holds_alternative<double>(value)){
-                    return std::get<double>(value);
-                }
-                else{
-                    throw FormulaError(FormulaError::Category::Value);
-                }
+            const CellInterface::NumericValue value = cell.GetNumericValue();
+            if(std::holds_alternative<double>(value)){
+                values.push_back(std::get<double>(value));
             }
-            return 0.0;
-        };
-
-        return ast_.Execute(func);
-    }
-    catch(const FormulaError& fe){
-        return fe;
-    }
+            else{
+                error = std::get<FormulaError>(value);
+            }
+        });
+        return error;
+    };
+    return ast.Execute(read_cell, read_range, anchor);
 }
 
-std::string Formula::GetExpression() const{
+std::string PrintExpression(const FormulaAST& ast, Position anchor){
     std::ostringstream ss;
-    ast_.PrintFormula(ss);
+    ast.PrintFormula(ss, anchor);
     return ss.str();
 }
 
-std::vector<Position> Formula::GetReferencedCells() const{
-    const auto& references = ast_.GetCells();
-    std::vector<Position> cells(references.begin(), references.end());
-    DeleteDuplicate(cells);
-    return cells;
+LazyFormula::LazyFormula(FormulaTable& table, std::string expression, Position anchor,
+                         std::vector<Position> references, std::vector<Range> ranges)
+    : table_(table)
+    , expression_(std::move(expression))
+    , anchor_(anchor)
+    , references_(std::move(references))
+    , ranges_(std::move(ranges))
+{}
+
+const FormulaAST& LazyFormula::GetAST() const{
+    // a failed parse leaves the flag unset, the next reader tries again
+    std::call_once(parsed_, [this]{
+        // the sheet's graph was built from the stored references, a formula
+        // reading anything else would break it
+        std::shared_ptr<const FormulaAST> ast;
+        try{
+            ast = table_.Parse(expression_, anchor_);
+        }
+        catch(const FormulaException& ex){
+            throw SnapshotException("Stored formula does not parse: "s + ex.what());
+        }
+        if(ShiftAll<Position>(ast->GetCells(), anchor_) != references_
+           || ShiftAll<Range>(ast->GetRanges(), anchor_) != ranges_){
+            throw SnapshotException("Stored formula does not match its references"s);
+        }
+        ast_ = std::move(ast);
+    });
+    return *ast_;
 }
 
-void Formula::DeleteDuplicate(std::vector<Position>& cells){
-    std::sort(cells.begin(), cells.end());
-    auto it = std::unique(cells.begin(), cells.end());
-    cells.resize(std::distance(cells.begin(), it));
+Position LazyFormula::GetAnchor() const{
+    return anchor_;
+}
+
+const std::string& LazyFormula::GetExpression() const{
+    return expression_;
+}
+
+Span<const Position> LazyFormula::GetReferences() const{
+    return references_;
 }
 
-std::optional<double> Formula::GetDouble(const std::string& text){
-    static const std::regex pattern_double(R"([ \t\n]*(-?)(0|([1-9][0-9]*))(.[0-9]+)?([eE]-?[1-9][0-9]*)?[ \t\n]*)");
-    try {
-        if(std::regex_match(text, pattern_double)){
-            return std::stod(text);
+Span<const Range> LazyFormula::GetRanges() const{
+    return ranges_;
+}
+
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
+    return std::make_unique<Formula>(expression);
+}
+
+std::shared_ptr<const FormulaAST> FormulaTable::Parse(std::string expression, Position pos){
+    std::lock_guard lock(mutex_);
+    auto key = NormalizeFormula(expression, pos);
+    if(!key){
+        // not even lexed, parsing reports the error
+        return ParseAST(expression, pos);
+    }
+    auto it = formulas_.find(*key);
+    if(it != formulas_.end()){
+        if(auto ast = it->second.lock()){
+            return ast;
         }
-    }  catch (...) {
+    }
 
+    auto ast = ParseAST(expression, pos);
+    if(it != formulas_.end()){
+        it->second = ast;
     }
-    return std::nullopt;
+    else{
+        SweepExpired();
+        formulas_.emplace(std::move(*key), ast);
+    }
+    return ast;
 }
 
-}  // namespace
+std::unique_ptr<LazyFormula> FormulaTable::ParseLazily(std::string expression, Position pos,
+                                                       std::vector<Position> references,
+                                                       std::vector<Range> ranges){
+    return std::make_unique<LazyFormula>(*this, std::move(expression), pos,
+                                         std::move(references), std::move(ranges));
+}
 
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
-    return std::make_unique<Formula>(std::move(expression));
+size_t FormulaTable::GetSharedCount() const{
+    std::lock_guard lock(mutex_);
+    return std::count_if(formulas_.begin(), formulas_.end(), [](const auto& entry){
+        return !entry.second.expired();
+    });
+}
+
+void FormulaTable::SweepExpired(){
+    if(formulas_.size() < next_sweep_){
+        return;
+    }
+    for(auto it = formulas_.begin(); it != formulas_.end();){
+        if(it->second.expired()){
+            it = formulas_.erase(it);
+        }
+        else{
+            ++it;
+        }
+    }
+    next_sweep_ = std::max<size_t>(64, formulas_.size() * 2);
 }
 
 
@@ -1,14 +1,115 @@
 #pragma once
 
 #include "common.h"
+#include "span.h"
 
+#include <iterator>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
+class FormulaAST;
+
+// Ячейки или диапазоны формулы, сдвинутые на позицию одной ячейки. Общая
+// формула хранит смещения от своей ячейки, они сдвигаются при чтении, а не
+// копируются в каждую ячейку. Элементы возвращаются по значению.
+template <typename T>
+class ShiftedSpan {
+public:
+    class Iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = T;
+
+        Iterator(const T* item, Position shift)
+            : item_(item)
+            , shift_(shift)
+        {}
+
+        T operator*() const {
+            return Shift(*item_, shift_);
+        }
+
+        Iterator& operator++() {
+            ++item_;
+            return *this;
+        }
+
+        Iterator operator++(int) {
+            Iterator it = *this;
+            ++item_;
+            return it;
+        }
+
+        bool operator==(const Iterator& rhs) const {
+            return item_ == rhs.item_;
+        }
+
+        bool operator!=(const Iterator& rhs) const {
+            return item_ != rhs.item_;
+        }
+
+    private:
+        const T* item_;
+        Position shift_;
+    };
+
+    ShiftedSpan() = default;
+
+    ShiftedSpan(Span<const T> items, Position shift = {0, 0})
+        : items_(items)
+        , shift_(shift)
+    {}
+
+    template <typename U>
+    ShiftedSpan(const std::vector<U>& items)
+        : items_(items)
+    {}
+
+    Iterator begin() const {
+        return Iterator(items_.begin(), shift_);
+    }
+
+    Iterator end() const {
+        return Iterator(items_.end(), shift_);
+    }
+
+    size_t size() const {
+        return items_.size();
+    }
+
+    bool empty() const {
+        return items_.empty();
+    }
+
+    T operator[](size_t i) const {
+        return Shift(items_[i], shift_);
+    }
+
+    static Position Shift(Position pos, Position shift) {
+        return {pos.row + shift.row, pos.col + shift.col};
+    }
+
+    static Range Shift(const Range& range, Position shift) {
+        return {Shift(range.top_left, shift), Shift(range.bottom_right, shift)};
+    }
+
+private:
+    Span<const T> items_;
+    Position shift_{0, 0};
+};
+
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Агрегатные функции над ячейками и диапазонами: SUM(A1:A100), AVERAGE(A1:C3,D5),
+//   MIN(...), MAX(...). Пустые ячейки диапазона пропускаются.
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -32,8 +133,87 @@ public:
         // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
         // ячеек.
         virtual std::vector<Position> GetReferencedCells() const = 0;
+
+        // Тот же список ячеек, но без копирования: он хранится в самой формуле
+        // и действителен, пока жива формула.
+        virtual Span<const Position> GetReferences() const = 0;
+
+        // Диапазоны, которые читают агрегатные функции формулы. Отсортированы
+        // по возрастанию и не повторяются. GetReferencedCells() включает все
+        // их ячейки, GetReferences() - нет.
+        virtual Span<const Range> GetRanges() const = 0;
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Общие скомпилированные формулы листа. Формулы, которые отличаются только
+// сдвигом ссылок, как при протягивании =B2*C2, =B3*C3, ..., разбираются один
+// раз, а каждая ячейка хранит ссылку на общую формулу и свою позицию.
+// Выражение формулы по-прежнему выводится с абсолютными ссылками A1.
+class LazyFormula;
+
+class FormulaTable {
+public:
+    // Как ParseFormula, но для формулы, записанной в ячейке pos. Возвращает
+    // общую скомпилированную формулу: её ячейки и диапазоны - смещения от pos.
+    std::shared_ptr<const FormulaAST> Parse(std::string expression, Position pos);
+
+    // Формула с уже известными ссылками, например загруженная из снимка листа.
+    // Разбирается при первом вычислении, выражение и ссылки доступны сразу.
+    std::unique_ptr<LazyFormula> ParseLazily(std::string expression, Position pos,
+                                             std::vector<Position> references,
+                                             std::vector<Range> ranges);
+
+    // Количество различных формул, которые сейчас используются.
+    size_t GetSharedCount() const;
+
+private:
+    void SweepExpired();
+
+    // lazy formulas are parsed during evaluation, possibly on several threads
+    mutable std::mutex mutex_;
+    // keyed by NormalizeFormula, formulas no cell uses any more expire
+    std::unordered_map<std::string, std::weak_ptr<const FormulaAST>> formulas_;
+    size_t next_sweep_ = 64;
+};
+
+// Формула, выражение и абсолютные ссылки которой известны заранее. Она
+// разбирается через таблицу при первом вычислении.
+class LazyFormula {
+public:
+    LazyFormula(FormulaTable& table, std::string expression, Position anchor,
+                std::vector<Position> references, std::vector<Range> ranges);
+
+    // Разбирает формулу, если она ещё не разобрана. Бросает SnapshotException,
+    // если выражение не разбирается или читает не те ячейки, что указаны.
+    const FormulaAST& GetAST() const;
+
+    Position GetAnchor() const;
+    const std::string& GetExpression() const;
+    Span<const Position> GetReferences() const;
+    Span<const Range> GetRanges() const;
+
+private:
+    FormulaTable& table_;
+    std::string expression_;
+    Position anchor_;
+    std::vector<Position> references_;
+    std::vector<Range> ranges_;
+    // a sheet and its views may compute the formula at once
+    mutable std::once_flag parsed_;
+    mutable std::shared_ptr<const FormulaAST> ast_;
+};
+
+// Вычисляет скомпилированную формулу, записанную в ячейке anchor.
+FormulaInterface::Value EvaluateFormula(const FormulaAST& ast, Position anchor,
+                                        const SheetInterface& sheet);
+
+// Выражение скомпилированной формулы, записанной в ячейке anchor.
+std::string PrintExpression(const FormulaAST& ast, Position anchor);
+
+// Ячейки ссылок и все ячейки диапазонов по возрастанию и без повторов, как их
+// возвращает GetReferencedCells(). Диапазон раскрывается по ячейкам, поэтому
+// это нужно только там, где интерфейс требует список ячеек.
+std::vector<Position> ListReferencedCells(Span<const Position> references, Span<const Range> ranges);
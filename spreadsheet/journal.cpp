@@ -0,0 +1,464 @@
+#include "journal.h"
+
+#include "snapshot.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <optional>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std::literals;
+
+namespace {
+
+constexpr size_t ALIGNMENT = 8;
+// the fields of a record the checksum covers start after it
+constexpr size_t CHECKED_OFFSET = sizeof(uint64_t);
+
+size_t Align(size_t size){
+    return (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+std::string ErrorText(){
+    return std::strerror(errno);
+}
+
+#ifdef _WIN32
+int OpenFile(const std::string& path, bool create){
+    const int fd = _open(path.c_str(), _O_WRONLY | _O_BINARY | (create ? _O_CREAT | _O_TRUNC : 0),
+                         _S_IREAD | _S_IWRITE);
+    if(fd >= 0 && !create){
+        _lseeki64(fd, 0, SEEK_END);
+    }
+    return fd;
+}
+
+void CloseFile(int fd){
+    _close(fd);
+}
+
+bool WriteFile(int fd, const char* data, size_t size){
+    while(size > 0){
+        const int written = _write(fd, data, static_cast<unsigned>(std::min<size_t>(size, 1 << 30)));
+        if(written < 0){
+            return false;
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+bool SyncFile(int fd){
+    return _commit(fd) == 0;
+}
+
+bool TruncateFile(int fd, uint64_t size){
+    return _chsize_s(fd, static_cast<__int64>(size)) == 0 && _lseeki64(fd, 0, SEEK_END) >= 0;
+}
+
+// a rename is flushed along with the file on Windows
+void SyncDirectory(const std::string&){
+}
+#else
+int OpenFile(const std::string& path, bool create){
+    return open(path.c_str(), O_WRONLY | O_CLOEXEC | (create ? O_CREAT | O_TRUNC : O_APPEND), 0644);
+}
+
+void CloseFile(int fd){
+    close(fd);
+}
+
+bool WriteFile(int fd, const char* data, size_t size){
+    while(size > 0){
+        const ssize_t written = write(fd, data, size);
+        if(written < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+bool SyncFile(int fd){
+#if defined(__linux__)
+    // the size of the file is synced along with the data, the rest of its
+    // metadata is of no use to the journal
+    return fdatasync(fd) == 0;
+#else
+    return fsync(fd) == 0;
+#endif
+}
+
+bool TruncateFile(int fd, uint64_t size){
+    return ftruncate(fd, static_cast<off_t>(size)) == 0;
+}
+
+// makes a file created or renamed in the directory of path durable
+void SyncDirectory(const std::string& path){
+    std::string directory = std::filesystem::path(path).parent_path().string();
+    if(directory.empty()){
+        directory = ".";
+    }
+    const int fd = open(directory.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0){
+        throw JournalException("Cannot open "s + directory + ": " + ErrorText());
+    }
+    const bool synced = fsync(fd) == 0;
+    close(fd);
+    if(!synced){
+        throw JournalException("Cannot sync "s + directory + ": " + ErrorText());
+    }
+}
+#endif
+
+std::optional<std::string> ReadWholeFile(const std::string& path){
+    std::ifstream input(path, std::ios::binary);
+    if(!input){
+        return std::nullopt;
+    }
+    return std::string(std::istreambuf_iterator<char>(input), {});
+}
+
+std::string MakeHeader(uint64_t base_sequence){
+    JournalHeader header{};
+    std::memcpy(header.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+    header.version = JOURNAL_VERSION;
+    header.base_sequence = base_sequence;
+    header.checksum = SnapshotChecksum(reinterpret_cast<const char*>(&header),
+                                       offsetof(JournalHeader, checksum));
+    return std::string(reinterpret_cast<const char*>(&header), sizeof(header));
+}
+
+JournalHeader ReadHeader(const std::string& data, const std::string& path){
+    JournalHeader header;
+    if(data.size() < sizeof(header)){
+        throw JournalException("Journal header is truncated: "s + path);
+    }
+    std::memcpy(&header, data.data(), sizeof(header));
+    if(std::memcmp(header.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0){
+        throw JournalException("Not a journal: "s + path);
+    }
+    if(header.version < 1 || header.version > JOURNAL_VERSION || header.reserved != 0){
+        throw JournalException("Unsupported journal version: "s + path);
+    }
+    if(header.checksum != SnapshotChecksum(data.data(), offsetof(JournalHeader, checksum))){
+        throw JournalException("Journal header checksum mismatch: "s + path);
+    }
+    return header;
+}
+
+// The record at offset if it is whole and passes its checksum
+std::optional<JournalRecord> ReadRecord(const std::string& data, size_t offset){
+    if(data.size() - offset < sizeof(JournalRecord)){
+        return std::nullopt;
+    }
+    JournalRecord record;
+    std::memcpy(&record, data.data() + offset, sizeof(record));
+    if(Align(sizeof(JournalRecord) + record.text_size) > data.size() - offset
+       || record.kind < JournalRecordKind::Set || record.kind > JournalRecordKind::DeleteColumns
+       || record.checksum != SnapshotChecksum(data.data() + offset + CHECKED_OFFSET,
+                                              sizeof(JournalRecord) - CHECKED_OFFSET + record.text_size)){
+        return std::nullopt;
+    }
+    return record;
+}
+
+uint32_t GetWriteOffset(const JournalRecord& record){
+    return uint32_t{record.write_offset[0]} | uint32_t{record.write_offset[1]} << 8
+           | uint32_t{record.write_offset[2]} << 16;
+}
+
+void SetWriteOffset(JournalRecord& record, size_t offset){
+    const uint32_t value = static_cast<uint32_t>(std::min<size_t>(offset, JOURNAL_WRITE_OFFSET_UNKNOWN));
+    record.write_offset[0] = static_cast<uint8_t>(value);
+    record.write_offset[1] = static_cast<uint8_t>(value >> 8);
+    record.write_offset[2] = static_cast<uint8_t>(value >> 16);
+}
+
+}  // namespace
+
+void WriteFileDurably(const std::string& path, std::string_view data){
+    const std::string temporary = path + ".tmp";
+    const int fd = OpenFile(temporary, true);
+    if(fd < 0){
+        throw JournalException("Cannot create "s + temporary + ": " + ErrorText());
+    }
+    const bool written = WriteFile(fd, data.data(), data.size()) && SyncFile(fd);
+    const std::string error = ErrorText();
+    CloseFile(fd);
+    if(!written){
+        throw JournalException("Cannot write "s + temporary + ": " + error);
+    }
+    std::error_code code;
+    std::filesystem::rename(temporary, path, code);
+    if(code){
+        throw JournalException("Cannot rename "s + temporary + ": " + code.message());
+    }
+    SyncDirectory(path);
+}
+
+Journal::Journal(std::string path, uint64_t after,
+                 const std::function<void(const JournalEntry&)>& replay)
+    : path_(std::move(path))
+{
+    std::optional<std::string> data = ReadWholeFile(path_);
+    if(!data){
+        data = MakeHeader(after);
+        WriteFileDurably(path_, *data);
+    }
+    const JournalHeader header = ReadHeader(*data, path_);
+    if(header.base_sequence > after){
+        throw JournalException("Journal starts after the checkpoint: "s + path_);
+    }
+
+    size_t offset = sizeof(JournalHeader);
+    uint64_t sequence = header.base_sequence;
+    while(true){
+        const std::optional<JournalRecord> record = ReadRecord(*data, offset);
+        if(!record || record->sequence != sequence + 1){
+            break;
+        }
+        const size_t size = Align(sizeof(JournalRecord) + record->text_size);
+        sequence = record->sequence;
+        if(sequence > after){
+            replay({sequence, record->kind, Position{record->row, record->col},
+                    std::string_view(data->data() + offset + sizeof(JournalRecord), record->text_size)});
+        }
+        offset += size;
+    }
+    // A crash only tears the records of the last write, none of them was
+    // acknowledged, and its pages may have reached the disk out of order.
+    // An intact record of a later write means the damaged one was synced,
+    // and cutting the file there would lose synced edits.
+    for(size_t later = offset + ALIGNMENT; later < data->size(); later += ALIGNMENT){
+        const std::optional<JournalRecord> record = ReadRecord(*data, later);
+        if(record && record->sequence > sequence && GetWriteOffset(*record) != JOURNAL_WRITE_OFFSET_UNKNOWN
+           && record->sequence - GetWriteOffset(*record) > sequence + 1){
+            throw JournalException("Journal is damaged after record "s + std::to_string(sequence) + ": " + path_);
+        }
+    }
+
+    if(sequence < after){
+        // the checkpoint was taken but the journal was not started over,
+        // every record is in the checkpoint
+        *data = MakeHeader(after);
+        WriteFileDurably(path_, *data);
+        sequence = after;
+        offset = data->size();
+    }
+    fd_ = OpenFile(path_, false);
+    if(fd_ < 0){
+        throw JournalException("Cannot open "s + path_ + ": " + ErrorText());
+    }
+    if(offset < data->size() && !(TruncateFile(fd_, offset) && SyncFile(fd_))){
+        const std::string error = ErrorText();
+        CloseFile(fd_);
+        throw JournalException("Cannot cut off the tail of "s + path_ + ": " + error);
+    }
+    appended_ = sequence;
+    durable_sequence_ = sequence;
+    size_ = offset;
+    flusher_ = std::thread([this]{
+        Flush();
+    });
+}
+
+Journal::~Journal(){
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    pending_.notify_one();
+    flusher_.join();
+    CloseFile(fd_);
+}
+
+uint64_t Journal::Append(JournalRecordKind kind, Position pos, std::string_view text){
+    JournalRecord record{};
+    record.row = pos.row;
+    record.col = pos.col;
+    record.text_size = static_cast<uint32_t>(text.size());
+    record.kind = kind;
+    const size_t size = Align(sizeof(JournalRecord) + text.size());
+
+    std::lock_guard lock(mutex_);
+    record.sequence = ++appended_;
+    if(!error_.empty()){
+        // nothing is written any more, WaitDurable reports the failure
+        return record.sequence;
+    }
+    // the flusher writes the records of the buffer with one write
+    SetWriteOffset(record, buffered_);
+    const size_t offset = buffer_.size();
+    buffer_.resize(offset + size);
+    char* data = buffer_.data() + offset;
+    if(!text.empty()){
+        // the data of an empty text may be null
+        std::memcpy(data + sizeof(JournalRecord), text.data(), text.size());
+    }
+    std::memcpy(data, &record, sizeof(record));
+    record.checksum = SnapshotChecksum(data + CHECKED_OFFSET,
+                                       sizeof(JournalRecord) - CHECKED_OFFSET + text.size());
+    std::memcpy(data, &record.checksum, sizeof(record.checksum));
+    size_ += size;
+    ++buffered_;
+    stats::Add(StatCounter::JournalRecords);
+    if(offset == 0 || buffered_ == gather_){
+        pending_.notify_one();
+    }
+    return record.sequence;
+}
+
+void Journal::WaitDurable(uint64_t sequence){
+    std::unique_lock lock(mutex_);
+    ++waiting_;
+    durable_.wait(lock, [&]{
+        return durable_sequence_ >= sequence || !error_.empty();
+    });
+    --waiting_;
+    if(durable_sequence_ < sequence){
+        throw JournalException(error_);
+    }
+}
+
+void Journal::Sync(){
+    uint64_t sequence;
+    {
+        std::lock_guard lock(mutex_);
+        sequence = appended_;
+    }
+    WaitDurable(sequence);
+}
+
+void Journal::CheckHealthy() const{
+    std::lock_guard lock(mutex_);
+    if(!error_.empty()){
+        throw JournalException(error_);
+    }
+}
+
+uint64_t Journal::GetLastSequence() const{
+    std::lock_guard lock(mutex_);
+    return appended_;
+}
+
+uint64_t Journal::GetSize() const{
+    std::lock_guard lock(mutex_);
+    return size_;
+}
+
+void Journal::Restart(uint64_t base_sequence, uint64_t offset){
+    std::unique_lock lock(mutex_);
+    durable_.wait(lock, [&]{
+        return durable_sequence_ >= base_sequence || !error_.empty();
+    });
+    restarting_ = true;
+    durable_.wait(lock, [this]{
+        return !writing_;
+    });
+    struct Resume{
+        Journal& journal;
+        ~Resume(){
+            journal.restarting_ = false;
+            journal.pending_.notify_one();
+        }
+    } resume{*this};
+    if(!error_.empty()){
+        throw JournalException(error_);
+    }
+
+    // the records written after offset are synced, the buffered ones follow
+    // them into the new file
+    const uint64_t written = size_ - buffer_.size();
+    std::string data = MakeHeader(base_sequence);
+    if(written > offset){
+        std::ifstream input(path_, std::ios::binary);
+        const size_t header = data.size();
+        data.resize(header + (written - offset));
+        if(!input.seekg(static_cast<std::streamoff>(offset))
+           || !input.read(data.data() + header, static_cast<std::streamsize>(written - offset))){
+            throw JournalException("Cannot read "s + path_);
+        }
+    }
+    WriteFileDurably(path_, data);
+    const int fd = OpenFile(path_, false);
+    if(fd < 0){
+        throw JournalException("Cannot open "s + path_ + ": " + ErrorText());
+    }
+    CloseFile(fd_);
+    fd_ = fd;
+    size_ = data.size() + buffer_.size();
+}
+
+void Journal::Flush(){
+    std::string batch;
+    std::unique_lock lock(mutex_);
+    while(true){
+        pending_.wait(lock, [this]{
+            return stopping_ || !buffer_.empty();
+        });
+        if(buffer_.empty()){
+            return;
+        }
+        if(buffered_ < gather_){
+            pending_.wait_for(lock, last_sync_ / 2, [this]{
+                return stopping_ || buffered_ >= gather_;
+            });
+        }
+        if(restarting_){
+            // Restart copies the file, it resumes the flusher when done
+            pending_.wait(lock, [this]{
+                return !restarting_;
+            });
+            continue;
+        }
+        // the records appended during the write go into the next batch, the
+        // writers waiting for this one will likely be back for it
+        batch.swap(buffer_);
+        buffered_ = 0;
+        gather_ = waiting_;
+        const uint64_t sequence = appended_;
+        writing_ = true;
+        lock.unlock();
+        const auto start = std::chrono::steady_clock::now();
+        const bool written = WriteFile(fd_, batch.data(), batch.size()) && SyncFile(fd_);
+        last_sync_ = std::chrono::steady_clock::now() - start;
+        const std::string error = written ? ""s : ErrorText();
+        stats::Add(StatCounter::JournalSyncs);
+        batch.clear();
+        lock.lock();
+        writing_ = false;
+        if(!written){
+            Fail("Cannot write "s + path_ + ": " + error);
+            return;
+        }
+        durable_sequence_ = sequence;
+        durable_.notify_all();
+    }
+}
+
+void Journal::Fail(std::string message){
+    // what follows the failed write may not be in the file, nothing is
+    // appended after it any more
+    error_ = std::move(message);
+    buffer_.clear();
+    durable_.notify_all();
+}
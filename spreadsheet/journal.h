@@ -0,0 +1,171 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+
+// Write-ahead journal of the edits of a sheet, see DurableSheet. The file is
+// a header followed by records, each starting at a multiple of 8 bytes:
+//
+//   JournalHeader
+//   JournalRecord, char[text_size]    one per SetCell, ClearCell or a
+//   ...                               structural edit of the rows or columns
+//
+// Records are numbered by their sequence, the first one follows the
+// base_sequence of the header: the last edit already in the checkpoint the
+// journal continues. The checksum of a record covers its fields after the
+// checksum and its text. Reading stops at the first record that is cut off,
+// fails its checksum or is out of sequence: that is where a crash
+// interrupted the writes, the rest of the file is dropped. The pages of the
+// last write may reach the disk in any order, so intact records of that
+// write may follow the damage. Each record keeps how many records of its
+// write come before it: if an intact record after the damage comes from a
+// later write, the damaged one had been synced, the journal was damaged
+// before its tail and is not opened. Version 1 journals, without the
+// structural edits, and version 2 ones, without the write offsets, are read
+// as well; a record of theirs is taken for the only one of its write.
+
+// Thrown when a journal can't be written or is damaged before its tail
+class JournalException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+inline constexpr char JOURNAL_MAGIC[8] = {'S', 'P', 'R', 'S', 'J', 'R', 'N', 'L'};
+inline constexpr uint32_t JOURNAL_VERSION = 3;
+// the write offset of the records further into their write than that
+inline constexpr uint32_t JOURNAL_WRITE_OFFSET_UNKNOWN = 0xFFFFFF;
+
+struct JournalHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t base_sequence;
+    // of the fields before it
+    uint64_t checksum;
+};
+
+enum class JournalRecordKind : uint8_t {
+    Set = 1,
+    Clear,
+    // the row of the record is the first index, the column the count
+    InsertRows,
+    DeleteRows,
+    InsertColumns,
+    DeleteColumns,
+};
+
+struct JournalRecord {
+    uint64_t checksum;
+    uint64_t sequence;
+    int32_t row;
+    int32_t col;
+    uint32_t text_size;
+    JournalRecordKind kind;
+    // how many records of the same write come before it, little-endian,
+    // saturated at JOURNAL_WRITE_OFFSET_UNKNOWN
+    uint8_t write_offset[3];
+};
+
+static_assert(sizeof(JournalHeader) == 32);
+static_assert(sizeof(JournalRecord) == 32);
+
+// An edit read back from a journal
+struct JournalEntry {
+    uint64_t sequence;
+    JournalRecordKind kind;
+    Position pos;
+    // the text of SetCell, empty for the other edits
+    std::string_view text;
+};
+
+// Appends records to a journal file and makes them durable with group
+// commit: a flusher thread writes whatever was appended since its last pass
+// with one write and one fsync, so the edits that come in while a sync is
+// under way share the next one. When several writers were waiting for a
+// sync, the next batch waits for as many records, for at most half a sync,
+// so that they don't trickle into the syncs one at a time. Append may be
+// called from any thread, the records are numbered in the order of the calls.
+class Journal {
+public:
+    // Opens the journal at path, creating it if there is none, and calls
+    // replay for the intact records after the given sequence, in order. The
+    // records after the last intact one are cut off. Throws JournalException
+    // if the file is not a journal, it starts after that sequence or an
+    // intact record written after a damaged one follows it.
+    Journal(std::string path, uint64_t after,
+            const std::function<void(const JournalEntry&)>& replay);
+    ~Journal();
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    // The sequence of the new record, it is durable once WaitDurable for it
+    // returns. Never throws: once a write failed the record is dropped, and
+    // WaitDurable for it throws instead.
+    uint64_t Append(JournalRecordKind kind, Position pos, std::string_view text = {});
+    // Blocks until the record with the given sequence and every record
+    // before it are on disk, throws JournalException if writing them failed
+    void WaitDurable(uint64_t sequence);
+    // waits for everything appended so far
+    void Sync();
+    // Throws JournalException if a write failed: nothing appended since is
+    // written
+    void CheckHealthy() const;
+
+    uint64_t GetLastSequence() const;
+    // bytes written and appended since the journal was started
+    uint64_t GetSize() const;
+
+    // Starts the journal over after the record with the given sequence,
+    // which ends at offset (GetSize right after it was appended): a fresh
+    // file with the records after it replaces the old one atomically. Waits
+    // for that record to be durable; records may be appended meanwhile, the
+    // ones the file holds by then are copied while Append waits.
+    void Restart(uint64_t base_sequence, uint64_t offset);
+
+private:
+    void Flush();
+    void Fail(std::string message);
+
+    std::string path_;
+    int fd_ = -1;
+
+    mutable std::mutex mutex_;
+    // wakes the flusher when there is something to write
+    std::condition_variable pending_;
+    // wakes the writers waiting for their records
+    std::condition_variable durable_;
+    // records appended since the flusher took the last batch
+    std::string buffer_;
+    size_t buffered_ = 0;
+    // threads in WaitDurable, and how many records the next batch waits for
+    size_t waiting_ = 0;
+    size_t gather_ = 0;
+    std::chrono::nanoseconds last_sync_{0};
+    uint64_t appended_ = 0;
+    uint64_t durable_sequence_ = 0;
+    uint64_t size_ = 0;
+    std::string error_;
+    bool stopping_ = false;
+    // the flusher is writing a batch; it takes no new one while a restart
+    // copies the file
+    bool writing_ = false;
+    bool restarting_ = false;
+    // writes the batches outside mutex_
+    std::thread flusher_;
+};
+
+// Replaces the file at path with data so that after a crash it holds either
+// the old or the new content: the data is synced to a temporary file which
+// is then renamed over path. Throws JournalException.
+void WriteFileDurably(const std::string& path, std::string_view data);
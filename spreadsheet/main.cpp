@@ -1,8 +1,34 @@
+#include "FormulaAST.h"
 #include "common.h"
+#include "delimited.h"
+#include "dependency_graph.h"
+#include "durable_sheet.h"
 #include "formula.h"
+#include "numeric_text.h"
+#include "sheet.h"
+#include "snapshot.h"
+#include "stats.h"
 #include "test_runner_p.h"
 
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <limits>
+#include <map>
+#include <optional>
+#include <random>
+#include <regex>
+#include <set>
+#include <thread>
+
+#ifndef _WIN32
+#include <csignal>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
@@ -205,6 +231,17 @@ void TestErrorValue() {
     sheet->SetCell("E2"_pos, "3D");
     ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
                  CellInterface::Value(FormulaError::Category::Value));
+
+    ASSERT_EQUAL(ToString(FormulaError::Category::Value), "#VALUE!");
+    ASSERT_EQUAL(ToString(FormulaError::Category::Div0), "#DIV/0!");
+    // the value prints as it always did, unlike the #REF! of formula texts
+    ASSERT_EQUAL(ToString(FormulaError::Category::Ref), "REF!");
+
+    auto refs = CreateSheet();
+    refs->SetCell("A1"_pos, "=#REF!+1");
+    std::ostringstream values;
+    refs->PrintValues(values);
+    ASSERT_EQUAL(values.str(), "REF!\n");
 }
 
 void TestErrorDiv0() {
@@ -351,6 +388,818 @@ void TestCellCircularReferences() {
     ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
 }
 
+void TestSparseStorage() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("XFD16384"_pos, "far");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{Position::MAX_ROWS, Position::MAX_COLS}));
+    ASSERT(sheet->GetCell("A1"_pos) == nullptr);
+    ASSERT(sheet->GetCell("XFC16384"_pos) == nullptr);
+    ASSERT_EQUAL(sheet->GetCell("XFD16384"_pos)->GetText(), "far");
+
+    sheet->SetCell("B2"_pos, "=XFD16383");
+    ASSERT(sheet->GetCell("XFD16383"_pos) != nullptr);
+    ASSERT(sheet->GetCell("XFD16383"_pos)->GetText().empty());
+
+    sheet->ClearCell("XFD16384"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 2}));
+    ASSERT(sheet->GetCell("XFD16384"_pos) == nullptr);
+
+    std::ostringstream texts;
+    sheet->PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "\t\n\t=XFD16383\n");
+}
+
+void TestFormulaLongExpressions() {
+    auto sheet = CreateSheet();
+    auto evaluate = [&](std::string expr) {
+        return ParseFormula(std::move(expr))->Evaluate(*sheet);
+    };
+
+    ASSERT_EQUAL(std::get<double>(evaluate("-(1-2)*-3")), -3);
+    ASSERT_EQUAL(std::get<double>(evaluate("+-+-2")), 2);
+
+    std::string wide = "1";
+    std::string deep = "1";
+    for (int i = 0; i < 100; ++i) {
+        wide += "+1";
+        deep = "(1+" + deep + ")";
+    }
+    ASSERT_EQUAL(std::get<double>(evaluate(wide)), 101);
+    ASSERT_EQUAL(std::get<double>(evaluate(deep)), 101);
+    ASSERT_EQUAL(std::get<FormulaError>(evaluate(wide + "/0")), FormulaError(FormulaError::Category::Div0));
+}
+
+void TestInvalidationThroughDiamonds() {
+    auto sheet = CreateSheet();
+    auto cell = [](int row) {
+        return Position{row, 0};
+    };
+    for (int row = 39; row > 1; --row) {
+        sheet->SetCell(cell(row), "=" + cell(row - 1).ToString() + "+" + cell(row - 2).ToString());
+    }
+    sheet->SetCell(cell(0), "1");
+    ASSERT_EQUAL(std::get<double>(sheet->GetCell(cell(39))->GetValue()), 39088169.0);
+    sheet->SetCell(cell(1), "1");
+    ASSERT_EQUAL(std::get<double>(sheet->GetCell(cell(39))->GetValue()), 102334155.0);
+
+    sheet->SetCell(cell(0), "0");
+    ASSERT_EQUAL(std::get<double>(sheet->GetCell(cell(39))->GetValue()), 63245986.0);
+    sheet->ClearCell(cell(1));
+    ASSERT_EQUAL(std::get<double>(sheet->GetCell(cell(39))->GetValue()), 0.0);
+}
+
+void TestCycleCheckOnDiamonds() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=B1+C1");
+    sheet->SetCell("B1"_pos, "=D1");
+    sheet->SetCell("C1"_pos, "=D1*2");
+    sheet->SetCell("D1"_pos, "=E1+E1");
+    sheet->SetCell("E1"_pos, "3");
+    ASSERT_EQUAL(std::get<double>(sheet->GetCell("A1"_pos)->GetValue()), 18.0);
+
+    auto is_cycle = [&](Position pos, std::string text) {
+        try {
+            sheet->SetCell(pos, std::move(text));
+        } catch (const CircularDependencyException&) {
+            return true;
+        }
+        return false;
+    };
+    ASSERT(is_cycle("E1"_pos, "=A1"));
+    ASSERT(is_cycle("E1"_pos, "=F1+C1"));
+    ASSERT(is_cycle("F1"_pos, "=F1"));
+    ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetText(), "3");
+    ASSERT(!is_cycle("F1"_pos, "=A1+B1+C1+D1"));
+    ASSERT_EQUAL(std::get<double>(sheet->GetCell("F1"_pos)->GetValue()), 18.0 + 6 + 12 + 6);
+}
+
+void TestCycleDetectionOnRandomEdits() {
+    constexpr int SIZE = 6;
+    std::mt19937 gen(2024);
+    std::uniform_int_distribution<int> coord(0, SIZE - 1);
+    std::uniform_int_distribution<int> ref_count(0, 3);
+    auto random_pos = [&] {
+        return Position{coord(gen), coord(gen)};
+    };
+
+    Sheet sheet;
+    for (int edit = 0; edit < 3000; ++edit) {
+        Position pos = random_pos();
+        if (edit % 10 == 0) {
+            sheet.ClearCell(pos);
+            continue;
+        }
+        std::vector<Position> refs;
+        std::string text = "=1";
+        for (int i = ref_count(gen); i > 0; --i) {
+            refs.push_back(random_pos());
+            text += "+" + refs.back().ToString();
+        }
+        std::sort(refs.begin(), refs.end());
+        refs.erase(std::unique(refs.begin(), refs.end()), refs.end());
+        const bool acyclic = sheet.CycleCheck(pos, refs);
+
+        bool rejected = false;
+        try {
+            sheet.SetCell(pos, text);
+        } catch (const CircularDependencyException&) {
+            rejected = true;
+        }
+        ASSERT_EQUAL(rejected, !acyclic);
+    }
+
+    Sheet fresh;
+    for (int row = 0; row < SIZE; ++row) {
+        for (int col = 0; col < SIZE; ++col) {
+            if (const CellInterface* cell = sheet.GetCell(Position{row, col})) {
+                fresh.SetCell(Position{row, col}, cell->GetText());
+            }
+        }
+    }
+    std::ostringstream values;
+    std::ostringstream fresh_values;
+    sheet.PrintValues(values);
+    fresh.PrintValues(fresh_values);
+    ASSERT_EQUAL(values.str(), fresh_values.str());
+}
+
+void TestRangeFunctions() {
+    auto sheet = CreateSheet();
+    auto evaluate = [&](std::string expr) {
+        return std::visit([](auto value) { return CellInterface::Value(value); },
+                          ParseFormula(std::move(expr))->Evaluate(*sheet));
+    };
+    auto reformat = [](std::string expr) {
+        return ParseFormula(std::move(expr))->GetExpression();
+    };
+
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("A2"_pos, "=A1*2");
+    sheet->SetCell("A3"_pos, "4");
+    sheet->SetCell("B2"_pos, "-3");
+    ASSERT_EQUAL(evaluate("SUM(A1:A3)"), CellInterface::Value(7.0));
+    ASSERT_EQUAL(evaluate("SUM(A3:A1)"), CellInterface::Value(7.0));
+    ASSERT_EQUAL(evaluate("SUM(A1:B3, 10, A1)"), CellInterface::Value(15.0));
+    // empty cells are skipped, not counted as zeros
+    ASSERT_EQUAL(evaluate("AVERAGE(A1:C5)"), CellInterface::Value(1.0));
+    ASSERT_EQUAL(evaluate("MIN(A1:B3)"), CellInterface::Value(-3.0));
+    ASSERT_EQUAL(evaluate("MAX(A1:B3)"), CellInterface::Value(4.0));
+    ASSERT_EQUAL(evaluate("MAX(D1:D9)"), CellInterface::Value(0.0));
+    ASSERT_EQUAL(evaluate("AVERAGE(D1:D9)"), CellInterface::Value(FormulaError::Category::Div0));
+    ASSERT_EQUAL(evaluate("1+SUM(A1:A3)*2"), CellInterface::Value(15.0));
+    ASSERT_EQUAL(evaluate("MAX(MIN(A1:A3), SUM(B1:B3))"), CellInterface::Value(1.0));
+
+    sheet->SetCell("C1"_pos, "text");
+    ASSERT_EQUAL(evaluate("SUM(A1:C1)"), CellInterface::Value(FormulaError::Category::Value));
+    sheet->SetCell("C1"_pos, "=1/0");
+    ASSERT_EQUAL(evaluate("SUM(A1:C1)"), CellInterface::Value(FormulaError::Category::Value));
+
+    ASSERT_EQUAL(reformat("SUM( A1 : B2 , (1+2)*3 )"), "SUM(A1:B2,(1+2)*3)");
+    ASSERT_EQUAL(reformat("-SUM(B2:A1)"), "-SUM(A1:B2)");
+    ASSERT_EQUAL(ParseFormula("A1+SUM(A1:B2,C3)")->GetReferencedCells(),
+                 (std::vector{"A1"_pos, "B1"_pos, "A2"_pos, "B2"_pos, "C3"_pos}));
+    ASSERT(ParseFormula("SUM(A1:B2)")->GetReferences().empty());
+
+    for (std::string bad : {"SUM()", "FOO(A1)", "A1:B2", "SUM(A1:)", "1+SUM(A1:ZZZZ1)"}) {
+        try {
+            ParseFormula(bad);
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+    }
+}
+
+void TestRangeDependencies() {
+    Sheet sheet;
+    auto value = [&](Position pos) {
+        return sheet.GetCell(pos)->GetValue();
+    };
+
+    sheet.SetCell("D1"_pos, "=SUM(A1:B100)");
+    ASSERT_EQUAL(value("D1"_pos), CellInterface::Value(0.0));
+    // nothing is created for the cells of a range
+    ASSERT(sheet.GetCell("A50"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 4}));
+
+    sheet.SetCell("A50"_pos, "5");
+    ASSERT_EQUAL(value("D1"_pos), CellInterface::Value(5.0));
+    sheet.SetCell("B100"_pos, "=A50*2");
+    ASSERT_EQUAL(value("D1"_pos), CellInterface::Value(15.0));
+    sheet.SetCell("A50"_pos, "1");
+    ASSERT_EQUAL(value("D1"_pos), CellInterface::Value(3.0));
+    sheet.ClearCell("B100"_pos);
+    ASSERT_EQUAL(value("D1"_pos), CellInterface::Value(1.0));
+    sheet.SetCell("C1"_pos, "=D1+1");
+    ASSERT_EQUAL(value("C1"_pos), CellInterface::Value(2.0));
+    sheet.SetCell("A1"_pos, "10");
+    ASSERT_EQUAL(value("C1"_pos), CellInterface::Value(12.0));
+
+    auto rejected = [&](Position pos, std::string text) {
+        try {
+            sheet.SetCell(pos, std::move(text));
+        } catch (const CircularDependencyException&) {
+            return true;
+        }
+        return false;
+    };
+    ASSERT(rejected("A2"_pos, "=SUM(A1:A3)"));
+    ASSERT(rejected("B7"_pos, "=C1"));
+    ASSERT(rejected("B7"_pos, "=MAX(C1:D1)"));
+    ASSERT(sheet.GetCell("B7"_pos) == nullptr);
+    ASSERT(!rejected("E1"_pos, "=SUM(A1:B100)"));
+    ASSERT(!rejected("A2"_pos, "=SUM(E2:E3)"));
+    ASSERT_EQUAL(value("C1"_pos), CellInterface::Value(12.0));
+
+    // once replaced, the old ranges are no longer dependencies
+    sheet.SetCell("D1"_pos, "=SUM(F1:F2)");
+    ASSERT_EQUAL(value("C1"_pos), CellInterface::Value(1.0));
+    sheet.SetCell("A1"_pos, "=C1");
+    sheet.SetCell("F1"_pos, "2");
+    ASSERT_EQUAL(value("A1"_pos), CellInterface::Value(3.0));
+
+    // a large range is listed cell by cell only by GetReferencedCells
+    sheet.SetCell("AA1"_pos, "=G1+SUM(A1:Z16000)");
+    const Cell* total = static_cast<const Cell*>(sheet.GetCell("AA1"_pos));
+    ASSERT_EQUAL(total->GetReferences(), std::vector{"G1"_pos});
+    ASSERT(total->GetRanges() == (std::vector{Range{"A1"_pos, "Z16000"_pos}}));
+    const CellInterface* window = sheet.GetCell("A2"_pos);
+    ASSERT_EQUAL(window->GetReferencedCells(), (std::vector{"E2"_pos, "E3"_pos}));
+}
+
+void TestRangeCycleDetectionOnRandomEdits() {
+    constexpr int SIZE = 8;
+    std::mt19937 gen(77);
+    std::uniform_int_distribution<int> coord(0, SIZE - 1);
+    std::uniform_int_distribution<int> ref_count(0, 2);
+    auto random_pos = [&] {
+        return Position{coord(gen), coord(gen)};
+    };
+
+    Sheet sheet;
+    for (int edit = 0; edit < 3000; ++edit) {
+        Position pos = random_pos();
+        if (edit % 10 == 0) {
+            sheet.ClearCell(pos);
+            continue;
+        }
+        std::vector<Position> refs;
+        std::vector<Range> ranges;
+        std::string text = "=1";
+        for (int i = ref_count(gen); i > 0; --i) {
+            refs.push_back(random_pos());
+            text += "+" + refs.back().ToString();
+        }
+        if (edit % 3 == 0) {
+            Position first = random_pos();
+            Position second = random_pos();
+            ranges.push_back({{std::min(first.row, second.row), std::min(first.col, second.col)},
+                              {std::max(first.row, second.row), std::max(first.col, second.col)}});
+            text += "+SUM(" + first.ToString() + ":" + second.ToString() + ")";
+        }
+        std::sort(refs.begin(), refs.end());
+        refs.erase(std::unique(refs.begin(), refs.end()), refs.end());
+        const bool acyclic = sheet.CycleCheck(pos, refs, ranges);
+
+        bool rejected = false;
+        try {
+            sheet.SetCell(pos, text);
+        } catch (const CircularDependencyException&) {
+            rejected = true;
+        }
+        ASSERT_EQUAL(rejected, !acyclic);
+    }
+
+    std::ostringstream values;
+    sheet.PrintValues(values);
+    Sheet parallel;
+    for (int row = 0; row < SIZE; ++row) {
+        for (int col = 0; col < SIZE; ++col) {
+            if (const CellInterface* cell = sheet.GetCell(Position{row, col})) {
+                parallel.SetCell(Position{row, col}, cell->GetText());
+            }
+        }
+    }
+    parallel.Recalculate(3);
+    std::ostringstream parallel_values;
+    parallel.PrintValues(parallel_values);
+    ASSERT_EQUAL(values.str(), parallel_values.str());
+}
+
+void TestParallelRecalculation() {
+    std::mt19937 random(7);
+    std::uniform_int_distribution<int> pick(0, 2);
+    Sheet lazy;
+    Sheet parallel;
+    auto set_both = [&](Position pos, const std::string& text) {
+        lazy.SetCell(pos, text);
+        parallel.SetCell(pos, text);
+    };
+    // every row reads up to three cells of the previous one, errors included
+    for (int col = 0; col < 20; ++col) {
+        set_both(Position{0, col}, col == 3 ? "text" : col == 5 ? "=1/0" : std::to_string(col));
+    }
+    for (int row = 1; row < 60; ++row) {
+        for (int col = 0; col < 20; ++col) {
+            std::string text = "=" + Position{row - 1, col}.ToString();
+            for (int i = pick(random); i > 0; --i) {
+                text += "+" + Position{row - 1, (col + pick(random) * 7) % 20}.ToString();
+            }
+            set_both(Position{row, col}, text);
+        }
+    }
+
+    // the pool of one call is kept for the next one with as many threads
+    auto check = [&](size_t threads) {
+        parallel.Recalculate(threads);
+        // the first row is text, read in place without a cache
+        for (int row = 1; row < 60; ++row) {
+            ASSERT(static_cast<const Cell*>(parallel.GetCell(Position{row, 19}))->HasCache());
+        }
+        std::ostringstream lazy_values;
+        std::ostringstream parallel_values;
+        lazy.PrintValues(lazy_values);
+        parallel.PrintValues(parallel_values);
+        ASSERT_EQUAL(lazy_values.str(), parallel_values.str());
+    };
+    check(4);
+    set_both("D1"_pos, "3");
+    set_both("F1"_pos, "=A1+B1");
+    check(4);
+    set_both("A30"_pos, "=E1");
+    check(2);
+}
+
+// The way formulas used to read text cells
+std::optional<double> ParseNumericTextWithRegex(const std::string& text) {
+    static const std::regex number(
+        R"([ \t\n]*(-?)(0|([1-9][0-9]*))(.[0-9]+)?([eE]-?[1-9][0-9]*)?[ \t\n]*)");
+    if (!std::regex_match(text, number)) {
+        return std::nullopt;
+    }
+    try {
+        return std::stod(text);
+    } catch (const std::exception&) {
+        return std::nullopt;
+    }
+}
+
+void TestNumericTextConformance() {
+    auto check = [](const std::string& text) {
+        auto expected = ParseNumericTextWithRegex(text);
+        auto actual = ParseNumericText(text);
+        ASSERT_EQUAL(actual.has_value(), expected.has_value());
+        if (expected) {
+            // bitwise, so that -0 and the last bits of rounding count too
+            ASSERT(std::memcmp(&*actual, &*expected, sizeof(double)) == 0);
+        }
+    };
+
+    for (const char* text :
+         {"", " ", "0", "-0", "00", "01", "0123", "10", "-7", "3.25", "3.", ".5", "1x5",
+          "1 5", "1\t5", "1\r5", "1\n5", "1\r", " \t\n42\n\t ", "+1", "--1", "1e5", "1E5",
+          "1e05", "1e-5", "1e-05", "1e+5", "1.5e3", "1.5e0", "1.5e", "1e5e5", "0x10", "-0x1f",
+          "0X10", "0x10e5", "0x10e-5", "0x1.8", "0xg", "1e308", "1e309", "-1e309", "1e-307",
+          "1e-310", "4.9e-324", "2e-324", "1e-400", "-1e-400", "2.2250738585072014e-308",
+          "179769313486231570000000000000000000000000000000000000000000000000000000000000000"
+          "000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+          "000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+          "0000000000000000000000000000000000000000000000000000000000000000000000000000",
+          "0.1000000000000000055511151231257827021181583404541015625", "1nan", "1inf"}) {
+        check(text);
+    }
+
+    std::mt19937 gen(8);
+    const std::string alphabet = "0001123456789-- \t\n\r.eExX+a";
+    std::uniform_int_distribution<size_t> letter(0, alphabet.size() - 1);
+    std::uniform_int_distribution<size_t> length(1, 12);
+    for (int i = 0; i < 20000; ++i) {
+        std::string text;
+        for (size_t j = length(gen); j > 0; --j) {
+            text += alphabet[letter(gen)];
+        }
+        check(text);
+    }
+
+    // text cells, the escaped ones included, read by formulas
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, " 0x10 ");
+    sheet.SetCell("A2"_pos, "'-2.5e1");
+    sheet.SetCell("A3"_pos, "1e-400");
+    sheet.SetCell("A4"_pos, "'");
+    sheet.SetCell("B1"_pos, "=A1+A2");
+    sheet.SetCell("B2"_pos, "=A3");
+    sheet.SetCell("B3"_pos, "=A4");
+    sheet.SetCell("B4"_pos, "=SUM(A1:A2)");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(-9.0));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+    ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetValue(), CellInterface::Value(-9.0));
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value("-2.5e1"));
+}
+
+// Tree, cells and ranges of a parsed formula, or the error
+std::string DescribeAST(const std::function<FormulaAST()>& parse) {
+    try {
+        FormulaAST ast = parse();
+        std::ostringstream out;
+        ast.Print(out);
+        out << " | ";
+        ast.PrintFormula(out);
+        out << " | ";
+        ast.PrintCells(out);
+        for (const Range& range : ast.GetRanges()) {
+            out << range.ToString() << ' ';
+        }
+        return out.str();
+    } catch (const std::exception&) {
+        return "error";
+    }
+}
+
+// Parses the text with both parsers. The hand-written one must build what
+// ANTLR builds or give up, and must not give up on well-formed formulas.
+void CheckParsersAgree(const std::string& text, bool well_formed) {
+    const std::string reference = DescribeAST([&] {
+        return ParseFormulaASTWithAntlr(text);
+    });
+    auto fast = TryParseFormulaAST(text);
+    if (fast) {
+        ASSERT_EQUAL(DescribeAST([&] {
+                         return std::move(*fast);
+                     }),
+                     reference);
+    } else {
+        ASSERT(!well_formed);
+    }
+    ASSERT_EQUAL(DescribeAST([&] {
+                     return ParseFormulaAST(text);
+                 }),
+                 reference);
+}
+
+void TestFormulaParsersAgree() {
+    for (const char* text :
+         {"1", "1e5", "1E+5", "2e-3", ".5", "0.25e1", "-A1*B1", "--1", "+-+1", "+(A1+B1)/C1",
+          "A1-(B1-C1)", "A1/(B1*C1)", "(((1)))", " \r\n1\t+ A1 ", "A01", "SUM(B5:A1,2)",
+          "SUM( A1 : B2 , -C3 )", "MAX(MIN(A1:A3),AVERAGE(1,2))+1", "XFD16384+A1"}) {
+        CheckParsersAgree(text, true);
+    }
+    for (const char* text :
+         {"", " ", "1e", "1.", "1..2", "e5", "A1B1", "sum(A1)", "FOO(A1)", "SUM", "SUM()",
+          "SUM(A1:)", "SUM(:A1)", "SUM(A1:B2+1)", "SUM((A1:B2))", "A1:B2", "ZZZZ1", "A0",
+          "XFD16385", "A99999999999", "1e400", "1+", "(1", "1)", "1 2", "A1 B1", "1#", "*1"}) {
+        CheckParsersAgree(text, false);
+    }
+
+    std::mt19937 gen(9);
+    auto pick = [&](int n) {
+        return std::uniform_int_distribution<int>(0, n - 1)(gen);
+    };
+    auto spaces = [&] {
+        return std::string(pick(4) == 0 ? pick(3) : 0, " \t\n"[pick(3)]);
+    };
+    auto cell = [&] {
+        return Position{pick(30), pick(30)}.ToString();
+    };
+    std::function<std::string(int)> expr = [&](int depth) -> std::string {
+        switch (depth > 4 ? pick(2) : pick(7)) {
+            case 0: {
+                static const char* numbers[] = {"0", "7", "12.5", ".25", "3e2", "4E-1", "1.5e+3"};
+                return numbers[pick(7)];
+            }
+            case 1:
+                return cell();
+            case 2:
+                return std::string(1, "+-"[pick(2)]) + spaces() + expr(depth + 1);
+            case 3:
+                return "(" + spaces() + expr(depth + 1) + spaces() + ")";
+            case 4:
+            case 5:
+                return expr(depth + 1) + spaces() + "+-*/"[pick(4)] + spaces() + expr(depth + 1);
+            default: {
+                static const char* names[] = {"SUM", "AVERAGE", "MIN", "MAX"};
+                std::string text = std::string(names[pick(4)]) + "(";
+                for (int i = pick(3); i >= 0; --i) {
+                    text += pick(2) ? cell() + spaces() + ":" + spaces() + cell() : expr(depth + 1);
+                    text += i > 0 ? "," : "";
+                }
+                return text + ")";
+            }
+        }
+    };
+    for (int i = 0; i < 2000; ++i) {
+        std::string text = spaces() + expr(0) + spaces();
+        CheckParsersAgree(text, true);
+        // and a broken copy of it
+        text.insert(text.begin() + pick(text.size() + 1), "()+-*/:,.eE1A "[pick(14)]);
+        CheckParsersAgree(text, false);
+    }
+}
+
+void TestSharedFormulas() {
+    Sheet sheet;
+    for (int row = 0; row < 1000; ++row) {
+        const std::string r = std::to_string(row + 1);
+        sheet.SetCell(Position{row, 1}, std::to_string(row));
+        sheet.SetCell(Position{row, 2}, "2");
+        sheet.SetCell(Position{row, 0}, row % 2 ? "=B" + r + "*C" + r : "= B" + r + " * C" + r);
+        sheet.SetCell(Position{row, 3}, "=SUM(B" + r + ":C" + r + ")+1E5");
+    }
+    ASSERT_EQUAL(sheet.GetFormulaTable().GetSharedCount(), 2u);
+
+    for (int row : {0, 1, 499, 999}) {
+        const std::string r = std::to_string(row + 1);
+        const CellInterface* cell = sheet.GetCell(Position{row, 0});
+        ASSERT_EQUAL(cell->GetText(), "=B" + r + "*C" + r);
+        ASSERT_EQUAL(cell->GetValue(), CellInterface::Value(row * 2.0));
+        ASSERT_EQUAL(cell->GetReferencedCells(),
+                     (std::vector<Position>{Position{row, 1}, Position{row, 2}}));
+        ASSERT_EQUAL(sheet.GetCell(Position{row, 3})->GetText(), "=SUM(B" + r + ":C" + r + ")+100000");
+        ASSERT_EQUAL(sheet.GetCell(Position{row, 3})->GetValue(),
+                     CellInterface::Value(row + 2.0 + 1e5));
+    }
+
+    // a shared formula still depends on its own row only
+    sheet.SetCell("B500"_pos, "10");
+    ASSERT_EQUAL(sheet.GetCell("A500"_pos)->GetValue(), CellInterface::Value(20.0));
+    ASSERT_EQUAL(sheet.GetCell("A499"_pos)->GetValue(), CellInterface::Value(996.0));
+
+    // the same text in another cell is another formula
+    sheet.SetCell("E1"_pos, "=B2*C2");
+    sheet.SetCell("E2"_pos, "=B2*C2");
+    ASSERT_EQUAL(sheet.GetFormulaTable().GetSharedCount(), 4u);
+
+    // formulas no cell uses any more are dropped
+    for (int row = 0; row < 1000; ++row) {
+        sheet.ClearCell(Position{row, 3});
+    }
+    ASSERT_EQUAL(sheet.GetFormulaTable().GetSharedCount(), 3u);
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetText(), "=B2*C2");
+    ASSERT_EQUAL(sheet.GetCell("E2"_pos)->GetText(), "=B2*C2");
+}
+
+void TestBatchEdits() {
+    using Result = Sheet::EditResult;
+    {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "=B1");
+        sheet.SetCell("B1"_pos, "1");
+        // swapping the direction is only acyclic once both edits are made
+        auto results = sheet.ApplyBatch({{"B1"_pos, "=A1+1"}, {"A1"_pos, "2"}});
+        ASSERT(results == std::vector<Result>({Result::Applied, Result::Applied}));
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 3.0);
+
+        results = sheet.ApplyBatch({{"C1"_pos, "=B1"}, {"D1"_pos, "=1+"}, {Position::NONE, "1"}});
+        ASSERT(results == std::vector<Result>({Result::NotApplied, Result::FormulaSyntax,
+                                               Result::InvalidPosition}));
+        ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+
+        results = sheet.ApplyBatch({{"A2"_pos, "=B2"}, {"B2"_pos, "=A2"}, {"C2"_pos, "=A1*2"},
+                                    {"D2"_pos, "=SUM(A1:D4)"}, {"C2"_pos, "=A1*3"}},
+                                   Sheet::BatchMode::ValidSubset);
+        ASSERT(results == std::vector<Result>({Result::CircularDependency, Result::CircularDependency,
+                                               Result::Applied, Result::CircularDependency,
+                                               Result::Applied}));
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("C2"_pos)->GetValue()), 6.0);
+        ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+        ASSERT(sheet.GetCell("D2"_pos) == nullptr);
+
+        // the cached values of the cells reading the batch are dropped
+        sheet.SetCell("E1"_pos, "=SUM(A1:C2)");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("E1"_pos)->GetValue()), 11.0);
+        sheet.ApplyBatch({{"A1"_pos, "3"}, {"A3"_pos, "=E1"}});
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("E1"_pos)->GetValue()), 16.0);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A3"_pos)->GetValue()), 16.0);
+    }
+
+    // Random batches mixed with single edits: the edits after a batch check
+    // the order it left against the full search.
+    constexpr int SIZE = 8;
+    std::mt19937 gen(113);
+    std::uniform_int_distribution<int> coord(0, SIZE - 1);
+    std::uniform_int_distribution<int> ref_count(0, 2);
+    std::uniform_int_distribution<int> batch_size(1, 12);
+    auto random_pos = [&] {
+        return Position{coord(gen), coord(gen)};
+    };
+    auto random_text = [&](int edit) {
+        std::string text = "=1";
+        for (int i = ref_count(gen); i > 0; --i) {
+            text += "+" + random_pos().ToString();
+        }
+        if (edit % 4 == 0) {
+            text += "+SUM(" + random_pos().ToString() + ":" + random_pos().ToString() + ")";
+        }
+        return text;
+    };
+
+    Sheet sheet;
+    for (int round = 0; round < 300; ++round) {
+        std::vector<Sheet::CellEdit> edits;
+        for (int i = batch_size(gen); i > 0; --i) {
+            edits.push_back({random_pos(), random_text(i)});
+        }
+        const auto mode = round % 2 ? Sheet::BatchMode::Atomic : Sheet::BatchMode::ValidSubset;
+        sheet.ApplyBatch(edits, mode);
+
+        for (int edit = 0; edit < 5; ++edit) {
+            Position pos = random_pos();
+            std::string text = random_text(edit);
+            auto formula = ParseFormula(text.substr(1));
+            const bool acyclic = sheet.CycleCheck(pos, formula->GetReferences(), formula->GetRanges());
+            bool rejected = false;
+            try {
+                sheet.SetCell(pos, text);
+            } catch (const CircularDependencyException&) {
+                rejected = true;
+            }
+            ASSERT_EQUAL(rejected, !acyclic);
+        }
+    }
+
+    std::ostringstream values;
+    sheet.PrintValues(values);
+    Sheet rebuilt;
+    for (int row = 0; row < SIZE; ++row) {
+        for (int col = 0; col < SIZE; ++col) {
+            if (const CellInterface* cell = sheet.GetCell(Position{row, col})) {
+                rebuilt.SetCell(Position{row, col}, cell->GetText());
+            }
+        }
+    }
+    std::ostringstream rebuilt_values;
+    rebuilt.PrintValues(rebuilt_values);
+    ASSERT_EQUAL(values.str(), rebuilt_values.str());
+}
+
+void TestSnapshot() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("A2"_pos, "'=escaped");
+    sheet.SetCell("A3"_pos, "text");
+    sheet.SetCell("B1"_pos, "=A1*10");
+    sheet.SetCell("B2"_pos, "=SUM(A1:B1)+C5");
+    sheet.SetCell("B3"_pos, "=A3+1");
+    sheet.SetCell("B4"_pos, "=1/0");
+    sheet.SetCell("C1"_pos, "=B1+B2");
+    sheet.SetCell("D4"_pos, "");
+    sheet.GetCell("B2"_pos)->GetValue();
+    sheet.GetCell("B3"_pos)->GetValue();
+    sheet.GetCell("B4"_pos)->GetValue();
+
+    std::ostringstream output;
+    sheet.SaveSnapshot(output);
+    const std::string data = output.str();
+    auto loaded = Sheet::LoadSnapshot(data);
+
+    auto print = [](const Sheet& sheet) {
+        std::ostringstream texts;
+        sheet.PrintTexts(texts);
+        std::ostringstream values;
+        sheet.PrintValues(values);
+        return texts.str() + values.str();
+    };
+    ASSERT_EQUAL(loaded->GetPrintableSize(), sheet.GetPrintableSize());
+    // the stored values are answered without parsing a single formula
+    ASSERT_EQUAL(std::get<double>(loaded->GetCell("B2"_pos)->GetValue()), 22.0);
+    ASSERT_EQUAL(std::get<FormulaError>(loaded->GetCell("B3"_pos)->GetValue()),
+                 FormulaError(FormulaError::Category::Value));
+    ASSERT_EQUAL(loaded->GetFormulaTable().GetSharedCount(), 0u);
+    ASSERT_EQUAL(print(*loaded), print(sheet));
+    ASSERT(loaded->GetCell("C5"_pos) != nullptr);
+
+    // the graph is rebuilt: edits invalidate, cycles are still rejected
+    loaded->SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(std::get<double>(loaded->GetCell("C1"_pos)->GetValue()), 63.0);
+    try {
+        loaded->SetCell("A1"_pos, "=C1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+
+    const auto path = std::filesystem::temp_directory_path() / "spreadsheet_snapshot_test.bin";
+    {
+        std::ofstream file(path, std::ios::binary);
+        file << data;
+    }
+    auto mapped = Sheet::LoadSnapshotFile(path.string());
+    ASSERT_EQUAL(print(*mapped), print(sheet));
+    std::filesystem::remove(path);
+
+    auto expect_damaged = [](const std::string& data) {
+        try {
+            Sheet::LoadSnapshot(data);
+            ASSERT(false);
+        } catch (const SnapshotException&) {
+        }
+    };
+    expect_damaged("");
+    expect_damaged(data.substr(0, data.size() - 8));
+    expect_damaged(data + std::string(8, '\0'));
+    for (size_t i = 0; i < data.size(); i += 7) {
+        std::string damaged = data;
+        damaged[i] ^= 0x20;
+        expect_damaged(damaged);
+    }
+}
+
+void TestDelimitedImportExport() {
+    // tiny chunks: records and quoted fields are split across reads
+    for (size_t chunk_size : {size_t{1}, size_t{5}, DelimitedReader::DEFAULT_CHUNK_SIZE}) {
+        std::istringstream input("a,\"b,c\",\"say \"\"hi\"\"\"\r\n\r\n,\"multi\nline\",x\ny");
+        DelimitedReader reader(input, DelimitedFormat::Csv, chunk_size);
+        std::vector<std::string_view> fields;
+        std::vector<std::vector<std::string>> records;
+        while (reader.ReadRecord(fields)) {
+            records.emplace_back(fields.begin(), fields.end());
+        }
+        ASSERT(records == std::vector<std::vector<std::string>>({
+                              {"a", "b,c", "say \"hi\""}, {""}, {"", "multi\nline", "x"}, {"y"}}));
+    }
+
+    Sheet sheet;
+    std::istringstream input("1,text,=A1*3\n\n'=escaped,\"with, comma\",=1/0\n,=A1+,=B1+1\n");
+    const ImportResult result = ImportDelimited(sheet, input, DelimitedFormat::Csv);
+    ASSERT_EQUAL(result.rows, 4u);
+    ASSERT_EQUAL(result.cells, 7u);
+    ASSERT_EQUAL(result.failed, 1u);
+    ASSERT_EQUAL(result.errors[0].pos, "B4"_pos);
+    ASSERT(result.errors[0].result == Sheet::EditResult::FormulaSyntax);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 3.0);
+
+    sheet.SetCell("D1"_pos, "=A1/3");
+    std::ostringstream values;
+    ExportDelimited(sheet, values, DelimitedFormat::Csv);
+    ASSERT_EQUAL(values.str(), "1,text,3,0.3333333333333333\n,,,\n=escaped,\"with, comma\",#DIV/0!,\n,,#VALUE!,\n");
+
+    // texts go back in unchanged
+    std::ostringstream texts;
+    ExportDelimited(sheet, texts, DelimitedFormat::Tsv, ExportContent::Texts);
+    Sheet reloaded;
+    std::istringstream texts_input(texts.str());
+    ImportDelimited(reloaded, texts_input, DelimitedFormat::Tsv);
+    std::ostringstream expected;
+    sheet.PrintTexts(expected);
+    std::ostringstream actual;
+    reloaded.PrintTexts(actual);
+    ASSERT_EQUAL(actual.str(), expected.str());
+}
+
+void TestPrintSparseCells() {
+    // the printing that looks at every position of the printable area
+    auto print_dense = [](const Sheet& sheet, bool values) {
+        std::ostringstream output;
+        const Size size = sheet.GetPrintableSize();
+        for (int row = 0; row < size.rows; ++row) {
+            for (int col = 0; col < size.cols; ++col) {
+                if (col > 0) {
+                    output << '\t';
+                }
+                const CellInterface* cell = sheet.GetCell(Position{row, col});
+                if (!cell || cell->GetText().empty()) {
+                    continue;
+                }
+                if (!values) {
+                    output << cell->GetText();
+                } else {
+                    std::visit([&output](const auto& value) { output << value; }, cell->GetValue());
+                }
+            }
+            output << '\n';
+        }
+        return output.str();
+    };
+
+    std::mt19937 gen(5);
+    std::uniform_int_distribution<int> coord(0, 40);
+    std::uniform_int_distribution<int> kind(0, 5);
+    Sheet sheet;
+    for (int edit = 0; edit < 400; ++edit) {
+        const Position pos{coord(gen) * 7, coord(gen)};
+        switch (kind(gen)) {
+        case 0: sheet.ClearCell(pos); break;
+        case 1: sheet.SetCell(pos, ""); break;
+        case 2: sheet.SetCell(pos, "'=text"); break;
+        case 3: sheet.SetCell(pos, std::to_string(edit)); break;
+        default:
+            try {
+                sheet.SetCell(pos, "=" + Position{coord(gen) * 7, coord(gen)}.ToString() + "/2");
+            } catch (const CircularDependencyException&) {
+            }
+        }
+        if (edit % 50 == 0) {
+            std::ostringstream texts;
+            sheet.PrintTexts(texts);
+            ASSERT_EQUAL(texts.str(), print_dense(sheet, false));
+            std::ostringstream values;
+            sheet.PrintValues(values);
+            ASSERT_EQUAL(values.str(), print_dense(sheet, true));
+        }
+    }
+}
+
 }  // namespace
 
 void MyTestPrint(){
@@ -441,6 +1290,1165 @@ void MyTestGetPrintableSize(){
     }
 }
 
+void TestValueView() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "'=escaped");
+    sheet.SetCell("A2"_pos, "text");
+    sheet.SetCell("A3"_pos, "=1/0");
+    sheet.SetCell("A4"_pos, "=A5+2");
+    sheet.SetCell("A5"_pos, "3");
+
+    const CellInterface* escaped = sheet.GetCell("A1"_pos);
+    ASSERT_EQUAL(std::get<std::string_view>(escaped->GetValueView()), std::string_view("=escaped"));
+    ASSERT_EQUAL(std::get<std::string>(escaped->GetValue()), "=escaped");
+    // the view points into the cell, nothing is copied on the way out
+    const std::string_view text = std::get<std::string_view>(sheet.GetCell("A2"_pos)->GetValueView());
+    ASSERT(text.data() == std::get<std::string_view>(sheet.GetCell("A2"_pos)->GetValueView()).data());
+    ASSERT_EQUAL(std::get<FormulaError>(sheet.GetCell("A3"_pos)->GetValueView()),
+                 FormulaError(FormulaError::Category::Div0));
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A4"_pos)->GetValueView()), 5.0);
+    ASSERT(static_cast<const Cell*>(sheet.GetCell("A4"_pos))->HasCache());
+    ASSERT(!static_cast<const Cell*>(sheet.GetCell("A5"_pos))->HasCache());
+
+    sheet.SetCell("A5"_pos, "4");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A4"_pos)->GetValueView()), 6.0);
+}
+
+void TestPrintableSizeCounters() {
+    // the printable area is tracked by per-row and per-column counters, a
+    // brute force over the set cells is the reference
+    std::mt19937 gen(17);
+    std::uniform_int_distribution<int> coord(0, 40);
+    std::uniform_int_distribution<int> action(0, 4);
+    Sheet sheet;
+    std::set<Position> printable;
+    for (int i = 0; i < 5000; ++i) {
+        const Position pos{coord(gen), coord(gen)};
+        switch (action(gen)) {
+            case 0:
+                sheet.ClearCell(pos);
+                printable.erase(pos);
+                break;
+            case 1:
+                sheet.SetCell(pos, "");
+                printable.insert(pos);
+                break;
+            case 2: {
+                // the cells a formula reads stay out of the area until set
+                const Position ref{coord(gen) + 100, coord(gen) + 100};
+                try {
+                    sheet.SetCell(pos, "=" + ref.ToString());
+                    printable.insert(pos);
+                } catch (const CircularDependencyException&) {
+                }
+                break;
+            }
+            default:
+                sheet.SetCell(pos, "text");
+                printable.insert(pos);
+        }
+        Size expected{0, 0};
+        for (const Position& cell : printable) {
+            expected.rows = std::max(expected.rows, cell.row + 1);
+            expected.cols = std::max(expected.cols, cell.col + 1);
+        }
+        ASSERT_EQUAL(sheet.GetPrintableSize(), expected);
+    }
+
+    std::ostringstream texts;
+    sheet.PrintTexts(texts);
+    std::ostringstream snapshot;
+    sheet.SaveSnapshot(snapshot);
+    const std::string data = snapshot.str();
+    auto loaded = Sheet::LoadSnapshot(data);
+    ASSERT_EQUAL(loaded->GetPrintableSize(), sheet.GetPrintableSize());
+    std::ostringstream loaded_texts;
+    loaded->PrintTexts(loaded_texts);
+    ASSERT_EQUAL(loaded_texts.str(), texts.str());
+}
+
+void TestDependencyGraph() {
+    // random edits against a map of sets, the dependents come in row order
+    std::mt19937 gen(23);
+    std::uniform_int_distribution<int> coord(0, 30);
+    DependencyGraph graph;
+    std::map<Position, std::set<Position>> expected;
+    for (int i = 0; i < 20000; ++i) {
+        const Position cell{coord(gen) * 500, coord(gen) % 4};
+        const Position dependent{coord(gen), coord(gen) * 500};
+        if (gen() % 3 == 0) {
+            graph.RemoveEdge(cell, dependent);
+            auto it = expected.find(cell);
+            if (it != expected.end() && it->second.erase(dependent) && it->second.empty()) {
+                expected.erase(it);
+            }
+        } else {
+            graph.AddEdge(cell, dependent);
+            expected[cell].insert(dependent);
+        }
+        ASSERT_EQUAL(graph.HasDependents(cell), expected.count(cell) > 0);
+    }
+    size_t edges = 0;
+    for (const auto& [cell, dependents] : expected) {
+        std::vector<Position> found;
+        graph.ForEachDependent(cell, [&found](Position dependent) {
+            found.push_back(dependent);
+        });
+        ASSERT(found == std::vector<Position>(dependents.begin(), dependents.end()));
+        edges += dependents.size();
+    }
+    ASSERT_EQUAL(graph.GetCellCount(), expected.size());
+    ASSERT_EQUAL(graph.GetEdgeCount(), edges);
+    for (const auto& [cell, dependents] : expected) {
+        for (const Position& dependent : dependents) {
+            graph.RemoveEdge(cell, dependent);
+        }
+    }
+    ASSERT_EQUAL(graph.GetCellCount(), 0u);
+    ASSERT_EQUAL(graph.GetEdgeCount(), 0u);
+
+    // the empty cells made for references go away with the last formula
+    // reading them, the cells set by the user stay
+    Sheet sheet;
+    sheet.SetCell("B1"_pos, "=A1");
+    ASSERT(sheet.GetCell("A1"_pos) != nullptr);
+    sheet.SetCell("B1"_pos, "=A2+A3");
+    ASSERT(sheet.GetCell("A1"_pos) == nullptr);
+    sheet.SetCell("A2"_pos, "5");
+    sheet.SetCell("C1"_pos, "=A3*2");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(5.0));
+    sheet.ClearCell("B1"_pos);
+    ASSERT(sheet.GetCell("A2"_pos) != nullptr);
+    ASSERT(sheet.GetCell("A3"_pos) != nullptr);
+    sheet.SetCell("A3"_pos, "4");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(8.0));
+    sheet.ClearCell("A3"_pos);
+    ASSERT(sheet.GetCell("A3"_pos) != nullptr);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(0.0));
+    sheet.ClearCell("C1"_pos);
+    ASSERT(sheet.GetCell("A3"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{2, 1}));
+}
+
+void TestConcurrentReaders() {
+    constexpr int ROWS = 2000;
+    constexpr size_t THREADS = 8;
+    auto fill = [](Sheet& sheet, int input) {
+        for (int row = 0; row < 10; ++row) {
+            sheet.SetCell(Position{row, 0}, std::to_string(row + input));
+        }
+        sheet.SetCell(Position{0, 1}, "=A1");
+        for (int row = 1; row < ROWS; ++row) {
+            const std::string r = std::to_string(row);
+            sheet.SetCell(Position{row, 1}, "=B" + r + "+A" + std::to_string(row % 10 + 1));
+            if (row % 100 == 0) {
+                sheet.SetCell(Position{row, 2}, "=SUM(B1:B" + r + ")/A1");
+            }
+        }
+    };
+    Sheet sheet;
+    fill(sheet, 0);
+    for (int input : {0, 1}) {
+        if (input > 0) {
+            sheet.SetCell("A1"_pos, "1");
+        }
+        Sheet reference;
+        fill(reference, 0);
+        reference.SetCell("A1"_pos, std::to_string(input));
+        std::ostringstream expected;
+        reference.PrintValues(expected);
+
+        // every thread reads the cells in its own order, from the deepest
+        // ones for some of them, then prints the whole sheet
+        Sheet::ResetStats();
+        std::vector<std::string> printed(THREADS);
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < THREADS; ++t) {
+            threads.emplace_back([&, t]() {
+                for (int i = 0; i < ROWS * 3; ++i) {
+                    const int index = (i * 7 + static_cast<int>(t) * 613) % (ROWS * 3);
+                    const int row = t % 2 ? ROWS - 1 - index / 3 : index / 3;
+                    sheet.GetNumericValue(Position{row, index % 3});
+                }
+                std::ostringstream output;
+                sheet.PrintValues(output);
+                printed[t] = output.str();
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        for (const std::string& output : printed) {
+            ASSERT_EQUAL(output, expected.str());
+        }
+#ifdef SPREADSHEET_STATS
+        // each formula is computed once however many threads read it
+        ASSERT_EQUAL(Sheet::GetStats().Get(StatCounter::Evaluations), uint64_t{ROWS + ROWS / 100 - 1});
+#endif
+    }
+}
+
+void TestErrorPropagation() {
+    for (auto category : {FormulaError::Category::Ref, FormulaError::Category::Value,
+                          FormulaError::Category::Div0}) {
+        const double boxed = FormulaAST::BoxError(category);
+        ASSERT(std::isnan(boxed));
+        ASSERT_EQUAL(FormulaAST::UnboxError(boxed), FormulaError(category));
+    }
+    ASSERT_EQUAL(FormulaAST::UnboxError(std::numeric_limits<double>::quiet_NaN()),
+                 FormulaError(FormulaError::Category::Value));
+
+    Sheet sheet;
+    auto error = [&sheet](std::string_view pos) {
+        return std::get<FormulaError>(sheet.GetCell(Position::FromString(pos))->GetValue());
+    };
+    const FormulaError div0(FormulaError::Category::Div0);
+    const FormulaError value(FormulaError::Category::Value);
+    sheet.SetCell("A1"_pos, "=1/0");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.SetCell("A3"_pos, "=SUM(A1:A2)");
+    // the first error the evaluation runs into wins, the right operand of an
+    // operator is computed first
+    sheet.SetCell("A4"_pos, "=1/0+A1");
+    sheet.SetCell("A5"_pos, "=A1+1/0");
+    sheet.SetCell("A6"_pos, "=AVERAGE(B1:B2)");
+    sheet.SetCell("A7"_pos, "=MAX(A1,1/0)");
+    sheet.SetCell("A8"_pos, "=MAX(1/0,A1)");
+    ASSERT_EQUAL(error("A1"), div0);
+    ASSERT_EQUAL(error("A2"), value);
+    ASSERT_EQUAL(error("A3"), value);
+    ASSERT_EQUAL(error("A4"), value);
+    ASSERT_EQUAL(error("A5"), div0);
+    ASSERT_EQUAL(error("A6"), div0);
+    ASSERT_EQUAL(error("A7"), value);
+    ASSERT_EQUAL(error("A8"), div0);
+
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A3"_pos)->GetValue()), 5.0);
+    ASSERT_EQUAL(error("A4"), div0);
+    ASSERT_EQUAL(error("A5"), div0);
+}
+
+void TestEngineStats() {
+    // the buckets cover every value in order, the bounds are tight
+    for (uint64_t value : {uint64_t{0}, uint64_t{7}, uint64_t{8}, uint64_t{9}, uint64_t{1000},
+                           uint64_t{123456789}, std::numeric_limits<uint64_t>::max()}) {
+        const size_t bucket = StatsHistogram::BucketOf(value);
+        ASSERT(bucket < StatsHistogram::BUCKETS);
+        ASSERT(value <= StatsHistogram::BucketUpperBound(bucket));
+        ASSERT(bucket == 0 || StatsHistogram::BucketUpperBound(bucket - 1) < value);
+    }
+    StatsHistogram histogram;
+    for (uint64_t value = 1; value <= 100; ++value) {
+        histogram.Add(StatsHistogram::BucketOf(value), 1);
+        histogram.AddSum(value);
+    }
+    ASSERT_EQUAL(histogram.GetMean(), 50.5);
+    ASSERT(histogram.GetPercentile(0.5) >= 50 && histogram.GetPercentile(0.5) <= 57);
+    ASSERT(histogram.GetPercentile(1.0) >= 100 && histogram.GetPercentile(1.0) <= 113);
+
+    Sheet::ResetStats();
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.SetCell("A3"_pos, "=A2*2");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A3"_pos)->GetValue()), 4.0);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A3"_pos)->GetValue()), 4.0);
+    sheet.SetCell("A1"_pos, "2");
+
+    const EngineStats stats = Sheet::GetStats();
+#ifdef SPREADSHEET_STATS
+    ASSERT(stats.enabled);
+    ASSERT_EQUAL(stats.Get(StatCounter::SetCells), uint64_t{4});
+    ASSERT_EQUAL(stats.Get(StatHistogram::SetCellLatency).GetCount(), uint64_t{4});
+    ASSERT_EQUAL(stats.Get(StatCounter::Parses), uint64_t{2});
+    ASSERT_EQUAL(stats.Get(StatHistogram::ParseLatency).GetCount(), uint64_t{2});
+    ASSERT_EQUAL(stats.Get(StatCounter::CycleChecks), uint64_t{2});
+    // A3 computes A2, the second read hits the cache
+    ASSERT_EQUAL(stats.Get(StatCounter::Evaluations), uint64_t{2});
+    ASSERT_EQUAL(stats.Get(StatCounter::CacheMisses), uint64_t{2});
+    ASSERT_EQUAL(stats.Get(StatCounter::CacheHits), uint64_t{1});
+    ASSERT_EQUAL(stats.GetCacheHitRatio(), 1.0 / 3);
+    // only the last edit finds cached values to clear
+    ASSERT_EQUAL(stats.Get(StatCounter::Invalidations), uint64_t{4});
+    ASSERT_EQUAL(stats.Get(StatCounter::CellsInvalidated), uint64_t{2});
+    ASSERT_EQUAL(stats.Get(StatHistogram::CellsInvalidatedPerEdit).GetPercentile(1.0), uint64_t{2});
+
+    // the values of finished threads are kept
+    std::thread([] {
+        Sheet other;
+        other.SetCell("B1"_pos, "x");
+    }).join();
+    ASSERT_EQUAL(Sheet::GetStats().Get(StatCounter::SetCells), uint64_t{5});
+#else
+    ASSERT(!stats.enabled);
+    ASSERT_EQUAL(stats.Get(StatCounter::SetCells), uint64_t{0});
+#endif
+}
+
+void TestSheetViews() {
+    constexpr int ROWS = 200;
+    constexpr size_t THREADS = 4;
+    auto fill = [](Sheet& sheet) {
+        for (int row = 0; row < ROWS; ++row) {
+            const std::string r = std::to_string(row + 1);
+            sheet.SetCell(Position{row, 0}, std::to_string(row));
+            sheet.SetCell(Position{row, 1}, "=A" + r + "*2" + (row > 0 ? "+B" + std::to_string(row) : ""));
+        }
+        sheet.SetCell("C1"_pos, "=SUM(B1:B200)");
+        sheet.SetCell("D1"_pos, "text");
+    };
+    auto print = [](const SheetInterface& sheet) {
+        std::ostringstream texts;
+        sheet.PrintTexts(texts);
+        std::ostringstream values;
+        sheet.PrintValues(values);
+        return texts.str() + values.str();
+    };
+    Sheet reference;
+    fill(reference);
+    const std::string expected = print(reference);
+
+    Sheet sheet;
+    fill(sheet);
+    // half of the values are cached when the view is taken
+    sheet.GetCell(Position{ROWS / 2, 1})->GetValue();
+    const CellInterface* a1 = sheet.GetCell("A1"_pos);
+    Sheet::ResetStats();
+    std::shared_ptr<const SheetView> view = sheet.Snapshot();
+
+    // the readers compute the rest of the view while the sheet is changed
+    std::vector<std::string> printed(THREADS);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < THREADS; ++t) {
+        threads.emplace_back([&, t]() {
+            for (int row = ROWS - 1; row >= 0; row -= static_cast<int>(t) + 1) {
+                view->GetCell(Position{row, 1})->GetValue();
+            }
+            printed[t] = print(*view);
+        });
+    }
+    for (int row = 0; row < ROWS; row += 3) {
+        sheet.SetCell(Position{row, 0}, "=" + std::to_string(row) + "+1");
+        sheet.GetCell(Position{row / 2, 1})->GetValue();
+    }
+    sheet.ClearCell("D1"_pos);
+    sheet.SetCell("E5"_pos, "new");
+    sheet.SetCell("C1"_pos, "=B200");
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    for (const std::string& output : printed) {
+        ASSERT_EQUAL(output, expected);
+    }
+    ASSERT_EQUAL(print(*view), expected);
+    ASSERT_EQUAL(view->GetPrintableSize(), (Size{ROWS, 4}));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ROWS, 5}));
+    ASSERT_EQUAL(a1->GetText(), "=0+1");
+    ASSERT_EQUAL(view->GetCell("A1"_pos)->GetText(), "0");
+    ASSERT(view->GetCell("E5"_pos) == nullptr);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()),
+                 std::get<double>(reference.GetCell(Position{ROWS - 1, 1})->GetValue()) + 2 * 67);
+    try {
+        std::const_pointer_cast<SheetView>(view)->SetCell("A1"_pos, "1");
+        ASSERT(false);
+    } catch (const ReadOnlySheetException&) {
+    }
+
+    // what only the view held is freed with it, by the next change of the sheet
+    view.reset();
+    sheet.SetCell("A1"_pos, "0");
+#ifdef SPREADSHEET_STATS
+    const EngineStats stats = Sheet::GetStats();
+    ASSERT(stats.Get(StatCounter::RetiredEntries) > 0);
+    ASSERT_EQUAL(stats.Get(StatCounter::ReclaimedEntries), stats.Get(StatCounter::RetiredEntries));
+#endif
+
+    // a view outlives its sheet, formulas loaded without values are parsed
+    // by the view through the sheet's formula table
+    Sheet unread;
+    fill(unread);
+    std::ostringstream saved;
+    unread.SaveSnapshot(saved);
+    const std::string data = saved.str();
+    auto loaded = Sheet::LoadSnapshot(data);
+    view = loaded->Snapshot();
+    loaded->SetCell("A1"_pos, "100");
+    loaded.reset();
+    ASSERT_EQUAL(print(*view), expected);
+}
+
+void TestStructuralEdits() {
+    auto texts = [](const SheetInterface& sheet) {
+        std::ostringstream output;
+        sheet.PrintTexts(output);
+        return output.str();
+    };
+    auto number = [](const Sheet& sheet, Position pos) {
+        return std::get<double>(sheet.GetCell(pos)->GetValue());
+    };
+    const FormulaError ref_error(FormulaError::Category::Ref);
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2");
+    sheet.SetCell("A3"_pos, "3");
+    sheet.SetCell("B1"_pos, "=A3*10");
+    sheet.SetCell("B4"_pos, "=SUM(A1:A3)");
+    sheet.SetCell("C1"_pos, "=A2+1");
+    const CellInterface* a3 = sheet.GetCell("A3"_pos);
+    ASSERT_EQUAL(number(sheet, "B4"_pos), 6.0);
+
+    // the cells after the inserted rows move, and so do the references to them
+    sheet.InsertRows(1, 2);
+    ASSERT(sheet.GetCell("A5"_pos) == a3);
+    ASSERT_EQUAL(a3->GetText(), "3");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A5*10");
+    ASSERT_EQUAL(sheet.GetCell("B6"_pos)->GetText(), "=SUM(A1:A5)");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=A4+1");
+    ASSERT_EQUAL(sheet.GetCell("B6"_pos)->GetReferencedCells(),
+                 (std::vector<Position>{"A1"_pos, "A2"_pos, "A3"_pos, "A4"_pos, "A5"_pos}));
+    // the range itself is one item, at its logical corners
+    const Cell* b6 = static_cast<const Cell*>(sheet.GetCell("B6"_pos));
+    ASSERT(b6->GetReferences().empty());
+    ASSERT(b6->GetRanges() == (std::vector{Range{"A1"_pos, "A5"_pos}}));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{6, 3}));
+    ASSERT_EQUAL(number(sheet, "B1"_pos), 30.0);
+    // the inserted rows are empty, a range spanning them covers them
+    ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+    sheet.SetCell("A2"_pos, "10");
+    ASSERT_EQUAL(number(sheet, "B6"_pos), 16.0);
+    // a formula set now reads the cells where they are now
+    sheet.SetCell("D1"_pos, "=A5+A2");
+    ASSERT_EQUAL(number(sheet, "D1"_pos), 13.0);
+    sheet.SetCell("A5"_pos, "4");
+    ASSERT_EQUAL(number(sheet, "D1"_pos), 14.0);
+    ASSERT_EQUAL(number(sheet, "B1"_pos), 40.0);
+
+    // a view keeps the sheet as it was
+    std::shared_ptr<const SheetView> view = sheet.Snapshot();
+    const std::string viewed = texts(*view);
+
+    // the references to deleted cells become #REF!, a range loses the
+    // deleted rows
+    sheet.DeleteRows(4, 1);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=#REF!*10");
+    ASSERT_EQUAL(std::get<FormulaError>(sheet.GetCell("B1"_pos)->GetValue()), ref_error);
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=#REF!+A2");
+    ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetText(), "=SUM(A1:A4)");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=A4+1");
+    ASSERT_EQUAL(number(sheet, "B5"_pos), 13.0);
+    ASSERT_EQUAL(number(sheet, "C1"_pos), 3.0);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{5, 4}));
+    ASSERT_EQUAL(texts(*view), viewed);
+    ASSERT_EQUAL(view->GetCell("A5"_pos)->GetText(), "4");
+    ASSERT_EQUAL(std::get<double>(view->GetCell("B1"_pos)->GetValue()), 40.0);
+
+    // the same for the columns
+    sheet.InsertColumns(0, 1);
+    ASSERT_EQUAL(sheet.GetCell("C5"_pos)->GetText(), "=SUM(B1:B4)");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=B4+1");
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetText(), "=#REF!+B2");
+    ASSERT_EQUAL(number(sheet, "C5"_pos), 13.0);
+    sheet.DeleteColumns(1, 1);
+    ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetText(), "=SUM(#REF!)");
+    ASSERT_EQUAL(std::get<FormulaError>(sheet.GetCell("B5"_pos)->GetValue()), ref_error);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=#REF!+1");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=#REF!+#REF!");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{5, 4}));
+
+    // a range with a corner in the deleted columns shrinks
+    Sheet columns;
+    for (int col = 0; col < 5; ++col) {
+        columns.SetCell(Position{0, col}, std::to_string(col + 1));
+    }
+    columns.SetCell("A2"_pos, "=SUM(B1:D1)");
+    columns.SetCell("A3"_pos, "=SUM(A1:E1)");
+    columns.DeleteColumns(2, 3);
+    ASSERT_EQUAL(columns.GetCell("A2"_pos)->GetText(), "=SUM(B1:B1)");
+    ASSERT_EQUAL(columns.GetCell("A3"_pos)->GetText(), "=SUM(A1:B1)");
+    ASSERT_EQUAL(std::get<double>(columns.GetCell("A3"_pos)->GetValue()), 3.0);
+    ASSERT_EQUAL(columns.GetPrintableSize(), (Size{3, 2}));
+
+    // the texts printed through the layout are shared by concurrent readers,
+    // a new layout prints them again
+    const std::string printed = texts(sheet);
+    sheet.InsertRows(20, 1);
+    std::vector<std::string> read(4);
+    std::vector<std::thread> readers;
+    for (size_t t = 0; t < read.size(); ++t) {
+        readers.emplace_back([&, t]() {
+            read[t] = texts(sheet);
+        });
+    }
+    for (std::thread& reader : readers) {
+        reader.join();
+    }
+    for (const std::string& output : read) {
+        ASSERT_EQUAL(output, printed);
+    }
+
+    // the stored snapshot is the sheet as it looks
+    std::ostringstream saved;
+    sheet.SaveSnapshot(saved);
+    const std::string data = saved.str();
+    auto loaded = Sheet::LoadSnapshot(data);
+    ASSERT_EQUAL(texts(*loaded), texts(sheet));
+    loaded->SetCell("A2"_pos, "20");
+    sheet.SetCell("A2"_pos, "20");
+    std::ostringstream loaded_values;
+    loaded->PrintValues(loaded_values);
+    std::ostringstream values;
+    sheet.PrintValues(values);
+    ASSERT_EQUAL(loaded_values.str(), values.str());
+
+    // a deleted reference may be typed in
+    sheet.SetCell("F1"_pos, "=#REF!+1");
+    ASSERT_EQUAL(sheet.GetCell("F1"_pos)->GetText(), "=#REF!+1");
+    ASSERT_EQUAL(std::get<FormulaError>(sheet.GetCell("F1"_pos)->GetValue()), ref_error);
+
+    // batches and cycle checks go by where the cells are now
+    std::vector<Sheet::EditResult> results = sheet.ApplyBatch({{"G1"_pos, "=SUM(G2:G3)"}, {"G3"_pos, "=G1"}});
+    ASSERT(results[1] == Sheet::EditResult::CircularDependency);
+    results = sheet.ApplyBatch({{"G1"_pos, "=SUM(A1:A4)"}, {"G3"_pos, "=G1"}});
+    ASSERT(results[0] == Sheet::EditResult::Applied && results[1] == Sheet::EditResult::Applied);
+    ASSERT_EQUAL(number(sheet, "G3"_pos), 20.0);
+    try {
+        sheet.SetCell("A3"_pos, "=G3");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+
+    // inserting pushes the last rows off the sheet, but never a printed cell
+    Sheet edge;
+    const Position last{Position::MAX_ROWS - 1, 0};
+    edge.SetCell(last, "1");
+    try {
+        edge.InsertRows(0, 1);
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+    edge.ClearCell(last);
+    edge.SetCell("A1"_pos, "=SUM(B1:B16384)+A16384");
+    edge.InsertRows(0, 1);
+    ASSERT_EQUAL(edge.GetCell("A2"_pos)->GetText(), "=SUM(B2:B16384)+#REF!");
+    for (auto [first, count] : {std::pair{-1, 1}, std::pair{0, -1}, std::pair{Position::MAX_ROWS, 1},
+                                std::pair{1, Position::MAX_ROWS}}) {
+        try {
+            edge.DeleteRows(first, count);
+            ASSERT(false);
+        } catch (const InvalidPositionException&) {
+        }
+    }
+}
+
+// A sheet edited at random against a plain model of it. The formulas add up
+// cells and ranges to the left of their own column, so the model computes
+// them without an order; a deleted reference is kept as none and only
+// makes the value an error.
+void TestStructuralEditsAgainstModel() {
+    constexpr int ROWS = 12;
+    constexpr int COLS = 8;
+    struct Term {
+        std::optional<Range> range;
+        bool is_range;
+    };
+    struct ModelCell {
+        int number = 0;
+        std::vector<Term> terms;
+        bool is_formula = false;
+    };
+    std::map<Position, ModelCell> model;
+
+    auto term_text = [](const Term& term) {
+        const std::string cells = !term.range ? "#REF!" : term.is_range ? term.range->ToString()
+                                                                        : term.range->top_left.ToString();
+        return term.is_range ? "SUM(" + cells + ")" : cells;
+    };
+    auto text = [&](const ModelCell& cell) {
+        if (!cell.is_formula) {
+            return std::to_string(cell.number);
+        }
+        std::string result = "=";
+        for (size_t i = 0; i < cell.terms.size(); ++i) {
+            result += (i > 0 ? "+" : "") + term_text(cell.terms[i]);
+        }
+        return result;
+    };
+    std::function<std::optional<int>(Position)> value = [&](Position pos) -> std::optional<int> {
+        auto it = model.find(pos);
+        if (it == model.end()) {
+            return 0;
+        }
+        if (!it->second.is_formula) {
+            return it->second.number;
+        }
+        int sum = 0;
+        for (const Term& term : it->second.terms) {
+            if (!term.range) {
+                return std::nullopt;
+            }
+            for (int row = term.range->top_left.row; row <= term.range->bottom_right.row; ++row) {
+                for (int col = term.range->top_left.col; col <= term.range->bottom_right.col; ++col) {
+                    const std::optional<int> cell = value(Position{row, col});
+                    if (!cell) {
+                        return std::nullopt;
+                    }
+                    sum += *cell;
+                }
+            }
+        }
+        return sum;
+    };
+
+    // an index of the edited axis after the edit, none if it was deleted
+    auto move_index = [](int index, bool insert, int first, int count) -> std::optional<int> {
+        if (insert) {
+            return index < first ? index : index + count;
+        }
+        if (index < first) {
+            return index;
+        }
+        if (index < first + count) {
+            return std::nullopt;
+        }
+        return index - count;
+    };
+
+    std::mt19937 random(25);
+    Sheet sheet;
+    for (int step = 0; step < 400; ++step) {
+        const int action = static_cast<int>(random() % 10);
+        if (action < 6) {
+            const Position pos{static_cast<int>(random() % ROWS), static_cast<int>(random() % COLS)};
+            ModelCell cell;
+            if (pos.col == 0 || random() % 3 == 0) {
+                cell.number = static_cast<int>(random() % 100);
+            } else {
+                cell.is_formula = true;
+                const int terms = 1 + static_cast<int>(random() % 3);
+                for (int i = 0; i < terms; ++i) {
+                    const int col = static_cast<int>(random() % pos.col);
+                    const int row = static_cast<int>(random() % ROWS);
+                    if (random() % 2 == 0) {
+                        cell.terms.push_back({Range{{row, col}, {row, col}}, false});
+                    } else {
+                        const int last_col = col + static_cast<int>(random() % (pos.col - col));
+                        const int last_row = std::min(ROWS - 1, row + static_cast<int>(random() % 4));
+                        cell.terms.push_back({Range{{row, col}, {last_row, last_col}}, true});
+                    }
+                }
+            }
+            sheet.SetCell(pos, text(cell));
+            model[pos] = cell;
+            continue;
+        }
+
+        const bool rows = random() % 2 == 0;
+        const bool insert = action < 8;
+        const int first = static_cast<int>(random() % (rows ? ROWS : COLS));
+        const int count = 1 + static_cast<int>(random() % 3);
+        if (rows) {
+            insert ? sheet.InsertRows(first, count) : sheet.DeleteRows(first, count);
+        } else {
+            insert ? sheet.InsertColumns(first, count) : sheet.DeleteColumns(first, count);
+        }
+        auto move = [&](Position pos) -> std::optional<Position> {
+            const std::optional<int> index = move_index(rows ? pos.row : pos.col, insert, first, count);
+            if (!index) {
+                return std::nullopt;
+            }
+            return rows ? Position{*index, pos.col} : Position{pos.row, *index};
+        };
+        std::map<Position, ModelCell> moved;
+        for (auto& [pos, cell] : model) {
+            const std::optional<Position> to = move(pos);
+            if (!to) {
+                continue;
+            }
+            for (Term& term : cell.terms) {
+                if (!term.range) {
+                    continue;
+                }
+                // the cells of the range left after the edit, looked at one by one
+                std::optional<Range> left;
+                const Range range = *term.range;
+                for (int row = range.top_left.row; row <= range.bottom_right.row; ++row) {
+                    for (int col = range.top_left.col; col <= range.bottom_right.col; ++col) {
+                        if (const std::optional<Position> cell_to = move(Position{row, col})) {
+                            if (!left) {
+                                left = Range{*cell_to, *cell_to};
+                            }
+                            left->bottom_right = *cell_to;
+                        }
+                    }
+                }
+                term.range = left;
+            }
+            moved[*to] = cell;
+        }
+        model = std::move(moved);
+
+        int printable_rows = 0;
+        int printable_cols = 0;
+        for (const auto& [pos, cell] : model) {
+            printable_rows = std::max(printable_rows, pos.row + 1);
+            printable_cols = std::max(printable_cols, pos.col + 1);
+            const CellInterface* sheet_cell = sheet.GetCell(pos);
+            ASSERT(sheet_cell != nullptr);
+            ASSERT_EQUAL(sheet_cell->GetText(), text(cell));
+            if (!cell.is_formula) {
+                continue;
+            }
+            const std::optional<int> expected = value(pos);
+            const CellInterface::Value actual = sheet_cell->GetValue();
+            if (expected) {
+                ASSERT_EQUAL(std::get<double>(actual), static_cast<double>(*expected));
+            } else {
+                // #REF! itself, or #VALUE! read from a cell holding it
+                ASSERT(std::holds_alternative<FormulaError>(actual));
+            }
+        }
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{printable_rows, printable_cols}));
+    }
+}
+
+// The edits the durability tests make, numbered like the journal records:
+// numbers, formulas reading them and a clear every fifth edit
+template <typename SheetType>
+void MakeDurableEdit(SheetType& sheet, uint64_t edit) {
+    const Position pos{static_cast<int>(edit * 7 % 50), static_cast<int>(edit % 3)};
+    if (edit % 5 == 0) {
+        sheet.ClearCell(pos);
+    } else if (pos.col == 2) {
+        sheet.SetCell(pos, "=A" + std::to_string(edit % 50 + 1) + "+B1*" + std::to_string(edit));
+    } else {
+        sheet.SetCell(pos, std::to_string(edit));
+    }
+}
+
+void TestIndexMapMoves() {
+    constexpr int SIZE = 1000;
+    IndexMap map(SIZE);
+    std::vector<int> model(SIZE);
+    for (int i = 0; i < SIZE; ++i) {
+        model[i] = i;
+    }
+    auto move = [&](int from, int count, int to) {
+        map.Move(from, count, to);
+        std::vector<int> taken(model.begin() + from, model.begin() + from + count);
+        model.erase(model.begin() + from, model.begin() + from + count);
+        model.insert(model.begin() + to, taken.begin(), taken.end());
+    };
+    auto check = [&] {
+        for (int logical = 0; logical < SIZE; ++logical) {
+            ASSERT_EQUAL(map.ToPhysical(logical), model[logical]);
+            ASSERT_EQUAL(map.ToLogical(model[logical]), logical);
+        }
+        size_t runs = 0;
+        int next = 0;
+        map.ForEachRun(0, SIZE - 1, [&](int logical, int physical, int length) {
+            ASSERT_EQUAL(logical, next);
+            for (int i = 0; i < length; ++i) {
+                ASSERT_EQUAL(physical + i, model[logical + i]);
+            }
+            next += length;
+            ++runs;
+        });
+        ASSERT_EQUAL(next, SIZE);
+        ASSERT_EQUAL(runs, map.GetRunCount());
+    };
+
+    // every other one of the last indexes put right after the first one: the
+    // labels between the same two runs run out and are spread again
+    for (int i = 0; i < 200; ++i) {
+        move(map.ToLogical(SIZE - 1 - 2 * i), 1, 1);
+    }
+    check();
+    ASSERT(!map.IsIdentity());
+
+    const IndexMap copy = map;
+    std::mt19937 gen(31);
+    for (int i = 0; i < 2000; ++i) {
+        const int count = std::uniform_int_distribution<int>(1, 20)(gen);
+        const int from = std::uniform_int_distribution<int>(0, SIZE - count)(gen);
+        const int to = std::uniform_int_distribution<int>(0, SIZE - count)(gen);
+        move(from, count, to);
+        if (i % 100 == 0) {
+            check();
+        }
+    }
+    check();
+    // a copy doesn't see the moves made after it
+    ASSERT_EQUAL(copy.ToPhysical(1), SIZE - 399);
+    ASSERT_EQUAL(copy.ToPhysical(200), SIZE - 1);
+    ASSERT_EQUAL(copy.GetRunCount(), 401u);
+
+    // putting every index back where it was leaves a single run
+    for (int logical = 0; logical < SIZE; ++logical) {
+        const int at = static_cast<int>(std::find(model.begin(), model.end(), logical) - model.begin());
+        move(at, 1, logical);
+    }
+    check();
+    ASSERT(map.IsIdentity());
+}
+
+std::string PrintDurable(const SheetInterface& sheet) {
+    std::ostringstream texts;
+    sheet.PrintTexts(texts);
+    std::ostringstream values;
+    sheet.PrintValues(values);
+    return texts.str() + values.str();
+}
+
+void TestDurableSheet() {
+    const auto directory = std::filesystem::temp_directory_path() / "spreadsheet_durable_test";
+    std::filesystem::remove_all(directory);
+    const std::string journal = (directory / "journal").string();
+    constexpr uint64_t EDITS = 40;
+
+    // the state after each number of edits
+    std::vector<std::string> expected;
+    {
+        Sheet reference;
+        expected.push_back(PrintDurable(reference));
+        for (uint64_t edit = 1; edit <= EDITS; ++edit) {
+            MakeDurableEdit(reference, edit);
+            expected.push_back(PrintDurable(reference));
+        }
+    }
+
+    {
+        DurableSheet sheet(directory.string());
+        for (uint64_t edit = 1; edit <= EDITS; ++edit) {
+            MakeDurableEdit(sheet, edit);
+        }
+        // rejected edits are not logged
+        try {
+            sheet.SetCell("A1"_pos, "=A1");
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        try {
+            sheet.SetCell(Position{-1, 0}, "1");
+            ASSERT(false);
+        } catch (const InvalidPositionException&) {
+        }
+        ASSERT_EQUAL(sheet.GetLastSequence(), EDITS);
+        ASSERT_EQUAL(PrintDurable(*sheet.Snapshot()), expected[EDITS]);
+    }
+    {
+        DurableSheet sheet(directory.string());
+        ASSERT_EQUAL(sheet.GetLastSequence(), EDITS);
+        ASSERT_EQUAL(PrintDurable(*sheet.Snapshot()), expected[EDITS]);
+    }
+
+    // a journal cut anywhere replays the edits before the cut
+    std::string data;
+    {
+        std::ifstream input(journal, std::ios::binary);
+        data.assign(std::istreambuf_iterator<char>(input), {});
+    }
+    for (size_t size = sizeof(JournalHeader); size <= data.size(); size += 5) {
+        {
+            std::ofstream output(journal, std::ios::binary | std::ios::trunc);
+            output << data.substr(0, size);
+        }
+        DurableSheet sheet(directory.string());
+        ASSERT(sheet.GetLastSequence() <= EDITS);
+        ASSERT_EQUAL(PrintDurable(*sheet.Snapshot()), expected[sheet.GetLastSequence()]);
+        // the torn tail is cut off, new edits follow the intact ones
+        ASSERT(std::filesystem::file_size(journal) <= size);
+    }
+    // one damaged in the middle is not cut, the synced edits after the
+    // damage would be lost
+    {
+        std::string damaged = data;
+        damaged[sizeof(JournalHeader) + offsetof(JournalRecord, sequence)] ^= 0x20;
+        {
+            std::ofstream output(journal, std::ios::binary | std::ios::trunc);
+            output << damaged;
+        }
+        try {
+            DurableSheet sheet(directory.string());
+            ASSERT(false);
+        } catch (const JournalException&) {
+        }
+        ASSERT_EQUAL(std::filesystem::file_size(journal), uint64_t{damaged.size()});
+        std::ofstream output(journal, std::ios::binary | std::ios::trunc);
+        output << data;
+    }
+
+    // the pages of the last write may reach the disk out of order: with one
+    // in the middle missing, its intact records are not acknowledged edits
+    // and are cut off along with the damaged ones; records of a later write
+    // would have followed a synced one
+    const auto tear_last_write = [&](bool one_write) {
+        const std::string text(3000, '7');
+        std::string torn = data;
+        for (uint64_t sequence = EDITS + 1; sequence <= EDITS + 6; ++sequence) {
+            JournalRecord record{};
+            record.sequence = sequence;
+            record.row = static_cast<int>(sequence);
+            record.text_size = static_cast<uint32_t>(text.size());
+            record.kind = JournalRecordKind::Set;
+            record.write_offset[0] = one_write ? static_cast<uint8_t>(sequence - EDITS - 1) : 0;
+            std::string bytes(reinterpret_cast<const char*>(&record), sizeof(record));
+            bytes += text;
+            record.checksum = SnapshotChecksum(bytes.data() + sizeof(record.checksum),
+                                               bytes.size() - sizeof(record.checksum));
+            std::memcpy(bytes.data(), &record.checksum, sizeof(record.checksum));
+            bytes.resize((bytes.size() + 7) / 8 * 8);
+            torn += bytes;
+        }
+        const size_t page = (data.size() + 2 * 3032) / 4096 * 4096;
+        std::fill(torn.begin() + page, torn.begin() + page + 4096, '\0');
+        std::ofstream output(journal, std::ios::binary | std::ios::trunc);
+        output << torn;
+        return page;
+    };
+    {
+        const size_t page = tear_last_write(true);
+        uint64_t replayed = 0;
+        {
+            Journal log(journal, 0, [&](const JournalEntry& entry) {
+                ASSERT_EQUAL(entry.sequence, replayed + 1);
+                replayed = entry.sequence;
+            });
+            ASSERT(replayed >= EDITS && replayed < EDITS + 3);
+            ASSERT_EQUAL(log.GetLastSequence(), replayed);
+        }
+        ASSERT(std::filesystem::file_size(journal) <= page);
+        tear_last_write(false);
+        try {
+            Journal log(journal, 0, [](const JournalEntry&) {});
+            ASSERT(false);
+        } catch (const JournalException&) {
+        }
+        std::ofstream output(journal, std::ios::binary | std::ios::trunc);
+        output << data;
+    }
+
+    // a checkpoint starts the journal over, the edits after it are replayed on top
+    {
+        DurableSheet sheet(directory.string());
+        ASSERT_EQUAL(PrintDurable(*sheet.Snapshot()), expected[EDITS]);
+        sheet.Checkpoint();
+        ASSERT_EQUAL(sheet.GetJournalSize(), uint64_t{sizeof(JournalHeader)});
+        sheet.SetCell("E1"_pos, "=A1+1");
+        ASSERT_EQUAL(sheet.GetLastSequence(), EDITS + 1);
+    }
+    {
+        DurableSheet sheet(directory.string());
+        ASSERT_EQUAL(sheet.GetLastSequence(), EDITS + 1);
+        ASSERT_EQUAL(sheet.Snapshot()->GetCell("E1"_pos)->GetText(), "=A1+1");
+        sheet.ClearCell("E1"_pos);
+        ASSERT_EQUAL(PrintDurable(*sheet.Snapshot()), expected[EDITS]);
+    }
+
+    // concurrent edits share their syncs, a small limit folds the journal
+    // into checkpoints while they go on
+    std::filesystem::remove_all(directory);
+    {
+        DurableSheetOptions options;
+        options.checkpoint_bytes = 4096;
+        DurableSheet sheet(directory.string(), options);
+        Sheet::ResetStats();
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&sheet, t]() {
+                for (int row = 0; row < 200; ++row) {
+                    sheet.SetCell(Position{row, t}, std::to_string(row * t));
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        // the checkpoints are written in the background, the journal kept
+        // only the records after the last one
+        ASSERT(sheet.GetJournalSize() < 800 * sizeof(JournalRecord));
+        sheet.Checkpoint();
+        ASSERT_EQUAL(sheet.GetJournalSize(), uint64_t{sizeof(JournalHeader)});
+#ifdef SPREADSHEET_STATS
+        const EngineStats stats = Sheet::GetStats();
+        ASSERT_EQUAL(stats.Get(StatCounter::JournalRecords), 800u);
+        ASSERT(stats.Get(StatCounter::JournalSyncs) <= 800u);
+#endif
+    }
+    {
+        DurableSheet sheet(directory.string());
+        ASSERT_EQUAL(sheet.GetLastSequence(), 800u);
+        ASSERT_EQUAL(sheet.Snapshot()->GetPrintableSize(), (Size{200, 4}));
+        ASSERT_EQUAL(sheet.Snapshot()->GetCell("D200"_pos)->GetText(), "597");
+        size_t checkpoints = 0;
+        for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+            checkpoints += entry.path().filename().string().rfind("checkpoint.", 0) == 0;
+        }
+        ASSERT_EQUAL(checkpoints, 1u);
+    }
+
+    // structural edits are journaled and replayed, on top of a checkpoint too
+    std::filesystem::remove_all(directory);
+    {
+        DurableSheet sheet(directory.string());
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A3"_pos, "3");
+        sheet.SetCell("B1"_pos, "=A3+A1");
+        sheet.EditStructure({StructuralEdit::Kind::InsertRows, 1, 2});
+        sheet.EditStructure({StructuralEdit::Kind::InsertColumns, 0, 1});
+        ASSERT_EQUAL(sheet.Snapshot()->GetCell("C1"_pos)->GetText(), "=B5+B1");
+        try {
+            sheet.EditStructure({StructuralEdit::Kind::DeleteRows, -1, 1});
+            ASSERT(false);
+        } catch (const InvalidPositionException&) {
+        }
+    }
+    {
+        DurableSheet sheet(directory.string());
+        ASSERT_EQUAL(sheet.GetLastSequence(), 5u);
+        ASSERT_EQUAL(sheet.Snapshot()->GetCell("C1"_pos)->GetText(), "=B5+B1");
+        sheet.Checkpoint();
+        sheet.EditStructure({StructuralEdit::Kind::DeleteRows, 4, 1});
+    }
+    {
+        DurableSheet sheet(directory.string());
+        std::shared_ptr<const SheetView> view = sheet.Snapshot();
+        ASSERT_EQUAL(view->GetCell("C1"_pos)->GetText(), "=#REF!+B1");
+        ASSERT_EQUAL(view->GetPrintableSize(), (Size{1, 3}));
+    }
+    std::filesystem::remove_all(directory);
+}
+
+// Kills a process editing a durable sheet at random points, checkpoints
+// included, and checks that the sheet it leaves behind holds every edit the
+// process saw return and the edits before them, in order.
+void TestDurableSheetCrashRecovery() {
+#ifndef _WIN32
+    const auto directory = std::filesystem::temp_directory_path() / "spreadsheet_crash_test";
+    std::filesystem::remove_all(directory);
+    DurableSheetOptions options;
+    options.checkpoint_bytes = 2048;
+    // the last edit the child saw return
+    auto* acknowledged = static_cast<std::atomic<uint64_t>*>(
+        mmap(nullptr, sizeof(std::atomic<uint64_t>), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+    ASSERT(acknowledged != MAP_FAILED);
+
+    std::mt19937 random(2024);
+    Sheet reference;
+    uint64_t applied = 0;
+    for (int round = 0; round < 30; ++round) {
+        acknowledged->store(0);
+        const pid_t child = fork();
+        ASSERT(child >= 0);
+        if (child == 0) {
+            DurableSheet sheet(directory.string(), options);
+            for (uint64_t edit = sheet.GetLastSequence() + 1;; ++edit) {
+                MakeDurableEdit(sheet, edit);
+                acknowledged->store(edit);
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(random() % 20000));
+        kill(child, SIGKILL);
+        int status = 0;
+        waitpid(child, &status, 0);
+
+        DurableSheet sheet(directory.string(), options);
+        const uint64_t recovered = sheet.GetLastSequence();
+        ASSERT(recovered >= acknowledged->load());
+        ASSERT(recovered >= applied);
+        for (; applied < recovered; ++applied) {
+            MakeDurableEdit(reference, applied + 1);
+        }
+        ASSERT_EQUAL(PrintDurable(*sheet.Snapshot()), PrintDurable(reference));
+    }
+    munmap(acknowledged, sizeof(std::atomic<uint64_t>));
+    std::filesystem::remove_all(directory);
+#endif
+}
+
+// The writes fail once the files reach the size limit, the failure comes
+// between the check of an edit and its record
+void TestJournalWriteFailure() {
+#ifndef _WIN32
+    const auto directory = std::filesystem::temp_directory_path() / "spreadsheet_failure_test";
+    std::filesystem::remove_all(directory);
+    const std::string journal = (directory / "journal").string();
+    // the limit is for the whole process, the child takes it
+    const pid_t child = fork();
+    ASSERT(child >= 0);
+    if (child == 0) {
+        try {
+            std::signal(SIGXFSZ, SIG_IGN);
+            {
+                DurableSheet sheet(directory.string());
+                sheet.SetCell("A1"_pos, "1");
+                Journal log(journal + ".raw", 0, [](const JournalEntry&) {});
+                log.CheckHealthy();
+                const rlimit limit{std::filesystem::file_size(journal + ".raw"), RLIM_INFINITY};
+                ASSERT(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+                // what an edit checked just before the failure appends
+                const uint64_t failed = log.Append(JournalRecordKind::Set, "A1"_pos, "1");
+                try {
+                    log.WaitDurable(failed);
+                    ASSERT(false);
+                } catch (const JournalException&) {
+                }
+                const uint64_t dropped = log.Append(JournalRecordKind::Clear, "A1"_pos);
+                ASSERT_EQUAL(dropped, failed + 1);
+                try {
+                    log.WaitDurable(dropped);
+                    ASSERT(false);
+                } catch (const JournalException&) {
+                }
+
+                // the edit under way is applied, waiting for it throws; the
+                // ones after the failure leave no trace
+                const uint64_t under_way = sheet.SetCellAsync("A2"_pos, "2");
+                try {
+                    sheet.WaitDurable(under_way);
+                    ASSERT(false);
+                } catch (const JournalException&) {
+                }
+                ASSERT_EQUAL(sheet.Snapshot()->GetCell("A2"_pos)->GetText(), "2");
+                const std::string before = PrintDurable(*sheet.Snapshot());
+                try {
+                    sheet.SetCellAsync("A3"_pos, "3");
+                    ASSERT(false);
+                } catch (const JournalException&) {
+                }
+                try {
+                    sheet.ClearCellAsync("A1"_pos);
+                    ASSERT(false);
+                } catch (const JournalException&) {
+                }
+                try {
+                    sheet.EditStructureAsync({StructuralEdit::Kind::InsertRows, 0, 1});
+                    ASSERT(false);
+                } catch (const JournalException&) {
+                }
+                ASSERT_EQUAL(PrintDurable(*sheet.Snapshot()), before);
+            }
+            const rlimit unlimited{RLIM_INFINITY, RLIM_INFINITY};
+            ASSERT(setrlimit(RLIMIT_FSIZE, &unlimited) == 0);
+            // the edits before the failure are all there is
+            DurableSheet sheet(directory.string());
+            ASSERT_EQUAL(sheet.GetLastSequence(), 1u);
+            ASSERT(sheet.Snapshot()->GetCell("A2"_pos) == nullptr);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            _exit(1);
+        }
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(child, &status, 0);
+    ASSERT(WIFEXITED(status));
+    ASSERT_EQUAL(WEXITSTATUS(status), 0);
+    std::filesystem::remove_all(directory);
+#endif
+}
+
 int main() {
     TestRunner tr;
     RUN_TEST(tr, TestPositionAndStringConversion);
@@ -464,5 +2472,34 @@ int main() {
     RUN_TEST(tr, TestCellCircularReferences);
     RUN_TEST(tr, MyTestPrint);
     RUN_TEST(tr, MyTestGetPrintableSize);
+    RUN_TEST(tr, TestSparseStorage);
+    RUN_TEST(tr, TestFormulaLongExpressions);
+    RUN_TEST(tr, TestInvalidationThroughDiamonds);
+    RUN_TEST(tr, TestCycleCheckOnDiamonds);
+    RUN_TEST(tr, TestCycleDetectionOnRandomEdits);
+    RUN_TEST(tr, TestParallelRecalculation);
+    RUN_TEST(tr, TestRangeFunctions);
+    RUN_TEST(tr, TestRangeDependencies);
+    RUN_TEST(tr, TestRangeCycleDetectionOnRandomEdits);
+    RUN_TEST(tr, TestNumericTextConformance);
+    RUN_TEST(tr, TestFormulaParsersAgree);
+    RUN_TEST(tr, TestSharedFormulas);
+    RUN_TEST(tr, TestBatchEdits);
+    RUN_TEST(tr, TestSnapshot);
+    RUN_TEST(tr, TestDelimitedImportExport);
+    RUN_TEST(tr, TestPrintSparseCells);
+    RUN_TEST(tr, TestValueView);
+    RUN_TEST(tr, TestEngineStats);
+    RUN_TEST(tr, TestErrorPropagation);
+    RUN_TEST(tr, TestPrintableSizeCounters);
+    RUN_TEST(tr, TestDependencyGraph);
+    RUN_TEST(tr, TestConcurrentReaders);
+    RUN_TEST(tr, TestSheetViews);
+    RUN_TEST(tr, TestStructuralEdits);
+    RUN_TEST(tr, TestStructuralEditsAgainstModel);
+    RUN_TEST(tr, TestIndexMapMoves);
+    RUN_TEST(tr, TestDurableSheet);
+    RUN_TEST(tr, TestDurableSheetCrashRecovery);
+    RUN_TEST(tr, TestJournalWriteFailure);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,122 @@
+#include "numeric_text.h"
+
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <string>
+
+namespace {
+
+bool IsSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\n';
+}
+
+bool IsDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+size_t SkipDigits(std::string_view text, size_t i) {
+    while(i < text.size() && IsDigit(text[i])){
+        ++i;
+    }
+    return i;
+}
+
+// [eE]-?[1-9][0-9]* up to the end of text
+bool IsExponent(std::string_view text) {
+    if(text.empty() || (text[0] != 'e' && text[0] != 'E')){
+        return false;
+    }
+    size_t i = 1;
+    if(i < text.size() && text[i] == '-'){
+        ++i;
+    }
+    if(i == text.size() || text[i] < '1' || text[i] > '9'){
+        return false;
+    }
+    return SkipDigits(text, i + 1) == text.size();
+}
+
+// (.[0-9]+)?([eE]-?[1-9][0-9]*)? up to the end of text. The digits after
+// the wildcard can't end early since the exponent starts with a letter.
+bool IsFractionAndExponent(std::string_view text) {
+    if(text.empty() || IsExponent(text)){
+        return true;
+    }
+    if(text[0] == '\n' || text[0] == '\r'){
+        return false;
+    }
+    size_t end = SkipDigits(text, 1);
+    if(end == 1){
+        return false;
+    }
+    return end == text.size() || IsExponent(text.substr(end));
+}
+
+bool Matches(std::string_view number) {
+    size_t i = 0;
+    if(i < number.size() && number[i] == '-'){
+        ++i;
+    }
+    if(i == number.size() || !IsDigit(number[i])){
+        return false;
+    }
+    if(number[i] == '0'){
+        return IsFractionAndExponent(number.substr(i + 1));
+    }
+    // Any split of the leading digits between the integer part and the
+    // wildcard leaves the same tail, so the longest integer part is enough.
+    return IsFractionAndExponent(number.substr(SkipDigits(number, i)));
+}
+
+// What std::stod does with a text that is already known to match
+std::optional<double> Convert(std::string_view number) {
+    const bool negative = number[0] == '-';
+    const size_t digits = negative ? 1 : 0;
+    double value = 0;
+    std::from_chars_result result;
+    if(number.size() > digits + 2 && number[digits] == '0'
+       && (number[digits + 1] == 'x' || number[digits + 1] == 'X')){
+        const char* first = number.data() + digits + 2;
+        result = std::from_chars(first, number.data() + number.size(), value, std::chars_format::hex);
+        value = negative ? -value : value;
+    }
+    else{
+        result = std::from_chars(number.data(), number.data() + number.size(), value);
+    }
+    if(result.ec != std::errc{}){
+        return std::nullopt;
+    }
+    // strtod reports an inexact subnormal result as a range error, leave
+    // telling those apart to strtod itself
+    if(value != 0 && std::fabs(value) <= std::numeric_limits<double>::min()){
+        std::string copy(number);
+        errno = 0;
+        value = std::strtod(copy.c_str(), nullptr);
+        if(errno == ERANGE){
+            return std::nullopt;
+        }
+    }
+    return value;
+}
+
+}  // namespace
+
+std::optional<double> ParseNumericText(std::string_view text) {
+    size_t first = 0;
+    while(first < text.size() && IsSpace(text[first])){
+        ++first;
+    }
+    // the number itself always ends with a digit
+    size_t last = text.size();
+    while(last > first && IsSpace(text[last - 1])){
+        --last;
+    }
+    std::string_view number = text.substr(first, last - first);
+    if(!Matches(number)){
+        return std::nullopt;
+    }
+    return Convert(number);
+}
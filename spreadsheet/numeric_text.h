@@ -0,0 +1,13 @@
+#pragma once
+
+#include <optional>
+#include <string_view>
+
+// Number represented by the text of a cell, if any. Formulas have always
+// accepted text matching
+//     [ \t\n]*(-?)(0|([1-9][0-9]*))(.[0-9]+)?([eE]-?[1-9][0-9]*)?[ \t\n]*
+// ('.' being any character but a line break) and taken std::stod of it,
+// which reads the longest numeric prefix, "0x" hex included, and fails when
+// the result is out of range. This scanner gives exactly the same results
+// without a regex and mostly without strtod.
+std::optional<double> ParseNumericText(std::string_view text);
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "sparse_grid.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Number of cells in each row (or each column) of a sheet and the extent of
+// the used ones, one past the last index with a cell. Counts are kept in
+// blocks of 64 indices allocated while any of them is in use, a two-level
+// bitmap of the non-zero counts finds the new extent in O(1) when the last
+// row empties.
+class OccupancyCounter {
+public:
+    // no row or column holds more than 16384 cells
+    using Count = uint16_t;
+
+    explicit OccupancyCounter(int size)
+        : blocks_((size + 63) / 64)
+        , words_(blocks_.size())
+        , summary_((words_.size() + 63) / 64)
+    {}
+
+    void Add(int index) {
+        std::unique_ptr<Block>& block = blocks_[index >> 6];
+        if (!block) {
+            block = std::make_unique<Block>();
+        }
+        if ((*block)[index & 63]++ == 0) {
+            words_[index >> 6] |= Bit(index);
+            summary_[index >> 12] |= Bit(index >> 6);
+            extent_ = std::max(extent_, index + 1);
+        }
+    }
+
+    void Remove(int index) {
+        std::unique_ptr<Block>& block = blocks_[index >> 6];
+        if (--(*block)[index & 63] != 0) {
+            return;
+        }
+        uint64_t& word = words_[index >> 6];
+        word &= ~Bit(index);
+        if (!word) {
+            block.reset();
+            summary_[index >> 12] &= ~Bit(index >> 6);
+        }
+        if (index + 1 == extent_) {
+            extent_ = FindExtent();
+        }
+    }
+
+    int GetExtent() const {
+        return extent_;
+    }
+
+    // The last index in [first, last] with a cell, -1 if there is none
+    int FindLast(int first, int last) const {
+        for (int word = last >> 6; word >= first >> 6; --word) {
+            uint64_t bits = words_[word];
+            if (word == last >> 6 && (last & 63) != 63) {
+                bits &= (Bit(last) << 1) - 1;
+            }
+            if (word == first >> 6) {
+                bits &= ~(Bit(first) - 1);
+            }
+            if (bits) {
+                return static_cast<int>(word * 64 + grid_detail::HighestBit(bits));
+            }
+        }
+        return -1;
+    }
+
+private:
+    static uint64_t Bit(int index) {
+        return uint64_t{1} << (index & 63);
+    }
+
+    int FindExtent() const {
+        for (size_t i = summary_.size(); i-- > 0;) {
+            if (summary_[i]) {
+                const size_t word = i * 64 + grid_detail::HighestBit(summary_[i]);
+                return static_cast<int>(word * 64 + grid_detail::HighestBit(words_[word]) + 1);
+            }
+        }
+        return 0;
+    }
+
+    using Block = std::array<Count, 64>;
+
+    std::vector<std::unique_ptr<Block>> blocks_;
+    // a bit per index with a non-zero count and a bit per non-zero word
+    std::vector<uint64_t> words_;
+    std::vector<uint64_t> summary_;
+    int extent_ = 0;
+};
@@ -0,0 +1,141 @@
+#include "range_index.h"
+
+#include <algorithm>
+#include <tuple>
+
+bool RangeIndex::Less(const Entry& lhs, const Entry& rhs) const{
+    if(!layout_ || layout_->IsIdentity()){
+        return std::tie(lhs.range, lhs.owner) < std::tie(rhs.range, rhs.owner);
+    }
+    // the owners only break ties, their physical order will do
+    const Range lhs_range = layout_->ToLogical(lhs.range);
+    const Range rhs_range = layout_->ToLogical(rhs.range);
+    if(!(lhs_range == rhs_range)){
+        return lhs_range < rhs_range;
+    }
+    return lhs.owner < rhs.owner;
+}
+
+bool RangeIndex::Entry::operator==(const Entry& rhs) const{
+    return range == rhs.range && owner == rhs.owner;
+}
+
+void RangeIndex::SetLayout(const SheetLayout* layout){
+    layout_ = layout;
+}
+
+void RangeIndex::Insert(const Range& range, Position owner){
+    uint32_t index;
+    if(!free_nodes_.empty()){
+        index = free_nodes_.back();
+        free_nodes_.pop_back();
+    }
+    else{
+        index = static_cast<uint32_t>(nodes_.size());
+        nodes_.emplace_back();
+    }
+    nodes_[index] = Node{{range, owner}, range.bottom_right.row, NextPriority()};
+
+    uint32_t left;
+    uint32_t right;
+    Split(root_, nodes_[index].entry, left, right);
+    root_ = Merge(Merge(left, index), right);
+    ++size_;
+    if(corner_cols_.empty()){
+        corner_cols_.resize(Position::MAX_COLS);
+    }
+    ++corner_cols_[range.top_left.col];
+    ++corner_cols_[range.bottom_right.col];
+}
+
+void RangeIndex::Erase(const Range& range, Position owner){
+    const size_t size = size_;
+    root_ = EraseFrom(root_, Entry{range, owner});
+    if(size_ < size){
+        --corner_cols_[range.top_left.col];
+        --corner_cols_[range.bottom_right.col];
+    }
+}
+
+size_t RangeIndex::Size() const{
+    return size_;
+}
+
+void RangeIndex::Update(uint32_t index){
+    Node& node = nodes_[index];
+    // the physical row which is the last one in the logical order
+    auto last = [this](int lhs, int rhs){
+        return ToLogicalRow(lhs) < ToLogicalRow(rhs) ? rhs : lhs;
+    };
+    node.max_last_row = node.entry.range.bottom_right.row;
+    if(node.left != NONE){
+        node.max_last_row = last(node.max_last_row, nodes_[node.left].max_last_row);
+    }
+    if(node.right != NONE){
+        node.max_last_row = last(node.max_last_row, nodes_[node.right].max_last_row);
+    }
+}
+
+// left gets the entries ordered before key, right the rest
+void RangeIndex::Split(uint32_t index, const Entry& key, uint32_t& left, uint32_t& right){
+    if(index == NONE){
+        left = NONE;
+        right = NONE;
+        return;
+    }
+    if(Less(nodes_[index].entry, key)){
+        Split(nodes_[index].right, key, nodes_[index].right, right);
+        left = index;
+    }
+    else{
+        Split(nodes_[index].left, key, left, nodes_[index].left);
+        right = index;
+    }
+    Update(index);
+}
+
+uint32_t RangeIndex::Merge(uint32_t left, uint32_t right){
+    if(left == NONE){
+        return right;
+    }
+    if(right == NONE){
+        return left;
+    }
+    if(nodes_[left].priority > nodes_[right].priority){
+        nodes_[left].right = Merge(nodes_[left].right, right);
+        Update(left);
+        return left;
+    }
+    nodes_[right].left = Merge(left, nodes_[right].left);
+    Update(right);
+    return right;
+}
+
+uint32_t RangeIndex::EraseFrom(uint32_t index, const Entry& key){
+    if(index == NONE){
+        return NONE;
+    }
+    Node& node = nodes_[index];
+    if(node.entry == key){
+        uint32_t merged = Merge(node.left, node.right);
+        free_nodes_.push_back(index);
+        --size_;
+        return merged;
+    }
+    if(Less(key, node.entry)){
+        node.left = EraseFrom(node.left, key);
+    }
+    else{
+        node.right = EraseFrom(node.right, key);
+    }
+    Update(index);
+    return index;
+}
+
+uint32_t RangeIndex::NextPriority(){
+    // xorshift32, the treap only needs the priorities to look random
+    seed_ ^= seed_ << 13;
+    seed_ ^= seed_ >> 17;
+    seed_ ^= seed_ << 5;
+    return seed_;
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include "common.h"
+#include "sheet_layout.h"
+
+#include <cstdint>
+#include <vector>
+
+// Index of the ranges read by formulas, answering which of them contain a
+// given cell. It is an interval tree over the rows of the ranges: a treap
+// ordered by the first row where every node knows the largest last row in
+// its subtree. A lookup costs O(log n) plus the ranges spanning the row, the
+// columns are checked on those only.
+//
+// The ranges of a sheet whose rows or columns were moved are stored at
+// physical positions and compared in the logical order of its layout. A
+// move keeps that order for every range whose corners were not moved, the
+// others have to be erased before the move and inserted again after it.
+class RangeIndex {
+public:
+    // The layout the ranges are ordered by, none compares them as they are
+    void SetLayout(const SheetLayout* layout);
+
+    void Insert(const Range& range, Position owner);
+    void Erase(const Range& range, Position owner);
+
+    // Calls func(owner) for every range containing pos
+    template <typename Func>
+    void ForEachContaining(Position pos, Func&& func) const{
+        const Position logical = layout_ ? layout_->ToLogical(pos) : pos;
+        auto check = [&](const Entry& entry){
+            if(ToLogical(entry.range).Contains(logical)){
+                func(entry.owner);
+            }
+        };
+        Query(root_, logical.row, logical.row, check);
+    }
+
+    // Calls func(range, owner) for every range reaching into the logical
+    // rows [first_row, last_row]
+    template <typename Func>
+    void ForEachInRows(int first_row, int last_row, Func&& func) const{
+        auto call = [&](const Entry& entry){
+            func(entry.range, entry.owner);
+        };
+        Query(root_, first_row, last_row, call);
+    }
+
+    // Calls func(range, owner) for every range with a corner in the logical
+    // columns [first_col, last_col]. The index is ordered by rows, so this
+    // goes through every range unless none has a corner there.
+    template <typename Func>
+    void ForEachInColumns(int first_col, int last_col, Func&& func) const{
+        if(corner_cols_.empty()){
+            return;
+        }
+        bool found = false;
+        auto count = [&](int, int physical, int length){
+            for(int col = physical; col < physical + length && !found; ++col){
+                found = corner_cols_[col] > 0;
+            }
+        };
+        if(layout_){
+            layout_->cols.ForEachRun(first_col, last_col, count);
+        }
+        else{
+            count(first_col, first_col, last_col - first_col + 1);
+        }
+        if(!found){
+            return;
+        }
+        auto call = [&](const Range& range, Position owner){
+            const Range logical = ToLogical(range);
+            if((first_col <= logical.top_left.col && logical.top_left.col <= last_col)
+               || (first_col <= logical.bottom_right.col && logical.bottom_right.col <= last_col)){
+                func(range, owner);
+            }
+        };
+        Walk(root_, call);
+    }
+
+    size_t Size() const;
+
+private:
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    struct Entry{
+        Range range;
+        Position owner;
+
+        bool operator==(const Entry& rhs) const;
+    };
+
+    struct Node{
+        Entry entry;
+        // physical, the last of the subtree in the logical order
+        int max_last_row;
+        uint32_t priority;
+        uint32_t left = NONE;
+        uint32_t right = NONE;
+    };
+
+    // calls func(entry) for the entries reaching into the logical rows
+    template <typename Func>
+    void Query(uint32_t index, int first_row, int last_row, Func& func) const{
+        while(index != NONE){
+            const Node& node = nodes_[index];
+            if(ToLogicalRow(node.max_last_row) < first_row){
+                return;
+            }
+            Query(node.left, first_row, last_row, func);
+            // the rest of the subtree starts below the rows
+            if(ToLogicalRow(node.entry.range.top_left.row) > last_row){
+                return;
+            }
+            if(ToLogicalRow(node.entry.range.bottom_right.row) >= first_row){
+                func(node.entry);
+            }
+            index = node.right;
+        }
+    }
+
+    template <typename Func>
+    void Walk(uint32_t index, Func& func) const{
+        for(; index != NONE; index = nodes_[index].right){
+            Walk(nodes_[index].left, func);
+            func(nodes_[index].entry.range, nodes_[index].entry.owner);
+        }
+    }
+
+    int ToLogicalRow(int row) const{
+        return layout_ ? layout_->rows.ToLogical(row) : row;
+    }
+    Range ToLogical(const Range& range) const{
+        return layout_ ? layout_->ToLogical(range) : range;
+    }
+    bool Less(const Entry& lhs, const Entry& rhs) const;
+
+    void Update(uint32_t index);
+    void Split(uint32_t index, const Entry& key, uint32_t& left, uint32_t& right);
+    uint32_t Merge(uint32_t left, uint32_t right);
+    uint32_t EraseFrom(uint32_t index, const Entry& key);
+    uint32_t NextPriority();
+
+    const SheetLayout* layout_ = nullptr;
+    // the corners of the ranges per physical column, taken once a range is
+    // inserted
+    std::vector<uint32_t> corner_cols_;
+    std::vector<Node> nodes_;
+    std::vector<uint32_t> free_nodes_;
+    uint32_t root_ = NONE;
+    uint32_t seed_ = 2463534242u;
+    size_t size_ = 0;
+};
@@ -2,219 +2,1074 @@
 
 #include "cell.h"
 #include "common.h"
+#include "stats.h"
 
 #include <algorithm>
+#include <atomic>
 #include <functional>
 #include <iostream>
+#include <limits>
 #include <optional>
 
 using namespace std::literals;
 
 Sheet::Sheet()
-    : no_empty_cell_sorted_to_column_(Comp())
-{}
+    : formulas_(std::make_shared<FormulaTable>())
+    , printable_rows_(Position::MAX_ROWS)
+    , printable_cols_(Position::MAX_COLS)
+    , cell_cols_(Position::MAX_COLS)
+{
+    range_dependents_.SetLayout(&spreadsheet_.GetLayout());
+}
 
 void Sheet::SetCell(Position pos, std::string text) {
-    std::unique_ptr<Cell> new_cell = TryCreateCell(pos, text);
-    auto refs = new_cell->GetReferencedCells();
-    if(!CycleCheck(pos, refs)){
+    stats::ScopedTimer timer(StatHistogram::SetCellLatency);
+    stats::Add(StatCounter::SetCells);
+    // the formula is parsed where the user sees it
+    CellSlot new_cell = TryCreateCell(pos, std::move(text));
+    pos = ToPhysical(pos);
+    if(!PlaceInOrder(pos, new_cell)){
+        spreadsheet_.Release(new_cell);
         throw CircularDependencyException("Сycle check was not successful"s);
     }
-    UpdateSize(pos);
+    InsertCell(pos, new_cell);
+    Invalidate(pos);
+}
+
+// Puts the cell into the grid and the dependency graph in place of the old
+// one, the order and the caches are up to the caller
+void Sheet::InsertCell(Position pos, CellSlot cell){
     DeleteDependencies(pos);
-    auto& ptr_to_cell = spreadsheet_[pos.row][pos.col];
-    ptr_to_cell.reset(new_cell.release());
-    for(const Position& cell : ptr_to_cell->GetReferencedCells()){
-        AddRefToCell(cell, pos);
-    }
-    no_empty_cell_sorted_to_column_.insert(pos);
-    no_empty_cell_sorted_to_row_.insert(pos);
-    ClearCache(pos);
+    AddCell(pos, cell);
+    EraseUnreferenced();
 }
 
-const CellInterface* Sheet::GetCell(Position pos) const {
-    if(!pos.IsValid()){
-        throw InvalidPositionException("Position of cell is not valid"s);
+// InsertCell for a position whose dependencies are already deleted, the
+// placeholders nothing reads any more are left to the caller
+void Sheet::AddCell(Position pos, CellSlot cell){
+    ShiftedSpan<Position> refs = spreadsheet_.GetReferences(cell);
+    ShiftedSpan<Range> ranges = spreadsheet_.GetRanges(cell);
+    const CellSlot* old_cell = FindCell(pos);
+    if(!old_cell || !old_cell->IsPrintable()){
+        printable_rows_.Add(pos.row);
+        printable_cols_.Add(pos.col);
     }
-    if(pos.col >= size_.cols || pos.row >= size_.rows){
-        return nullptr;
+    if(!old_cell){
+        cell_cols_.Add(pos.col);
+    }
+    cell.SetPrintable();
+    spreadsheet_.Insert(pos, cell);
+    for(const Position& ref : refs){
+        CreateEmptyCell(ref);
+        AddRefToCell(ref, pos);
+    }
+    // cells of ranges get no placeholders, they are found through the index
+    for(const Range& range : ranges){
+        range_dependents_.Insert(range, pos);
     }
-    return spreadsheet_[pos.row][pos.col].get();
+}
+
+const CellInterface* Sheet::GetCell(Position pos) const {
+    return const_cast<Sheet*>(this)->GetCell(pos);
 }
 CellInterface* Sheet::GetCell(Position pos) {
     if(!pos.IsValid()){
         throw InvalidPositionException("Position of cell is not valid"s);
     }
-    if(pos.col >= size_.cols || pos.row >= size_.rows){
-        return nullptr;
-    }
-    return spreadsheet_[pos.row][pos.col].get();
+    // the handle lives as long as the cell, so the pointer stays valid
+    // through the changes of the cell until it is removed, and it follows
+    // the cell when rows or columns are inserted or deleted
+    return handles_.Get(spreadsheet_, ToPhysical(pos));
+}
+
+CellInterface::NumericValue Sheet::GetNumericValue(Position pos) const{
+    const CellSlot* slot = spreadsheet_.Find(ToPhysical(pos));
+    return slot ? spreadsheet_.GetNumericValue(*slot) : 0.0;
 }
 
 void Sheet::ClearCell(Position pos) {
     if(!pos.IsValid()){
         throw InvalidPositionException("Position of cell is not valid"s);
     }
-    if(pos.row < size_.rows && pos.col < size_.cols){
-        ClearCache(pos);
-        auto& ptr_to_cell = spreadsheet_[pos.row][pos.col];
-        ptr_to_cell.reset();
-        ptr_to_cell = std::make_unique<Cell>(*this);
-        no_empty_cell_sorted_to_row_.erase(pos);
-        no_empty_cell_sorted_to_column_.erase(pos);
-        UpdateSize();
+    pos = ToPhysical(pos);
+    if(const CellSlot* cell = spreadsheet_.Find(pos)){
+        if(cell->IsPrintable()){
+            printable_rows_.Remove(pos.row);
+            printable_cols_.Remove(pos.col);
+        }
+        Invalidate(pos);
+        DeleteDependencies(pos);
+        if(!dependents_.HasDependents(pos)){
+            EraseCell(pos);
+        }
+        else{
+            // formulas still refer to this cell, keep it as an empty one
+            spreadsheet_.Insert(pos, CellSlot());
+        }
+        EraseUnreferenced();
     }
 }
 
-Size Sheet::GetPrintableSize() const {
-    return size_;
+// Removes the cell from the grid, its handle is reused for another cell
+void Sheet::EraseCell(Position pos){
+    spreadsheet_.Erase(pos);
+    cell_cols_.Remove(pos.col);
+    handles_.Release(pos);
 }
 
-void Sheet::ClearCache(Position pos) const{
-    if(const Cell* ptr_to_cell = dynamic_cast<const Cell*>(GetCell(pos))){
-        ptr_to_cell->ClearCache();
-        for(const Position& ref : GetReferencesUp(pos)){
-            ClearCache(ref);
+void Sheet::ForEachCellInRange(
+    const Range& range,
+    const std::function<void(const CellInterface&)>& func) const {
+    if(!range.top_left.IsValid() || !range.bottom_right.IsValid()){
+        throw InvalidPositionException("Range is not valid"s);
+    }
+    const Range cells = spreadsheet_.GetLayout().ToPhysical(range);
+    spreadsheet_.ForEachInRange(cells.top_left, cells.bottom_right,
+                                [&](Position, const CellSlot& cell){
+        if(!cell.IsEmpty()){
+            func(Cell(spreadsheet_, cell));
         }
+    });
+}
+
+namespace {
+// One past the last logical index with a printable cell
+int GetLogicalExtent(const OccupancyCounter& counter, const IndexMap& map){
+    if(map.IsIdentity()){
+        return counter.GetExtent();
+    }
+    int extent = 0;
+    if(counter.GetExtent() > 0){
+        map.ForEachRun(0, map.GetSize() - 1, [&](int logical, int physical, int length){
+            const int last = counter.FindLast(physical, physical + length - 1);
+            if(last >= 0){
+                extent = logical + (last - physical) + 1;
+            }
+        });
+    }
+    return extent;
+}
+}  // namespace
+
+Size Sheet::GetPrintableSize() const {
+    const SheetLayout& layout = spreadsheet_.GetLayout();
+    return Size{GetLogicalExtent(printable_rows_, layout.rows), GetLogicalExtent(printable_cols_, layout.cols)};
+}
+
+template <typename Func>
+void Sheet::ForEachDependent(Position pos, Func&& func) const{
+    dependents_.ForEachDependent(pos, func);
+    range_dependents_.ForEachContaining(pos, func);
+}
+
+// Only the cells with references of their own matter for the order and the
+// cycles, so the cells inside ranges are filtered down to the formulas.
+template <typename Func>
+void Sheet::ForEachReference(const CellSlot& cell, Func&& func) const{
+    for(const Position& ref : spreadsheet_.GetReferences(cell)){
+        func(ref);
+    }
+    for(const Range& range : spreadsheet_.GetRanges(cell)){
+        spreadsheet_.ForEachInRange(range.top_left, range.bottom_right,
+                                    [&func](Position ref, const CellSlot& ref_cell){
+            if(ref_cell.IsReferenced()){
+                func(ref);
+            }
+        });
+    }
+}
+
+void Sheet::ClearCache(Position pos){
+    Invalidate(ToPhysical(pos));
+}
+
+void Sheet::Invalidate(Position pos){
+    uint64_t invalidated = spreadsheet_.ClearCache(pos);
+    // A cell gets its value only after all the cells it reads got theirs,
+    // so a dependent without a cached value has no cached dependents either.
+    // The missing cache serves as the dirty flag: every affected cell is
+    // visited once and the walk stops at the ones already invalidated.
+    std::vector<Position>& worklist = invalidation_worklist_;
+    worklist.clear();
+    worklist.push_back(pos);
+    while(!worklist.empty()){
+        Position current = worklist.back();
+        worklist.pop_back();
+        ForEachDependent(current, [&](Position ref){
+            if(spreadsheet_.ClearCache(ref)){
+                worklist.push_back(ref);
+                ++invalidated;
+            }
+        });
     }
+    stats::Add(StatCounter::Invalidations);
+    stats::Add(StatCounter::CellsInvalidated, invalidated);
+    stats::Record(StatHistogram::CellsInvalidatedPerEdit, invalidated);
+}
+
+Position Sheet::ToPhysical(Position pos) const{
+    return spreadsheet_.GetLayout().ToPhysical(pos);
 }
 
-const std::set<Position>& Sheet::GetReferencesUp(Position pos) const{
-    auto it = cells_and_cells_dependent_on_.find(pos);
-    static const std::set<Position> empty_refs;
-    return (it == cells_and_cells_dependent_on_.end())
-            ? empty_refs
-            : it->second;
+const CellSlot* Sheet::FindCell(Position pos) const{
+    return spreadsheet_.Find(pos);
 }
 
-const std::vector<Position> Sheet::GetReferencesDown(Position pos) const{
-    if(auto ptr_to_cell = GetCell(pos)){
-        return ptr_to_cell->GetReferencedCells();
+ShiftedSpan<Position> Sheet::GetReferencesDown(Position pos) const{
+    if(const CellSlot* cell = FindCell(pos)){
+        return spreadsheet_.GetReferences(*cell);
     }
     return {};
 }
 
 void Sheet::DeleteDependencies(Position pos){
     for(Position ref : GetReferencesDown(pos)){
-        cells_and_cells_dependent_on_[ref].erase(pos);
+        dependents_.RemoveEdge(ref, pos);
+        if(!dependents_.HasDependents(ref)){
+            unreferenced_.push_back(ref);
+        }
+    }
+    if(const CellSlot* cell = FindCell(pos)){
+        for(const Range& range : spreadsheet_.GetRanges(*cell)){
+            range_dependents_.Erase(range, pos);
+        }
     }
 }
 
 void Sheet::AddRefToCell(Position cell, Position ref){
-    auto& refs = cells_and_cells_dependent_on_[cell];
-    refs.insert(ref);
+    dependents_.AddEdge(cell, ref);
+}
+
+// The placeholders made for the references nothing reads any more go away,
+// the cells written by the user stay
+void Sheet::EraseUnreferenced(){
+    for(Position pos : unreferenced_){
+        const CellSlot* cell = FindCell(pos);
+        if(cell && cell->IsEmpty() && !cell->IsPrintable() && !dependents_.HasDependents(pos)){
+            EraseCell(pos);
+        }
+    }
+    unreferenced_.clear();
 }
 
-bool Sheet::CycleCheck(Position pos, const std::vector<Position> references_down) const{
-    std::set<Position> cells_for_check_cycle;
-    cells_for_check_cycle.insert(pos);
-    return CycleCheck(references_down, cells_for_check_cycle);
+namespace {
+enum WalkMark : uint8_t {
+    WHITE = 0,
+    GRAY,
+    BLACK,
+    DIRTY,
+};
+}  // namespace
+
+uint32_t Sheet::NextWalkEpoch() const{
+    if(++walk_epoch_ == 0){
+        // the counter wrapped around, old marks could be mistaken for fresh ones
+        spreadsheet_.ResetMarks();
+        walk_epoch_ = 1;
+    }
+    return walk_epoch_;
 }
 
-bool Sheet::CycleCheck(const std::vector<Position>& references, std::set<Position>& cells_to_formula) const{
-    for(const Position& ref : references){
-        if(!cells_to_formula.insert(ref).second){
+bool Sheet::CycleCheck(Position pos, ShiftedSpan<Position> references_down,
+                       ShiftedSpan<Range> ranges) const{
+    // Iterative three-color DFS over the references as they would be after
+    // the formula is set. pos stays gray for the whole walk, so reaching it
+    // means a cycle; black cells are fully explored and skipped, which keeps
+    // the walk linear on graphs with shared subexpressions.
+    stats::Add(StatCounter::CycleChecks);
+    const SheetLayout& layout = spreadsheet_.GetLayout();
+    if(!layout.IsIdentity()){
+        std::vector<Position>& physical_references = walk_physical_references_;
+        std::vector<Range>& physical_ranges = walk_physical_ranges_;
+        physical_references.clear();
+        physical_ranges.clear();
+        pos = layout.ToPhysical(pos);
+        for(const Position& ref : references_down){
+            physical_references.push_back(layout.ToPhysical(ref));
+        }
+        for(const Range& range : ranges){
+            physical_ranges.push_back(layout.ToPhysical(range));
+        }
+        references_down = ShiftedSpan<Position>(physical_references);
+        ranges = ShiftedSpan<Range>(physical_ranges);
+    }
+    const uint32_t epoch = NextWalkEpoch();
+    std::vector<WalkFrame>& stack = walk_stack_;
+    stack.clear();
+    if(!PushWalkFrame(nullptr, references_down, ranges, pos)){
+        return false;
+    }
+    while(!stack.empty()){
+        WalkFrame& frame = stack.back();
+        if(frame.next == frame.references.size()){
+            if(frame.cell){
+                spreadsheet_.SetMark(*frame.cell, epoch, BLACK);
+            }
+            stack.pop_back();
+            continue;
+        }
+        const Position ref = frame.references[frame.next++];
+        if(ref == pos){
             return false;
         }
-        const std::vector<Position> references_down = GetReferencesDown(ref);
-        if(!CycleCheck(references_down, cells_to_formula)){
+        // cells without references end the path, only formulas are marked
+        const CellSlot* cell = FindCell(ref);
+        if(!cell || !cell->IsReferenced()){
+            continue;
+        }
+        const uint8_t mark = spreadsheet_.GetMark(*cell, epoch);
+        if(mark == GRAY){
             return false;
         }
+        if(mark == WHITE){
+            stats::Add(StatCounter::CycleCheckNodes);
+            spreadsheet_.SetMark(*cell, epoch, GRAY);
+            if(!PushWalkFrame(cell, spreadsheet_.GetReferences(*cell),
+                              spreadsheet_.GetRanges(*cell), pos)){
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// A frame of a formula with ranges walks a copy of its references extended
+// with the formulas inside the ranges. False if one of the ranges covers pos.
+bool Sheet::PushWalkFrame(const CellSlot* cell, ShiftedSpan<Position> references,
+                          ShiftedSpan<Range> ranges, Position pos) const{
+    if(!ranges.empty()){
+        const size_t depth = walk_stack_.size();
+        if(walk_references_.size() <= depth){
+            walk_references_.resize(depth + 1);
+        }
+        std::vector<Position>& expanded = walk_references_[depth];
+        expanded.assign(references.begin(), references.end());
+        for(const Range& range : ranges){
+            if(spreadsheet_.GetLayout().Contains(range, pos)){
+                return false;
+            }
+            spreadsheet_.ForEachInRange(range.top_left, range.bottom_right,
+                                        [&expanded](Position ref, const CellSlot& ref_cell){
+                if(ref_cell.IsReferenced()){
+                    expanded.push_back(ref);
+                }
+            });
+        }
+        references = ShiftedSpan<Position>(expanded);
     }
+    walk_stack_.push_back({cell, references, 0});
     return true;
 }
 
-void Sheet::UpdateSize(){
-    if(!no_empty_cell_sorted_to_row_.empty()){
-        const Position& pos_back_row = *no_empty_cell_sorted_to_row_.rbegin();
-        size_.rows = pos_back_row.row + 1;
-        const Position& pos_back_col = *no_empty_cell_sorted_to_column_.rbegin();
-        size_.cols = pos_back_col.col + 1;
+int64_t Sheet::GetOrder(Position pos) const{
+    // cells reading nothing may precede anything
+    const CellSlot* cell = FindCell(pos);
+    return cell && cell->IsReferenced() ? spreadsheet_.GetOrder(*cell) : std::numeric_limits<int64_t>::min();
+}
+
+bool Sheet::PlaceInOrder(Position pos, const CellSlot& new_cell){
+    if(!new_cell.IsReferenced()){
+        return true;
+    }
+    stats::Add(StatCounter::CycleChecks);
+    const CellSlot* old_cell = FindCell(pos);
+    const bool was_ranked = old_cell && old_cell->IsReferenced();
+    int64_t order;
+    if(was_ranked){
+        order = spreadsheet_.GetOrder(*old_cell);
     }
     else{
-        size_.rows = 0;
-        size_.cols = 0;
+        bool has_dependents = false;
+        ForEachDependent(pos, [&has_dependents](Position){
+            has_dependents = true;
+        });
+        order = has_dependents ? --min_order_ : ++max_order_;
+    }
+
+    bool acyclic = true;
+    for(const Range& range : spreadsheet_.GetRanges(new_cell)){
+        acyclic = acyclic && !spreadsheet_.GetLayout().Contains(range, pos);
+    }
+    ForEachReference(new_cell, [&](Position ref){
+        if(!acyclic){
+            return;
+        }
+        if(ref == pos){
+            acyclic = false;
+            return;
+        }
+        const int64_t ref_order = GetOrder(ref);
+        if(ref_order > order && !ReorderForEdge(pos, order, ref, ref_order)){
+            acyclic = false;
+        }
+    });
+    // the edges accepted so far may have moved pos up, which is still
+    // consistent with its old references
+    if(was_ranked){
+        spreadsheet_.SetOrder(*old_cell, order);
     }
+    spreadsheet_.SetOrder(new_cell, order);
+    return acyclic;
 }
 
-void Sheet::UpdateSize(Position new_pos){
-    if(new_pos.col >= size_.cols){
-        for(auto& row : spreadsheet_){
-            row.resize(new_pos.col + 1);
-            for(int i = size_.cols; i < static_cast<int>(row.size()); ++i){
-                row[i] = std::make_unique<Cell>(*this);
+bool Sheet::ReorderForEdge(Position pos, int64_t& pos_order, Position ref, int64_t ref_order){
+    const uint32_t epoch = NextWalkEpoch();
+
+    // cells reachable from pos which rank below ref; ref among them is a cycle
+    forward_region_.clear();
+    forward_region_.push_back({pos_order, pos});
+    bool reaches_ref = false;
+    for(size_t i = 0; i < forward_region_.size() && !reaches_ref; ++i){
+        ForEachDependent(forward_region_[i].pos, [&](Position dependent){
+            if(reaches_ref){
+                return;
+            }
+            if(dependent == ref){
+                reaches_ref = true;
+                return;
+            }
+            const CellSlot* cell = FindCell(dependent);
+            const int64_t order = spreadsheet_.GetOrder(*cell);
+            if(order < ref_order && spreadsheet_.GetMark(*cell, epoch) == WHITE){
+                spreadsheet_.SetMark(*cell, epoch, BLACK);
+                forward_region_.push_back({order, dependent});
+            }
+        });
+    }
+    stats::Add(StatCounter::CycleCheckNodes, forward_region_.size());
+    if(reaches_ref){
+        return false;
+    }
+
+    // cells ref depends on which rank above pos
+    backward_region_.clear();
+    backward_region_.push_back({ref_order, ref});
+    spreadsheet_.SetMark(*FindCell(ref), epoch, BLACK);
+    for(size_t i = 0; i < backward_region_.size(); ++i){
+        ForEachReference(*FindCell(backward_region_[i].pos), [&](Position reference){
+            const int64_t order = reference == pos ? pos_order : GetOrder(reference);
+            if(order <= pos_order){
+                return;
             }
+            const CellSlot* cell = FindCell(reference);
+            if(spreadsheet_.GetMark(*cell, epoch) == WHITE){
+                spreadsheet_.SetMark(*cell, epoch, BLACK);
+                backward_region_.push_back({order, reference});
+            }
+        });
+    }
+    stats::Add(StatCounter::CycleCheckNodes, backward_region_.size());
+
+    // Both regions reuse their own ranks: the backward one takes the lowest,
+    // the forward one (with pos) goes after it, relative order is kept.
+    std::sort(forward_region_.begin(), forward_region_.end());
+    std::sort(backward_region_.begin(), backward_region_.end());
+    region_orders_.clear();
+    for(const RankedCell& cell : backward_region_){
+        region_orders_.push_back(cell.order);
+    }
+    for(const RankedCell& cell : forward_region_){
+        region_orders_.push_back(cell.order);
+    }
+    std::sort(region_orders_.begin(), region_orders_.end());
+    size_t next = 0;
+    for(const RankedCell& cell : backward_region_){
+        spreadsheet_.SetOrder(*FindCell(cell.pos), region_orders_[next++]);
+    }
+    for(const RankedCell& cell : forward_region_){
+        if(cell.pos == pos){
+            pos_order = region_orders_[next++];
+        }
+        else{
+            spreadsheet_.SetOrder(*FindCell(cell.pos), region_orders_[next++]);
         }
-        size_.cols = new_pos.col + 1;
     }
-    if(new_pos.row >= size_.rows){
-        spreadsheet_.resize(new_pos.row +1);
-        for(int i = size_.rows; i < new_pos.row + 1; ++i){
-            auto& row = spreadsheet_[i];
-            row.resize(size_.cols);
-            for(int j = size_.cols; j < static_cast<int>(row.size()); ++j){
-                row[j] = std::make_unique<Cell>(*this);
+    return true;
+}
+
+void Sheet::Recalculate(size_t threads) const{
+    // Cells without references are cheap to compute, they get their values
+    // right here so that the workers only ever read them.
+    const uint32_t epoch = NextWalkEpoch();
+    std::vector<const CellSlot*> dirty;
+    spreadsheet_.ForEach([&](Position, const CellSlot& cell){
+        if(cell.GetKind() != CellKind::Formula || cell.HasCache()){
+            return;
+        }
+        if(!cell.IsReferenced()){
+            spreadsheet_.GetValue(cell);
+            return;
+        }
+        spreadsheet_.SetMark(cell, epoch, DIRTY, static_cast<uint32_t>(dirty.size()));
+        dirty.push_back(&cell);
+    });
+
+    // Edges between dirty cells are laid out as flat per-cell lists of
+    // dependents, a cell is ready once all the dirty cells it reads are computed
+    std::vector<std::pair<uint32_t, uint32_t>> edges;
+    edges.reserve(dirty.size() * 2);
+    std::vector<uint32_t> first_dependent(dirty.size() + 1, 0);
+    std::vector<std::atomic<uint32_t>> pending(dirty.size());
+    std::vector<WorkStealingPool::Task> ready;
+    for(size_t i = 0; i < dirty.size(); ++i){
+        uint32_t count = 0;
+        ForEachReference(*dirty[i], [&](Position ref){
+            const CellSlot* cell = FindCell(ref);
+            if(cell && spreadsheet_.GetMark(*cell, epoch) == DIRTY){
+                const uint32_t index = spreadsheet_.GetMarkIndex(*cell);
+                edges.emplace_back(index, static_cast<uint32_t>(i));
+                ++first_dependent[index + 1];
+                ++count;
             }
+        });
+        pending[i].store(count, std::memory_order_relaxed);
+        if(count == 0){
+            ready.push_back(static_cast<WorkStealingPool::Task>(i));
+        }
+    }
+    for(size_t i = 0; i < dirty.size(); ++i){
+        first_dependent[i + 1] += first_dependent[i];
+    }
+    std::vector<uint32_t> dependents(edges.size());
+    {
+        std::vector<uint32_t> next(first_dependent.begin(), first_dependent.end() - 1);
+        for(const auto& [from, to] : edges){
+            dependents[next[from]++] = to;
         }
-        size_.rows = new_pos.row + 1;
     }
+
+    if(!recalculation_pool_ || recalculation_pool_->GetThreadCount() != std::max<size_t>(threads, 1)){
+        recalculation_pool_ = std::make_unique<WorkStealingPool>(threads);
+    }
+    recalculation_pool_->Run(ready, dirty.size(), [&](WorkStealingPool::Task task, WorkStealingPool::Worker& worker){
+        spreadsheet_.GetValue(*dirty[task]);
+        for(uint32_t i = first_dependent[task]; i < first_dependent[task + 1]; ++i){
+            if(pending[dependents[i]].fetch_sub(1, std::memory_order_acq_rel) == 1){
+                worker.Push(dependents[i]);
+            }
+        }
+    });
 }
 
-std::unique_ptr<Cell> Sheet::TryCreateCell(Position pos, std::string text){
-    if(!pos.IsValid()){
-        throw InvalidPositionException("Position of cell is not valid"s);
+std::vector<Sheet::EditResult> Sheet::ApplyBatch(std::vector<CellEdit> edits, BatchMode mode){
+    constexpr uint32_t NOT_STAGED = std::numeric_limits<uint32_t>::max();
+    std::vector<EditResult> results(edits.size(), EditResult::Applied);
+    // the last valid edit of every position, the earlier ones share its result
+    std::vector<StagedCell> staged;
+    std::vector<uint32_t> staged_of_edit(edits.size(), NOT_STAGED);
+    SparseGrid<uint32_t> staged_index;
+    for(size_t i = 0; i < edits.size(); ++i){
+        if(!edits[i].pos.IsValid()){
+            results[i] = EditResult::InvalidPosition;
+            continue;
+        }
+        CellSlot cell;
+        try{
+            cell = TryCreateCell(edits[i].pos, std::move(edits[i].text));
+        }
+        catch(const FormulaException&){
+            results[i] = EditResult::FormulaSyntax;
+            continue;
+        }
+        const Position pos = ToPhysical(edits[i].pos);
+        if(const uint32_t* index = staged_index.Find(pos)){
+            spreadsheet_.Release(staged[*index].cell);
+            staged[*index].cell = cell;
+            staged[*index].edit = i;
+            staged_of_edit[i] = *index;
+        }
+        else{
+            staged_of_edit[i] = static_cast<uint32_t>(staged.size());
+            staged_index.Insert(pos, staged_of_edit[i]);
+            staged.push_back({pos, cell, i, false});
+        }
+    }
+
+    // Dropping a cycle brings back the old content of its cells, which may
+    // close other cycles, so the subset is checked again until it is clean.
+    std::vector<uint32_t> cyclic;
+    do{
+        cyclic.clear();
+        FindBatchCycles(staged, staged_index, cyclic);
+        for(uint32_t index : cyclic){
+            staged[index].dropped = true;
+            results[staged[index].edit] = EditResult::CircularDependency;
+        }
+    } while(mode == BatchMode::ValidSubset && !cyclic.empty());
+
+    const bool failed = std::any_of(results.begin(), results.end(), [](EditResult result){
+        return result != EditResult::Applied;
+    });
+    if(mode == BatchMode::Atomic && failed){
+        for(EditResult& result : results){
+            if(result == EditResult::Applied){
+                result = EditResult::NotApplied;
+            }
+        }
+        for(StagedCell& staged_cell : staged){
+            spreadsheet_.Release(staged_cell.cell);
+        }
+    }
+    else{
+        CommitBatch(staged);
+    }
+    for(size_t i = 0; i < edits.size(); ++i){
+        if(staged_of_edit[i] != NOT_STAGED){
+            results[i] = results[staged[staged_of_edit[i]].edit];
+        }
     }
-    std::unique_ptr<Cell> new_cell = std::make_unique<Cell>(*this);
-    new_cell->Set(text);
-    return new_cell;
+    return results;
 }
 
-void Sheet::PrintValues(std::ostream& output) const {
-    for(int row = 0; row < size_.rows; ++row){
-        bool is_first = true;
-        for(int col = 0; col < size_.cols; ++col){
-            if(!is_first){
-                output << '\t';
-            }
-            is_first = false;
-            if(auto ptr_to_cell = GetCell(Position{row, col})){
-                if(ptr_to_cell->GetText().empty()){
+// Tarjan's strongly connected components over the graph as it would be after
+// the batch. The current graph is acyclic, so every cycle passes through a
+// staged formula and the walk starts only from them. The staged cells of a
+// component with more than one cell or with a self-reference are reported.
+void Sheet::FindBatchCycles(const std::vector<StagedCell>& staged,
+                            const SparseGrid<uint32_t>& staged_index,
+                            std::vector<uint32_t>& cyclic) const{
+    auto find_staged = [&](Position pos) -> const StagedCell* {
+        const uint32_t* index = staged_index.Find(pos);
+        return index && !staged[*index].dropped ? &staged[*index] : nullptr;
+    };
+    auto find_cell = [&](Position pos) -> const CellSlot* {
+        const StagedCell* staged_cell = find_staged(pos);
+        return staged_cell ? &staged_cell->cell : FindCell(pos);
+    };
+
+    // the references of the cells on the DFS stack, one slice per frame
+    std::vector<Position> references;
+    auto push_references = [&](const CellSlot& cell){
+        for(const Position& ref : spreadsheet_.GetReferences(cell)){
+            references.push_back(ref);
+        }
+        for(const Range& range : spreadsheet_.GetRanges(cell)){
+            spreadsheet_.ForEachInRange(range.top_left, range.bottom_right,
+                                        [&](Position ref, const CellSlot& ref_cell){
+                if(!find_staged(ref) && ref_cell.IsReferenced()){
+                    references.push_back(ref);
+                }
+            });
+            auto push_staged = [&](Position ref, uint32_t index){
+                if(!staged[index].dropped && staged[index].cell.IsReferenced()){
+                    references.push_back(ref);
+                }
+            };
+            const SheetLayout& layout = spreadsheet_.GetLayout();
+            if(layout.IsIdentity()){
+                staged_index.ForEachInRange(range.top_left, range.bottom_right, push_staged);
+                continue;
+            }
+            layout.ForEachBlock(layout.ToLogical(range.top_left), layout.ToLogical(range.bottom_right),
+                                [&](Position top_left, Position bottom_right, Position){
+                staged_index.ForEachInRange(top_left, bottom_right, push_staged);
+            });
+        }
+    };
+
+    struct Node{
+        Position pos;
+        uint32_t lowlink;
+        bool on_stack;
+        bool self_reference;
+    };
+    struct Frame{
+        uint32_t node;
+        size_t begin;
+        size_t next;
+        size_t end;
+    };
+    std::vector<Node> nodes;
+    std::vector<uint32_t> component;
+    std::vector<Frame> stack;
+    // the mark index of a visited cell is its DFS number
+    const uint32_t epoch = NextWalkEpoch();
+    auto visit = [&](Position pos, const CellSlot& cell){
+        const uint32_t node = static_cast<uint32_t>(nodes.size());
+        spreadsheet_.SetMark(cell, epoch, GRAY, node);
+        nodes.push_back({pos, node, true, false});
+        component.push_back(node);
+        const size_t begin = references.size();
+        push_references(cell);
+        stack.push_back({node, begin, begin, references.size()});
+    };
+
+    for(const StagedCell& root : staged){
+        if(root.dropped || !root.cell.IsReferenced() || spreadsheet_.GetMark(root.cell, epoch) != WHITE){
+            continue;
+        }
+        visit(root.pos, root.cell);
+        while(!stack.empty()){
+            Frame& frame = stack.back();
+            if(frame.next < frame.end){
+                const uint32_t node = frame.node;
+                const Position ref = references[frame.next++];
+                const CellSlot* cell = find_cell(ref);
+                if(!cell || !cell->IsReferenced()){
                     continue;
                 }
-                const auto& value = ptr_to_cell->GetValue();
-                if(std::holds_alternative<std::string>(value)){
-                    output << std::get<std::string>(value);
+                if(spreadsheet_.GetMark(*cell, epoch) == WHITE){
+                    visit(ref, *cell);
+                    continue;
                 }
-                else if(std::holds_alternative<double>(value)){
-                    output << std::get<double>(value);
+                const uint32_t ref_node = spreadsheet_.GetMarkIndex(*cell);
+                if(ref_node == node){
+                    nodes[node].self_reference = true;
                 }
-                else{
-                    output << std::get<FormulaError>(value);
+                else if(nodes[ref_node].on_stack){
+                    nodes[node].lowlink = std::min(nodes[node].lowlink, ref_node);
                 }
+                continue;
             }
+
+            const uint32_t node = frame.node;
+            references.resize(frame.begin);
+            stack.pop_back();
+            if(!stack.empty()){
+                uint32_t& parent_lowlink = nodes[stack.back().node].lowlink;
+                parent_lowlink = std::min(parent_lowlink, nodes[node].lowlink);
+            }
+            if(nodes[node].lowlink != node){
+                continue;
+            }
+            const bool is_cycle = component.back() != node || nodes[node].self_reference;
+            uint32_t member;
+            do{
+                member = component.back();
+                component.pop_back();
+                nodes[member].on_stack = false;
+                if(is_cycle){
+                    if(const uint32_t* index = staged_index.Find(nodes[member].pos);
+                       index && !staged[*index].dropped){
+                        cyclic.push_back(*index);
+                    }
+                }
+            } while(member != node);
         }
-        output << '\n';
     }
 }
 
-void Sheet::PrintTexts(std::ostream& output) const {
-    for(int row = 0; row < size_.rows; ++row){
-        bool is_first = true;
-        for(int col = 0; col < size_.cols; ++col){
-            if(!is_first){
-                output << '\t';
+// Applies the checked cells the way SetCell does. A formula replacing a
+// ranked cell keeps its rank; the formulas that are new to the order or rank
+// below one of their references are ranked afresh together with everything
+// reading them.
+void Sheet::CommitBatch(std::vector<StagedCell>& staged){
+    std::vector<Position> changed;
+    std::vector<Position>& cone = invalidation_worklist_;
+    cone.clear();
+    for(StagedCell& staged_cell : staged){
+        if(staged_cell.dropped){
+            spreadsheet_.Release(staged_cell.cell);
+            continue;
+        }
+        const Position pos = staged_cell.pos;
+        const CellSlot& new_cell = staged_cell.cell;
+        if(new_cell.IsReferenced()){
+            const CellSlot* old_cell = FindCell(pos);
+            if(old_cell && old_cell->IsReferenced()){
+                spreadsheet_.SetOrder(new_cell, spreadsheet_.GetOrder(*old_cell));
+            }
+            else{
+                spreadsheet_.SetOrder(new_cell, ++max_order_);
+                cone.push_back(pos);
             }
-            is_first = false;
-            if(auto ptr_to_cell = GetCell(Position{row, col})){
-                output << ptr_to_cell->GetText();
+        }
+        InsertCell(pos, new_cell);
+        changed.push_back(pos);
+    }
+
+    for(const Position& pos : changed){
+        const CellSlot* cell = FindCell(pos);
+        if(!cell->IsReferenced()){
+            continue;
+        }
+        const int64_t order = spreadsheet_.GetOrder(*cell);
+        bool ordered = true;
+        ForEachReference(*cell, [&](Position ref){
+            ordered = ordered && GetOrder(ref) < order;
+        });
+        if(!ordered){
+            cone.push_back(pos);
+        }
+    }
+    if(!cone.empty()){
+        // the cycles were ruled out before the commit
+        RerankCone(cone);
+    }
+
+    // the missing cache stops the walks, each affected cell is cleared once
+    for(const Position& pos : changed){
+        Invalidate(pos);
+    }
+}
+
+// Kahn's algorithm over the given cells and everything reading them gives
+// their formulas fresh ranks above all the others. The mark index counts the
+// cells of the cone a cell still waits for, each occurrence the way
+// ForEachDependent will report it. False if the cone has a cycle.
+bool Sheet::RerankCone(std::vector<Position>& cone){
+    const uint32_t epoch = NextWalkEpoch();
+    size_t size = 0;
+    for(size_t i = 0; i < cone.size(); ++i){
+        const CellSlot* cell = FindCell(cone[i]);
+        if(spreadsheet_.GetMark(*cell, epoch) == WHITE){
+            spreadsheet_.SetMark(*cell, epoch, GRAY);
+            cone[size++] = cone[i];
+        }
+    }
+    cone.resize(size);
+    for(size_t i = 0; i < cone.size(); ++i){
+        ForEachDependent(cone[i], [&](Position dependent){
+            const CellSlot* cell = FindCell(dependent);
+            if(spreadsheet_.GetMark(*cell, epoch) == WHITE){
+                spreadsheet_.SetMark(*cell, epoch, GRAY);
+                cone.push_back(dependent);
+            }
+        });
+    }
+
+    std::vector<Position> ready;
+    for(const Position& pos : cone){
+        const CellSlot* cell = FindCell(pos);
+        uint32_t pending = 0;
+        auto count = [&](Position ref){
+            const CellSlot* ref_cell = FindCell(ref);
+            if(ref_cell && spreadsheet_.GetMark(*ref_cell, epoch) != WHITE){
+                ++pending;
+            }
+        };
+        for(const Position& ref : spreadsheet_.GetReferences(*cell)){
+            count(ref);
+        }
+        for(const Range& range : spreadsheet_.GetRanges(*cell)){
+            spreadsheet_.ForEachInRange(range.top_left, range.bottom_right,
+                                        [&](Position ref, const CellSlot&){
+                count(ref);
+            });
+        }
+        spreadsheet_.SetMark(*cell, epoch, GRAY, pending);
+        if(pending == 0){
+            ready.push_back(pos);
+        }
+    }
+    for(size_t i = 0; i < ready.size(); ++i){
+        const CellSlot* cell = FindCell(ready[i]);
+        if(cell->IsReferenced()){
+            spreadsheet_.SetOrder(*cell, ++max_order_);
+        }
+        ForEachDependent(ready[i], [&](Position dependent){
+            const CellSlot* dependent_cell = FindCell(dependent);
+            const uint32_t pending = spreadsheet_.GetMarkIndex(*dependent_cell) - 1;
+            spreadsheet_.SetMark(*dependent_cell, epoch, GRAY, pending);
+            if(pending == 0){
+                ready.push_back(dependent);
+            }
+        });
+    }
+    return ready.size() == cone.size();
+}
+
+void Sheet::InsertRows(int before, int count){
+    EditStructure({StructuralEdit::Kind::InsertRows, before, count});
+}
+
+void Sheet::DeleteRows(int first, int count){
+    EditStructure({StructuralEdit::Kind::DeleteRows, first, count});
+}
+
+void Sheet::InsertColumns(int before, int count){
+    EditStructure({StructuralEdit::Kind::InsertColumns, before, count});
+}
+
+void Sheet::DeleteColumns(int first, int count){
+    EditStructure({StructuralEdit::Kind::DeleteColumns, first, count});
+}
+
+// The cells stay at their physical positions, only the layout changes. The
+// formulas with a reference or a range corner in the dropped band are the
+// only ones whose cells change, they are set again with their references
+// rewritten and keep their ranks: they read the same cells as before or
+// fewer. The other formulas read the same cells through the new layout, a
+// range spanning the band just loses or gains the rows (columns) in between.
+void Sheet::EditStructure(const StructuralEdit& edit){
+    const int size = edit.IsRows() ? Position::MAX_ROWS : Position::MAX_COLS;
+    if(edit.count < 0 || edit.first < 0 || edit.first > size - edit.count){
+        throw InvalidPositionException("Rows or columns are not on the sheet"s);
+    }
+    if(edit.count == 0){
+        return;
+    }
+    if(edit.IsInsert()){
+        // the rows (columns) pushed off the sheet must have no printable cell
+        const SheetLayout& layout = spreadsheet_.GetLayout();
+        const IndexMap& map = edit.IsRows() ? layout.rows : layout.cols;
+        const OccupancyCounter& printable = edit.IsRows() ? printable_rows_ : printable_cols_;
+        bool pushed_off = false;
+        map.ForEachRun(edit.GetDroppedFirst(), edit.GetDroppedLast(), [&](int, int physical, int length){
+            pushed_off = pushed_off || printable.FindLast(physical, physical + length - 1) >= 0;
+        });
+        if(pushed_off){
+            throw InvalidPositionException("Inserting would push cells off the sheet"s);
+        }
+    }
+
+    struct MovedFormula{
+        Position pos;
+        Position anchor;
+        std::string text;
+        int64_t order;
+    };
+    std::vector<Position> dropped;
+    std::vector<MovedFormula> moved;
+    {
+        const SheetLayout& layout = spreadsheet_.GetLayout();
+        auto is_dropped = [&](Position pos){
+            const Position logical = layout.ToLogical(pos);
+            const int index = edit.IsRows() ? logical.row : logical.col;
+            return edit.GetDroppedFirst() <= index && index <= edit.GetDroppedLast();
+        };
+        const Range band = edit.IsRows()
+            ? Range{{edit.GetDroppedFirst(), 0}, {edit.GetDroppedLast(), Position::MAX_COLS - 1}}
+            : Range{{0, edit.GetDroppedFirst()}, {Position::MAX_ROWS - 1, edit.GetDroppedLast()}};
+        bool has_cells = edit.IsRows();
+        layout.cols.ForEachRun(edit.GetDroppedFirst(), edit.GetDroppedLast(), [&](int, int physical, int length){
+            has_cells = has_cells || cell_cols_.FindLast(physical, physical + length - 1) >= 0;
+        });
+        if(has_cells){
+            const Range cells = layout.ToPhysical(band);
+            spreadsheet_.ForEachInRange(cells.top_left, cells.bottom_right, [&](Position pos, const CellSlot&){
+                dropped.push_back(pos);
+            });
+        }
+
+        std::vector<Position> affected;
+        for(const Position& pos : dropped){
+            dependents_.ForEachDependent(pos, [&](Position dependent){
+                if(!is_dropped(dependent)){
+                    affected.push_back(dependent);
+                }
+            });
+        }
+        auto check_range = [&](const Range& range, Position owner){
+            if(!is_dropped(owner) && (is_dropped(range.top_left) || is_dropped(range.bottom_right))){
+                affected.push_back(owner);
             }
+        };
+        if(edit.IsRows()){
+            range_dependents_.ForEachInRows(edit.GetDroppedFirst(), edit.GetDroppedLast(), check_range);
+        }
+        else{
+            range_dependents_.ForEachInColumns(edit.GetDroppedFirst(), edit.GetDroppedLast(), check_range);
+        }
+        std::sort(affected.begin(), affected.end());
+        affected.erase(std::unique(affected.begin(), affected.end()), affected.end());
+
+        auto locate_cell = [&](Position pos){
+            return edit.Map(layout.ToLogical(pos));
+        };
+        auto locate_range = [&](const Range& range){
+            return edit.Map(layout.ToLogical(range));
+        };
+        for(const Position& pos : affected){
+            const CellSlot& cell = *FindCell(pos);
+            moved.push_back({pos, *edit.Map(layout.ToLogical(pos)),
+                             spreadsheet_.RelocateText(cell, locate_cell, locate_range),
+                             spreadsheet_.GetOrder(cell)});
+        }
+
+        // the dependents of the dropped cells see them gone, the moved
+        // formulas are computed again anyway
+        for(const Position& pos : dropped){
+            Invalidate(pos);
+        }
+    }
+
+    for(const MovedFormula& formula : moved){
+        DeleteDependencies(formula.pos);
+    }
+    for(const Position& pos : dropped){
+        if(FindCell(pos)->IsPrintable()){
+            printable_rows_.Remove(pos.row);
+            printable_cols_.Remove(pos.col);
+        }
+        DeleteDependencies(pos);
+    }
+    for(const Position& pos : dropped){
+        EraseCell(pos);
+    }
+
+    SheetLayout layout = spreadsheet_.GetLayout();
+    edit.Apply(layout);
+    spreadsheet_.SetLayout(std::move(layout));
+    range_dependents_.SetLayout(&spreadsheet_.GetLayout());
+
+    for(MovedFormula& formula : moved){
+        CellSlot cell = spreadsheet_.MakeFormula(formulas_->Parse(formula.text.substr(1), formula.anchor),
+                                                 formula.anchor);
+        if(cell.IsReferenced()){
+            spreadsheet_.SetOrder(cell, formula.order);
         }
-        output << '\n';
+        AddCell(formula.pos, cell);
+    }
+    for(const MovedFormula& formula : moved){
+        Invalidate(formula.pos);
+    }
+    EraseUnreferenced();
+}
+
+EngineStats Sheet::GetStats(){
+    return stats::Collect();
+}
+
+void Sheet::ResetStats(){
+    stats::Reset();
+}
+
+FormulaTable& Sheet::GetFormulaTable(){
+    return *formulas_;
+}
+
+const FormulaTable& Sheet::GetFormulaTable() const{
+    return *formulas_;
+}
+
+std::shared_ptr<const SheetView> Sheet::Snapshot() const{
+    return std::make_shared<SheetView>(spreadsheet_, formulas_, GetPrintableSize());
+}
+
+CellSlot Sheet::TryCreateCell(Position pos, std::string text){
+    if(!pos.IsValid()){
+        throw InvalidPositionException("Position of cell is not valid"s);
+    }
+    if(text.empty()){
+        return CellSlot();
+    }
+    if(text.front() == FORMULA_SIGN && text.size() > 1){
+        // formulas are shared through the table relative to pos
+        return spreadsheet_.MakeFormula(formulas_->Parse(text.substr(1), pos), pos);
+    }
+    return spreadsheet_.MakeText(std::move(text));
+}
+
+void Sheet::CreateEmptyCell(Position pos){
+    if(!spreadsheet_.Find(pos)){
+        spreadsheet_.Insert(pos, CellSlot());
+        cell_cols_.Add(pos.col);
     }
 }
 
-bool Sheet::Comp::operator()(const Position& lhs, const Position& rhs) const {
-    return std::tie(lhs.col, lhs.row) < std::tie(rhs.col, rhs.row);
+void Sheet::PrintValues(std::ostream& output) const {
+    spreadsheet_.PrintValues(output, GetPrintableSize());
+}
+
+void Sheet::PrintTexts(std::ostream& output) const {
+    spreadsheet_.PrintTexts(output, GetPrintableSize());
+}
+
+void Sheet::ForEachPrintableCell(const std::function<void(Position, const Cell&)>& func) const{
+    spreadsheet_.ForEachPrintable(GetPrintableSize(), [&](Position pos, const CellSlot& cell){
+        func(pos, Cell(spreadsheet_, cell));
+    });
 }
 
 std::unique_ptr<SheetInterface> CreateSheet() {
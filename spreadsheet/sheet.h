@@ -2,15 +2,57 @@
 
 #include "cell.h"
 #include "common.h"
+#include "dependency_graph.h"
+#include "formula.h"
+#include "occupancy.h"
+#include "range_index.h"
+#include "sheet_view.h"
+#include "snapshot.h"
+#include "sparse_grid.h"
+#include "stats.h"
+#include "work_stealing_pool.h"
 
+#include <deque>
 #include <functional>
 #include <vector>
 #include <memory>
 #include <set>
 #include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
 
+// Any number of threads may read a sheet at once while nothing changes it:
+// GetCell and the values and texts of the cells, GetNumericValue,
+// ForEachCellInRange, GetPrintableSize, PrintValues, PrintTexts,
+// ForEachPrintableCell, SaveSnapshot and Snapshot. A formula without a cached
+// value is computed by the first thread reading it, the others wait for that
+// value. Every other call, Recalculate included, needs the sheet to itself.
+// The views Snapshot takes may be read from any thread at any time.
 class Sheet : public SheetInterface {
 public:
+    struct CellEdit{
+        Position pos;
+        std::string text;
+    };
+
+    // Outcome of one edit of a batch
+    enum class EditResult : uint8_t {
+        Applied,
+        InvalidPosition,
+        FormulaSyntax,
+        CircularDependency,
+        // the edit is fine, but the atomic batch was rejected as a whole
+        NotApplied,
+    };
+
+    enum class BatchMode : uint8_t {
+        // one failed edit rejects the whole batch
+        Atomic,
+        // the valid edits are applied, the failed ones are only reported
+        ValidSubset,
+    };
 
     Sheet();
     ~Sheet() = default;
@@ -22,35 +64,177 @@ public:
 
     void ClearCell(Position pos) override;
 
+    void ForEachCellInRange(
+        const Range& range,
+        const std::function<void(const CellInterface&)>& func) const override;
+
     Size GetPrintableSize() const override;
 
+    // Formulas read the cells through it, no handle is made for them
+    CellInterface::NumericValue GetNumericValue(Position pos) const override;
+
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
 
-    bool CycleCheck(Position pos, const std::vector<Position> references_down) const;
-    bool CycleCheck(const std::vector<Position>& references, std::set<Position>& cells_to_formula) const;
-    void ClearCache(Position pos) const;
+    // Calls func for the cells PrintTexts prints, row by row. A cell is only
+    // valid during the call, no handle is kept for it as GetCell would.
+    void ForEachPrintableCell(const std::function<void(Position, const Cell&)>& func) const;
+
+    // Checks that setting a formula with the given references at pos
+    // doesn't close a cycle by searching everything the formula reads.
+    // SetCell relies on the topological order instead, this full search is
+    // kept as the reference implementation.
+    bool CycleCheck(Position pos, ShiftedSpan<Position> references_down,
+                    ShiftedSpan<Range> ranges = {}) const;
+    void ClearCache(Position pos);
+
+    // Computes every formula without a cached value on the given number of
+    // threads instead of lazily on access. Cells are scheduled as soon as all
+    // the cells they read have their values, so the results are the same as
+    // the lazy ones. Must not run concurrently with any other call.
+    void Recalculate(size_t threads = std::thread::hardware_concurrency()) const;
+
+    // Sets many cells the way SetCell would, a later edit of a cell
+    // replacing an earlier one, but checks the cycles of all the new formulas
+    // in one pass over the resulting graph and invalidates the affected cells
+    // once. Errors are reported per edit instead of being thrown.
+    std::vector<EditResult> ApplyBatch(std::vector<CellEdit> edits,
+                                       BatchMode mode = BatchMode::Atomic);
+
+    // Inserts count empty rows (columns) before the given one or deletes
+    // count of them starting at the given one. The cells after them move,
+    // the references to them are rewritten, and the ones to deleted cells
+    // become #REF!; a range loses its deleted rows (columns). Inserting
+    // moves the last rows of the sheet out of it: throws
+    // InvalidPositionException if a printable cell would go, or if the rows
+    // are not on the sheet. Costs O(log runs) per run moved for the layout
+    // (see IndexMap), plus the formulas referring to the deleted cells and
+    // the cells removed. The runs grow with every edit in a new place, and
+    // once the layout is not the identity every position a call is given or
+    // returns is mapped in O(log runs).
+    void InsertRows(int before, int count);
+    void DeleteRows(int first, int count);
+    void InsertColumns(int before, int count);
+    void DeleteColumns(int first, int count);
+    // any of the four
+    void EditStructure(const StructuralEdit& edit);
+
+    // Writes the cells, the references of the formulas and the formula
+    // values computed so far in the format described in snapshot.h
+    void SaveSnapshot(std::ostream& output) const;
+    // A loaded sheet answers GetValue from the stored values, its formulas are
+    // parsed only when they have to be computed again. Both throw
+    // SnapshotException if the data is damaged; the file is memory-mapped.
+    static std::unique_ptr<Sheet> LoadSnapshot(std::string_view data);
+    static std::unique_ptr<Sheet> LoadSnapshotFile(const std::string& path);
+
+    // A read-only view of the sheet as it is now, which later changes of the
+    // sheet don't reach. It costs the same for any size of the sheet: the
+    // view shares the cells, a change copies the tile it writes to the first
+    // time after the view was taken. What only the views hold is freed with
+    // the last of them, and they may outlive the sheet.
+    std::shared_ptr<const SheetView> Snapshot() const;
+
+    // Counters and latency histograms of the engine, see stats.h. They are
+    // process-wide: formulas are parsed and computed by every sheet alike.
+    static EngineStats GetStats();
+    static void ResetStats();
+
+    // compiled formulas shared by the cells a formula was filled into
+    FormulaTable& GetFormulaTable();
+    const FormulaTable& GetFormulaTable() const;
 private:
-    void UpdateSize();
-    void UpdateSize(Position new_pos);
-    const std::set<Position>& GetReferencesUp(Position pos) const;
-    const std::vector<Position> GetReferencesDown(Position pos) const;
+    // The public calls take logical positions, everything inside works on
+    // the physical ones the cells are stored at
+    Position ToPhysical(Position pos) const;
+    const CellSlot* FindCell(Position pos) const;
+    ShiftedSpan<Position> GetReferencesDown(Position pos) const;
+    template <typename Func>
+    void ForEachDependent(Position pos, Func&& func) const;
+    template <typename Func>
+    void ForEachReference(const CellSlot& cell, Func&& func) const;
+    bool PushWalkFrame(const CellSlot* cell, ShiftedSpan<Position> references,
+                       ShiftedSpan<Range> ranges, Position pos) const;
+    uint32_t NextWalkEpoch() const;
+    int64_t GetOrder(Position pos) const;
+    bool PlaceInOrder(Position pos, const CellSlot& new_cell);
+    bool ReorderForEdge(Position pos, int64_t& pos_order, Position ref, int64_t ref_order);
+    void Invalidate(Position pos);
     void AddRefToCell(Position cell, Position ref);
     void DeleteDependencies(Position pos);
-    std::unique_ptr<Cell> TryCreateCell(Position pos, std::string text);
+    void EraseUnreferenced();
+    void EraseCell(Position pos);
+    CellSlot TryCreateCell(Position pos, std::string text);
+    void CreateEmptyCell(Position pos);
+    void InsertCell(Position pos, CellSlot cell);
+    void AddCell(Position pos, CellSlot cell);
+
+    struct StagedCell{
+        Position pos;
+        CellSlot cell;
+        size_t edit;
+        bool dropped;
+    };
+    void FindBatchCycles(const std::vector<StagedCell>& staged,
+                         const SparseGrid<uint32_t>& staged_index,
+                         std::vector<uint32_t>& cyclic) const;
+    void CommitBatch(std::vector<StagedCell>& staged);
+    bool RerankCone(std::vector<Position>& cone);
+
+    // shared with the views, whose formulas may still have to be parsed
+    std::shared_ptr<FormulaTable> formulas_;
+    // cells depending on each cell through a reference of their own
+    DependencyGraph dependents_;
+    // referenced cells which lost their last dependent in DeleteDependencies,
+    // their empty placeholders are erased once the edit is in place
+    std::vector<Position> unreferenced_;
+    // formulas reading a range are found through it instead of per-cell edges
+    RangeIndex range_dependents_;
+    // printable cells per row and per column, they give the printable size
+    OccupancyCounter printable_rows_;
+    OccupancyCounter printable_cols_;
+    // all the cells per column, placeholders too: the columns without any
+    // are not walked when columns are deleted or pushed off the sheet
+    OccupancyCounter cell_cols_;
+
+    // Only written cells and the empty cells referenced by formulas are stored
+    CellTable spreadsheet_;
+    // handles of the cells GetCell was asked for, made on demand and reused
+    // once their cell is removed
+    mutable CellHandles handles_;
 
-    struct Comp{
-        bool operator()(const Position& lhs, const Position& rhs) const;
+    // scratch state of graph walks, reused to avoid allocations
+    struct WalkFrame{
+        const CellSlot* cell;
+        ShiftedSpan<Position> references;
+        size_t next;
     };
+    mutable std::vector<Position> invalidation_worklist_;
+    mutable std::vector<WalkFrame> walk_stack_;
+    // references of the frames with ranges, one list per stack depth
+    mutable std::vector<std::vector<Position>> walk_references_;
+    // the references of a cycle check moved to physical positions
+    mutable std::vector<Position> walk_physical_references_;
+    mutable std::vector<Range> walk_physical_ranges_;
+    mutable uint32_t walk_epoch_ = 0;
 
-    // These three containers are needed to find the minimum PrintableSize
-    // and to store arrays of cells depending on the cell in the key of the map
-    std::map<Position, std::set<Position>> cells_and_cells_dependent_on_;
-    std::set<Position> no_empty_cell_sorted_to_row_;
-    std::set<Position, Comp> no_empty_cell_sorted_to_column_;
+    // the threads of Recalculate, kept for the next call with as many
+    mutable std::unique_ptr<WorkStealingPool> recalculation_pool_;
 
-    //std::set<Position> no_empty_cells_;
-    //std::set<Position, Comp> no_empty_cell_sorted_to_column_;
-    std::vector<std::vector<std::unique_ptr<Cell>>> spreadsheet_;
-    Size size_;
+    // Topological order of formula cells, maintained incrementally
+    // (Pearce-Kelly): new ranks are taken below the minimum or above the
+    // maximum, the affected region is renumbered within its own ranks.
+    struct RankedCell{
+        int64_t order;
+        Position pos;
+
+        bool operator<(const RankedCell& rhs) const{
+            return order < rhs.order;
+        }
+    };
+    int64_t min_order_ = 0;
+    int64_t max_order_ = 0;
+    std::vector<RankedCell> forward_region_;
+    std::vector<RankedCell> backward_region_;
+    std::vector<int64_t> region_orders_;
 };
@@ -0,0 +1,443 @@
+#include "sheet_layout.h"
+
+#include <cmath>
+#include <vector>
+
+namespace {
+
+// Labels are in (0, LABEL_END), 0 and LABEL_END stand for no run
+constexpr int LABEL_BITS = 62;
+constexpr uint64_t LABEL_END = uint64_t{1} << LABEL_BITS;
+// An aligned range of 2^bits labels holding more than (2 / DENSITY)^bits
+// runs is too dense to take a new one (Bender et al., "Two simplified
+// algorithms for maintaining order in a list"); with 62 bits that leaves
+// room for about 4 billion runs
+constexpr double DENSITY = 1.4;
+
+// the treap priority of a node with the given key, splitmix64
+uint32_t Priority(uint64_t key){
+    key += 0x9e3779b97f4a7c15;
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111eb;
+    return static_cast<uint32_t>(key ^ (key >> 31));
+}
+
+}  // namespace
+
+IndexMap::IndexMap(int size)
+    : runs_(MakeNode(nullptr, nullptr, Run{0, size}, LABEL_END / 2, Priority(LABEL_END / 2)))
+    , by_physical_(MakeNode(nullptr, nullptr, 0, LABEL_END / 2, Priority(0)))
+    , size_(size)
+{}
+
+int IndexMap::GetSize() const{
+    return size_;
+}
+
+bool IndexMap::IsIdentity() const{
+    // the runs of a permutation of [0, size) with a single one
+    return runs_->count == 1;
+}
+
+size_t IndexMap::GetRunCount() const{
+    return static_cast<size_t>(runs_->count);
+}
+
+int IndexMap::ToPhysical(int logical) const{
+    if(IsIdentity()){
+        return logical;
+    }
+    const FoundRun found = FindRun(logical);
+    return found.run.physical + (logical - found.logical);
+}
+
+int IndexMap::ToLogical(int physical) const{
+    if(IsIdentity()){
+        return physical;
+    }
+    // the run with the last start not after the index, then its place among
+    // the runs with smaller labels
+    const PhysicalNode* run = nullptr;
+    for(const PhysicalNode* node = by_physical_.get(); node;){
+        if(node->physical <= physical){
+            run = node;
+            node = node->right.get();
+        }
+        else{
+            node = node->left.get();
+        }
+    }
+    int logical = 0;
+    for(const LogicalNode* node = runs_.get();;){
+        if(run->label < node->label){
+            node = node->left.get();
+            continue;
+        }
+        logical += node->left ? node->left->span : 0;
+        if(run->label == node->label){
+            return logical + (physical - run->physical);
+        }
+        logical += node->run.length;
+        node = node->right.get();
+    }
+}
+
+void IndexMap::Move(int from, int count, int to){
+    if(count == 0 || from == to){
+        return;
+    }
+    SplitRunAt(from);
+    SplitRunAt(from + count);
+    std::vector<FoundRun> moved;
+    for(int logical = from; logical < from + count; logical += moved.back().run.length){
+        moved.push_back(FindRun(logical));
+    }
+    for(const FoundRun& found : moved){
+        RemoveRun(found);
+    }
+    MergeRunsAt(from);
+
+    // the moved runs get labels between the runs they are put between
+    SplitRunAt(to);
+    int logical = to;
+    for(size_t i = 0; i < moved.size(); ++i){
+        const uint64_t before = logical > 0 ? FindRun(logical - 1).label : 0;
+        const uint64_t after = logical < GetSpan() ? FindRun(logical).label : LABEL_END;
+        AddRun(moved[i].run, NewLabel(before, after, static_cast<int>(moved.size() - i - 1)));
+        logical += moved[i].run.length;
+    }
+    MergeRunsAt(to);
+    MergeRunsAt(to + count);
+}
+
+IndexMap::LogicalTree IndexMap::MakeNode(LogicalTree left, LogicalTree right, Run run, uint64_t label,
+                                         uint32_t priority){
+    const int span = run.length + (left ? left->span : 0) + (right ? right->span : 0);
+    const int count = 1 + (left ? left->count : 0) + (right ? right->count : 0);
+    return std::make_shared<const LogicalNode>(
+        LogicalNode{std::move(left), std::move(right), run, label, span, count, priority});
+}
+
+IndexMap::LogicalTree IndexMap::Merge(const LogicalTree& left, const LogicalTree& right){
+    if(!left || !right){
+        return left ? left : right;
+    }
+    if(left->priority > right->priority){
+        return MakeNode(left->left, Merge(left->right, right), left->run, left->label, left->priority);
+    }
+    return MakeNode(Merge(left, right->left), right->right, right->run, right->label, right->priority);
+}
+
+void IndexMap::Split(const LogicalTree& tree, uint64_t label, LogicalTree& left, LogicalTree& right){
+    if(!tree){
+        left = nullptr;
+        right = nullptr;
+        return;
+    }
+    LogicalTree rest;
+    if(tree->label < label){
+        Split(tree->right, label, rest, right);
+        left = MakeNode(tree->left, rest, tree->run, tree->label, tree->priority);
+    }
+    else{
+        Split(tree->left, label, left, rest);
+        right = MakeNode(rest, tree->right, tree->run, tree->label, tree->priority);
+    }
+}
+
+IndexMap::PhysicalTree IndexMap::MakeNode(PhysicalTree left, PhysicalTree right, int physical, uint64_t label,
+                                          uint32_t priority){
+    return std::make_shared<const PhysicalNode>(
+        PhysicalNode{std::move(left), std::move(right), physical, label, priority});
+}
+
+IndexMap::PhysicalTree IndexMap::Merge(const PhysicalTree& left, const PhysicalTree& right){
+    if(!left || !right){
+        return left ? left : right;
+    }
+    if(left->priority > right->priority){
+        return MakeNode(left->left, Merge(left->right, right), left->physical, left->label, left->priority);
+    }
+    return MakeNode(Merge(left, right->left), right->right, right->physical, right->label, right->priority);
+}
+
+void IndexMap::Split(const PhysicalTree& tree, int physical, PhysicalTree& left, PhysicalTree& right){
+    if(!tree){
+        left = nullptr;
+        right = nullptr;
+        return;
+    }
+    PhysicalTree rest;
+    if(tree->physical < physical){
+        Split(tree->right, physical, rest, right);
+        left = MakeNode(tree->left, rest, tree->physical, tree->label, tree->priority);
+    }
+    else{
+        Split(tree->left, physical, left, rest);
+        right = MakeNode(rest, tree->right, tree->physical, tree->label, tree->priority);
+    }
+}
+
+IndexMap::PhysicalTree IndexMap::WithLabel(const PhysicalTree& tree, int physical, uint64_t label){
+    if(physical < tree->physical){
+        return MakeNode(WithLabel(tree->left, physical, label), tree->right, tree->physical, tree->label,
+                        tree->priority);
+    }
+    if(physical > tree->physical){
+        return MakeNode(tree->left, WithLabel(tree->right, physical, label), tree->physical, tree->label,
+                        tree->priority);
+    }
+    return MakeNode(tree->left, tree->right, physical, label, tree->priority);
+}
+
+int IndexMap::GetSpan() const{
+    return runs_ ? runs_->span : 0;
+}
+
+IndexMap::FoundRun IndexMap::FindRun(int logical) const{
+    int offset = 0;
+    for(const LogicalNode* node = runs_.get();;){
+        const int begin = offset + (node->left ? node->left->span : 0);
+        if(logical < begin){
+            node = node->left.get();
+            continue;
+        }
+        if(logical < begin + node->run.length){
+            return {node->run, node->label, begin};
+        }
+        offset = begin + node->run.length;
+        node = node->right.get();
+    }
+}
+
+int IndexMap::CountBelow(uint64_t label) const{
+    int count = 0;
+    for(const LogicalNode* node = runs_.get(); node;){
+        if(node->label < label){
+            count += 1 + (node->left ? node->left->count : 0);
+            node = node->right.get();
+        }
+        else{
+            node = node->left.get();
+        }
+    }
+    return count;
+}
+
+void IndexMap::AddRun(Run run, uint64_t label){
+    LogicalTree left;
+    LogicalTree right;
+    Split(runs_, label, left, right);
+    runs_ = Merge(Merge(left, MakeNode(nullptr, nullptr, run, label, Priority(label))), right);
+    PhysicalTree before;
+    PhysicalTree after;
+    Split(by_physical_, run.physical, before, after);
+    by_physical_ = Merge(Merge(before, MakeNode(nullptr, nullptr, run.physical, label, Priority(run.physical))),
+                         after);
+}
+
+void IndexMap::RemoveRun(const FoundRun& found){
+    LogicalTree left;
+    LogicalTree rest;
+    LogicalTree removed;
+    LogicalTree right;
+    Split(runs_, found.label, left, rest);
+    Split(rest, found.label + 1, removed, right);
+    runs_ = Merge(left, right);
+    PhysicalTree before;
+    PhysicalTree others;
+    PhysicalTree removed_physical;
+    PhysicalTree after;
+    Split(by_physical_, found.run.physical, before, others);
+    Split(others, found.run.physical + 1, removed_physical, after);
+    by_physical_ = Merge(before, after);
+}
+
+void IndexMap::SplitRunAt(int logical){
+    if(logical <= 0 || logical >= GetSpan()){
+        return;
+    }
+    const FoundRun found = FindRun(logical);
+    if(found.logical == logical){
+        return;
+    }
+    const int end = found.logical + found.run.length;
+    const uint64_t after = end < GetSpan() ? FindRun(end).label : LABEL_END;
+    const int head = logical - found.logical;
+    RemoveRun(found);
+    AddRun(Run{found.run.physical, head}, found.label);
+    AddRun(Run{found.run.physical + head, found.run.length - head}, NewLabel(found.label, after, 0));
+}
+
+void IndexMap::MergeRunsAt(int logical){
+    if(logical <= 0 || logical >= GetSpan()){
+        return;
+    }
+    const FoundRun right = FindRun(logical);
+    const FoundRun left = FindRun(logical - 1);
+    if(right.logical != logical || left.run.physical + left.run.length != right.run.physical){
+        return;
+    }
+    RemoveRun(left);
+    RemoveRun(right);
+    AddRun(Run{left.run.physical, left.run.length + right.run.length}, left.label);
+}
+
+uint64_t IndexMap::NewLabel(uint64_t before, uint64_t after, int following){
+    const uint64_t step = (after - before) / (static_cast<uint64_t>(following) + 2);
+    if(step > 0){
+        return before + step;
+    }
+    return before != 0 ? Relabel(before, true) : Relabel(after, false);
+}
+
+// Spreads the labels of the smallest aligned range around anchor that is
+// not too dense with the new run evenly over the range, and gives the new
+// one's label: it goes right after the anchor or right before it.
+uint64_t IndexMap::Relabel(uint64_t anchor, bool after_anchor){
+    uint64_t low = 0;
+    uint64_t high = LABEL_END;
+    int count = 0;
+    for(int bits = 1; bits <= LABEL_BITS; ++bits){
+        low = anchor & ~((uint64_t{1} << bits) - 1);
+        high = low + (uint64_t{1} << bits);
+        count = CountBelow(high) - CountBelow(low) + 1;
+        if(count <= std::pow(2.0 / DENSITY, bits)){
+            break;
+        }
+    }
+
+    LogicalTree left;
+    LogicalTree rest;
+    LogicalTree range;
+    LogicalTree right;
+    Split(runs_, low, left, rest);
+    Split(rest, high, range, right);
+    std::vector<std::pair<Run, uint64_t>> runs;
+    runs.reserve(static_cast<size_t>(count));
+    std::vector<const LogicalNode*> stack;
+    for(const LogicalNode* node = range.get(); node || !stack.empty();){
+        if(node){
+            stack.push_back(node);
+            node = node->left.get();
+            continue;
+        }
+        node = stack.back();
+        stack.pop_back();
+        runs.emplace_back(node->run, node->label);
+        node = node->right.get();
+    }
+
+    const size_t slot = static_cast<size_t>(std::find_if(runs.begin(), runs.end(), [anchor](const auto& run){
+        return run.second == anchor;
+    }) - runs.begin()) + (after_anchor ? 1 : 0);
+    const uint64_t gap = (high - low) / (runs.size() + 2);
+    LogicalTree relabeled;
+    for(size_t i = 0; i < runs.size(); ++i){
+        const uint64_t label = low + (i + (i >= slot ? 2 : 1)) * gap;
+        relabeled = Merge(relabeled, MakeNode(nullptr, nullptr, runs[i].first, label, Priority(label)));
+        by_physical_ = WithLabel(by_physical_, runs[i].first.physical, label);
+    }
+    runs_ = Merge(Merge(left, relabeled), right);
+    return low + (slot + 1) * gap;
+}
+
+bool SheetLayout::IsIdentity() const{
+    return rows.IsIdentity() && cols.IsIdentity();
+}
+
+Position SheetLayout::ToPhysical(Position pos) const{
+    if(!pos.IsValid()){
+        return pos;
+    }
+    return Position{rows.ToPhysical(pos.row), cols.ToPhysical(pos.col)};
+}
+
+Position SheetLayout::ToLogical(Position pos) const{
+    if(!pos.IsValid()){
+        return pos;
+    }
+    return Position{rows.ToLogical(pos.row), cols.ToLogical(pos.col)};
+}
+
+Range SheetLayout::ToPhysical(const Range& range) const{
+    return Range{ToPhysical(range.top_left), ToPhysical(range.bottom_right)};
+}
+
+Range SheetLayout::ToLogical(const Range& range) const{
+    return Range{ToLogical(range.top_left), ToLogical(range.bottom_right)};
+}
+
+bool SheetLayout::Contains(const Range& range, Position pos) const{
+    if(IsIdentity()){
+        return range.Contains(pos);
+    }
+    return ToLogical(range).Contains(ToLogical(pos));
+}
+
+bool StructuralEdit::IsRows() const{
+    return kind == Kind::InsertRows || kind == Kind::DeleteRows;
+}
+
+bool StructuralEdit::IsInsert() const{
+    return kind == Kind::InsertRows || kind == Kind::InsertColumns;
+}
+
+int StructuralEdit::GetDroppedFirst() const{
+    const int size = IsRows() ? Position::MAX_ROWS : Position::MAX_COLS;
+    return IsInsert() ? size - count : first;
+}
+
+int StructuralEdit::GetDroppedLast() const{
+    return GetDroppedFirst() + count - 1;
+}
+
+std::optional<int> StructuralEdit::Map(int index) const{
+    if(GetDroppedFirst() <= index && index <= GetDroppedLast()){
+        return std::nullopt;
+    }
+    if(IsInsert()){
+        return index < first ? index : index + count;
+    }
+    return index < first ? index : index - count;
+}
+
+std::optional<Position> StructuralEdit::Map(Position pos) const{
+    const std::optional<int> index = Map(IsRows() ? pos.row : pos.col);
+    if(!index){
+        return std::nullopt;
+    }
+    return IsRows() ? Position{*index, pos.col} : Position{pos.row, *index};
+}
+
+std::optional<Range> StructuralEdit::Map(const Range& range) const{
+    int begin = IsRows() ? range.top_left.row : range.top_left.col;
+    int end = IsRows() ? range.bottom_right.row : range.bottom_right.col;
+    // the corners in the dropped band move to the indexes next to it
+    if(GetDroppedFirst() <= begin && begin <= GetDroppedLast()){
+        begin = GetDroppedLast() + 1;
+    }
+    if(GetDroppedFirst() <= end && end <= GetDroppedLast()){
+        end = GetDroppedFirst() - 1;
+    }
+    if(begin > end){
+        return std::nullopt;
+    }
+    begin = *Map(begin);
+    end = *Map(end);
+    if(IsRows()){
+        return Range{{begin, range.top_left.col}, {end, range.bottom_right.col}};
+    }
+    return Range{{range.top_left.row, begin}, {range.bottom_right.row, end}};
+}
+
+void StructuralEdit::Apply(SheetLayout& layout) const{
+    IndexMap& map = IsRows() ? layout.rows : layout.cols;
+    // the dropped indexes are reused for the inserted ones, or put at the end
+    if(IsInsert()){
+        map.Move(GetDroppedFirst(), count, first);
+    }
+    else{
+        map.Move(first, count, map.GetSize() - count);
+    }
+}
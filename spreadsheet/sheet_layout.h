@@ -0,0 +1,212 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <optional>
+
+// Order of the rows (or the columns) of a sheet: which physical index the
+// cells of the row at a logical index are stored under. Inserting or
+// deleting rows only moves physical indexes around, the cells stay where
+// they are. The order is kept as runs of consecutive physical indexes in two
+// treaps: one in the logical order, where every node knows how many indexes
+// its subtree spans, and one by the first physical index of the runs. The
+// runs carry labels that grow in the logical order (order maintenance, see
+// NewLabel), so that a run found by its physical index is found in the
+// logical treap too.
+//
+// A lookup either way costs O(log runs). A move costs O(log runs) per run it
+// moves, plus the relabeling, O(log^2 runs) amortized. A sheet nobody
+// inserted into has one run. The nodes never change once made, copies of a
+// map share them and cost O(1).
+class IndexMap {
+public:
+    explicit IndexMap(int size);
+
+    int GetSize() const;
+    bool IsIdentity() const;
+    size_t GetRunCount() const;
+
+    int ToPhysical(int logical) const;
+    int ToLogical(int physical) const;
+
+    // Takes out the count indexes starting at from and puts them back
+    // starting at to, counted among the indexes left without them
+    void Move(int from, int count, int to);
+
+    // Calls func(logical, physical, length) for the runs covering the
+    // logical indexes [first, last], clipped to them, in logical order
+    template <typename Func>
+    void ForEachRun(int first, int last, Func&& func) const{
+        VisitRuns(runs_.get(), 0, first, last, func);
+    }
+
+private:
+    struct Run{
+        int physical;
+        int length;
+    };
+
+    struct LogicalNode;
+    struct PhysicalNode;
+    using LogicalTree = std::shared_ptr<const LogicalNode>;
+    using PhysicalTree = std::shared_ptr<const PhysicalNode>;
+
+    // ordered by the labels
+    struct LogicalNode{
+        LogicalTree left;
+        LogicalTree right;
+        Run run;
+        uint64_t label;
+        // the indexes and the runs of the subtree
+        int span;
+        int count;
+        uint32_t priority;
+    };
+
+    // ordered by the first physical index of the runs
+    struct PhysicalNode{
+        PhysicalTree left;
+        PhysicalTree right;
+        int physical;
+        uint64_t label;
+        uint32_t priority;
+    };
+
+    // A run and where it starts in the logical order
+    struct FoundRun{
+        Run run;
+        uint64_t label;
+        int logical;
+    };
+
+    // offset is the logical index the subtree starts at
+    template <typename Func>
+    static void VisitRuns(const LogicalNode* node, int offset, int first, int last, Func& func){
+        while(node){
+            const int begin = offset + (node->left ? node->left->span : 0);
+            if(first < begin){
+                VisitRuns(node->left.get(), offset, first, last, func);
+            }
+            if(begin > last){
+                return;
+            }
+            const int end = begin + node->run.length;
+            if(end > first){
+                const int clipped = std::max(first, begin);
+                func(clipped, node->run.physical + (clipped - begin), std::min(last + 1, end) - clipped);
+            }
+            offset = end;
+            node = node->right.get();
+        }
+    }
+
+    static LogicalTree MakeNode(LogicalTree left, LogicalTree right, Run run, uint64_t label, uint32_t priority);
+    static LogicalTree Merge(const LogicalTree& left, const LogicalTree& right);
+    // the runs with labels below the given one and the others
+    static void Split(const LogicalTree& tree, uint64_t label, LogicalTree& left, LogicalTree& right);
+    static PhysicalTree MakeNode(PhysicalTree left, PhysicalTree right, int physical, uint64_t label,
+                                 uint32_t priority);
+    static PhysicalTree Merge(const PhysicalTree& left, const PhysicalTree& right);
+    static void Split(const PhysicalTree& tree, int physical, PhysicalTree& left, PhysicalTree& right);
+    static PhysicalTree WithLabel(const PhysicalTree& tree, int physical, uint64_t label);
+
+    int GetSpan() const;
+    FoundRun FindRun(int logical) const;
+    // how many runs have labels below the given one
+    int CountBelow(uint64_t label) const;
+    void AddRun(Run run, uint64_t label);
+    void RemoveRun(const FoundRun& found);
+    // makes a run start at the logical index
+    void SplitRunAt(int logical);
+    // merges the runs meeting at the logical index if they continue each
+    // other physically
+    void MergeRunsAt(int logical);
+    // A label between the ones of the runs before and after a new run, 0
+    // and LABEL_END where there is none; room is left for the given number
+    // of runs coming after it
+    uint64_t NewLabel(uint64_t before, uint64_t after, int following);
+    uint64_t Relabel(uint64_t anchor, bool after_anchor);
+
+    LogicalTree runs_;
+    PhysicalTree by_physical_;
+    int size_;
+};
+
+// The order of the rows and the columns of a sheet. Cells, references and
+// ranges are stored at physical positions; a range covers the cells between
+// its corners in the logical order, whatever their physical positions are.
+struct SheetLayout {
+    IndexMap rows{Position::MAX_ROWS};
+    IndexMap cols{Position::MAX_COLS};
+
+    bool IsIdentity() const;
+
+    // an invalid position maps to itself
+    Position ToPhysical(Position pos) const;
+    Position ToLogical(Position pos) const;
+    Range ToPhysical(const Range& range) const;
+    Range ToLogical(const Range& range) const;
+
+    // whether the physical range covers the physical position
+    bool Contains(const Range& range, Position pos) const;
+
+    // Calls func(Position physical_top_left, Position physical_bottom_right,
+    // Position logical_top_left) for physically contiguous blocks covering
+    // the logical range. Going through the blocks in order, each one row by
+    // row, visits the range row by row from left to right.
+    template <typename Func>
+    void ForEachBlock(Position top_left, Position bottom_right, Func&& func) const{
+        if(cols.GetRunCount() == 1 || top_left.col == bottom_right.col){
+            const int col = cols.ToPhysical(top_left.col);
+            const int width = bottom_right.col - top_left.col;
+            rows.ForEachRun(top_left.row, bottom_right.row, [&](int logical, int physical, int length){
+                func(Position{physical, col}, Position{physical + length - 1, col + width},
+                     Position{logical, top_left.col});
+            });
+            return;
+        }
+        // a run of columns only spans part of a row, the rows go one by one
+        rows.ForEachRun(top_left.row, bottom_right.row, [&](int logical_row, int physical_row, int height){
+            for(int row = 0; row < height; ++row){
+                cols.ForEachRun(top_left.col, bottom_right.col, [&](int logical, int physical, int length){
+                    func(Position{physical_row + row, physical}, Position{physical_row + row, physical + length - 1},
+                         Position{logical_row + row, logical});
+                });
+            }
+        });
+    }
+};
+
+// Rows or columns inserted or deleted: where the logical indexes go. The
+// cells of the deleted indexes are dropped, and so are the ones an insertion
+// pushes past the end of the sheet.
+struct StructuralEdit {
+    enum class Kind {
+        InsertRows,
+        DeleteRows,
+        InsertColumns,
+        DeleteColumns,
+    };
+
+    Kind kind;
+    // the index the new ones are inserted before, or the first deleted one
+    int first;
+    int count;
+
+    bool IsRows() const;
+    bool IsInsert() const;
+    // the logical indexes whose cells are dropped, before the edit
+    int GetDroppedFirst() const;
+    int GetDroppedLast() const;
+
+    // the logical index after the edit, none for a dropped one
+    std::optional<int> Map(int index) const;
+    std::optional<Position> Map(Position pos) const;
+    // A range keeps the indexes left of it, none if it had only dropped ones
+    std::optional<Range> Map(const Range& range) const;
+
+    void Apply(SheetLayout& layout) const;
+};
@@ -0,0 +1,60 @@
+#include "sheet_view.h"
+
+using namespace std::literals;
+
+SheetView::SheetView(const CellTable& cells, std::shared_ptr<FormulaTable> formulas, Size size)
+    : formulas_(std::move(formulas))
+    , cells_(cells, CellTable::VIEW)
+    , size_(size)
+{}
+
+void SheetView::SetCell(Position, std::string){
+    throw ReadOnlySheetException("Snapshot of a sheet can not be changed"s);
+}
+
+const CellInterface* SheetView::GetCell(Position pos) const{
+    return const_cast<SheetView*>(this)->GetCell(pos);
+}
+
+CellInterface* SheetView::GetCell(Position pos){
+    if(!pos.IsValid()){
+        throw InvalidPositionException("Position of cell is not valid"s);
+    }
+    return handles_.Get(cells_, cells_.GetLayout().ToPhysical(pos));
+}
+
+void SheetView::ClearCell(Position){
+    throw ReadOnlySheetException("Snapshot of a sheet can not be changed"s);
+}
+
+void SheetView::ForEachCellInRange(
+    const Range& range,
+    const std::function<void(const CellInterface&)>& func) const{
+    if(!range.top_left.IsValid() || !range.bottom_right.IsValid()){
+        throw InvalidPositionException("Range is not valid"s);
+    }
+    const Range cells = cells_.GetLayout().ToPhysical(range);
+    cells_.ForEachInRange(cells.top_left, cells.bottom_right,
+                          [&](Position, const CellSlot& cell){
+        if(!cell.IsEmpty()){
+            func(Cell(cells_, cell));
+        }
+    });
+}
+
+Size SheetView::GetPrintableSize() const{
+    return size_;
+}
+
+CellInterface::NumericValue SheetView::GetNumericValue(Position pos) const{
+    const CellSlot* slot = cells_.Find(cells_.GetLayout().ToPhysical(pos));
+    return slot ? cells_.GetNumericValue(*slot) : 0.0;
+}
+
+void SheetView::PrintValues(std::ostream& output) const{
+    cells_.PrintValues(output, size_);
+}
+
+void SheetView::PrintTexts(std::ostream& output) const{
+    cells_.PrintTexts(output, size_);
+}
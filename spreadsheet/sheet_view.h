@@ -0,0 +1,56 @@
+#pragma once
+
+#include "cell.h"
+#include "common.h"
+#include "formula.h"
+
+#include <functional>
+#include <memory>
+#include <stdexcept>
+
+// Thrown when a read-only view of a sheet is asked to change
+class ReadOnlySheetException : public std::logic_error {
+public:
+    using std::logic_error::logic_error;
+};
+
+// A sheet as it was when Sheet::Snapshot took it. The view shares the tiles
+// of cells and the texts and formulas with the sheet and never changes:
+// everything the sheet changes later is written to copies. Any number of
+// threads may read it at once, also while the sheet is being changed.
+//
+// The values the sheet had cached when the view was taken are shared, the
+// formulas the view computes itself are kept with the view. SetCell and
+// ClearCell throw ReadOnlySheetException.
+class SheetView : public SheetInterface {
+public:
+    SheetView(const CellTable& cells, std::shared_ptr<FormulaTable> formulas, Size size);
+
+    void SetCell(Position pos, std::string text) override;
+
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+
+    void ClearCell(Position pos) override;
+
+    void ForEachCellInRange(
+        const Range& range,
+        const std::function<void(const CellInterface&)>& func) const override;
+
+    Size GetPrintableSize() const override;
+
+    CellInterface::NumericValue GetNumericValue(Position pos) const override;
+
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+
+    // see Sheet::SaveSnapshot; the sheet may be changed meanwhile
+    void SaveSnapshot(std::ostream& output) const;
+
+private:
+    // lazily parsed formulas reach it while they are computed
+    std::shared_ptr<FormulaTable> formulas_;
+    CellTable cells_;
+    Size size_;
+    mutable CellHandles handles_;
+};
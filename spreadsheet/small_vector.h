@@ -0,0 +1,207 @@
+#pragma once
+
+#include "span.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// Vector of trivially copyable values which keeps up to N of them inline and
+// only goes to the heap when it outgrows that.
+template <typename T, size_t N>
+class SmallVector {
+    static_assert(std::is_trivially_copyable_v<T>, "SmallVector only holds trivially copyable types");
+
+public:
+    SmallVector() = default;
+
+    template <typename It>
+    SmallVector(It first, It last) {
+        for (; first != last; ++first) {
+            push_back(*first);
+        }
+    }
+
+    SmallVector(const SmallVector& other) {
+        Assign(other);
+    }
+
+    SmallVector(SmallVector&& other) noexcept {
+        Steal(other);
+    }
+
+    SmallVector& operator=(const SmallVector& other) {
+        if (this != &other) {
+            clear();
+            Assign(other);
+        }
+        return *this;
+    }
+
+    SmallVector& operator=(SmallVector&& other) noexcept {
+        if (this != &other) {
+            Free();
+            Steal(other);
+        }
+        return *this;
+    }
+
+    ~SmallVector() {
+        Free();
+    }
+
+    T* data() {
+        return IsInline() ? reinterpret_cast<T*>(buffer_) : heap_;
+    }
+
+    const T* data() const {
+        return IsInline() ? reinterpret_cast<const T*>(buffer_) : heap_;
+    }
+
+    T* begin() {
+        return data();
+    }
+
+    T* end() {
+        return data() + size_;
+    }
+
+    const T* begin() const {
+        return data();
+    }
+
+    const T* end() const {
+        return data() + size_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    size_t capacity() const {
+        return capacity_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    T& operator[](size_t i) {
+        return data()[i];
+    }
+
+    const T& operator[](size_t i) const {
+        return data()[i];
+    }
+
+    T& back() {
+        return data()[size_ - 1];
+    }
+
+    void push_back(const T& value) {
+        if (size_ == capacity_) {
+            Grow(size_t{capacity_} * 2);
+        }
+        data()[size_++] = value;
+    }
+
+    void pop_back() {
+        assert(size_ > 0);
+        --size_;
+    }
+
+    T* insert(const T* pos, const T& value) {
+        size_t index = pos - data();
+        T copy = value;
+        if (size_ == capacity_) {
+            Grow(size_t{capacity_} * 2);
+        }
+        T* first = data() + index;
+        std::memmove(first + 1, first, (size_ - index) * sizeof(T));
+        *first = copy;
+        ++size_;
+        return first;
+    }
+
+    T* erase(const T* pos) {
+        T* first = data() + (pos - data());
+        std::memmove(first, first + 1, (end() - first - 1) * sizeof(T));
+        --size_;
+        return first;
+    }
+
+    T* erase(const T* first, const T* last) {
+        T* target = data() + (first - data());
+        const size_t count = last - first;
+        std::memmove(target, target + count, (end() - target - count) * sizeof(T));
+        size_ -= static_cast<uint32_t>(count);
+        return target;
+    }
+
+    void clear() {
+        size_ = 0;
+    }
+
+    // Frees the heap buffer if the values fit inline again
+    void shrink_to_fit() {
+        if (!IsInline() && size_ <= N) {
+            T* heap = heap_;
+            std::memcpy(buffer_, heap, size_ * sizeof(T));
+            delete[] reinterpret_cast<unsigned char*>(heap);
+            capacity_ = N;
+        }
+    }
+
+    operator Span<const T>() const {
+        return {data(), size_};
+    }
+
+private:
+    bool IsInline() const {
+        return capacity_ == N;
+    }
+
+    void Grow(size_t capacity) {
+        T* heap = reinterpret_cast<T*>(new unsigned char[capacity * sizeof(T)]);
+        std::memcpy(heap, data(), size_ * sizeof(T));
+        Free();
+        heap_ = heap;
+        capacity_ = static_cast<uint32_t>(capacity);
+    }
+
+    void Free() {
+        if (!IsInline()) {
+            delete[] reinterpret_cast<unsigned char*>(heap_);
+            capacity_ = N;
+        }
+    }
+
+    void Assign(const SmallVector& other) {
+        if (other.size_ > capacity_) {
+            Grow(other.size_);
+        }
+        std::memcpy(data(), other.data(), other.size_ * sizeof(T));
+        size_ = other.size_;
+    }
+
+    void Steal(SmallVector& other) {
+        if (other.IsInline()) {
+            std::memcpy(buffer_, other.buffer_, other.size_ * sizeof(T));
+        } else {
+            heap_ = other.heap_;
+            capacity_ = other.capacity_;
+            other.capacity_ = N;
+        }
+        size_ = other.size_;
+        other.size_ = 0;
+    }
+
+    uint32_t size_ = 0;
+    uint32_t capacity_ = N;
+    union {
+        alignas(T) unsigned char buffer_[N * sizeof(T)];
+        T* heap_;
+    };
+};
@@ -0,0 +1,381 @@
+#include "snapshot.h"
+
+#include "cell.h"
+#include "sheet.h"
+#include "sheet_view.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std::literals;
+
+#if defined(__BYTE_ORDER__)
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "snapshots are written in the host byte order");
+#endif
+
+uint64_t SnapshotChecksum(const char* data, size_t size){
+    // FNV-1a over 64-bit words, the shift mixes the high bits back down
+    uint64_t hash = 0xcbf29ce484222325;
+    auto mix = [&hash](uint64_t word){
+        hash = (hash ^ word) * 0x100000001b3;
+        hash ^= hash >> 29;
+    };
+    size_t i = 0;
+    for(; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)){
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        mix(word);
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, data + i, size - i);
+    mix(tail ^ size);
+    return hash;
+}
+
+namespace {
+
+constexpr size_t ALIGNMENT = 8;
+
+size_t Align(size_t size){
+    return (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+template <typename T>
+void AppendSection(std::string& buffer, const std::vector<T>& items){
+    const size_t offset = buffer.size();
+    const size_t size = items.size() * sizeof(T);
+    buffer.resize(offset + Align(size));
+    if(size != 0){
+        std::memcpy(buffer.data() + offset, items.data(), size);
+    }
+}
+
+void CheckData(bool condition, const char* message){
+    if(!condition){
+        throw SnapshotException(message);
+    }
+}
+
+// Bounds-checked access to the sections of a snapshot. The data is only
+// copied out record by record, it may be unaligned.
+class SnapshotReader {
+public:
+    explicit SnapshotReader(std::string_view data)
+        : data_(data)
+    {
+        CheckData(data_.size() >= sizeof(SnapshotHeader), "Snapshot is truncated");
+        std::memcpy(&header_, data_.data(), sizeof(header_));
+        CheckData(std::memcmp(header_.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0,
+                  "Not a sheet snapshot");
+        CheckData(header_.version == SNAPSHOT_VERSION, "Unsupported snapshot version");
+        CheckData(header_.reserved == 0, "Unsupported snapshot flags");
+
+        size_t offset = sizeof(SnapshotHeader);
+        cells_ = TakeSection(offset, header_.cell_count, sizeof(SnapshotCell));
+        references_ = TakeSection(offset, header_.reference_count, sizeof(SnapshotPosition));
+        ranges_ = TakeSection(offset, header_.range_count, sizeof(SnapshotRange));
+        strings_ = TakeSection(offset, header_.string_count, sizeof(SnapshotString));
+        bytes_ = TakeSection(offset, header_.string_bytes, 1);
+        CheckData(offset == data_.size(), "Snapshot size does not match its header");
+        CheckData(SnapshotChecksum(data_.data() + sizeof(SnapshotHeader),
+                                   data_.size() - sizeof(SnapshotHeader)) == header_.checksum,
+                  "Snapshot checksum mismatch");
+    }
+
+    size_t GetCellCount() const{
+        return header_.cell_count;
+    }
+
+    SnapshotCell GetCell(size_t index) const{
+        return Read<SnapshotCell>(cells_, index);
+    }
+
+    std::string_view GetString(uint32_t index) const{
+        CheckData(index < header_.string_count, "String index is out of bounds");
+        const auto string = Read<SnapshotString>(strings_, index);
+        CheckData(string.offset <= header_.string_bytes
+                  && string.size <= header_.string_bytes - string.offset,
+                  "String is out of bounds");
+        return data_.substr(bytes_ + string.offset, string.size);
+    }
+
+    // sorted without repetitions, the way formulas list them
+    std::vector<Position> GetReferences(const SnapshotCell& cell) const{
+        CheckSlice(cell.first_reference, cell.reference_count, header_.reference_count);
+        std::vector<Position> references;
+        references.reserve(cell.reference_count);
+        for(uint32_t i = 0; i < cell.reference_count; ++i){
+            const Position pos = ToPosition(Read<SnapshotPosition>(references_, cell.first_reference + i));
+            CheckData(references.empty() || references.back() < pos, "References are not sorted");
+            references.push_back(pos);
+        }
+        return references;
+    }
+
+    std::vector<Range> GetRanges(const SnapshotCell& cell) const{
+        CheckSlice(cell.first_range, cell.range_count, header_.range_count);
+        std::vector<Range> ranges;
+        ranges.reserve(cell.range_count);
+        for(uint32_t i = 0; i < cell.range_count; ++i){
+            const auto range = Read<SnapshotRange>(ranges_, cell.first_range + i);
+            const Range value{ToPosition(range.top_left), ToPosition(range.bottom_right)};
+            CheckData(value.top_left.row <= value.bottom_right.row
+                      && value.top_left.col <= value.bottom_right.col, "Range is inverted");
+            CheckData(ranges.empty() || ranges.back() < value, "Ranges are not sorted");
+            ranges.push_back(value);
+        }
+        return ranges;
+    }
+
+    static Position ToPosition(SnapshotPosition stored){
+        const Position pos{stored.row, stored.col};
+        CheckData(pos.IsValid(), "Position is out of the sheet");
+        return pos;
+    }
+
+private:
+    size_t TakeSection(size_t& offset, uint64_t count, size_t item_size) const{
+        CheckData(count <= (data_.size() - offset) / item_size, "Snapshot section is truncated");
+        const size_t begin = offset;
+        offset = std::min(data_.size(), offset + Align(count * item_size));
+        return begin;
+    }
+
+    static void CheckSlice(uint32_t first, uint32_t count, uint64_t size){
+        CheckData(first <= size && count <= size - first, "Formula references are out of bounds");
+    }
+
+    template <typename T>
+    T Read(size_t section, size_t index) const{
+        T item;
+        std::memcpy(&item, data_.data() + section + index * sizeof(T), sizeof(T));
+        return item;
+    }
+
+    std::string_view data_;
+    SnapshotHeader header_;
+    size_t cells_;
+    size_t references_;
+    size_t ranges_;
+    size_t strings_;
+    size_t bytes_;
+};
+
+SnapshotPosition ToSnapshot(Position pos){
+    return {pos.row, pos.col};
+}
+
+// The printable cells of the table, of a sheet or of a view of one
+void WriteSnapshot(const CellTable& table, Size size, std::ostream& output){
+    std::vector<SnapshotCell> cells;
+    std::vector<SnapshotPosition> references;
+    std::vector<SnapshotRange> ranges;
+    std::vector<SnapshotString> strings;
+    std::string bytes;
+    std::unordered_map<std::string, uint32_t> interned;
+    auto intern = [&](std::string text){
+        auto [it, inserted] = interned.try_emplace(std::move(text), static_cast<uint32_t>(strings.size()));
+        if(inserted){
+            strings.push_back({bytes.size(), it->first.size()});
+            bytes += it->first;
+        }
+        return it->second;
+    };
+
+    // the snapshot is stored in the logical order, the way the formulas
+    // would be parsed from it
+    const SheetLayout& layout = table.GetLayout();
+    std::vector<Position> logical_references;
+    std::vector<Range> logical_ranges;
+    cells.reserve(table.Size());
+    table.ForEachPrintable(size, [&](Position pos, const CellSlot& cell){
+        SnapshotCell record{};
+        record.pos = ToSnapshot(pos);
+        std::string text(table.GetText(cell));
+        if(cell.IsEmpty()){
+            record.kind = SnapshotCellKind::Empty;
+            record.text = intern(""s);
+        }
+        else if(cell.GetKind() == CellKind::Formula){
+            ShiftedSpan<Position> cell_references = table.GetReferences(cell);
+            ShiftedSpan<Range> cell_ranges = table.GetRanges(cell);
+            if(!layout.IsIdentity()){
+                logical_references.clear();
+                for(const Position& ref : cell_references){
+                    logical_references.push_back(layout.ToLogical(ref));
+                }
+                std::sort(logical_references.begin(), logical_references.end());
+                logical_ranges.clear();
+                for(const Range& range : cell_ranges){
+                    logical_ranges.push_back(layout.ToLogical(range));
+                }
+                std::sort(logical_ranges.begin(), logical_ranges.end());
+                cell_references = ShiftedSpan<Position>(logical_references);
+                cell_ranges = ShiftedSpan<Range>(logical_ranges);
+            }
+            record.kind = SnapshotCellKind::Formula;
+            record.text = intern(text.substr(1));
+            record.first_reference = static_cast<uint32_t>(references.size());
+            record.reference_count = static_cast<uint32_t>(cell_references.size());
+            for(const Position& ref : cell_references){
+                references.push_back(ToSnapshot(ref));
+            }
+            record.first_range = static_cast<uint32_t>(ranges.size());
+            record.range_count = static_cast<uint32_t>(cell_ranges.size());
+            for(const Range& range : cell_ranges){
+                ranges.push_back({ToSnapshot(range.top_left), ToSnapshot(range.bottom_right)});
+            }
+            // values that were never computed are left to the loaded sheet
+            if(cell.HasCache()){
+                const CellInterface::ValueView value = table.GetValue(cell);
+                if(std::holds_alternative<double>(value)){
+                    record.value = SnapshotValueKind::Number;
+                    record.number = std::get<double>(value);
+                }
+                else if(std::holds_alternative<FormulaError>(value)){
+                    record.value = SnapshotValueKind::Error;
+                    record.error = static_cast<uint8_t>(std::get<FormulaError>(value).GetCategory());
+                }
+            }
+        }
+        else{
+            record.kind = SnapshotCellKind::Text;
+            record.text = intern(std::move(text));
+        }
+        cells.push_back(record);
+    });
+
+    std::string payload;
+    AppendSection(payload, cells);
+    AppendSection(payload, references);
+    AppendSection(payload, ranges);
+    AppendSection(payload, strings);
+    const size_t bytes_offset = payload.size();
+    payload.resize(bytes_offset + Align(bytes.size()));
+    std::copy(bytes.begin(), bytes.end(), payload.begin() + bytes_offset);
+
+    SnapshotHeader header{};
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.cell_count = cells.size();
+    header.reference_count = references.size();
+    header.range_count = ranges.size();
+    header.string_count = strings.size();
+    header.string_bytes = bytes.size();
+    header.checksum = SnapshotChecksum(payload.data(), payload.size());
+    output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    output.write(payload.data(), static_cast<std::streamsize>(payload.size()));
+}
+
+}  // namespace
+
+void Sheet::SaveSnapshot(std::ostream& output) const{
+    WriteSnapshot(spreadsheet_, GetPrintableSize(), output);
+}
+
+void SheetView::SaveSnapshot(std::ostream& output) const{
+    WriteSnapshot(cells_, size_, output);
+}
+
+std::unique_ptr<Sheet> Sheet::LoadSnapshot(std::string_view data){
+    const SnapshotReader reader(data);
+    auto sheet = std::make_unique<Sheet>();
+    std::vector<Position> formulas;
+    std::optional<Position> previous;
+    for(size_t i = 0; i < reader.GetCellCount(); ++i){
+        const SnapshotCell record = reader.GetCell(i);
+        const Position pos = SnapshotReader::ToPosition(record.pos);
+        CheckData(!previous || *previous < pos, "Cells are not sorted");
+        previous = pos;
+
+        CellSlot cell;
+        const std::string_view text = reader.GetString(record.text);
+        switch(record.kind){
+        case SnapshotCellKind::Empty:
+            break;
+        case SnapshotCellKind::Text:
+            // anything else would have been set as a formula
+            CheckData(!text.empty() && (text.size() == 1 || text.front() != FORMULA_SIGN),
+                      "Text cell holds a formula");
+            cell = sheet->spreadsheet_.MakeText(std::string(text));
+            break;
+        case SnapshotCellKind::Formula: {
+            CheckData(!text.empty(), "Formula is empty");
+            std::optional<CellInterface::NumericValue> value;
+            if(record.value == SnapshotValueKind::Number){
+                value = record.number;
+            }
+            else if(record.value == SnapshotValueKind::Error){
+                CheckData(record.error <= static_cast<uint8_t>(FormulaError::Category::Div0),
+                          "Unknown formula error");
+                value = FormulaError(static_cast<FormulaError::Category>(record.error));
+            }
+            else{
+                CheckData(record.value == SnapshotValueKind::None, "Unknown value kind");
+            }
+            cell = sheet->spreadsheet_.MakeFormula(
+                sheet->formulas_->ParseLazily(std::string(text), pos, reader.GetReferences(record),
+                                             reader.GetRanges(record)),
+                value);
+            if(cell.IsReferenced()){
+                formulas.push_back(pos);
+            }
+            break;
+        }
+        default:
+            throw SnapshotException("Unknown cell kind");
+        }
+        sheet->InsertCell(pos, cell);
+    }
+    // the formulas are ranked from scratch, which also rules out cycles
+    CheckData(sheet->RerankCone(formulas), "Snapshot has a circular dependency");
+    return sheet;
+}
+
+std::unique_ptr<Sheet> Sheet::LoadSnapshotFile(const std::string& path){
+#ifdef _WIN32
+    std::ifstream input(path, std::ios::binary);
+    if(!input){
+        throw SnapshotException("Cannot open "s + path);
+    }
+    const std::string data(std::istreambuf_iterator<char>(input), {});
+    return LoadSnapshot(data);
+#else
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0){
+        throw SnapshotException("Cannot open "s + path + ": " + std::strerror(errno));
+    }
+    struct stat info;
+    if(fstat(fd, &info) != 0 || info.st_size == 0){
+        close(fd);
+        throw SnapshotException("Cannot map "s + path);
+    }
+    const size_t size = static_cast<size_t>(info.st_size);
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED){
+        throw SnapshotException("Cannot map "s + path + ": " + std::strerror(errno));
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    struct Unmap{
+        void* data;
+        size_t size;
+        ~Unmap(){
+            munmap(data, size);
+        }
+    } unmap{data, size};
+    return LoadSnapshot(std::string_view(static_cast<const char*>(data), size));
+#endif
+}
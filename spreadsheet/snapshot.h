@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+
+// Binary snapshot of a sheet, see Sheet::SaveSnapshot. All the numbers are
+// little-endian, every section starts at a multiple of 8 bytes:
+//
+//   SnapshotHeader
+//   SnapshotCell[cell_count]          printable cells in row-major order
+//   SnapshotPosition[reference_count] single references of the formulas
+//   SnapshotRange[range_count]        ranges of the formulas
+//   SnapshotString[string_count]      interned texts and expressions
+//   char[string_bytes]                their characters
+//
+// The checksum covers everything after the header. Formulas are stored as
+// their expressions along with the cells they read, so that the dependency
+// graph is rebuilt without parsing them.
+
+// Thrown when a snapshot is damaged or has an unknown version
+class SnapshotException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+inline constexpr char SNAPSHOT_MAGIC[8] = {'S', 'P', 'R', 'S', 'H', 'E', 'E', 'T'};
+inline constexpr uint32_t SNAPSHOT_VERSION = 1;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t cell_count;
+    uint64_t reference_count;
+    uint64_t range_count;
+    uint64_t string_count;
+    uint64_t string_bytes;
+    uint64_t checksum;
+};
+
+enum class SnapshotCellKind : uint8_t {
+    Empty,
+    Text,
+    Formula,
+};
+
+// the value of a formula computed before the snapshot was taken
+enum class SnapshotValueKind : uint8_t {
+    None,
+    Number,
+    Error,
+};
+
+struct SnapshotPosition {
+    int32_t row;
+    int32_t col;
+};
+
+struct SnapshotCell {
+    SnapshotPosition pos;
+    // the text of a text cell, the expression without '=' of a formula
+    uint32_t text;
+    SnapshotCellKind kind;
+    SnapshotValueKind value;
+    // FormulaError::Category of an error value
+    uint8_t error;
+    uint8_t reserved;
+    uint32_t first_reference;
+    uint32_t reference_count;
+    uint32_t first_range;
+    uint32_t range_count;
+    double number;
+};
+
+struct SnapshotRange {
+    SnapshotPosition top_left;
+    SnapshotPosition bottom_right;
+};
+
+struct SnapshotString {
+    uint64_t offset;
+    uint64_t size;
+};
+
+static_assert(sizeof(SnapshotHeader) == 64);
+static_assert(sizeof(SnapshotCell) == 40);
+static_assert(sizeof(SnapshotRange) == 16);
+static_assert(sizeof(SnapshotString) == 16);
+
+// 64-bit hash of the bytes, word at a time
+uint64_t SnapshotChecksum(const char* data, size_t size);
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Non-owning view of a contiguous array, a stand-in for C++20 std::span.
+template <typename T>
+class Span {
+public:
+    Span() = default;
+
+    Span(T* data, size_t size)
+        : data_(data)
+        , size_(size)
+    {}
+
+    template <typename U>
+    Span(const std::vector<U>& values)
+        : data_(values.data())
+        , size_(values.size())
+    {}
+
+    T* begin() const {
+        return data_;
+    }
+
+    T* end() const {
+        return data_ + size_;
+    }
+
+    T* data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    T& operator[](size_t i) const {
+        return data_[i];
+    }
+
+private:
+    T* data_ = nullptr;
+    size_t size_ = 0;
+};
@@ -0,0 +1,464 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace grid_detail {
+
+inline int CountTrailingZeros(uint64_t x) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, x);
+    return static_cast<int>(index);
+#else
+    return __builtin_ctzll(x);
+#endif
+}
+
+// x must not be zero
+inline int HighestBit(uint64_t x) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse64(&index, x);
+    return static_cast<int>(index);
+#else
+    return 63 - __builtin_clzll(x);
+#endif
+}
+
+// Fixed-size bitmap with fast iteration over the set bits of a sub-range.
+template <int N>
+class BitMask {
+public:
+    void Set(int i) {
+        words_[i >> 6] |= uint64_t{1} << (i & 63);
+    }
+
+    void Reset(int i) {
+        words_[i >> 6] &= ~(uint64_t{1} << (i & 63));
+    }
+
+    bool Test(int i) const {
+        return (words_[i >> 6] >> (i & 63)) & 1;
+    }
+
+    // Calls func(i) for every set bit i in [first, last] in increasing order.
+    template <typename Func>
+    void ForEachSet(int first, int last, Func&& func) const {
+        for (int w = first >> 6; w <= (last >> 6); ++w) {
+            uint64_t word = words_[w];
+            if (w == (first >> 6)) {
+                word &= ~uint64_t{0} << (first & 63);
+            }
+            if (w == (last >> 6) && (last & 63) != 63) {
+                word &= (uint64_t{1} << ((last & 63) + 1)) - 1;
+            }
+            while (word) {
+                func(w * 64 + CountTrailingZeros(word));
+                word &= word - 1;
+            }
+        }
+    }
+
+private:
+    std::array<uint64_t, (N + 63) / 64> words_{};
+};
+
+// Base of the nodes shared between the copies of a grid: the number of
+// grids holding the node and the version of the grid that made it. A copy
+// of a node is held by nobody yet.
+class SharedNode {
+public:
+    SharedNode() = default;
+
+    SharedNode(const SharedNode& other)
+        : version_(other.version_)
+    {}
+
+    SharedNode& operator=(const SharedNode&) = delete;
+
+    uint32_t GetVersion() const {
+        return version_;
+    }
+
+    void SetVersion(uint32_t version) {
+        version_ = version;
+    }
+
+private:
+    template <typename Node>
+    friend class NodePtr;
+
+    mutable std::atomic<uint32_t> refs_{0};
+    uint32_t version_ = 0;
+};
+
+// Pointer holding a shared node, a plain pointer in size; the last one
+// deletes the node, possibly in another thread than the one that made it
+template <typename Node>
+class NodePtr {
+public:
+    NodePtr() = default;
+
+    explicit NodePtr(Node* node)
+        : node_(node)
+    {
+        Hold();
+    }
+
+    NodePtr(const NodePtr& other)
+        : node_(other.node_)
+    {
+        Hold();
+    }
+
+    NodePtr& operator=(const NodePtr& other) {
+        NodePtr copy(other);
+        std::swap(node_, copy.node_);
+        return *this;
+    }
+
+    ~NodePtr() {
+        reset();
+    }
+
+    Node* get() const {
+        return node_;
+    }
+
+    Node& operator*() const {
+        return *node_;
+    }
+
+    Node* operator->() const {
+        return node_;
+    }
+
+    explicit operator bool() const {
+        return node_ != nullptr;
+    }
+
+    void reset() {
+        // the acquire makes the writes of the other holders visible to
+        // the destructor
+        if (node_ && node_->refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete node_;
+        }
+        node_ = nullptr;
+    }
+
+private:
+    void Hold() {
+        if (node_) {
+            node_->refs_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    Node* node_ = nullptr;
+};
+
+// A level of the tile directory: N lazily allocated children plus a bitmap
+// of the populated ones, so that iteration skips empty regions. Children are
+// shared between the copies of a grid, see SparseGrid.
+template <typename Child, int N>
+class Directory : public SharedNode {
+public:
+    Child* Get(int i) const {
+        return children_[i].get();
+    }
+
+    // The child to change, copied first unless it was made by this version
+    // of the grid. Nullptr if there is none.
+    Child* GetMutable(int i, uint32_t version) {
+        NodePtr<Child>& child = children_[i];
+        if (child && child->GetVersion() != version) {
+            child = NodePtr<Child>(new Child(*child));
+            child->SetVersion(version);
+        }
+        return child.get();
+    }
+
+    Child& GetOrCreate(int i, uint32_t version) {
+        if (!children_[i]) {
+            children_[i] = NodePtr<Child>(new Child());
+            children_[i]->SetVersion(version);
+            mask_.Set(i);
+            ++count_;
+        }
+        return *GetMutable(i, version);
+    }
+
+    void Release(int i) {
+        if (children_[i]) {
+            children_[i].reset();
+            mask_.Reset(i);
+            --count_;
+        }
+    }
+
+    bool Empty() const {
+        return count_ == 0;
+    }
+
+    template <typename Func>
+    void ForEach(int first, int last, Func&& func) const {
+        mask_.ForEachSet(first, last, [&](int i) {
+            func(i, *children_[i]);
+        });
+    }
+
+private:
+    std::array<NodePtr<Child>, N> children_;
+    BitMask<N> mask_;
+    int count_ = 0;
+};
+
+}  // namespace grid_detail
+
+// Sparse storage of the sheet cells. The sheet is split into square tiles of
+// TILE_SIZE x TILE_SIZE slots that are allocated on the first write and freed
+// together with their last occupied slot. Tiles are reached through a small
+// three-level directory (row band -> segment of tiles -> tile), so lookups are
+// O(1) and an empty region of the sheet costs no memory at all.
+//
+// A copy of the grid shares all the nodes with the original and is made in
+// O(1). Nodes carry the version of the grid that made them and copying a grid
+// moves both sides to new versions, so either of them copies a node it
+// shares before the first write to it, together with the directory path
+// leading there. Reads never change a node and may go on in other threads
+// while the owner of another copy writes.
+template <typename T>
+class SparseGrid {
+public:
+    static constexpr int TILE_SHIFT = 3;
+    static constexpr int TILE_SIZE = 1 << TILE_SHIFT;
+    static constexpr int SEGMENT_SHIFT = 6;
+    static constexpr int SEGMENT_SIZE = 1 << SEGMENT_SHIFT;
+
+    static constexpr int BAND_COUNT = Position::MAX_ROWS / TILE_SIZE;
+    static constexpr int TILE_COLS = Position::MAX_COLS / TILE_SIZE;
+    static constexpr int SEGMENT_COUNT = TILE_COLS / SEGMENT_SIZE;
+
+    SparseGrid()
+        : root_(new Root())
+    {}
+
+    // The source is const for its readers, only its version moves on
+    SparseGrid(const SparseGrid& other)
+        : root_(other.root_)
+        , size_(other.size_)
+        , version_(other.Share())
+    {}
+
+    SparseGrid& operator=(const SparseGrid& other) {
+        if (this != &other) {
+            root_ = other.root_;
+            size_ = other.size_;
+            version_.store(other.Share(), std::memory_order_relaxed);
+        }
+        return *this;
+    }
+
+    // Returns the slot at pos or nullptr if it's not occupied.
+    const T* Find(Position pos) const {
+        const Tile* tile = FindTile(pos);
+        if (tile && tile->IsOccupied(pos.row & (TILE_SIZE - 1), pos.col & (TILE_SIZE - 1))) {
+            return &tile->At(pos.row & (TILE_SIZE - 1), pos.col & (TILE_SIZE - 1));
+        }
+        return nullptr;
+    }
+
+    // The slot at pos to change it, the tile is copied first if it is
+    // shared. The slot must be occupied.
+    T* FindMutable(Position pos) {
+        const uint32_t version = GetVersion();
+        Band* band = MutableRoot().GetMutable(pos.row >> TILE_SHIFT, version);
+        int tile_col = pos.col >> TILE_SHIFT;
+        Segment* segment = band->GetMutable(tile_col >> SEGMENT_SHIFT, version);
+        Tile* tile = segment->GetMutable(tile_col & (SEGMENT_SIZE - 1), version);
+        return &tile->At(pos.row & (TILE_SIZE - 1), pos.col & (TILE_SIZE - 1));
+    }
+
+    // Stores value at pos, replacing the previous one.
+    T& Insert(Position pos, T value) {
+        const uint32_t version = GetVersion();
+        Band& band = MutableRoot().GetOrCreate(pos.row >> TILE_SHIFT, version);
+        int tile_col = pos.col >> TILE_SHIFT;
+        Segment& segment = band.GetOrCreate(tile_col >> SEGMENT_SHIFT, version);
+        Tile& tile = segment.GetOrCreate(tile_col & (SEGMENT_SIZE - 1), version);
+        int row = pos.row & (TILE_SIZE - 1);
+        int col = pos.col & (TILE_SIZE - 1);
+        if (!tile.IsOccupied(row, col)) {
+            tile.Occupy(row, col);
+            ++size_;
+        }
+        T& slot = tile.At(row, col);
+        slot = std::move(value);
+        return slot;
+    }
+
+    // Empties the slot at pos and releases the directory nodes left empty.
+    void Erase(Position pos) {
+        if (!Find(pos)) {
+            return;
+        }
+        const uint32_t version = GetVersion();
+        int band_index = pos.row >> TILE_SHIFT;
+        int tile_col = pos.col >> TILE_SHIFT;
+        int segment_index = tile_col >> SEGMENT_SHIFT;
+        int tile_index = tile_col & (SEGMENT_SIZE - 1);
+        Root& root = MutableRoot();
+        Band* band = root.GetMutable(band_index, version);
+        Segment* segment = band->GetMutable(segment_index, version);
+        Tile* tile = segment->GetMutable(tile_index, version);
+        tile->Vacate(pos.row & (TILE_SIZE - 1), pos.col & (TILE_SIZE - 1));
+        --size_;
+        if (!tile->Empty()) {
+            return;
+        }
+        segment->Release(tile_index);
+        if (segment->Empty()) {
+            band->Release(segment_index);
+            if (band->Empty()) {
+                root.Release(band_index);
+            }
+        }
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    // Calls func(Position, T&) for every occupied slot inside the rectangle
+    // [top_left, bottom_right] in row-major order; empty tiles are skipped.
+    template <typename Func>
+    void ForEachInRange(Position top_left, Position bottom_right, Func&& func) const {
+        root_->ForEach(top_left.row >> TILE_SHIFT, bottom_right.row >> TILE_SHIFT,
+                       [&](int band_index, const Band& band) {
+            int first_row = std::max(top_left.row, band_index << TILE_SHIFT);
+            int last_row = std::min(bottom_right.row, ((band_index + 1) << TILE_SHIFT) - 1);
+            int first_tile = top_left.col >> TILE_SHIFT;
+            int last_tile = bottom_right.col >> TILE_SHIFT;
+            for (int row = first_row; row <= last_row; ++row) {
+                band.ForEach(first_tile >> SEGMENT_SHIFT, last_tile >> SEGMENT_SHIFT,
+                             [&](int segment_index, const Segment& segment) {
+                    int base = segment_index << SEGMENT_SHIFT;
+                    segment.ForEach(std::max(first_tile - base, 0),
+                                    std::min(last_tile - base, SEGMENT_SIZE - 1),
+                                    [&](int tile_index, const Tile& tile) {
+                        int tile_first_col = (base + tile_index) << TILE_SHIFT;
+                        int first_col = std::max(top_left.col - tile_first_col, 0);
+                        int last_col = std::min(bottom_right.col - tile_first_col, TILE_SIZE - 1);
+                        tile.ForEachInRow(row & (TILE_SIZE - 1), first_col, last_col,
+                                          [&](int col, const T& value) {
+                            func(Position{row, tile_first_col + col}, value);
+                        });
+                    });
+                });
+            }
+        });
+    }
+
+    template <typename Func>
+    void ForEach(Func&& func) const {
+        ForEachInRange(Position{0, 0}, Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1},
+                       std::forward<Func>(func));
+    }
+
+private:
+    class Tile : public grid_detail::SharedNode {
+    public:
+        T& At(int row, int col) {
+            return slots_[(row << TILE_SHIFT) | col];
+        }
+
+        const T& At(int row, int col) const {
+            return slots_[(row << TILE_SHIFT) | col];
+        }
+
+        bool IsOccupied(int row, int col) const {
+            return (row_masks_[row] >> col) & 1;
+        }
+
+        void Occupy(int row, int col) {
+            row_masks_[row] |= static_cast<uint16_t>(1u << col);
+            ++count_;
+        }
+
+        void Vacate(int row, int col) {
+            row_masks_[row] &= static_cast<uint16_t>(~(1u << col));
+            slots_[(row << TILE_SHIFT) | col] = T{};
+            --count_;
+        }
+
+        bool Empty() const {
+            return count_ == 0;
+        }
+
+        template <typename Func>
+        void ForEachInRow(int row, int first_col, int last_col, Func&& func) const {
+            unsigned mask = row_masks_[row];
+            mask &= (~0u << first_col) & ((1u << (last_col + 1)) - 1);
+            while (mask) {
+                int col = grid_detail::CountTrailingZeros(mask);
+                func(col, slots_[(row << TILE_SHIFT) | col]);
+                mask &= mask - 1;
+            }
+        }
+
+    private:
+        static_assert(TILE_SIZE <= 16, "row masks are 16 bits wide");
+
+        std::array<T, TILE_SIZE * TILE_SIZE> slots_{};
+        std::array<uint16_t, TILE_SIZE> row_masks_{};
+        int count_ = 0;
+    };
+
+    using Segment = grid_detail::Directory<Tile, SEGMENT_SIZE>;
+    using Band = grid_detail::Directory<Segment, SEGMENT_COUNT>;
+    using Root = grid_detail::Directory<Band, BAND_COUNT>;
+
+    const Tile* FindTile(Position pos) const {
+        const Band* band = root_->Get(pos.row >> TILE_SHIFT);
+        if (!band) {
+            return nullptr;
+        }
+        int tile_col = pos.col >> TILE_SHIFT;
+        const Segment* segment = band->Get(tile_col >> SEGMENT_SHIFT);
+        return segment ? segment->Get(tile_col & (SEGMENT_SIZE - 1)) : nullptr;
+    }
+
+    uint32_t GetVersion() const {
+        return version_.load(std::memory_order_relaxed);
+    }
+
+    Root& MutableRoot() {
+        const uint32_t version = GetVersion();
+        if (root_->GetVersion() != version) {
+            root_ = grid_detail::NodePtr<Root>(new Root(*root_));
+            root_->SetVersion(version);
+        }
+        return *root_;
+    }
+
+    // Moves this grid past the versions of its nodes and returns the version
+    // of the copy, which is past them as well
+    uint32_t Share() const {
+        return version_.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    grid_detail::NodePtr<Root> root_;
+    size_t size_ = 0;
+    // copies are taken by the readers of a const grid, possibly at once
+    mutable std::atomic<uint32_t> version_{0};
+};
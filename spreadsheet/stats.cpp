@@ -0,0 +1,208 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <vector>
+
+size_t StatsHistogram::BucketOf(uint64_t value){
+    if(value < SUB_BUCKETS){
+        return static_cast<size_t>(value);
+    }
+    int exponent = 63;
+    while(!(value >> exponent)){
+        --exponent;
+    }
+    // the bits below the leading one select the linear bucket
+    const size_t sub_bucket = (value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+    return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub_bucket;
+}
+
+uint64_t StatsHistogram::BucketUpperBound(size_t bucket){
+    if(bucket < SUB_BUCKETS){
+        return bucket;
+    }
+    const int exponent = static_cast<int>(bucket / SUB_BUCKETS) + SUB_BUCKET_BITS - 1;
+    const uint64_t sub_bucket = bucket % SUB_BUCKETS;
+    const uint64_t width = uint64_t{1} << (exponent - SUB_BUCKET_BITS);
+    return (uint64_t{1} << exponent) + (sub_bucket + 1) * width - 1;
+}
+
+void StatsHistogram::Add(size_t bucket, uint64_t count){
+    buckets_[bucket] += count;
+    count_ += count;
+}
+
+void StatsHistogram::AddSum(uint64_t value){
+    sum_ += value;
+}
+
+void StatsHistogram::Merge(const StatsHistogram& other){
+    for(size_t bucket = 0; bucket < BUCKETS; ++bucket){
+        buckets_[bucket] += other.buckets_[bucket];
+    }
+    count_ += other.count_;
+    sum_ += other.sum_;
+}
+
+uint64_t StatsHistogram::GetCount() const{
+    return count_;
+}
+
+uint64_t StatsHistogram::GetSum() const{
+    return sum_;
+}
+
+double StatsHistogram::GetMean() const{
+    return count_ == 0 ? 0.0 : static_cast<double>(sum_) / count_;
+}
+
+uint64_t StatsHistogram::GetPercentile(double fraction) const{
+    if(count_ == 0){
+        return 0;
+    }
+    // nearest rank
+    const uint64_t rank = std::clamp<uint64_t>(static_cast<uint64_t>(std::ceil(fraction * count_)), 1, count_);
+    uint64_t seen = 0;
+    for(size_t bucket = 0; bucket < BUCKETS; ++bucket){
+        seen += buckets_[bucket];
+        if(seen >= rank){
+            return BucketUpperBound(bucket);
+        }
+    }
+    return BucketUpperBound(BUCKETS - 1);
+}
+
+uint64_t StatsHistogram::GetBucketCount(size_t bucket) const{
+    return buckets_[bucket];
+}
+
+uint64_t EngineStats::Get(StatCounter counter) const{
+    return counters[static_cast<size_t>(counter)];
+}
+
+const StatsHistogram& EngineStats::Get(StatHistogram histogram) const{
+    return histograms[static_cast<size_t>(histogram)];
+}
+
+double EngineStats::GetCacheHitRatio() const{
+    const uint64_t hits = Get(StatCounter::CacheHits);
+    const uint64_t reads = hits + Get(StatCounter::CacheMisses);
+    return reads == 0 ? 0.0 : static_cast<double>(hits) / reads;
+}
+
+namespace stats {
+
+#ifdef SPREADSHEET_STATS
+
+namespace {
+
+// The blocks of the running threads and the sums of the finished ones
+struct Registry {
+    std::mutex mutex;
+    std::vector<ThreadStats*> threads;
+    EngineStats retired;
+};
+
+Registry& GetRegistry() {
+    // never destroyed, threads may exit after the static destructors ran
+    static Registry* registry = new Registry();
+    return *registry;
+}
+
+void AddTo(EngineStats& stats, const ThreadStats& block) {
+    for(size_t i = 0; i < block.counters.size(); ++i){
+        stats.counters[i] += block.counters[i].load(std::memory_order_relaxed);
+    }
+    for(size_t i = 0; i < block.histograms.size(); ++i){
+        StatsHistogram histogram;
+        for(size_t bucket = 0; bucket < StatsHistogram::BUCKETS; ++bucket){
+            if(const uint64_t count = block.histograms[i].buckets[bucket].load(std::memory_order_relaxed)){
+                histogram.Add(bucket, count);
+            }
+        }
+        histogram.AddSum(block.histograms[i].sum.load(std::memory_order_relaxed));
+        stats.histograms[i].Merge(histogram);
+    }
+}
+
+thread_local bool thread_exiting = false;
+
+// Owns the block of a thread and hands its values over when the thread exits
+struct ThreadRegistration {
+    ThreadStats* block = nullptr;
+
+    ~ThreadRegistration() {
+        // events recorded by the destructors of other thread locals are dropped
+        thread_exiting = true;
+        current_thread = nullptr;
+        if(!block){
+            return;
+        }
+        Registry& registry = GetRegistry();
+        std::lock_guard lock(registry.mutex);
+        AddTo(registry.retired, *block);
+        registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), block));
+        delete block;
+    }
+};
+
+}  // namespace
+
+thread_local ThreadStats* current_thread = nullptr;
+
+ThreadStats* RegisterThread() {
+    if(thread_exiting){
+        return nullptr;
+    }
+    thread_local ThreadRegistration registration;
+    auto block = new ThreadStats();
+    {
+        Registry& registry = GetRegistry();
+        std::lock_guard lock(registry.mutex);
+        registry.threads.push_back(block);
+    }
+    registration.block = block;
+    current_thread = block;
+    return block;
+}
+
+EngineStats Collect() {
+    Registry& registry = GetRegistry();
+    std::lock_guard lock(registry.mutex);
+    EngineStats stats = registry.retired;
+    stats.enabled = true;
+    for(const ThreadStats* block : registry.threads){
+        AddTo(stats, *block);
+    }
+    return stats;
+}
+
+void Reset() {
+    Registry& registry = GetRegistry();
+    std::lock_guard lock(registry.mutex);
+    registry.retired = EngineStats();
+    for(ThreadStats* block : registry.threads){
+        for(std::atomic<uint64_t>& counter : block->counters){
+            counter.store(0, std::memory_order_relaxed);
+        }
+        for(ThreadStats::Histogram& histogram : block->histograms){
+            for(std::atomic<uint64_t>& bucket : histogram.buckets){
+                bucket.store(0, std::memory_order_relaxed);
+            }
+            histogram.sum.store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+#else
+
+EngineStats Collect() {
+    return EngineStats();
+}
+
+void Reset() {}
+
+#endif
+
+}  // namespace stats
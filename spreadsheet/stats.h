@@ -0,0 +1,194 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+// Events counted by the engine
+enum class StatCounter : uint8_t {
+    SetCells,
+    // walks started by an edit, each clearing the caches of a cell and of
+    // everything computed from it
+    Invalidations,
+    CellsInvalidated,
+    // searches for a cycle a new formula could close, by SetCell through the
+    // topological order or by the full Sheet::CycleCheck
+    CycleChecks,
+    CycleCheckNodes,
+    Evaluations,
+    // reads of formula values, answered from the cache or computed
+    CacheHits,
+    CacheMisses,
+    Parses,
+    // texts and formulas replaced while a sheet view could still read them,
+    // and those of them freed once no view could
+    RetiredEntries,
+    ReclaimedEntries,
+    // records appended to journals, and the syncs that made them durable
+    JournalRecords,
+    JournalSyncs,
+    COUNT,
+};
+
+// Distributions recorded by the engine, the latencies are in nanoseconds
+enum class StatHistogram : uint8_t {
+    SetCellLatency,
+    // every 32nd evaluation of a thread, they are too short to time them all
+    EvaluationLatency,
+    ParseLatency,
+    CellsInvalidatedPerEdit,
+    COUNT,
+};
+
+// HDR-style histogram of non-negative integers: each power of two is split
+// into 8 linear buckets, so a value is known within 12.5% over the whole
+// range of uint64_t in under 4 KB.
+class StatsHistogram {
+public:
+    static constexpr int SUB_BUCKET_BITS = 3;
+    static constexpr size_t SUB_BUCKETS = size_t{1} << SUB_BUCKET_BITS;
+    static constexpr size_t BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    static size_t BucketOf(uint64_t value);
+    // the largest value falling into the bucket
+    static uint64_t BucketUpperBound(size_t bucket);
+
+    void Add(size_t bucket, uint64_t count);
+    // the sum of the values is kept apart from the buckets, for the mean
+    void AddSum(uint64_t value);
+    void Merge(const StatsHistogram& other);
+
+    uint64_t GetCount() const;
+    uint64_t GetSum() const;
+    double GetMean() const;
+    // An upper bound of the given fraction of the values, 0 if there are none
+    uint64_t GetPercentile(double fraction) const;
+    uint64_t GetBucketCount(size_t bucket) const;
+
+private:
+    std::array<uint64_t, BUCKETS> buckets_{};
+    uint64_t count_ = 0;
+    uint64_t sum_ = 0;
+};
+
+// What the engine recorded in all threads of the process since the start or
+// the last reset. Empty unless the engine is built with SPREADSHEET_STATS.
+struct EngineStats {
+    bool enabled = false;
+    std::array<uint64_t, static_cast<size_t>(StatCounter::COUNT)> counters{};
+    std::array<StatsHistogram, static_cast<size_t>(StatHistogram::COUNT)> histograms;
+
+    uint64_t Get(StatCounter counter) const;
+    const StatsHistogram& Get(StatHistogram histogram) const;
+    // share of formula reads answered from the cache, 0 if there were none
+    double GetCacheHitRatio() const;
+};
+
+// Recording is per thread: every thread writes to its own block, so an event
+// costs a few plain loads and stores and never contends; Collect sums the
+// blocks. Without SPREADSHEET_STATS the recording functions are empty and
+// compile away.
+namespace stats {
+
+#ifdef SPREADSHEET_STATS
+
+struct ThreadStats {
+    // only the owning thread writes, Collect may read at any time
+    std::array<std::atomic<uint64_t>, static_cast<size_t>(StatCounter::COUNT)> counters{};
+    struct Histogram {
+        std::array<std::atomic<uint64_t>, StatsHistogram::BUCKETS> buckets{};
+        std::atomic<uint64_t> sum{0};
+    };
+    std::array<Histogram, static_cast<size_t>(StatHistogram::COUNT)> histograms{};
+    // events left until the next sampled one
+    uint32_t sample_countdown = 0;
+};
+
+extern thread_local ThreadStats* current_thread;
+// Registers a block for the calling thread, null once the thread is exiting
+ThreadStats* RegisterThread();
+
+inline void Bump(std::atomic<uint64_t>& value, uint64_t delta) {
+    value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+inline void Add(StatCounter counter, uint64_t value = 1) {
+    ThreadStats* block = current_thread ? current_thread : RegisterThread();
+    if(block){
+        Bump(block->counters[static_cast<size_t>(counter)], value);
+    }
+}
+
+inline void Record(StatHistogram histogram, uint64_t value) {
+    ThreadStats* block = current_thread ? current_thread : RegisterThread();
+    if(block){
+        ThreadStats::Histogram& target = block->histograms[static_cast<size_t>(histogram)];
+        Bump(target.buckets[StatsHistogram::BucketOf(value)], 1);
+        Bump(target.sum, value);
+    }
+}
+
+// Records the lifetime of the object into a latency histogram
+class ScopedTimer {
+public:
+    explicit ScopedTimer(StatHistogram histogram)
+        : histogram_(histogram)
+        , start_(std::chrono::steady_clock::now())
+    {}
+
+    ~ScopedTimer() {
+        const auto elapsed = std::chrono::steady_clock::now() - start_;
+        Record(histogram_, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    StatHistogram histogram_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// A ScopedTimer for one in SAMPLE_PERIOD objects of the thread
+class SampledTimer {
+public:
+    static constexpr uint32_t SAMPLE_PERIOD = 32;
+
+    explicit SampledTimer(StatHistogram histogram) {
+        ThreadStats* block = current_thread ? current_thread : RegisterThread();
+        if(block && block->sample_countdown-- == 0){
+            block->sample_countdown = SAMPLE_PERIOD - 1;
+            timer_.emplace(histogram);
+        }
+    }
+
+private:
+    std::optional<ScopedTimer> timer_;
+};
+
+#else
+
+inline void Add(StatCounter, uint64_t = 1) {}
+inline void Record(StatHistogram, uint64_t) {}
+
+class ScopedTimer {
+public:
+    explicit ScopedTimer(StatHistogram) {}
+};
+
+class SampledTimer {
+public:
+    explicit SampledTimer(StatHistogram) {}
+};
+
+#endif
+
+EngineStats Collect();
+// Zeroes the recorded values. Events recorded by other threads during the
+// reset may survive it.
+void Reset();
+
+}  // namespace stats
@@ -0,0 +1,144 @@
+#include "work_stealing_pool.h"
+
+#include <algorithm>
+
+void WorkStealingPool::Worker::Push(Task task){
+    std::lock_guard guard(mutex_);
+    tasks_.push_back(task);
+}
+
+bool WorkStealingPool::Worker::Pop(Task& task){
+    std::lock_guard guard(mutex_);
+    if(tasks_.empty()){
+        return false;
+    }
+    task = tasks_.front();
+    tasks_.pop_front();
+    return true;
+}
+
+bool WorkStealingPool::Worker::Steal(Task& task){
+    std::lock_guard guard(mutex_);
+    if(tasks_.empty()){
+        return false;
+    }
+    task = tasks_.back();
+    tasks_.pop_back();
+    return true;
+}
+
+WorkStealingPool::WorkStealingPool(size_t threads){
+    workers_.resize(std::max<size_t>(threads, 1));
+    for(auto& worker : workers_){
+        worker = std::make_unique<Worker>();
+    }
+    helpers_.reserve(workers_.size() - 1);
+    for(size_t i = 1; i < workers_.size(); ++i){
+        helpers_.emplace_back([this, i]{
+            HelperLoop(i);
+        });
+    }
+}
+
+WorkStealingPool::~WorkStealingPool(){
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    started_.notify_all();
+    for(auto& helper : helpers_){
+        helper.join();
+    }
+}
+
+size_t WorkStealingPool::GetThreadCount() const{
+    return workers_.size();
+}
+
+void WorkStealingPool::Run(const std::vector<Task>& initial_tasks, size_t total_tasks,
+                           const std::function<void(Task, Worker&)>& func){
+    completed_ = 0;
+    failed_ = false;
+    error_ = nullptr;
+    for(size_t i = 0; i < initial_tasks.size(); ++i){
+        workers_[i % workers_.size()]->Push(initial_tasks[i]);
+    }
+
+    {
+        std::lock_guard lock(mutex_);
+        ++run_;
+        total_tasks_ = total_tasks;
+        func_ = &func;
+        running_ = helpers_.size();
+    }
+    started_.notify_all();
+    WorkerLoop(0, total_tasks, func);
+    {
+        std::unique_lock lock(mutex_);
+        finished_.wait(lock, [this]{
+            return running_ == 0;
+        });
+        func_ = nullptr;
+    }
+
+    for(auto& worker : workers_){
+        worker->tasks_.clear();
+    }
+    if(error_){
+        std::rethrow_exception(error_);
+    }
+}
+
+void WorkStealingPool::HelperLoop(size_t index){
+    uint64_t done = 0;
+    std::unique_lock lock(mutex_);
+    while(true){
+        started_.wait(lock, [&]{
+            return stopping_ || run_ != done;
+        });
+        if(stopping_){
+            return;
+        }
+        done = run_;
+        const size_t total_tasks = total_tasks_;
+        const std::function<void(Task, Worker&)>& func = *func_;
+        lock.unlock();
+        WorkerLoop(index, total_tasks, func);
+        lock.lock();
+        if(--running_ == 0){
+            finished_.notify_one();
+        }
+    }
+}
+
+void WorkStealingPool::WorkerLoop(size_t index, size_t total_tasks,
+                                  const std::function<void(Task, Worker&)>& func){
+    Worker& worker = *workers_[index];
+    while(!failed_.load(std::memory_order_acquire)
+          && completed_.load(std::memory_order_acquire) < total_tasks){
+        Task task;
+        if(!worker.Pop(task) && !Steal(index, task)){
+            std::this_thread::yield();
+            continue;
+        }
+        try{
+            func(task, worker);
+        }
+        catch(...){
+            if(!failed_.exchange(true)){
+                error_ = std::current_exception();
+            }
+            return;
+        }
+        completed_.fetch_add(1, std::memory_order_acq_rel);
+    }
+}
+
+bool WorkStealingPool::Steal(size_t thief, Task& task){
+    for(size_t i = 1; i < workers_.size(); ++i){
+        if(workers_[(thief + i) % workers_.size()]->Steal(task)){
+            return true;
+        }
+    }
+    return false;
+}
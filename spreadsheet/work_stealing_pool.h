@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs a set of tasks which grows while it runs on a fixed number of threads
+// (the calling one included). Every worker keeps its own deque: it pushes
+// tasks at the back and takes them from the front, so a worker runs its tasks
+// in the order they became ready and stays within one layer of the sheet.
+// A worker that ran out of tasks steals the newest ones from the others.
+// The threads are started with the pool and sleep between the runs.
+class WorkStealingPool {
+public:
+    using Task = uint32_t;
+
+    class Worker {
+    public:
+        // Schedules a task on this worker's deque
+        void Push(Task task);
+
+    private:
+        friend class WorkStealingPool;
+
+        bool Pop(Task& task);
+        bool Steal(Task& task);
+
+        std::mutex mutex_;
+        std::deque<Task> tasks_;
+    };
+
+    explicit WorkStealingPool(size_t threads);
+    ~WorkStealingPool();
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    // the calling thread included
+    size_t GetThreadCount() const;
+
+    // Calls func for every initial task and every task pushed by func until
+    // total_tasks of them have completed. The first exception thrown by func
+    // stops the run and is rethrown here.
+    void Run(const std::vector<Task>& initial_tasks, size_t total_tasks,
+             const std::function<void(Task, Worker&)>& func);
+
+private:
+    void HelperLoop(size_t index);
+    void WorkerLoop(size_t index, size_t total_tasks, const std::function<void(Task, Worker&)>& func);
+    bool Steal(size_t thief, Task& task);
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    // the threads of the workers but the first, which is the one calling Run
+    std::vector<std::thread> helpers_;
+    std::mutex mutex_;
+    // wakes the helpers for a run, and Run once all of them are done with it
+    std::condition_variable started_;
+    std::condition_variable finished_;
+    // the run the helpers are asked for, numbered from 1 on
+    uint64_t run_ = 0;
+    size_t total_tasks_ = 0;
+    const std::function<void(Task, Worker&)>* func_ = nullptr;
+    size_t running_ = 0;
+    bool stopping_ = false;
+    std::atomic<size_t> completed_{0};
+    std::atomic<bool> failed_{false};
+    std::exception_ptr error_;
+};